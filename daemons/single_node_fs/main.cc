@@ -476,7 +476,16 @@ void chfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
  */
 void chfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                 struct fuse_file_info *fi) {
-    UNIMPLEMENTED();
+    logger << "CHFS FUSE fsync\n";
+    FileOperation *fs =
+        reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+    // the metadata lives on the same device, so datasync flushes it as well
+    auto res = fs->sync();
+    if (res.is_err()) {
+        fuse_reply_err(req, EIO);
+    } else {
+        fuse_reply_err(req, 0);
+    }
 }
 
 /** Open directory
@@ -676,7 +685,7 @@ auto main(int argc, char **argv) -> int {
     fuseserver_oper.statfs = chfs_statfs;
     // fuseserver_oper.flush = chfs_flush;
     // fuseserver_oper.release = chfs_release;
-    // fuseserver_oper.fsync = chfs_fsync;
+    fuseserver_oper.fsync = chfs_fsync;
     // fuseserver_oper.opendir = chfs_opendir;
     // fuseserver_oper.releasedir = chfs_releasedir;
     // fuseserver_oper.fsyncdir = chfs_fsyncdir;
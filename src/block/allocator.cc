@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <functional>
+#include <sched.h>
+#include <thread>
+
 #include "block/allocator.h"
 #include "common/bitmap.h"
 #include "common/macros.h"
@@ -24,6 +29,7 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
                 "not available blocks to store the bitmap");
 
     this->bitmap_block_cnt = total_bitmap_block;
+    this->base_bitmap_block_cnt = total_bitmap_block;
     if (this->bitmap_block_cnt * total_bits_per_block ==
         this->bm->total_blocks()) {
         this->last_block_num = total_bits_per_block;
@@ -34,141 +40,682 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
                 "last block num should be less than total bits per block");
 
     if (!will_initialize) {
+        CHFS_VERIFY(this->load_bitmap().is_ok(), "failed to load the bitmap");
         return;
     }
 
-    // zeroing
-    for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
-        this->bm->zero_block(i + this->bitmap_block_id);
-    }
-
-    block_id_t cur_block_id = this->bitmap_block_id;
-    std::vector<u8> buffer(bm->block_size());
-    auto bitmap = Bitmap(buffer.data(), bm->block_size());
-    bitmap.zeroed();
+    this->bitmap_mirror.assign(
+        static_cast<usize>(this->bitmap_block_cnt) * bm->block_size(), 0);
+    auto bitmap =
+        Bitmap(this->bitmap_mirror.data(), this->bitmap_mirror.size());
 
     // set the blocks of the bitmap block to 1
+    // + bitmap_block_id is necessary, since the bitmap block starts with an
+    // offset
     for (block_id_t i = 0; i < this->bitmap_block_cnt + this->bitmap_block_id;
          i++) {
-        // + bitmap_block_id is necessary, since the bitmap block starts with an
-        // offset
-        auto block_id = i / total_bits_per_block + this->bitmap_block_id;
-        auto block_idx = i % total_bits_per_block;
+        bitmap.set(i);
+    }
+
+    this->reset_groups();
+    for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
+        const u8 *data = this->bitmap_mirror.data() +
+                         static_cast<usize>(i) * bm->block_size();
+        bm->write_block(i + this->bitmap_block_id, data);
+        const usize free_cnt =
+            Bitmap(const_cast<u8 *>(data), bm->block_size())
+                .count_zeros_to_bound(this->tracked_bits(i));
+        this->groups[i]->free_cnt = free_cnt;
+        this->total_free += free_cnt;
+    }
+}
 
-        if (block_id != cur_block_id) {
-            bm->write_block(cur_block_id, buffer.data());
+auto BlockAllocator::create_from_existing(std::shared_ptr<BlockManager> bm,
+                                          usize bitmap_block_id,
+                                          usize base_bitmap_block_cnt)
+    -> std::shared_ptr<BlockAllocator> {
+    auto res = std::make_shared<BlockAllocator>(std::move(bm), bitmap_block_id,
+                                                false);
+    CHFS_VERIFY(base_bitmap_block_cnt > 0 &&
+                    base_bitmap_block_cnt <= res->bitmap_block_cnt,
+                "Wrong number of bitmap blocks");
+    if (base_bitmap_block_cnt != res->base_bitmap_block_cnt) {
+        // the grown bitmap blocks are elsewhere, load them from there
+        res->base_bitmap_block_cnt = base_bitmap_block_cnt;
+        CHFS_VERIFY(res->load_bitmap().is_ok(), "failed to load the bitmap");
+    }
+    return res;
+}
 
-            cur_block_id = block_id;
-            bitmap.zeroed();
-        }
+auto BlockAllocator::bitmap_block_location(usize i) const -> block_id_t {
+    if (i < this->base_bitmap_block_cnt) {
+        return this->bitmap_block_id + i;
+    }
+    return static_cast<block_id_t>(i) * this->bm->block_size() * KBitsPerByte;
+}
 
-        bitmap.set(block_idx);
+auto BlockAllocator::tracked_bits(usize i) const -> usize {
+    if (i == this->bitmap_block_cnt - 1) {
+        return this->last_block_num;
     }
+    return this->bm->block_size() * KBitsPerByte;
+}
 
-    bm->write_block(cur_block_id, buffer.data());
+auto BlockAllocator::reset_groups() -> void {
+    this->groups.clear();
+    for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
+        this->groups.push_back(std::make_unique<AllocGroup>());
+    }
+    this->total_free = 0;
 }
 
-// Fixme: currently we don't consider errors in this implementation
-auto BlockAllocator::free_block_cnt() const -> usize {
-    usize total_free_blocks = 0;
-    std::vector<u8> buffer(bm->block_size());
+auto BlockAllocator::lock_groups(usize first, usize last)
+    -> std::vector<std::unique_lock<std::mutex>> {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (!this->thread_safe) {
+        return locks;
+    }
+    last = std::min<usize>(last, this->bitmap_block_cnt - 1);
+    for (usize i = first; i <= last; i++) {
+        locks.emplace_back(this->groups[i]->mtx);
+    }
+    return locks;
+}
+
+auto BlockAllocator::home_group() const -> usize {
+    const int cpu = sched_getcpu();
+    if (cpu < 0) {
+        return std::hash<std::thread::id>{}(std::this_thread::get_id()) %
+               this->bitmap_block_cnt;
+    }
+    return static_cast<usize>(cpu) % this->bitmap_block_cnt;
+}
 
+auto BlockAllocator::load_bitmap() -> ChfsNullResult {
+    const auto block_sz = this->bm->block_size();
+    this->bitmap_mirror.resize(static_cast<usize>(this->bitmap_block_cnt) *
+                               block_sz);
+    this->reset_groups();
     for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
-        bm->read_block(i + this->bitmap_block_id, buffer.data()).unwrap();
-
-        usize n_free_blocks = 0;
-        if (i == this->bitmap_block_cnt - 1) {
-            // last one
-            // std::cerr <<"last block num: " << this->last_block_num <<
-            // std::endl;
-            n_free_blocks = Bitmap(buffer.data(), bm->block_size())
-                                .count_zeros_to_bound(this->last_block_num);
+        u8 *data =
+            this->bitmap_mirror.data() + static_cast<usize>(i) * block_sz;
+        auto res = this->bm->read_block(this->bitmap_block_location(i), data);
+        if (res.is_err()) {
+            return res;
+        }
+        const usize free_cnt =
+            Bitmap(data, block_sz).count_zeros_to_bound(this->tracked_bits(i));
+        this->groups[i]->free_cnt = free_cnt;
+        this->total_free += free_cnt;
+    }
+    return KNullOk;
+}
+
+auto BlockAllocator::update_bit(block_id_t block_id, bool used)
+    -> ChfsNullResult {
+    const auto block_sz = this->bm->block_size();
+    const auto total_bits_per_block = block_sz * KBitsPerByte;
+    const usize bitmap_idx = block_id / total_bits_per_block;
+    const usize byte_off = (block_id % total_bits_per_block) / KBitsPerByte;
+    const u8 mask = 1 << (block_id % KBitsPerByte);
+
+    u8 &byte = this->bitmap_mirror[bitmap_idx * block_sz + byte_off];
+    const u8 updated = used ? (byte | mask) : (byte & ~mask);
+    auto res = this->bm->write_partial_block(
+        this->bitmap_block_location(bitmap_idx), &updated, byte_off, 1);
+    if (res.is_err()) {
+        return res;
+    }
+
+    byte = updated;
+    if (used) {
+        this->groups[bitmap_idx]->free_cnt -= 1;
+        this->total_free -= 1;
+    } else {
+        this->groups[bitmap_idx]->free_cnt += 1;
+        this->total_free += 1;
+    }
+    return KNullOk;
+}
+
+auto BlockAllocator::update_blocks(const std::vector<block_id_t> &block_ids,
+                                   bool used) -> ChfsNullResult {
+    const auto block_sz = this->bm->block_size();
+    const auto total_bits_per_block = block_sz * KBitsPerByte;
+    std::vector<u8> bytes;
+    std::vector<BitmapUndo> undo;
+    usize i = 0;
+    while (i < block_ids.size()) {
+        // the blocks tracked by the bitmap block of the i-th one
+        const usize bitmap_idx = block_ids[i] / total_bits_per_block;
+        const usize block_start = bitmap_idx * total_bits_per_block;
+        usize j = i;
+        while (j < block_ids.size() &&
+               block_ids[j] < block_start + total_bits_per_block) {
+            j++;
+        }
+        const usize first_byte = (block_ids[i] - block_start) / KBitsPerByte;
+        const usize last_byte =
+            (block_ids[j - 1] - block_start) / KBitsPerByte;
+
+        u8 *mirror = this->bitmap_mirror.data() + bitmap_idx * block_sz;
+        bytes.assign(mirror + first_byte, mirror + last_byte + 1);
+        auto bitmap = Bitmap(bytes.data(), bytes.size());
+        const usize base = first_byte * KBitsPerByte + block_start;
+        for (usize k = i; k < j; k++) {
+            if (used) {
+                bitmap.set(block_ids[k] - base);
+            } else {
+                bitmap.clear(block_ids[k] - base);
+            }
+        }
+        auto res = this->bm->write_partial_block(
+            this->bitmap_block_location(bitmap_idx), bytes.data(), first_byte,
+            bytes.size());
+        if (res.is_err()) {
+            this->roll_back(undo, used);
+            return res;
+        }
+
+        if (j < block_ids.size()) {
+            // a later bitmap block may fail
+            undo.push_back(BitmapUndo{
+                bitmap_idx, first_byte,
+                std::vector<u8>(mirror + first_byte, mirror + last_byte + 1),
+                j - i});
+        }
+        memcpy(mirror + first_byte, bytes.data(), bytes.size());
+        if (used) {
+            this->groups[bitmap_idx]->free_cnt -= j - i;
+            this->total_free -= j - i;
         } else {
-            n_free_blocks =
-                Bitmap(buffer.data(), bm->block_size()).count_zeros();
+            this->groups[bitmap_idx]->free_cnt += j - i;
+            this->total_free += j - i;
         }
-        // std::cerr << "check free block: " << i << " : " << n_free_blocks
-        //           << std::endl;
-        total_free_blocks += n_free_blocks;
+        i = j;
     }
-    return total_free_blocks;
+    return KNullOk;
 }
 
-// Your implementation
-auto BlockAllocator::allocate() -> ChfsResult<block_id_t> {
-    std::vector<u8> buffer(bm->block_size());
+auto BlockAllocator::update_range(block_id_t start, usize len, bool used)
+    -> ChfsNullResult {
+    const auto block_sz = this->bm->block_size();
+    const auto total_bits_per_block = block_sz * KBitsPerByte;
+    std::vector<u8> bytes;
+    std::vector<BitmapUndo> undo;
+    usize pos = start;
+    const usize end = static_cast<usize>(start) + len;
+    while (pos < end) {
+        // the part of the range in the bitmap block of `pos`
+        const usize bitmap_idx = pos / total_bits_per_block;
+        const usize block_start = bitmap_idx * total_bits_per_block;
+        const usize part_end =
+            std::min(end, block_start + total_bits_per_block);
+        const usize first_byte = (pos - block_start) / KBitsPerByte;
+        const usize last_byte = (part_end - 1 - block_start) / KBitsPerByte;
 
-    for (uint i = 0; i < this->bitmap_block_cnt; i++) {
-        bm->read_block(i + this->bitmap_block_id, buffer.data());
+        u8 *mirror = this->bitmap_mirror.data() + bitmap_idx * block_sz;
+        bytes.assign(mirror + first_byte, mirror + last_byte + 1);
+        auto bitmap = Bitmap(bytes.data(), bytes.size());
+        const usize base = first_byte * KBitsPerByte + block_start;
+        for (usize i = pos; i < part_end; i++) {
+            if (used) {
+                bitmap.set(i - base);
+            } else {
+                bitmap.clear(i - base);
+            }
+        }
+        auto res = this->bm->write_partial_block(
+            this->bitmap_block_location(bitmap_idx), bytes.data(), first_byte,
+            bytes.size());
+        if (res.is_err()) {
+            this->roll_back(undo, used);
+            return res;
+        }
 
-        // The index of the allocated bit inside current bitmap block.
-        std::optional<block_id_t> res = std::nullopt;
-        auto bitmap = Bitmap(buffer.data(), bm->block_size());
-        if (i == this->bitmap_block_cnt - 1) {
-            // If current block is the last block of the bitmap.
+        const usize cnt = part_end - pos;
+        if (part_end < end) {
+            undo.push_back(BitmapUndo{
+                bitmap_idx, first_byte,
+                std::vector<u8>(mirror + first_byte, mirror + last_byte + 1),
+                cnt});
+        }
+        memcpy(mirror + first_byte, bytes.data(), bytes.size());
+        if (used) {
+            this->groups[bitmap_idx]->free_cnt -= cnt;
+            this->total_free -= cnt;
+        } else {
+            this->groups[bitmap_idx]->free_cnt += cnt;
+            this->total_free += cnt;
+        }
+        pos = part_end;
+    }
+    return KNullOk;
+}
 
-            // TODO: Find the first free bit of current bitmap block
-            // and store it in `res`.
-            // UNIMPLEMENTED();
-            res = bitmap.find_first_free_w_bound(this->last_block_num);
+auto BlockAllocator::roll_back(const std::vector<BitmapUndo> &undo,
+                               bool used) -> void {
+    const auto block_sz = this->bm->block_size();
+    for (auto it = undo.rbegin(); it != undo.rend(); ++it) {
+        auto res = this->bm->write_partial_block(
+            this->bitmap_block_location(it->bitmap_idx), it->old_bytes.data(),
+            it->first_byte, it->old_bytes.size());
+        if (res.is_err()) {
+            std::cerr << "allocator: failed to roll back bitmap block "
+                      << it->bitmap_idx << std::endl;
+        }
+        memcpy(this->bitmap_mirror.data() + it->bitmap_idx * block_sz +
+                   it->first_byte,
+               it->old_bytes.data(), it->old_bytes.size());
+        if (used) {
+            this->groups[it->bitmap_idx]->free_cnt += it->cnt;
+            this->total_free += it->cnt;
         } else {
+            this->groups[it->bitmap_idx]->free_cnt -= it->cnt;
+            this->total_free -= it->cnt;
+        }
+    }
+}
+
+auto BlockAllocator::free_block_cnt() const -> usize {
+    return this->total_free;
+}
+
+auto BlockAllocator::tracked_blocks() const -> usize {
+    return static_cast<usize>(this->bitmap_block_cnt - 1) *
+               this->bm->block_size() * KBitsPerByte +
+           this->last_block_num;
+}
+
+auto BlockAllocator::find_free_in(usize i, usize from)
+    -> std::optional<block_id_t> {
+    const auto block_sz = this->bm->block_size();
+    auto bitmap = Bitmap(this->bitmap_mirror.data() + i * block_sz, block_sz);
+    auto res = bitmap.find_next_free(from, this->tracked_bits(i));
+    if (!res) {
+        return std::nullopt;
+    }
+    return static_cast<block_id_t>(res.value() +
+                                   i * block_sz * KBitsPerByte);
+}
 
-            // TODO: Find the first free bit of current bitmap block
-            // and store it in `res`.
-            // UNIMPLEMENTED();
-            res = bitmap.find_first_free();
+auto BlockAllocator::first_fit() -> std::optional<block_id_t> {
+    for (usize i = 0; i < this->bitmap_block_cnt; i++) {
+        if (this->groups[i]->free_cnt == 0) {
+            // full, no need to look into it
+            continue;
         }
+        auto res = this->find_free_in(i, 0);
+        CHFS_ASSERT(res.has_value(), "the free count is out of sync");
+        return res;
+    }
+    return std::nullopt;
+}
+
+auto BlockAllocator::next_fit() -> std::optional<block_id_t> {
+    const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+    if (this->rotor >= this->tracked_blocks()) {
+        this->rotor = 0;
+    }
 
-        // If we find one free bit inside current bitmap block.
+    // from the rotor to the end, then wrap around to the blocks before it
+    const usize start = this->rotor / total_bits_per_block;
+    for (usize k = 0; k <= this->bitmap_block_cnt; k++) {
+        const usize i = (start + k) % this->bitmap_block_cnt;
+        if (this->groups[i]->free_cnt == 0) {
+            continue;
+        }
+        auto res = this->find_free_in(
+            i, k == 0 ? this->rotor % total_bits_per_block : 0);
         if (res) {
-            // The block id of the allocated block.
-            // The total bits per block.(a bitmap block's mapping data block
-            // num)
-            const auto total_bits_per_block = bm->block_size() * KBitsPerByte;
-            block_id_t retval =
-                static_cast<block_id_t>(res.value() + i * total_bits_per_block);
-            CHFS_ASSERT(retval >= bitmap_block_id + bitmap_block_cnt,
-                        "allocate the reserved block");
-            bitmap.set(res.value());
-            // update bitmap
-            bm->write_block(i + bitmap_block_id, buffer.data());
-            // TODO:
-            // 1. Set the free bit we found to 1 in the bitmap.
-            // 2. Flush the changed bitmap block back to the block manager.
-            // 3. Calculate the value of `retval`.
-            // UNIMPLEMENTED();
-            return ChfsResult<block_id_t>(retval);
+            return res;
         }
     }
+    return std::nullopt;
+}
+
+auto BlockAllocator::best_fit() -> std::optional<block_id_t> {
+    // the fullest bitmap block with a free bit
+    std::optional<usize> best_block = std::nullopt;
+    usize best_free = 0;
+    for (usize i = 0; i < this->bitmap_block_cnt; i++) {
+        const usize free_cnt = this->groups[i]->free_cnt;
+        if (free_cnt != 0 && (!best_block || free_cnt < best_free)) {
+            best_block = i;
+            best_free = free_cnt;
+        }
+    }
+    if (!best_block) {
+        return std::nullopt;
+    }
+
+    // then the smallest free run in it
+    const auto block_sz = this->bm->block_size();
+    const auto bound = this->tracked_bits(*best_block);
+    auto bitmap =
+        Bitmap(this->bitmap_mirror.data() + *best_block * block_sz, block_sz);
+    usize best_start = 0;
+    usize best_len = 0;
+    usize pos = 0;
+    while (pos < bound) {
+        auto run_start = bitmap.find_next_free(pos, bound);
+        if (!run_start) {
+            break;
+        }
+        const usize run_end =
+            bitmap.find_next_used(*run_start, bound).value_or(bound);
+        if (best_len == 0 || run_end - *run_start < best_len) {
+            best_start = *run_start;
+            best_len = run_end - *run_start;
+            if (best_len == 1) {
+                break;
+            }
+        }
+        pos = run_end;
+    }
+    CHFS_ASSERT(best_len > 0, "the free count is out of sync");
+    return static_cast<block_id_t>(best_start +
+                                   *best_block * block_sz * KBitsPerByte);
+}
+
+auto BlockAllocator::allocate_in_groups() -> ChfsResult<block_id_t> {
+    const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+    const usize home = this->home_group();
+    for (usize k = 0; k < this->bitmap_block_cnt; k++) {
+        const usize i = (home + k) % this->bitmap_block_cnt;
+        auto &group = *this->groups[i];
+        if (group.free_cnt == 0) {
+            // full, no need to lock it
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(group.mtx);
+        const usize from =
+            this->policy == AllocPolicy::NextFit ? group.rotor : 0;
+        auto res = this->find_free_in(i, from);
+        if (!res && from != 0) {
+            res = this->find_free_in(i, 0);
+        }
+        if (!res) {
+            // taken by the others in the meantime
+            continue;
+        }
+
+        const block_id_t retval = res.value();
+        CHFS_ASSERT(retval >= bitmap_block_id + base_bitmap_block_cnt,
+                    "allocate the reserved block");
+        auto write_res = this->update_bit(retval, true);
+        if (write_res.is_err()) {
+            return ChfsResult<block_id_t>(write_res.unwrap_error());
+        }
+        group.rotor = retval - i * total_bits_per_block + 1;
+        return ChfsResult<block_id_t>(retval);
+    }
     return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
 }
 
 // Your implementation
-auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
+auto BlockAllocator::allocate() -> ChfsResult<block_id_t> {
+    auto resize_lock = this->lock_resize();
+    if (this->thread_safe) {
+        return this->allocate_in_groups();
+    }
+
+    std::optional<block_id_t> res = std::nullopt;
+    switch (this->policy) {
+    case AllocPolicy::FirstFit:
+        res = this->first_fit();
+        break;
+    case AllocPolicy::NextFit:
+        res = this->next_fit();
+        break;
+    case AllocPolicy::BestFit:
+        res = this->best_fit();
+        break;
+    }
+    if (!res) {
+        return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
+    }
+
+    const block_id_t retval = res.value();
+    CHFS_ASSERT(retval >= bitmap_block_id + base_bitmap_block_cnt,
+                "allocate the reserved block");
+    auto write_res = this->update_bit(retval, true);
+    if (write_res.is_err()) {
+        return ChfsResult<block_id_t>(write_res.unwrap_error());
+    }
+    this->rotor = retval + 1;
+    return ChfsResult<block_id_t>(retval);
+}
+
+auto BlockAllocator::allocate(usize cnt)
+    -> ChfsResult<std::vector<block_id_t>> {
+    auto resize_lock = this->lock_resize();
+    auto locks = this->lock_all_groups();
+    if (cnt > this->total_free) {
+        return ChfsResult<std::vector<block_id_t>>(ErrorType::OUT_OF_RESOURCE);
+    }
+
+    const auto block_sz = this->bm->block_size();
+    const auto total_bits_per_block = block_sz * KBitsPerByte;
+    const usize total = this->tracked_blocks();
+    const usize start = this->policy == AllocPolicy::NextFit &&
+                                this->rotor < total
+                            ? this->rotor
+                            : 0;
+
+    // take the free blocks in order from the start, then wrap around
+    auto bitmap =
+        Bitmap(this->bitmap_mirror.data(), this->bitmap_mirror.size());
+    std::vector<block_id_t> block_ids;
+    block_ids.reserve(cnt);
+    const std::pair<usize, usize> ranges[] = {{start, total}, {0, start}};
+    for (auto [from, to] : ranges) {
+        usize pos = from;
+        while (block_ids.size() < cnt && pos < to) {
+            const usize bitmap_idx = pos / total_bits_per_block;
+            const usize block_end =
+                std::min(to, (bitmap_idx + 1) * total_bits_per_block);
+            auto free_bit = this->groups[bitmap_idx]->free_cnt == 0
+                                ? std::nullopt
+                                : bitmap.find_next_free(pos, block_end);
+            if (!free_bit) {
+                pos = block_end;
+                continue;
+            }
+            block_ids.push_back(static_cast<block_id_t>(*free_bit));
+            pos = *free_bit + 1;
+        }
+    }
+    CHFS_ASSERT(block_ids.size() == cnt, "the free count is out of sync");
+    if (cnt == 0) {
+        return ChfsResult<std::vector<block_id_t>>(std::move(block_ids));
+    }
+
+    const block_id_t next = block_ids.back() + 1;
+    std::sort(block_ids.begin(), block_ids.end());
+    CHFS_ASSERT(block_ids.front() >= bitmap_block_id + base_bitmap_block_cnt,
+                "allocate the reserved block");
+    auto res = this->update_blocks(block_ids, true);
+    if (res.is_err()) {
+        return ChfsResult<std::vector<block_id_t>>(res.unwrap_error());
+    }
+    this->rotor = next;
+    return ChfsResult<std::vector<block_id_t>>(std::move(block_ids));
+}
+
+auto BlockAllocator::allocate_extent(usize min_len, usize max_len,
+                                     block_id_t goal)
+    -> ChfsResult<std::pair<block_id_t, usize>> {
+    if (min_len == 0 || min_len > max_len) {
+        return ChfsResult<std::pair<block_id_t, usize>>(
+            ErrorType::INVALID_ARG);
+    }
+
+    auto resize_lock = this->lock_resize();
+    if (this->thread_safe) {
+        return this->allocate_extent_in_groups(min_len, max_len, goal);
+    }
+
+    const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+    const usize total = this->tracked_blocks();
+    if (goal == 0 || goal >= total) {
+        goal = this->policy == AllocPolicy::NextFit && this->rotor < total
+                   ? this->rotor
+                   : 0;
+    }
+
+    // the bitmap blocks are back to back in the mirror, so the runs are
+    // searched through all of them at once
+    auto bitmap =
+        Bitmap(this->bitmap_mirror.data(), this->bitmap_mirror.size());
+    block_id_t best_start = 0;
+    usize best_len = 0;
+    bool done = false;
+    // from the goal to the end, then from the beginning to the goal
+    const std::pair<usize, usize> ranges[] = {{goal, total}, {0, goal}};
+    usize scanned = 0;
+    for (auto [from, to] : ranges) {
+        usize pos = from;
+        while (!done && pos < to) {
+            const usize bitmap_idx = pos / total_bits_per_block;
+            const usize block_end =
+                std::min(to, (bitmap_idx + 1) * total_bits_per_block);
+            auto run_start = this->groups[bitmap_idx]->free_cnt == 0
+                                 ? std::nullopt
+                                 : bitmap.find_next_free(pos, block_end);
+            if (!run_start) {
+                scanned += block_end - pos;
+                pos = block_end;
+            } else {
+                const usize run_end =
+                    bitmap
+                        .find_next_used(*run_start,
+                                        std::min(total, *run_start + max_len))
+                        .value_or(std::min(total, *run_start + max_len));
+                const usize len = run_end - *run_start;
+                if (len >= min_len && len > best_len) {
+                    best_start = static_cast<block_id_t>(*run_start);
+                    best_len = len;
+                }
+                scanned += run_end - pos;
+                pos = run_end;
+            }
+            done = best_len == max_len ||
+                   (best_len > 0 && scanned >= total_bits_per_block);
+        }
+    }
+    if (best_len == 0) {
+        return ChfsResult<std::pair<block_id_t, usize>>(
+            ErrorType::OUT_OF_RESOURCE);
+    }
+
+    CHFS_ASSERT(best_start >= bitmap_block_id + base_bitmap_block_cnt,
+                "allocate the reserved block");
+    auto res = this->update_range(best_start, best_len, true);
+    if (res.is_err()) {
+        return ChfsResult<std::pair<block_id_t, usize>>(res.unwrap_error());
+    }
+    this->rotor = best_start + best_len;
+    return ChfsResult<std::pair<block_id_t, usize>>({best_start, best_len});
+}
+
+auto BlockAllocator::longest_free_run(usize from, usize to, usize end,
+                                      usize max_len)
+    -> std::pair<usize, usize> {
+    auto bitmap =
+        Bitmap(this->bitmap_mirror.data(), this->bitmap_mirror.size());
+    std::pair<usize, usize> best = {0, 0};
+    usize pos = from;
+    while (pos < to && best.second < max_len) {
+        auto run_start = bitmap.find_next_free(pos, to);
+        if (!run_start) {
+            break;
+        }
+        const usize limit = std::min(end, *run_start + max_len);
+        const usize run_end =
+            bitmap.find_next_used(*run_start, limit).value_or(limit);
+        if (run_end - *run_start > best.second) {
+            best = {*run_start, run_end - *run_start};
+        }
+        pos = run_end;
+    }
+    return best;
+}
+
+auto BlockAllocator::allocate_extent_in_groups(usize min_len, usize max_len,
+                                               block_id_t goal)
+    -> ChfsResult<std::pair<block_id_t, usize>> {
+    const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+    const usize total = this->tracked_blocks();
+    const bool has_goal = goal != 0 && goal < total;
+    const usize first =
+        has_goal ? goal / total_bits_per_block : this->home_group();
+    for (usize k = 0; k < this->bitmap_block_cnt; k++) {
+        const usize i = (first + k) % this->bitmap_block_cnt;
+        auto &group = *this->groups[i];
+        if (group.free_cnt < min_len) {
+            // too full for the run, no need to lock it
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(group.mtx);
+        const usize start = i * total_bits_per_block;
+        const usize end = start + this->tracked_bits(i);
+        usize from = start;
+        if (k == 0 && has_goal) {
+            from = goal;
+        } else if (this->policy == AllocPolicy::NextFit) {
+            from = std::min(end, start + group.rotor);
+        }
+        // from `from` to the end of the group, then from its beginning
+        auto run = this->longest_free_run(from, end, end, max_len);
+        if (run.second < max_len && from > start) {
+            auto wrapped = this->longest_free_run(start, from, end, max_len);
+            if (wrapped.second > run.second) {
+                run = wrapped;
+            }
+        }
+        if (run.second < min_len) {
+            continue;
+        }
+
+        CHFS_ASSERT(run.first >= bitmap_block_id + base_bitmap_block_cnt,
+                    "allocate the reserved block");
+        auto res = this->update_range(run.first, run.second, true);
+        if (res.is_err()) {
+            return ChfsResult<std::pair<block_id_t, usize>>(
+                res.unwrap_error());
+        }
+        group.rotor = run.first + run.second - start;
+        return ChfsResult<std::pair<block_id_t, usize>>(
+            {static_cast<block_id_t>(run.first), run.second});
+    }
+    return ChfsResult<std::pair<block_id_t, usize>>(ErrorType::OUT_OF_RESOURCE);
+}
+
+auto BlockAllocator::check_deallocate(block_id_t block_id) -> ChfsNullResult {
     if (block_id >= this->bm->total_blocks()) {
         std::cerr << "invalid id: try to deallocate a too large block id: "
                   << block_id << std::endl;
         return ChfsNullResult(ErrorType::INVALID_ARG);
     }
 
-    // TODO: Implement this function.
-    // 1. According to `block_id`, zero the bit in the bitmap.
-    // 2. Flush the changed bitmap block back to the block manager.
-    // 3. Return ChfsNullResult(ErrorType::INVALID_ARG)
-    //    if you find `block_id` is invalid (e.g. already freed).
-
-    // UNIMPLEMENTED();
-    CHFS_ASSERT(block_id >= bitmap_block_id + bitmap_block_cnt,
+    CHFS_ASSERT(block_id >= bitmap_block_id + base_bitmap_block_cnt,
                 "deallocate the reserved block");
     const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
-    const auto cur_bitmap_block_id =
-        this->bitmap_block_id + block_id / total_bits_per_block;
-    CHFS_ASSERT(cur_bitmap_block_id < bitmap_block_id + bitmap_block_cnt,
-                "invalid bitmap block id");
+    const auto bitmap_idx = block_id / total_bits_per_block;
+    CHFS_ASSERT(bitmap_idx < bitmap_block_cnt, "invalid bitmap block id");
+    if (bitmap_idx >= this->base_bitmap_block_cnt &&
+        block_id == this->bitmap_block_location(bitmap_idx)) {
+        std::cerr << "deallocate: the block stores the bitmap, block id: "
+                  << block_id << std::endl;
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
 
-    auto buffer = std::vector<u8>(this->bm->block_size());
-    this->bm->read_block(cur_bitmap_block_id, buffer.data());
-    auto bitmap = Bitmap(buffer.data(), this->bm->block_size());
+    auto bitmap = Bitmap(this->bitmap_mirror.data() +
+                             bitmap_idx * this->bm->block_size(),
+                         this->bm->block_size());
 
     // is free block
     if (!bitmap.check(block_id % total_bits_per_block)) {
@@ -176,8 +723,172 @@ auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
                   << std::endl;
         return ChfsNullResult(ErrorType::INVALID_ARG);
     }
-    bitmap.clear(block_id % total_bits_per_block);
-    bm->write_block(cur_bitmap_block_id, buffer.data());
+    return KNullOk;
+}
+
+// Your implementation
+auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
+    auto resize_lock = this->lock_resize();
+    const usize group = block_id / (this->bm->block_size() * KBitsPerByte);
+    auto locks = this->lock_groups(group, group);
+    auto res = this->check_deallocate(block_id);
+    if (res.is_err()) {
+        return res;
+    }
+    std::unique_lock<std::mutex> dedup_lock(this->dedup_mtx, std::defer_lock);
+    if (this->dedup != nullptr) {
+        if (this->thread_safe) {
+            dedup_lock.lock();
+        }
+        if (this->dedup->release(block_id)) {
+            // still referenced by other files
+            return KNullOk;
+        }
+    }
+    res = this->update_bit(block_id, false);
+    if (res.is_err()) {
+        return res;
+    }
+    if (this->dedup != nullptr) {
+        // only once the block is free, so a failure keeps its entry
+        this->dedup->forget(block_id);
+        if (dedup_lock.owns_lock()) {
+            dedup_lock.unlock();
+        }
+    }
+
+    if (this->discard_on_free) {
+        return this->bm->discard_blocks({block_id});
+    }
+    return KNullOk;
+}
+
+auto BlockAllocator::deallocate(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+    if (block_ids.empty()) {
+        return KNullOk;
+    }
+    const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+    auto resize_lock = this->lock_resize();
+    auto [min_id, max_id] =
+        std::minmax_element(block_ids.begin(), block_ids.end());
+    auto locks = this->lock_groups(*min_id / total_bits_per_block,
+                                   *max_id / total_bits_per_block);
+    for (auto block_id : block_ids) {
+        auto res = this->check_deallocate(block_id);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+
+    std::vector<block_id_t> sorted = block_ids;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<block_id_t> to_free;
+    std::unique_lock<std::mutex> dedup_lock(this->dedup_mtx, std::defer_lock);
+    if (this->dedup == nullptr) {
+        auto dup = std::adjacent_find(sorted.begin(), sorted.end());
+        if (dup != sorted.end()) {
+            std::cerr << "deallocate: double free, block id: " << *dup
+                      << std::endl;
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        to_free = std::move(sorted);
+    } else {
+        if (this->thread_safe) {
+            dedup_lock.lock();
+        }
+        // a shared block appears at most once for each of its references,
+        // and only its last reference frees it, so the blocks to free stay
+        // sorted and unique
+        for (auto it = sorted.begin(); it != sorted.end();) {
+            auto next = std::upper_bound(it, sorted.end(), *it);
+            const auto refs = this->dedup->ref_count(*it);
+            if (static_cast<u64>(next - it) > refs) {
+                std::cerr << "deallocate: double free, block id: " << *it
+                          << std::endl;
+                return ChfsNullResult(ErrorType::INVALID_ARG);
+            }
+            if (static_cast<u64>(next - it) == refs) {
+                to_free.push_back(*it);
+            }
+            it = next;
+        }
+    }
+
+    auto res = this->update_blocks(to_free, false);
+    if (res.is_err()) {
+        return res;
+    }
+    if (this->dedup != nullptr) {
+        // the references are only dropped once the bitmap is updated, so
+        // nothing changes on failure
+        for (auto block_id : sorted) {
+            this->dedup->release(block_id);
+        }
+        for (auto block_id : to_free) {
+            this->dedup->forget(block_id);
+        }
+        if (dedup_lock.owns_lock()) {
+            dedup_lock.unlock();
+        }
+    }
+    if (this->discard_on_free && !to_free.empty()) {
+        return this->bm->discard_blocks(to_free);
+    }
+    return KNullOk;
+}
+
+auto BlockAllocator::grow(usize new_block_cnt) -> ChfsNullResult {
+    const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+    std::unique_lock<std::shared_mutex> resize_lock(this->resize_mtx,
+                                                    std::defer_lock);
+    if (this->thread_safe) {
+        resize_lock.lock();
+    }
+    auto locks = this->lock_all_groups();
+    if (new_block_cnt < this->tracked_blocks() ||
+        new_block_cnt > this->bm->total_blocks()) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    // the spare bits of the last bitmap block are already zero, so only the
+    // new bitmap blocks need initializing
+    const block_id_t new_bitmap_block_cnt =
+        (new_block_cnt + total_bits_per_block - 1) / total_bits_per_block;
+    const auto block_sz = this->bm->block_size();
+    const usize old_bitmap_block_cnt = this->bitmap_block_cnt;
+    this->bitmap_mirror.resize(static_cast<usize>(new_bitmap_block_cnt) *
+                               block_sz);
+    for (usize i = old_bitmap_block_cnt; i < new_bitmap_block_cnt; i++) {
+        u8 *data = this->bitmap_mirror.data() + i * block_sz;
+        auto bitmap = Bitmap(data, block_sz);
+        // the bitmap block itself
+        bitmap.set(0);
+        auto res = this->bm->write_block(this->bitmap_block_location(i), data);
+        if (res.is_err()) {
+            this->bitmap_mirror.resize(old_bitmap_block_cnt * block_sz);
+            return res;
+        }
+    }
+
+    // the last bitmap block tracks more blocks now, recount from it
+    const usize old_free = this->groups.back()->free_cnt;
+    for (usize i = old_bitmap_block_cnt; i < new_bitmap_block_cnt; i++) {
+        this->groups.push_back(std::make_unique<AllocGroup>());
+    }
+    this->bitmap_block_cnt = new_bitmap_block_cnt;
+    this->last_block_num =
+        new_block_cnt - (new_bitmap_block_cnt - 1) * total_bits_per_block;
+    usize new_free = 0;
+    for (usize i = old_bitmap_block_cnt - 1; i < new_bitmap_block_cnt; i++) {
+        const usize free_cnt =
+            Bitmap(this->bitmap_mirror.data() + i * block_sz, block_sz)
+                .count_zeros_to_bound(this->tracked_bits(i));
+        this->groups[i]->free_cnt = free_cnt;
+        new_free += free_cnt;
+    }
+    // at once, so `free_block_cnt` never sees the last group missing
+    this->total_free += new_free - old_free;
     return KNullOk;
 }
 
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <cstring>
+
+#include "block/cache.h"
+
+namespace chfs {
+
+/**
+ * A pin over a cache frame
+ */
+class FramePin : public BlockPin {
+    CachedBlockManager *cache;
+    usize frame;
+
+  public:
+    FramePin(CachedBlockManager *cache, usize frame, block_id_t block_id)
+        : BlockPin(block_id, cache->frame_ptr(frame)), cache(cache),
+          frame(frame) {
+        this->cache->frames[frame].pins += 1;
+    }
+
+    ~FramePin() override {
+        std::lock_guard<std::mutex> lock(this->cache->mtx);
+        auto &f = this->cache->frames[this->frame];
+        f.pins -= 1;
+        f.dirty = f.dirty || this->dirty;
+    }
+};
+
+CachedBlockManager::CachedBlockManager(std::shared_ptr<BlockManager> inner,
+                                       usize capacity, CachePolicy policy)
+    : BlockManager(inner->total_blocks(), inner->block_size(), nullptr),
+      inner(std::move(inner)), capacity(capacity), policy(policy),
+      clock_hand(0), hits(0), misses(0) {
+    CHFS_VERIFY(capacity > 0, "The cache needs at least one frame");
+
+    this->frame_data.resize(static_cast<u64>(capacity) * this->block_sz);
+    this->frames.resize(capacity, Frame{0, false, false, 0, false, lru.end()});
+    this->free_frames.reserve(capacity);
+    // hand out the low frames first
+    for (usize i = capacity; i > 0; i--) {
+        this->free_frames.push_back(i - 1);
+    }
+    this->table.reserve(capacity);
+}
+
+CachedBlockManager::~CachedBlockManager() {
+    this->wait_async();
+    auto res = this->flush();
+    if (res.is_err()) {
+        std::cerr << "cache: failed to flush upon destruction" << std::endl;
+    }
+}
+
+auto CachedBlockManager::write_block(block_id_t block_id,
+                                     const u8 *data) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    // the whole block is overwritten, so there is no need to load it
+    auto frame_res = this->get_frame(block_id, false);
+    if (frame_res.is_err()) {
+        return ChfsNullResult(frame_res.unwrap_error());
+    }
+    auto frame = frame_res.unwrap();
+    memcpy(this->frame_ptr(frame), data, this->block_sz);
+    this->frames[frame].dirty = true;
+    this->record_access(block_id, 1, true);
+    return KNullOk;
+}
+
+auto CachedBlockManager::write_partial_block(block_id_t block_id,
+                                             const u8 *data, usize offset,
+                                             usize len) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (offset + len > this->block_sz) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    auto frame_res = this->get_frame(block_id, true);
+    if (frame_res.is_err()) {
+        return ChfsNullResult(frame_res.unwrap_error());
+    }
+    auto frame = frame_res.unwrap();
+    memcpy(this->frame_ptr(frame) + offset, data, len);
+    this->frames[frame].dirty = true;
+    this->record_access(block_id, 1, true);
+    return KNullOk;
+}
+
+auto CachedBlockManager::read_block(block_id_t block_id,
+                                    u8 *data) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto frame_res = this->get_frame(block_id, true);
+    if (frame_res.is_err()) {
+        return ChfsNullResult(frame_res.unwrap_error());
+    }
+    memcpy(data, this->frame_ptr(frame_res.unwrap()), this->block_sz);
+    this->record_access(block_id, 1, false);
+    return KNullOk;
+}
+
+auto CachedBlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
+    if (this->discard_enabled) {
+        // drop the cached copy and let the device release the block
+        this->record_access(block_id, 1, true);
+        return this->discard_blocks({block_id});
+    }
+
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto frame_res = this->get_frame(block_id, false);
+    if (frame_res.is_err()) {
+        return ChfsNullResult(frame_res.unwrap_error());
+    }
+    auto frame = frame_res.unwrap();
+    memset(this->frame_ptr(frame), 0, this->block_sz);
+    this->frames[frame].dirty = true;
+    this->record_access(block_id, 1, true);
+    return KNullOk;
+}
+
+auto CachedBlockManager::pin_block(block_id_t block_id, bool writable)
+    -> ChfsResult<std::shared_ptr<BlockPin>> {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto frame_res = this->get_frame(block_id, true);
+    if (frame_res.is_err()) {
+        return ChfsResult<std::shared_ptr<BlockPin>>(frame_res.unwrap_error());
+    }
+    auto pin = std::shared_ptr<BlockPin>(
+        new FramePin(this, frame_res.unwrap(), block_id));
+    this->record_access(block_id, 1, writable);
+    return ChfsResult<std::shared_ptr<BlockPin>>(pin);
+}
+
+auto CachedBlockManager::prefetch(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+    for (const auto &block_id : block_ids) {
+        if (block_id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+    }
+    // let the device start reading before the workers ask for the blocks
+    auto res = this->inner->prefetch(block_ids);
+    if (res.is_err()) {
+        return res;
+    }
+
+    auto batch = block_ids;
+    const usize limit = std::max<usize>(1, this->capacity / 2);
+    batch.resize(std::min<usize>(batch.size(), limit));
+    this->get_io_pool().submit([this, batch] {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        for (const auto &block_id : batch) {
+            if (this->table.count(block_id) != 0) {
+                continue;
+            }
+            // prefetching is a hint, the read will retry on failure
+            if (this->get_frame(block_id, true).is_err()) {
+                break;
+            }
+        }
+    });
+    return KNullOk;
+}
+
+auto CachedBlockManager::flush() -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (usize i = 0; i < this->capacity; i++) {
+        if (this->frames[i].valid && this->frames[i].dirty) {
+            auto res = this->write_back(i);
+            if (res.is_err()) {
+                return res;
+            }
+        }
+    }
+    return KNullOk;
+}
+
+auto CachedBlockManager::discard_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    // held until the device is discarded as well, so no miss in between
+    // loads the old content back
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (auto block_id : block_ids) {
+        auto it = this->table.find(block_id);
+        if (it == this->table.end()) {
+            continue;
+        }
+        const auto frame = it->second;
+        auto &f = this->frames[frame];
+        if (f.pins > 0) {
+            // still in use, so keep the frame but match the device
+            memset(this->frame_ptr(frame), 0, this->block_sz);
+            f.dirty = false;
+            continue;
+        }
+        f.dirty = false;
+        this->reclaim(frame).unwrap();
+        this->free_frames.push_back(frame);
+    }
+    return this->inner->discard_blocks(block_ids);
+}
+
+auto CachedBlockManager::grow(usize new_block_cnt) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->inner->grow(new_block_cnt);
+    if (res.is_ok()) {
+        this->block_cnt = this->inner->total_blocks();
+    }
+    return res;
+}
+
+auto CachedBlockManager::sync() -> ChfsNullResult {
+    auto res = this->flush();
+    if (res.is_err()) {
+        return res;
+    }
+    return this->inner->sync();
+}
+
+auto CachedBlockManager::sync_range(block_id_t start,
+                                    usize cnt) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        for (usize i = 0; i < this->capacity; i++) {
+            const auto &f = this->frames[i];
+            if (f.valid && f.dirty && f.block_id >= start &&
+                f.block_id < start + cnt) {
+                auto res = this->write_back(i);
+                if (res.is_err()) {
+                    return res;
+                }
+            }
+        }
+    }
+    return this->inner->sync_range(start, cnt);
+}
+
+auto CachedBlockManager::hit_count() const -> u64 {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->hits;
+}
+
+auto CachedBlockManager::miss_count() const -> u64 {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->misses;
+}
+
+auto CachedBlockManager::cached_blocks() const -> usize {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->table.size();
+}
+
+auto CachedBlockManager::dirty_blocks() const -> usize {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    usize count = 0;
+    for (const auto &frame : this->frames) {
+        if (frame.valid && frame.dirty) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+auto CachedBlockManager::get_frame(block_id_t block_id,
+                                   bool load) -> ChfsResult<usize> {
+    if (block_id >= this->block_cnt) {
+        std::cerr << "cache: invalid block id " << block_id << std::endl;
+        return ChfsResult<usize>(ErrorType::INVALID_ARG);
+    }
+
+    auto it = this->table.find(block_id);
+    if (it != this->table.end()) {
+        this->hits += 1;
+        this->touch(it->second);
+        return ChfsResult<usize>(it->second);
+    }
+
+    this->misses += 1;
+    usize frame = 0;
+    if (!this->free_frames.empty()) {
+        frame = this->free_frames.back();
+        this->free_frames.pop_back();
+    } else {
+        auto evict_res = this->evict();
+        if (evict_res.is_err()) {
+            return evict_res;
+        }
+        frame = evict_res.unwrap();
+    }
+
+    if (load) {
+        auto res = this->inner->read_block(block_id, this->frame_ptr(frame));
+        if (res.is_err()) {
+            this->free_frames.push_back(frame);
+            return ChfsResult<usize>(res.unwrap_error());
+        }
+    }
+
+    auto &f = this->frames[frame];
+    f.block_id = block_id;
+    f.valid = true;
+    f.dirty = false;
+    f.pins = 0;
+    f.referenced = true;
+    if (this->policy == CachePolicy::LRU) {
+        this->lru.push_front(frame);
+        f.lru_pos = this->lru.begin();
+    }
+    this->table[block_id] = frame;
+    return ChfsResult<usize>(frame);
+}
+
+auto CachedBlockManager::evict() -> ChfsResult<usize> {
+    std::optional<usize> victim = std::nullopt;
+    if (this->policy == CachePolicy::LRU) {
+        for (auto it = this->lru.rbegin(); it != this->lru.rend(); ++it) {
+            if (this->frames[*it].pins == 0) {
+                victim = *it;
+                break;
+            }
+        }
+    } else {
+        // give each referenced frame a second chance, two rounds are enough
+        // to find an unpinned frame if there is one
+        for (usize i = 0; i < 2 * this->capacity; i++) {
+            auto &f = this->frames[this->clock_hand];
+            auto cur = this->clock_hand;
+            this->clock_hand = (this->clock_hand + 1) % this->capacity;
+            if (f.pins > 0) {
+                continue;
+            }
+            if (!f.referenced) {
+                victim = cur;
+                break;
+            }
+            f.referenced = false;
+        }
+    }
+
+    if (!victim) {
+        std::cerr << "cache: all the frames are pinned" << std::endl;
+        return ChfsResult<usize>(ErrorType::OUT_OF_RESOURCE);
+    }
+    return this->reclaim(victim.value());
+}
+
+auto CachedBlockManager::reclaim(usize victim) -> ChfsResult<usize> {
+    auto &f = this->frames[victim];
+    if (f.dirty) {
+        auto res = this->write_back(victim);
+        if (res.is_err()) {
+            return ChfsResult<usize>(res.unwrap_error());
+        }
+    }
+
+    if (this->policy == CachePolicy::LRU) {
+        this->lru.erase(f.lru_pos);
+        f.lru_pos = this->lru.end();
+    }
+    this->table.erase(f.block_id);
+    f.valid = false;
+    return ChfsResult<usize>(victim);
+}
+
+auto CachedBlockManager::touch(usize frame) -> void {
+    auto &f = this->frames[frame];
+    if (this->policy == CachePolicy::LRU) {
+        this->lru.splice(this->lru.begin(), this->lru, f.lru_pos);
+    } else {
+        f.referenced = true;
+    }
+}
+
+auto CachedBlockManager::write_back(usize frame) -> ChfsNullResult {
+    auto &f = this->frames[frame];
+    auto res = this->inner->write_block(f.block_id, this->frame_ptr(frame));
+    if (res.is_ok()) {
+        f.dirty = false;
+    }
+    return res;
+}
+
+} // namespace chfs
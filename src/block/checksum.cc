@@ -0,0 +1,631 @@
+#include <cstring>
+#include <set>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "block/checksum.h"
+
+namespace chfs {
+
+namespace {
+
+// the reflected CRC32C (Castagnoli) polynomial
+const u32 KCrc32cPoly = 0x82F63B78;
+
+/**
+ * The lookup tables of the slicing-by-8 algorithm:
+ * t[0] is the classic byte-wise table, and t[k][i] is the CRC of byte i
+ * followed by k zero bytes.
+ */
+struct Crc32cTable {
+    u32 t[8][256];
+
+    Crc32cTable() {
+        for (u32 i = 0; i < 256; i++) {
+            u32 crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc & 1) ? (crc >> 1) ^ KCrc32cPoly : crc >> 1;
+            }
+            t[0][i] = crc;
+        }
+        for (u32 i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+auto crc32c_table() -> const Crc32cTable & {
+    static const Crc32cTable table;
+    return table;
+}
+
+#if defined(__x86_64__)
+// the chunk lengths of the three-way interleaved hardware CRC
+// (the middle one covers most of a 4 KiB block in one round)
+const usize KCrcLong = 8192;
+const usize KCrcMid = 1344;
+const usize KCrcShort = 256;
+
+// multiplies a and b modulo the CRC polynomial, in the reflected bit order
+auto multmodp(u32 a, u32 b) -> u32 {
+    u32 m = 1u << 31;
+    u32 p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ KCrc32cPoly : b >> 1;
+    }
+    return p;
+}
+
+// x^n modulo the CRC polynomial
+auto xpow_mod(usize n) -> u32 {
+    u32 sq = 1u << 30; // x^1
+    u32 p = 1u << 31;  // x^0
+    for (; n != 0; n >>= 1) {
+        if (n & 1) {
+            p = multmodp(sq, p);
+        }
+        sq = multmodp(sq, sq);
+    }
+    return p;
+}
+
+// x^(8 * n) modulo the CRC polynomial, i.e., the operator of n zero bytes
+auto zeros_op(usize n) -> u32 { return xpow_mod(8 * n); }
+
+/**
+ * The tables that shift a CRC state over `KCrcLong`, `KCrcMid` or
+ * `KCrcShort` zero bytes, used to combine the interleaved streams: t[k][i] is the shift of
+ * byte i placed at byte k of the state.
+ */
+struct Crc32cShift {
+    u32 long_t[4][256];
+    u32 mid_t[4][256];
+    u32 short_t[4][256];
+
+    Crc32cShift() {
+        fill(long_t, zeros_op(KCrcLong));
+        fill(mid_t, zeros_op(KCrcMid));
+        fill(short_t, zeros_op(KCrcShort));
+    }
+
+    static auto fill(u32 (&t)[4][256], u32 op) -> void {
+        for (u32 k = 0; k < 4; k++) {
+            for (u32 i = 0; i < 256; i++) {
+                t[k][i] = multmodp(op, i << (8 * k));
+            }
+        }
+    }
+};
+
+auto crc32c_shift_table() -> const Crc32cShift & {
+    static const Crc32cShift table;
+    return table;
+}
+
+auto shift(const u32 (&t)[4][256], u32 crc) -> u32 {
+    return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+           t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+/**
+ * Runs three independent `crc32` chains over three adjacent chunks of
+ * `chunk` bytes each, so the instruction's latency is hidden, then folds
+ * the second and third states into the first one.
+ */
+__attribute__((target("sse4.2"))) auto
+crc32c_3way(const u8 *&data, usize &len, u64 c0, usize chunk,
+            const u32 (&t)[4][256]) -> u64 {
+    while (len >= 3 * chunk) {
+        u64 c1 = 0, c2 = 0;
+        const u8 *end = data + chunk;
+        do {
+            u64 w0, w1, w2;
+            memcpy(&w0, data, sizeof(w0));
+            memcpy(&w1, data + chunk, sizeof(w1));
+            memcpy(&w2, data + 2 * chunk, sizeof(w2));
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+            data += sizeof(u64);
+        } while (data < end);
+        c0 = shift(t, static_cast<u32>(c0)) ^ c1;
+        c0 = shift(t, static_cast<u32>(c0)) ^ c2;
+        data += 2 * chunk;
+        len -= 3 * chunk;
+    }
+    return c0;
+}
+
+__attribute__((target("sse4.2"))) auto
+crc32c_hardware(const u8 *data, usize len, u32 crc) -> u32 {
+    const auto &shifts = crc32c_shift_table();
+    u64 c = ~crc;
+    c = crc32c_3way(data, len, c, KCrcLong, shifts.long_t);
+    c = crc32c_3way(data, len, c, KCrcMid, shifts.mid_t);
+    c = crc32c_3way(data, len, c, KCrcShort, shifts.short_t);
+    while (len >= sizeof(u64)) {
+        u64 word;
+        memcpy(&word, data, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+        data += sizeof(u64);
+        len -= sizeof(u64);
+    }
+    u32 c32 = static_cast<u32>(c);
+    while (len > 0) {
+        c32 = _mm_crc32_u8(c32, *data);
+        data += 1;
+        len -= 1;
+    }
+    return ~c32;
+}
+
+auto has_sse42() -> bool {
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+
+// the bytes folded per round by the carry-less multiplication version
+const usize KFoldRound = 4 * sizeof(__m512i);
+
+/**
+ * The constants that fold a 16-byte lane forward over `bits` bits: the low
+ * half of the lane is multiplied by x^(bits + 31) and the high half by
+ * x^(bits - 33), where the offsets account for the position of the halves,
+ * the 32-bit constants sitting in the low bits of 64-bit operands, and the
+ * one-bit shift of a reflected carry-less product.
+ */
+struct FoldConstants {
+    u64 lo;
+    u64 hi;
+
+    explicit FoldConstants(usize bits)
+        : lo(xpow_mod(bits + 31)), hi(xpow_mod(bits - 33)) {}
+};
+
+/**
+ * The folding constants of `crc32c_fold`, computed once.
+ */
+struct Crc32cFold {
+    FoldConstants round;    // across `KFoldRound` bytes
+    FoldConstants vec;      // across a 64-byte vector
+    FoldConstants lanes[3]; // across 48, 32 and 16 bytes
+
+    Crc32cFold()
+        : round(8 * KFoldRound), vec(512),
+          lanes{FoldConstants(384), FoldConstants(256), FoldConstants(128)} {
+    }
+};
+
+auto crc32c_fold_table() -> const Crc32cFold & {
+    static const Crc32cFold table;
+    return table;
+}
+
+__attribute__((target("sse4.2,pclmul"))) auto
+fold_lane(__m128i lane, const FoldConstants &k) -> __m128i {
+    const __m128i kk = _mm_set_epi64x(static_cast<long long>(k.hi),
+                                      static_cast<long long>(k.lo));
+    return _mm_xor_si128(_mm_clmulepi64_si128(lane, kk, 0x00),
+                         _mm_clmulepi64_si128(lane, kk, 0x11));
+}
+
+__attribute__((target("avx512f"))) auto
+broadcast(const FoldConstants &k) -> __m512i {
+    return _mm512_set4_epi64(
+        static_cast<long long>(k.hi), static_cast<long long>(k.lo),
+        static_cast<long long>(k.hi), static_cast<long long>(k.lo));
+}
+
+__attribute__((target("avx512f,vpclmulqdq"))) auto
+fold_lanes(__m512i lanes, __m512i k, __m512i next) -> __m512i {
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(lanes, k, 0x00),
+                                     _mm512_clmulepi64_epi128(lanes, k, 0x11),
+                                     next, 0x96);
+}
+
+/**
+ * Computes the CRC by folding the data with carry-less multiplications,
+ * 16 lanes of 16 bytes at a time, which runs about twice as fast as the
+ * `crc32` instruction. The folded 16 bytes and the tail are then fed to the
+ * `crc32` instruction.
+ * The data must hold at least `KFoldRound` bytes.
+ */
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2"))) auto
+crc32c_fold(const u8 *data, usize len, u32 crc) -> u32 {
+    const auto &consts = crc32c_fold_table();
+
+    // the initial CRC is folded in as if it were xored into the data
+    __m512i acc[4];
+    for (usize i = 0; i < 4; i++) {
+        acc[i] = _mm512_loadu_si512(data + i * sizeof(__m512i));
+    }
+    acc[0] = _mm512_xor_si512(
+        acc[0], _mm512_castsi128_si512(_mm_cvtsi32_si128(~crc)));
+    data += KFoldRound;
+    len -= KFoldRound;
+
+    const __m512i k_round = broadcast(consts.round);
+    while (len >= KFoldRound) {
+        for (usize i = 0; i < 4; i++) {
+            acc[i] = fold_lanes(
+                acc[i], k_round,
+                _mm512_loadu_si512(data + i * sizeof(__m512i)));
+        }
+        data += KFoldRound;
+        len -= KFoldRound;
+    }
+
+    const __m512i k_vec = broadcast(consts.vec);
+    __m512i v = fold_lanes(acc[0], k_vec, acc[1]);
+    v = fold_lanes(v, k_vec, acc[2]);
+    v = fold_lanes(v, k_vec, acc[3]);
+    while (len >= sizeof(__m512i)) {
+        v = fold_lanes(v, k_vec, _mm512_loadu_si512(data));
+        data += sizeof(__m512i);
+        len -= sizeof(__m512i);
+    }
+
+    __m128i parts[4];
+    _mm512_storeu_si512(parts, v);
+    __m128i lane = parts[3];
+    for (usize i = 0; i < 3; i++) {
+        lane = _mm_xor_si128(lane, fold_lane(parts[i], consts.lanes[i]));
+    }
+    while (len >= sizeof(__m128i)) {
+        lane = _mm_xor_si128(
+            fold_lane(lane, consts.lanes[2]),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)));
+        data += sizeof(__m128i);
+        len -= sizeof(__m128i);
+    }
+
+    u64 c = _mm_crc32_u64(0, static_cast<u64>(_mm_cvtsi128_si64(lane)));
+    c = _mm_crc32_u64(c, static_cast<u64>(_mm_extract_epi64(lane, 1)));
+    return crc32c_hardware(data, len, ~static_cast<u32>(c));
+}
+
+auto has_vpclmul() -> bool {
+    static const bool supported = __builtin_cpu_supports("sse4.2") &&
+                                  __builtin_cpu_supports("pclmul") &&
+                                  __builtin_cpu_supports("avx512f") &&
+                                  __builtin_cpu_supports("vpclmulqdq");
+    return supported;
+}
+#endif
+
+} // namespace
+
+auto crc32c_software(const u8 *data, usize len, u32 crc) -> u32 {
+    const auto &t = crc32c_table().t;
+    u32 c = ~crc;
+    while (len >= 8) {
+        u32 lo, hi;
+        memcpy(&lo, data, sizeof(lo));
+        memcpy(&hi, data + 4, sizeof(hi));
+        lo ^= c;
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+            t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^
+            t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = t[0][(c ^ *data) & 0xff] ^ (c >> 8);
+        data += 1;
+        len -= 1;
+    }
+    return ~c;
+}
+
+auto crc32c(const u8 *data, usize len, u32 crc) -> u32 {
+#if defined(__x86_64__)
+    if (len >= KFoldRound && has_vpclmul()) {
+        return crc32c_fold(data, len, crc);
+    }
+    if (has_sse42()) {
+        return crc32c_hardware(data, len, crc);
+    }
+#endif
+    return crc32c_software(data, len, crc);
+}
+
+namespace {
+
+/**
+ * The number of table blocks needed by a device of `total` blocks, such that
+ * the remaining blocks all have an entry in the table.
+ */
+auto table_block_cnt(usize total, usize block_size) -> usize {
+    const usize per_block = block_size / sizeof(u32) + 1;
+    return (total + per_block - 1) / per_block;
+}
+
+} // namespace
+
+ChecksumBlockManager::ChecksumBlockManager(std::shared_ptr<BlockManager> inner)
+    : BlockManager(inner->total_blocks() -
+                       table_block_cnt(inner->total_blocks(),
+                                       inner->block_size()),
+                   inner->block_size(), nullptr),
+      inner(std::move(inner)) {
+    this->table_blocks =
+        table_block_cnt(this->inner->total_blocks(), this->block_sz);
+
+    // load the table from the tail of the device
+    std::vector<block_id_t> table_ids;
+    for (usize i = 0; i < this->table_blocks; i++) {
+        table_ids.push_back(this->block_cnt + i);
+    }
+    std::vector<u8> table(static_cast<u64>(this->table_blocks) *
+                          this->block_sz);
+    auto res = this->inner->read_blocks(table_ids, table.data());
+    CHFS_VERIFY(res.is_ok(), "Failed to load the checksum table");
+    this->sums.resize(this->block_cnt);
+    memcpy(this->sums.data(), table.data(), this->block_cnt * sizeof(u32));
+
+    std::vector<u8> zeros(this->block_sz, 0);
+    this->zero_sum = to_entry(crc32c(zeros.data(), this->block_sz));
+}
+
+auto ChecksumBlockManager::verify(block_id_t block_id,
+                                  const u8 *data) const -> bool {
+    const auto expected = this->sums[block_id];
+    return expected == 0 ||
+           expected == to_entry(crc32c(data, this->block_sz));
+}
+
+auto ChecksumBlockManager::store_entries(block_id_t start,
+                                         block_id_t end) -> ChfsNullResult {
+    const auto per_block = this->entries_per_block();
+    while (start < end) {
+        const auto table_idx = start / per_block;
+        const auto chunk_end =
+            std::min<block_id_t>(end, (table_idx + 1) * per_block);
+        auto res = this->inner->write_partial_block(
+            this->block_cnt + table_idx,
+            reinterpret_cast<const u8 *>(this->sums.data() + start),
+            (start % per_block) * sizeof(u32),
+            (chunk_end - start) * sizeof(u32));
+        if (res.is_err()) {
+            return res;
+        }
+        start = chunk_end;
+    }
+    return KNullOk;
+}
+
+auto ChecksumBlockManager::store_table_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    const auto per_block = this->entries_per_block();
+    std::set<usize> dirty_tables;
+    for (auto id : block_ids) {
+        dirty_tables.insert(id / per_block);
+    }
+    for (auto table_idx : dirty_tables) {
+        auto res = this->store_entries(
+            table_idx * per_block,
+            std::min<block_id_t>(this->block_cnt, (table_idx + 1) * per_block));
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto ChecksumBlockManager::write_block(block_id_t block_id,
+                                       const u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, true);
+    auto res = this->inner->write_block(block_id, data);
+    if (res.is_err()) {
+        return res;
+    }
+    const auto sum = to_entry(crc32c(data, this->block_sz));
+    this->record_access(block_id, 1, true);
+    auto table_lock = this->lock_table();
+    this->sums[block_id] = sum;
+    return this->store_entries(block_id, block_id + 1);
+}
+
+auto ChecksumBlockManager::write_partial_block(block_id_t block_id,
+                                               const u8 *data, usize offset,
+                                               usize len) -> ChfsNullResult {
+    if (block_id >= this->block_cnt || offset + len > this->block_sz) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, true);
+    std::vector<u8> buffer(this->block_sz);
+    auto res = this->load_block(block_id, buffer.data());
+    if (res.is_err()) {
+        return res;
+    }
+    memcpy(buffer.data() + offset, data, len);
+
+    res = this->inner->write_partial_block(block_id, data, offset, len);
+    if (res.is_err()) {
+        return res;
+    }
+    const auto sum = to_entry(crc32c(buffer.data(), this->block_sz));
+    this->record_access(block_id, 1, true);
+    auto table_lock = this->lock_table();
+    this->sums[block_id] = sum;
+    return this->store_entries(block_id, block_id + 1);
+}
+
+auto ChecksumBlockManager::load_block(block_id_t block_id,
+                                      u8 *data) -> ChfsNullResult {
+    auto res = this->inner->read_block(block_id, data);
+    if (res.is_err()) {
+        return res;
+    }
+    if (!this->verify(block_id, data)) {
+        std::cerr << "checksum mismatch on block " << block_id << std::endl;
+        return ChfsNullResult(ErrorType::Corrupted);
+    }
+    return KNullOk;
+}
+
+auto ChecksumBlockManager::read_block(block_id_t block_id,
+                                      u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, false);
+    auto res = this->load_block(block_id, data);
+    if (res.is_err()) {
+        return res;
+    }
+    this->record_access(block_id, 1, false);
+    return KNullOk;
+}
+
+auto ChecksumBlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, true);
+    auto res = this->discard_enabled
+                   ? this->inner->discard_blocks({block_id})
+                   : this->inner->zero_block(block_id);
+    if (res.is_err()) {
+        return res;
+    }
+    this->record_access(block_id, 1, true);
+    auto table_lock = this->lock_table();
+    this->sums[block_id] = this->zero_sum;
+    return this->store_entries(block_id, block_id + 1);
+}
+
+auto ChecksumBlockManager::read_blocks(
+    const std::vector<block_id_t> &block_ids, u8 *buffer) -> ChfsNullResult {
+    for (auto id : block_ids) {
+        if (id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+    }
+    auto guard = this->lock_blocks(block_ids, false);
+    auto res = this->inner->read_blocks(block_ids, buffer);
+    if (res.is_err()) {
+        return res;
+    }
+
+    // verify the whole batch, so all the corrupted blocks are reported
+    bool corrupted = false;
+    for (usize i = 0; i < block_ids.size(); i++) {
+        if (!this->verify(block_ids[i],
+                          buffer + static_cast<u64>(i) * this->block_sz)) {
+            std::cerr << "checksum mismatch on block " << block_ids[i]
+                      << std::endl;
+            corrupted = true;
+        }
+    }
+    if (corrupted) {
+        return ChfsNullResult(ErrorType::Corrupted);
+    }
+    this->record_access(block_ids, false);
+    return KNullOk;
+}
+
+auto ChecksumBlockManager::write_blocks(
+    const std::vector<block_id_t> &block_ids,
+    const u8 *buffer) -> ChfsNullResult {
+    for (auto id : block_ids) {
+        if (id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+    }
+    auto guard = this->lock_blocks(block_ids, true);
+    auto res = this->inner->write_blocks(block_ids, buffer);
+    if (res.is_err()) {
+        return res;
+    }
+
+    std::vector<u32> new_sums(block_ids.size());
+    for (usize i = 0; i < block_ids.size(); i++) {
+        new_sums[i] = to_entry(crc32c(
+            buffer + static_cast<u64>(i) * this->block_sz, this->block_sz));
+    }
+    this->record_access(block_ids, true);
+    auto table_lock = this->lock_table();
+    for (usize i = 0; i < block_ids.size(); i++) {
+        this->sums[block_ids[i]] = new_sums[i];
+    }
+    return this->store_table_blocks(block_ids);
+}
+
+auto ChecksumBlockManager::discard_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    for (auto id : block_ids) {
+        if (id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+    }
+    auto guard = this->lock_blocks(block_ids, true);
+    auto res = this->inner->discard_blocks(block_ids);
+    if (res.is_err()) {
+        return res;
+    }
+
+    auto table_lock = this->lock_table();
+    for (auto id : block_ids) {
+        this->sums[id] = this->zero_sum;
+    }
+    return this->store_table_blocks(block_ids);
+}
+
+auto ChecksumBlockManager::grow(usize new_block_cnt) -> ChfsNullResult {
+    if (new_block_cnt < this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    if (new_block_cnt == this->block_cnt) {
+        return KNullOk;
+    }
+
+    // every block and the table, as the table moves
+    auto guard = this->lock_blocks(0, this->block_cnt, true);
+    auto table_lock = this->lock_table();
+    // the table for `new_block_cnt` blocks, with which the constructor
+    // derives the same geometry from the grown device
+    const auto per_block = this->entries_per_block();
+    const usize new_table_blocks = (new_block_cnt + per_block - 1) / per_block;
+    auto res = this->inner->grow(new_block_cnt + new_table_blocks);
+    if (res.is_err()) {
+        return res;
+    }
+
+    this->sums.resize(new_block_cnt, 0);
+    this->block_cnt = new_block_cnt;
+    this->table_blocks = new_table_blocks;
+    return this->store_entries(0, new_block_cnt);
+}
+
+auto ChecksumBlockManager::sync_range(block_id_t start,
+                                      usize cnt) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto res = this->inner->sync_range(start, cnt);
+    if (res.is_err() || cnt == 0) {
+        return res;
+    }
+    // the checksums of the range are durable as well
+    const auto per_block = this->entries_per_block();
+    const auto first = start / per_block;
+    const auto last = (start + cnt - 1) / per_block;
+    return this->inner->sync_range(this->block_cnt + first, last - first + 1);
+}
+
+} // namespace chfs
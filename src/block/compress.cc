@@ -0,0 +1,531 @@
+#include <cstring>
+#include <set>
+
+#include "block/compress.h"
+
+namespace chfs {
+
+namespace {
+
+const usize KMinMatch = 4;
+const usize KMaxOffset = 65535;
+const usize KHashBits = 12;
+// the misses after which the compressor starts skipping bytes
+const usize KSkipTrigger = 6;
+
+auto read32(const u8 *p) -> u32 {
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+auto hash32(u32 v) -> u32 { return (v * 2654435761u) >> (32 - KHashBits); }
+
+/**
+ * A bounded output buffer, which stops writing once it would overflow
+ */
+struct LzWriter {
+    u8 *op;
+    u8 *end;
+    bool overflow = false;
+
+    auto put(u8 b) -> void {
+        if (op >= end) {
+            overflow = true;
+            return;
+        }
+        *op++ = b;
+    }
+
+    auto put(const u8 *src, usize len) -> void {
+        if (static_cast<usize>(end - op) < len) {
+            overflow = true;
+            return;
+        }
+        memcpy(op, src, len);
+        op += len;
+    }
+
+    /**
+     * Write the part of a length beyond the 4 bits of the token
+     */
+    auto put_length(usize len) -> void {
+        while (len >= 255) {
+            put(255);
+            len -= 255;
+        }
+        put(static_cast<u8>(len));
+    }
+};
+
+/**
+ * Write a sequence of literals, followed by a match unless it is the last one
+ */
+auto emit_sequence(LzWriter &w, const u8 *literals, usize literal_len,
+                   usize offset, usize match_len) -> void {
+    const usize ml = match_len == 0 ? 0 : match_len - KMinMatch;
+    const u8 token = static_cast<u8>((std::min<usize>(literal_len, 15) << 4) |
+                                     std::min<usize>(ml, 15));
+    w.put(token);
+    if (literal_len >= 15) {
+        w.put_length(literal_len - 15);
+    }
+    w.put(literals, literal_len);
+    if (match_len == 0) {
+        return;
+    }
+    w.put(static_cast<u8>(offset & 0xff));
+    w.put(static_cast<u8>(offset >> 8));
+    if (ml >= 15) {
+        w.put_length(ml - 15);
+    }
+}
+
+/**
+ * Read the part of a length beyond the 4 bits of the token
+ */
+auto get_length(const u8 *src, usize len, usize &ip, usize &out) -> bool {
+    u8 b;
+    do {
+        if (ip >= len) {
+            return false;
+        }
+        b = src[ip++];
+        out += b;
+    } while (b == 255);
+    return true;
+}
+
+} // namespace
+
+auto lz_compress(const u8 *src, usize len, u8 *dst, usize cap) -> usize {
+    std::vector<u32> table(1 << KHashBits, ~0u);
+    LzWriter w{dst, dst + cap};
+
+    usize ip = 0;
+    usize anchor = 0;
+    usize misses = 0;
+    while (ip + KMinMatch <= len && !w.overflow) {
+        const u32 seq = read32(src + ip);
+        const u32 h = hash32(seq);
+        const u32 candidate = table[h];
+        table[h] = ip;
+        if (candidate == ~0u || ip - candidate > KMaxOffset ||
+            read32(src + candidate) != seq) {
+            ip += 1 + (misses++ >> KSkipTrigger);
+            continue;
+        }
+
+        usize match_len = KMinMatch;
+        while (ip + match_len < len &&
+               src[candidate + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+        emit_sequence(w, src + anchor, ip - anchor, ip - candidate, match_len);
+        ip += match_len;
+        anchor = ip;
+        misses = 0;
+    }
+    emit_sequence(w, src + anchor, len - anchor, 0, 0);
+    if (w.overflow) {
+        return 0;
+    }
+    return w.op - dst;
+}
+
+auto lz_decompress(const u8 *src, usize len, u8 *dst, usize cap)
+    -> ChfsResult<usize> {
+    usize ip = 0;
+    usize op = 0;
+    while (ip < len) {
+        const u8 token = src[ip++];
+        usize literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(src, len, ip, literal_len)) {
+            return ChfsResult<usize>(ErrorType::Corrupted);
+        }
+        if (literal_len > len - ip || literal_len > cap - op) {
+            return ChfsResult<usize>(ErrorType::Corrupted);
+        }
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) {
+            return ChfsResult<usize>(ErrorType::Corrupted);
+        }
+        const usize offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        usize match_len = token & 15;
+        if (match_len == 15 && !get_length(src, len, ip, match_len)) {
+            return ChfsResult<usize>(ErrorType::Corrupted);
+        }
+        match_len += KMinMatch;
+        if (offset == 0 || offset > op || match_len > cap - op) {
+            return ChfsResult<usize>(ErrorType::Corrupted);
+        }
+        // byte by byte, as the match may overlap its own output
+        for (usize i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return ChfsResult<usize>(op);
+}
+
+namespace {
+
+const u64 KCompressMagic = 0x31307a6c73666863; // "chfslz01"
+
+/**
+ * The header at the last block of the underlying device
+ */
+struct CompressHeader {
+    u64 magic;
+    u64 block_cnt;
+};
+
+/**
+ * The number of table blocks needed by `block_cnt` logical blocks
+ */
+auto table_block_cnt(usize block_cnt, usize block_size) -> usize {
+    const usize per_block = block_size / sizeof(CompressedExtent);
+    return (block_cnt + per_block - 1) / per_block;
+}
+
+/**
+ * The number of logical blocks of a device: the recorded one if the device
+ * is formatted, otherwise the requested one or, by default, as many as the
+ * physical blocks left to the data.
+ */
+auto logical_block_cnt(BlockManager &inner, usize requested) -> usize {
+    std::vector<u8> buffer(inner.block_size());
+    auto res = inner.read_block(inner.total_blocks() - 1, buffer.data());
+    CHFS_VERIFY(res.is_ok(), "Failed to read the compression header");
+    CompressHeader header;
+    memcpy(&header, buffer.data(), sizeof(header));
+    if (header.magic == KCompressMagic) {
+        return header.block_cnt;
+    }
+    if (requested != 0) {
+        return requested;
+    }
+    // each table block serves itself and the data blocks of its entries
+    const usize per_block = inner.block_size() / sizeof(CompressedExtent) + 1;
+    const usize usable = inner.total_blocks() - 1;
+    return usable - (usable + per_block - 1) / per_block;
+}
+
+} // namespace
+
+CompressedBlockManager::CompressedBlockManager(
+    std::shared_ptr<BlockManager> inner, usize block_cnt)
+    : BlockManager(logical_block_cnt(*inner, block_cnt), inner->block_size(),
+                   nullptr),
+      inner(std::move(inner)), slot_sz(this->block_sz / KCompressSlots),
+      physical_buf(this->block_sz), compress_buf(this->block_sz) {
+    CHFS_VERIFY(this->block_sz % KCompressSlots == 0 &&
+                    this->block_sz <= 65536,
+                "Unsupported block size for compression");
+    const usize total = this->inner->total_blocks();
+    this->table_blocks = table_block_cnt(this->block_cnt, this->block_sz);
+    CHFS_VERIFY(this->table_blocks + 1 < total,
+                "The device is too small for the remap table");
+    this->data_blocks = total - 1 - this->table_blocks;
+    const block_id_t header_id = total - 1;
+    const block_id_t table_start = this->data_blocks;
+
+    // format the device if it has no header yet
+    std::vector<u8> buffer(this->block_sz, 0);
+    auto res = this->inner->read_block(header_id, buffer.data());
+    CHFS_VERIFY(res.is_ok(), "Failed to read the compression header");
+    CompressHeader header;
+    memcpy(&header, buffer.data(), sizeof(header));
+    if (header.magic != KCompressMagic) {
+        std::vector<u8> zeros(this->block_sz, 0);
+        for (usize i = 0; i < this->table_blocks; i++) {
+            res = this->inner->write_block(table_start + i, zeros.data());
+            CHFS_VERIFY(res.is_ok(), "Failed to format the remap table");
+        }
+        header = CompressHeader{KCompressMagic, this->block_cnt};
+        memcpy(zeros.data(), &header, sizeof(header));
+        res = this->inner->write_block(header_id, zeros.data());
+        CHFS_VERIFY(res.is_ok(), "Failed to write the compression header");
+    }
+
+    // load the table and rebuild the slot masks from it
+    std::vector<block_id_t> table_ids;
+    for (usize i = 0; i < this->table_blocks; i++) {
+        table_ids.push_back(table_start + i);
+    }
+    std::vector<u8> table(static_cast<u64>(this->table_blocks) *
+                          this->block_sz);
+    res = this->inner->read_blocks(table_ids, table.data());
+    CHFS_VERIFY(res.is_ok(), "Failed to load the remap table");
+    this->extents.resize(this->block_cnt);
+    memcpy(this->extents.data(), table.data(),
+           this->block_cnt * sizeof(CompressedExtent));
+
+    this->slot_masks.resize(this->data_blocks, 0);
+    for (const auto &extent : this->extents) {
+        if (extent.slot_cnt == 0) {
+            continue;
+        }
+        CHFS_VERIFY(extent.physical < this->data_blocks &&
+                        extent.slot + extent.slot_cnt <= KCompressSlots,
+                    "Corrupted remap table");
+        this->slot_masks[extent.physical] |=
+            ((1u << extent.slot_cnt) - 1) << extent.slot;
+    }
+}
+
+auto CompressedBlockManager::allocate(usize slot_cnt)
+    -> ChfsResult<CompressedExtent> {
+    const u32 want = (1u << slot_cnt) - 1;
+    // keep filling the block of the last extent before moving on
+    for (usize i = 0; i < this->data_blocks; i++) {
+        const block_id_t physical = (this->rotor + i) % this->data_blocks;
+        const u32 mask = this->slot_masks[physical];
+        for (usize slot = 0; slot + slot_cnt <= KCompressSlots; slot++) {
+            if ((mask & (want << slot)) == 0) {
+                this->slot_masks[physical] |= want << slot;
+                this->rotor = physical;
+                return ChfsResult<CompressedExtent>(CompressedExtent{
+                    static_cast<u32>(physical), static_cast<u8>(slot),
+                    static_cast<u8>(slot_cnt), 0});
+            }
+        }
+    }
+    return ChfsResult<CompressedExtent>(ErrorType::OUT_OF_RESOURCE);
+}
+
+auto CompressedBlockManager::release(const CompressedExtent &extent) -> bool {
+    if (extent.slot_cnt == 0) {
+        return false;
+    }
+    this->slot_masks[extent.physical] &=
+        ~(((1u << extent.slot_cnt) - 1) << extent.slot);
+    return this->slot_masks[extent.physical] == 0;
+}
+
+auto CompressedBlockManager::store_entries(block_id_t start, block_id_t end)
+    -> ChfsNullResult {
+    const usize per_block = this->block_sz / sizeof(CompressedExtent);
+    while (start < end) {
+        const auto table_idx = start / per_block;
+        const auto chunk_end =
+            std::min<block_id_t>(end, (table_idx + 1) * per_block);
+        auto res = this->inner->write_partial_block(
+            this->data_blocks + table_idx,
+            reinterpret_cast<const u8 *>(this->extents.data() + start),
+            (start % per_block) * sizeof(CompressedExtent),
+            (chunk_end - start) * sizeof(CompressedExtent));
+        if (res.is_err()) {
+            return res;
+        }
+        start = chunk_end;
+    }
+    return KNullOk;
+}
+
+auto CompressedBlockManager::load(block_id_t block_id,
+                                  u8 *data) -> ChfsNullResult {
+    const auto extent = this->extents[block_id];
+    if (extent.slot_cnt == 0) {
+        memset(data, 0, this->block_sz);
+        return KNullOk;
+    }
+    if (this->is_raw(extent)) {
+        return this->inner->read_block(extent.physical, data);
+    }
+
+    auto res = this->inner->read_block(extent.physical,
+                                       this->physical_buf.data());
+    if (res.is_err()) {
+        return res;
+    }
+    auto len = lz_decompress(this->physical_buf.data() +
+                                 static_cast<u64>(extent.slot) * this->slot_sz,
+                             extent.len, data, this->block_sz);
+    if (len.is_err() || len.unwrap() != this->block_sz) {
+        std::cerr << "failed to decompress block " << block_id << std::endl;
+        return ChfsNullResult(ErrorType::Corrupted);
+    }
+    return KNullOk;
+}
+
+auto CompressedBlockManager::store(block_id_t block_id,
+                                   const u8 *data) -> ChfsNullResult {
+    CompressedExtent extent{0, 0, 0, 0};
+    bool is_zero = true;
+    for (usize i = 0; i < this->block_sz && is_zero; i++) {
+        is_zero = data[i] == 0;
+    }
+
+    if (!is_zero) {
+        // anything that needs all the slots is stored raw
+        const usize len =
+            lz_compress(data, this->block_sz, this->compress_buf.data(),
+                        (KCompressSlots - 1) * this->slot_sz);
+        const usize slot_cnt =
+            len == 0 ? KCompressSlots : (len + this->slot_sz - 1) / this->slot_sz;
+        auto alloc_res = this->allocate(slot_cnt);
+        if (alloc_res.is_err()) {
+            return ChfsNullResult(alloc_res.unwrap_error());
+        }
+        extent = alloc_res.unwrap();
+        extent.len = static_cast<u16>(len);
+
+        auto res = len == 0
+                       ? this->inner->write_block(extent.physical, data)
+                       : this->inner->write_partial_block(
+                             extent.physical, this->compress_buf.data(),
+                             static_cast<u64>(extent.slot) * this->slot_sz,
+                             len);
+        if (res.is_err()) {
+            this->release(extent);
+            return res;
+        }
+    }
+
+    // the data is in place, remap the block and free its old extent
+    const auto old = this->extents[block_id];
+    this->extents[block_id] = extent;
+    auto res = this->store_entries(block_id, block_id + 1);
+    if (res.is_err()) {
+        this->extents[block_id] = old;
+        this->release(extent);
+        return res;
+    }
+    if (this->release(old) && this->discard_enabled) {
+        return this->inner->discard_blocks({old.physical});
+    }
+    return KNullOk;
+}
+
+auto CompressedBlockManager::write_block(block_id_t block_id,
+                                         const u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->store(block_id, data);
+    if (res.is_ok()) {
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto CompressedBlockManager::write_partial_block(block_id_t block_id,
+                                                 const u8 *data, usize offset,
+                                                 usize len) -> ChfsNullResult {
+    if (block_id >= this->block_cnt || offset + len > this->block_sz) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    std::lock_guard<std::mutex> lock(this->mtx);
+    std::vector<u8> buffer(this->block_sz);
+    auto res = this->load(block_id, buffer.data());
+    if (res.is_err()) {
+        return res;
+    }
+    memcpy(buffer.data() + offset, data, len);
+    res = this->store(block_id, buffer.data());
+    if (res.is_ok()) {
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto CompressedBlockManager::read_block(block_id_t block_id,
+                                        u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->load(block_id, data);
+    if (res.is_ok()) {
+        this->record_access(block_id, 1, false);
+    }
+    return res;
+}
+
+auto CompressedBlockManager::zero_block(block_id_t block_id)
+    -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->unmap({block_id}, this->discard_enabled);
+    if (res.is_ok()) {
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto CompressedBlockManager::discard_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    for (auto id : block_ids) {
+        if (id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+    }
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->unmap(block_ids, true);
+}
+
+auto CompressedBlockManager::unmap(const std::vector<block_id_t> &block_ids,
+                                   bool discard) -> ChfsNullResult {
+    const usize per_block = this->block_sz / sizeof(CompressedExtent);
+    std::set<usize> dirty_tables;
+    std::vector<CompressedExtent> released;
+    for (auto id : block_ids) {
+        released.push_back(this->extents[id]);
+        this->extents[id] = CompressedExtent{0, 0, 0, 0};
+        dirty_tables.insert(id / per_block);
+    }
+    for (auto table_idx : dirty_tables) {
+        auto res = this->store_entries(
+            table_idx * per_block,
+            std::min<block_id_t>(this->block_cnt, (table_idx + 1) * per_block));
+        if (res.is_err()) {
+            return res;
+        }
+    }
+
+    std::vector<block_id_t> freed;
+    for (const auto &extent : released) {
+        if (this->release(extent)) {
+            freed.push_back(extent.physical);
+        }
+    }
+    if (!discard || freed.empty()) {
+        return KNullOk;
+    }
+    return this->inner->discard_blocks(freed);
+}
+
+auto CompressedBlockManager::sync_range(block_id_t start,
+                                        usize cnt) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    return this->inner->sync();
+}
+
+auto CompressedBlockManager::physical_blocks_used() -> usize {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    usize used = 0;
+    for (auto mask : this->slot_masks) {
+        used += mask != 0;
+    }
+    return used;
+}
+
+auto CompressedBlockManager::get_extent(block_id_t block_id)
+    -> CompressedExtent {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->extents[block_id];
+}
+
+} // namespace chfs
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <cstring>
+
+#include "block/dedup.h"
+
+namespace chfs {
+
+DedupIndex::DedupIndex(usize capacity)
+    : capacity(std::max<usize>(capacity, 1)) {}
+
+auto DedupIndex::fingerprint(const u8 *data, usize len) -> u64 {
+    const u64 KMul = 0x9E3779B97F4A7C15;
+    u64 h = len * KMul;
+    usize i = 0;
+    for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+        u64 word;
+        memcpy(&word, data + i, sizeof(word));
+        word *= KMul;
+        word ^= word >> 32;
+        h = (h ^ word) * KMul;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ data[i]) * KMul;
+    }
+    return h ^ (h >> 32);
+}
+
+auto DedupIndex::lookup(u64 fingerprint) -> std::optional<block_id_t> {
+    auto it = this->by_fingerprint.find(fingerprint);
+    if (it == this->by_fingerprint.end()) {
+        return std::nullopt;
+    }
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+    return it->second->second;
+}
+
+auto DedupIndex::insert(u64 fingerprint, block_id_t block_id) -> void {
+    this->forget(block_id);
+    auto it = this->by_fingerprint.find(fingerprint);
+    if (it != this->by_fingerprint.end()) {
+        this->by_block.erase(it->second->second);
+        this->lru.erase(it->second);
+        this->by_fingerprint.erase(it);
+    }
+
+    if (this->lru.size() >= this->capacity) {
+        const auto &victim = this->lru.back();
+        this->by_fingerprint.erase(victim.first);
+        this->by_block.erase(victim.second);
+        this->lru.pop_back();
+    }
+    this->lru.emplace_front(fingerprint, block_id);
+    this->by_fingerprint[fingerprint] = this->lru.begin();
+    this->by_block[block_id] = fingerprint;
+}
+
+auto DedupIndex::forget(block_id_t block_id) -> void {
+    auto it = this->by_block.find(block_id);
+    if (it == this->by_block.end()) {
+        return;
+    }
+    auto entry = this->by_fingerprint.find(it->second);
+    this->lru.erase(entry->second);
+    this->by_fingerprint.erase(entry);
+    this->by_block.erase(it);
+}
+
+auto DedupIndex::add_ref(block_id_t block_id) -> void {
+    this->extra_refs[block_id] += 1;
+}
+
+auto DedupIndex::release(block_id_t block_id) -> bool {
+    auto it = this->extra_refs.find(block_id);
+    if (it == this->extra_refs.end()) {
+        return false;
+    }
+    if (--it->second == 0) {
+        this->extra_refs.erase(it);
+    }
+    return true;
+}
+
+auto DedupIndex::ref_count(block_id_t block_id) const -> u32 {
+    auto it = this->extra_refs.find(block_id);
+    return it == this->extra_refs.end() ? 1 : it->second + 1;
+}
+
+} // namespace chfs
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "block/direct.h"
+
+namespace chfs {
+
+AlignedBufferPool::AlignedBufferPool(usize buffer_sz, usize alignment,
+                                     usize capacity)
+    : buffer_sz(buffer_sz), alignment(alignment), capacity(capacity) {
+    this->free_buffers.reserve(capacity);
+    for (usize i = 0; i < capacity; i++) {
+        void *buffer = nullptr;
+        CHFS_VERIFY(posix_memalign(&buffer, alignment, buffer_sz) == 0,
+                    "Failed to allocate an aligned buffer");
+        this->free_buffers.push_back(static_cast<u8 *>(buffer));
+    }
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+    for (auto buffer : this->free_buffers) {
+        free(buffer);
+    }
+}
+
+auto AlignedBufferPool::acquire() -> u8 * {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    if (!this->free_buffers.empty()) {
+        auto buffer = this->free_buffers.back();
+        this->free_buffers.pop_back();
+        return buffer;
+    }
+    lock.unlock();
+
+    void *buffer = nullptr;
+    CHFS_VERIFY(posix_memalign(&buffer, this->alignment, this->buffer_sz) == 0,
+                "Failed to allocate an aligned buffer");
+    return static_cast<u8 *>(buffer);
+}
+
+auto AlignedBufferPool::release(u8 *buffer) -> void {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (this->free_buffers.size() < this->capacity) {
+        this->free_buffers.push_back(buffer);
+    } else {
+        free(buffer);
+    }
+}
+
+DirectBlockManager::DirectBlockManager(const std::string &file,
+                                       usize block_cnt, usize pool_sz)
+    : BlockManager(block_cnt, KDefaultBlockSize, nullptr),
+      pool(KDefaultBlockSize, KDefaultBlockSize, pool_sz) {
+    this->file_name_ = file;
+    this->fd = open_device_file(file, block_cnt, this->block_sz, O_DIRECT);
+    this->block_cnt = block_cnt;
+    this->zero_buffer = this->pool.acquire();
+    memset(this->zero_buffer, 0, this->block_sz);
+}
+
+DirectBlockManager::~DirectBlockManager() {
+    this->wait_async();
+    for (auto &[block_id, block] : this->prefetched) {
+        this->pool.release(block.buffer);
+    }
+    this->pool.release(this->zero_buffer);
+    close(this->fd);
+}
+
+auto DirectBlockManager::pread_full(u8 *buffer, u64 len,
+                                    u64 offset) -> ChfsNullResult {
+    u64 done = 0;
+    while (done < len) {
+        auto ret = pread(this->fd, buffer + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            std::cerr << "direct read failed at " << offset + done << ": "
+                      << (ret < 0 ? strerror(errno) : "EOF") << std::endl;
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+        done += ret;
+    }
+    return KNullOk;
+}
+
+auto DirectBlockManager::pwrite_full(const u8 *buffer, u64 len,
+                                     u64 offset) -> ChfsNullResult {
+    u64 done = 0;
+    while (done < len) {
+        auto ret = pwrite(this->fd, buffer + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            std::cerr << "direct write failed at " << offset + done << ": "
+                      << strerror(errno) << std::endl;
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+        done += ret;
+    }
+    return KNullOk;
+}
+
+auto DirectBlockManager::write_block(block_id_t block_id,
+                                     const u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    const u64 offset = block_id * this->block_sz;
+    ChfsNullResult res = KNullOk;
+    if (this->pool.is_aligned(data)) {
+        auto guard = this->lock_blocks(block_id, 1, true);
+        res = this->pwrite_full(data, this->block_sz, offset);
+        this->drop_prefetched(block_id, 1);
+    } else {
+        auto buffer = this->pool.acquire();
+        memcpy(buffer, data, this->block_sz);
+        {
+            auto guard = this->lock_blocks(block_id, 1, true);
+            res = this->pwrite_full(buffer, this->block_sz, offset);
+            this->drop_prefetched(block_id, 1);
+        }
+        this->pool.release(buffer);
+    }
+    if (res.is_ok()) {
+        this->mark_dirty(block_id, 1);
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto DirectBlockManager::write_partial_block(block_id_t block_id,
+                                             const u8 *data, usize offset,
+                                             usize len) -> ChfsNullResult {
+    if (block_id >= this->block_cnt || offset + len > this->block_sz) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    // direct I/O works on whole blocks, so read-modify-write the block,
+    // holding it so that no other write lands between the read and the write
+    auto buffer = this->pool.acquire();
+    const u64 block_off = block_id * this->block_sz;
+    ChfsNullResult res = KNullOk;
+    {
+        auto guard = this->lock_blocks(block_id, 1, true);
+        res = this->pread_full(buffer, this->block_sz, block_off);
+        if (res.is_ok()) {
+            memcpy(buffer + offset, data, len);
+            res = this->pwrite_full(buffer, this->block_sz, block_off);
+        }
+        this->drop_prefetched(block_id, 1);
+    }
+    this->pool.release(buffer);
+    if (res.is_ok()) {
+        this->mark_dirty(block_id, 1);
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto DirectBlockManager::read_block(block_id_t block_id,
+                                    u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    const u64 offset = block_id * this->block_sz;
+    ChfsNullResult res = KNullOk;
+    auto guard = this->lock_blocks(block_id, 1, false);
+    if (!this->take_prefetched(block_id, 1, data).empty()) {
+        // read ahead since its last write
+        this->record_access(block_id, 1, false);
+        return KNullOk;
+    }
+    if (this->pool.is_aligned(data)) {
+        res = this->pread_full(data, this->block_sz, offset);
+    } else {
+        auto buffer = this->pool.acquire();
+        res = this->pread_full(buffer, this->block_sz, offset);
+        if (res.is_ok()) {
+            memcpy(data, buffer, this->block_sz);
+        }
+        this->pool.release(buffer);
+    }
+    if (res.is_ok()) {
+        this->record_access(block_id, 1, false);
+    }
+    return res;
+}
+
+auto DirectBlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
+    if (this->discard_enabled) {
+        this->record_access(block_id, 1, true);
+        return this->discard_blocks({block_id});
+    }
+    return this->write_block(block_id, this->zero_buffer);
+}
+
+auto DirectBlockManager::read_blocks(const std::vector<block_id_t> &block_ids,
+                                     u8 *buffer) -> ChfsNullResult {
+    if (!this->pool.is_aligned(buffer)) {
+        // the per-block fallback locks each block in read_block
+        return BlockManager::read_blocks(block_ids, buffer);
+    }
+
+    for (const auto &run : contiguous_runs(block_ids)) {
+        if (run.start + run.len > this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        auto guard = this->lock_blocks(run.start, run.len, false);
+        u8 *data = buffer + static_cast<u64>(run.idx) * this->block_sz;
+        // the blocks read ahead are copied, the others read in runs
+        auto taken = this->take_prefetched(run.start, run.len, data);
+        for (usize i = 0; i < run.len;) {
+            if (!taken.empty() && taken[i]) {
+                i++;
+                continue;
+            }
+            usize end = i + 1;
+            while (end < run.len && (taken.empty() || !taken[end])) {
+                end++;
+            }
+            auto res = this->pread_full(
+                data + static_cast<u64>(i) * this->block_sz,
+                static_cast<u64>(end - i) * this->block_sz,
+                (run.start + i) * this->block_sz);
+            if (res.is_err()) {
+                return res;
+            }
+            i = end;
+        }
+        this->record_access(run.start, run.len, false);
+    }
+    return KNullOk;
+}
+
+auto DirectBlockManager::write_blocks(const std::vector<block_id_t> &block_ids,
+                                      const u8 *buffer) -> ChfsNullResult {
+    if (!this->pool.is_aligned(buffer)) {
+        return BlockManager::write_blocks(block_ids, buffer);
+    }
+
+    for (const auto &run : contiguous_runs(block_ids)) {
+        if (run.start + run.len > this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        ChfsNullResult res = KNullOk;
+        {
+            auto guard = this->lock_blocks(run.start, run.len, true);
+            res = this->pwrite_full(
+                buffer + static_cast<u64>(run.idx) * this->block_sz,
+                static_cast<u64>(run.len) * this->block_sz,
+                run.start * this->block_sz);
+            this->drop_prefetched(run.start, run.len);
+        }
+        if (res.is_err()) {
+            return res;
+        }
+        this->mark_dirty(run.start, run.len);
+        this->record_access(run.start, run.len, true);
+    }
+    return KNullOk;
+}
+
+auto DirectBlockManager::discard_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    auto res = BlockManager::discard_blocks(block_ids);
+    for (auto block_id : block_ids) {
+        this->drop_prefetched(block_id, 1);
+    }
+    return res;
+}
+
+auto DirectBlockManager::prefetch(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+    auto sorted = block_ids;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (!sorted.empty() && sorted.back() >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    // claim the blocks not read ahead yet, as many as there is room for
+    std::vector<block_id_t> claimed;
+    u64 ticket = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->prefetch_mtx);
+        ticket = ++this->prefetch_ticket;
+        for (auto block_id : sorted) {
+            if (this->prefetched.size() >= KMaxPrefetchedBlocks) {
+                break;
+            }
+            if (this->prefetched.emplace(block_id, Prefetched{nullptr, ticket})
+                    .second) {
+                claimed.push_back(block_id);
+            }
+        }
+    }
+    for (const auto &run : contiguous_runs(claimed)) {
+        this->get_io_pool().submit([this, run, ticket] {
+            this->read_ahead(run.start, run.len, ticket);
+        });
+    }
+    return KNullOk;
+}
+
+auto DirectBlockManager::read_ahead(block_id_t start, usize cnt,
+                                    u64 ticket) -> void {
+    std::vector<u8 *> buffers(cnt);
+    std::vector<iovec> iov(cnt);
+    for (usize i = 0; i < cnt; i++) {
+        buffers[i] = this->pool.acquire();
+        iov[i] = iovec{buffers[i], this->block_sz};
+    }
+
+    bool ok = true;
+    {
+        auto guard = this->lock_blocks(start, cnt, false);
+        const u64 len = static_cast<u64>(cnt) * this->block_sz;
+        auto ret = preadv(this->fd, iov.data(), static_cast<int>(cnt),
+                          start * this->block_sz);
+        if (ret < 0 || static_cast<u64>(ret) != len) {
+            // a short read is finished block by block
+            for (usize i = 0; i < cnt && ok; i++) {
+                ok = this->pread_full(buffers[i], this->block_sz,
+                                      (start + i) * this->block_sz)
+                         .is_ok();
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(this->prefetch_mtx);
+    for (usize i = 0; i < cnt; i++) {
+        auto it = this->prefetched.find(start + i);
+        // a write since the claim drops the block, and may claim it anew
+        const bool mine = it != this->prefetched.end() &&
+                          it->second.ticket == ticket &&
+                          it->second.buffer == nullptr;
+        if (mine && ok) {
+            it->second.buffer = buffers[i];
+            continue;
+        }
+        if (mine) {
+            this->prefetched.erase(it);
+        }
+        this->pool.release(buffers[i]);
+    }
+}
+
+auto DirectBlockManager::take_prefetched(block_id_t start, usize cnt,
+                                         u8 *data) -> std::vector<bool> {
+    std::vector<bool> taken;
+    std::lock_guard<std::mutex> lock(this->prefetch_mtx);
+    if (this->prefetched.empty()) {
+        return taken;
+    }
+    for (usize i = 0; i < cnt; i++) {
+        auto it = this->prefetched.find(start + i);
+        if (it == this->prefetched.end() || it->second.buffer == nullptr) {
+            continue;
+        }
+        if (taken.empty()) {
+            taken.resize(cnt, false);
+        }
+        memcpy(data + static_cast<u64>(i) * this->block_sz, it->second.buffer,
+               this->block_sz);
+        this->pool.release(it->second.buffer);
+        this->prefetched.erase(it);
+        taken[i] = true;
+    }
+    return taken;
+}
+
+auto DirectBlockManager::drop_prefetched(block_id_t start, usize cnt) -> void {
+    std::lock_guard<std::mutex> lock(this->prefetch_mtx);
+    if (this->prefetched.empty()) {
+        return;
+    }
+    for (usize i = 0; i < cnt; i++) {
+        auto it = this->prefetched.find(start + i);
+        if (it == this->prefetched.end()) {
+            continue;
+        }
+        if (it->second.buffer != nullptr) {
+            this->pool.release(it->second.buffer);
+        }
+        this->prefetched.erase(it);
+    }
+}
+
+} // namespace chfs
@@ -1,8 +1,14 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <filesystem>
+#include <fstream>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
 #include <unistd.h>
 
 #include "block/manager.h"
@@ -10,6 +16,9 @@
 
 namespace chfs {
 
+// the size of a huge page backing MAP_HUGETLB mappings
+const u64 KHugePageSize = 2 * 1024 * 1024;
+
 auto get_file_sz(std::string &file_name) -> usize {
     std::filesystem::path path = file_name;
     return std::filesystem::file_size(path);
@@ -40,13 +49,24 @@ BlockManager::BlockManager(const std::string &file)
  * actual block cnt.
  */
 BlockManager::BlockManager(usize block_cnt, usize block_size)
+    : BlockManager(block_cnt, block_size, BlockManagerOptions()) {}
+
+BlockManager::BlockManager(usize block_cnt, usize block_size,
+                           const BlockManagerOptions &options)
     : block_sz(block_size), file_name_("in-memory"), fd(-1),
-      block_cnt(block_cnt), in_memory(true) {
+      block_data(nullptr), block_cnt(block_cnt), in_memory(true) {
     // An important step to prevent overflow
     u64 buf_sz = static_cast<u64>(block_cnt) * static_cast<u64>(block_size);
     CHFS_VERIFY(buf_sz > 0, "Santiy check buffer size fails");
-    this->block_data = new u8[buf_sz];
-    CHFS_VERIFY(this->block_data != nullptr, "Failed to allocate memory");
+    this->map_sz = buf_sz;
+    this->map_storage(options);
+}
+
+BlockManager::BlockManager(usize block_cnt, usize block_size, std::nullptr_t)
+    : block_sz(block_size), file_name_("layered"), fd(-1),
+      block_data(nullptr), block_cnt(block_cnt), in_memory(true) {
+    CHFS_VERIFY(block_cnt > 0 && block_size > 0,
+                "Santiy check layered manager geometry fails");
 }
 
 /**
@@ -54,24 +74,224 @@ BlockManager::BlockManager(usize block_cnt, usize block_size)
  * @input db_file: database file name
  */
 BlockManager::BlockManager(const std::string &file, usize block_cnt)
-    : file_name_(file), block_cnt(block_cnt), in_memory(false) {
-    this->fd = open(file.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    CHFS_ASSERT(this->fd != -1, "Failed to open the block manager file");
+    : BlockManager(file, block_cnt, BlockManagerOptions()) {}
 
-    auto file_sz = get_file_sz(this->file_name_);
-    if (file_sz == 0) {
-        initialize_file(this->fd, this->total_storage_sz());
+BlockManager::BlockManager(const std::string &file, usize block_cnt,
+                           const BlockManagerOptions &options)
+    : file_name_(file), block_data(nullptr), block_cnt(block_cnt),
+      in_memory(false) {
+    usize actual_cnt = block_cnt;
+    this->fd = open_device_file(file, actual_cnt, this->block_sz);
+    this->block_cnt = actual_cnt;
+    this->map_sz = static_cast<u64>(actual_cnt) * this->block_sz;
+    this->map_storage(options);
+}
+
+namespace {
+
+auto round_up(u64 len, u64 unit) -> u64 {
+    return (len + unit - 1) / unit * unit;
+}
+
+// reserve `len` bytes of address space aligned to `align` without backing
+// them, null if it is exhausted
+auto reserve_address_space(u64 len, u64 align) -> u8 * {
+    void *addr = mmap(nullptr, len + align, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    const auto start = reinterpret_cast<uintptr_t>(addr);
+    const auto aligned = round_up(start, align);
+    if (aligned > start) {
+        munmap(addr, aligned - start);
+    }
+    if (start + align > aligned) {
+        munmap(reinterpret_cast<void *>(aligned + len),
+               start + align - aligned);
+    }
+    return reinterpret_cast<u8 *>(aligned);
+}
+
+} // namespace
+
+auto BlockManager::map_storage(const BlockManagerOptions &options) -> void {
+    int flags = this->fd >= 0 ? MAP_SHARED : (MAP_PRIVATE | MAP_ANONYMOUS);
+    // the in-memory device is faulted in after its placement is set
+    const bool place = this->fd < 0 && (options.numa != NumaPolicy::Default ||
+                                        options.prefault_threads > 0);
+    if (options.populate && !place) {
+        flags |= MAP_POPULATE;
+    }
+
+    // reserve the address space the device may grow into, and map the
+    // device at its start, so `grow` never has to move the mapping
+    const u64 max_sz = options.max_blocks > 0
+                           ? static_cast<u64>(options.max_blocks) * block_sz
+                           : this->map_sz * KDefaultMapGrowth;
+    this->reserve_sz =
+        round_up(std::max(max_sz, this->map_sz), KHugePageSize);
+    u8 *base = reserve_address_space(this->reserve_sz, KHugePageSize);
+    if (base != nullptr) {
+        flags |= MAP_FIXED;
     } else {
-        this->block_cnt = file_sz / this->block_sz;
-        CHFS_ASSERT(this->total_storage_sz() ==
-                        KDefaultBlockCnt * this->block_sz,
-                    "The file size mismatches");
+        std::cerr << "failed to reserve the address space to grow into: "
+                  << strerror(errno) << std::endl;
+    }
+
+    void *addr = MAP_FAILED;
+    bool thp = options.huge_pages;
+    if (options.hugetlb && this->fd < 0) {
+        // a hugetlb mapping spans whole huge pages
+        const u64 len = round_up(this->map_sz, KHugePageSize);
+        addr = mmap(base, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                    -1, 0);
+        if (addr != MAP_FAILED) {
+            this->map_sz = len;
+            this->hugetlb_mapped = true;
+        } else {
+            std::cerr << "no huge pages available, falling back to "
+                         "transparent huge pages"
+                      << std::endl;
+            thp = true;
+        }
+    }
+    if (addr == MAP_FAILED) {
+        addr = mmap(base, this->map_sz, PROT_READ | PROT_WRITE, flags,
+                    this->fd, 0);
+    }
+    CHFS_VERIFY(addr != MAP_FAILED, "Failed to mmap the data");
+    this->block_data = static_cast<u8 *>(addr);
+    if (base == nullptr) {
+        this->reserve_sz = this->map_sz;
+    }
+
+    this->map_opts = options;
+    this->map_opts.huge_pages = thp;
+    this->map_opts.populate = options.populate && !place;
+    this->discard_enabled = options.discard;
+    this->set_thread_safe(options.thread_safe);
+    this->prepare_mapping(0, this->map_sz);
+}
+
+auto BlockManager::prepare_mapping(u64 offset, u64 len) -> void {
+    const auto &options = this->map_opts;
+    u8 *start = this->block_data + offset;
+    if (options.huge_pages && madvise(start, len, MADV_HUGEPAGE) != 0) {
+        std::cerr << "transparent huge pages are unavailable: "
+                  << strerror(errno) << std::endl;
+    }
+    if (this->fd < 0 && (options.numa != NumaPolicy::Default ||
+                         options.prefault_threads > 0)) {
+        this->place_memory(offset, len);
+    }
+    if (options.hint != AccessHint::Normal) {
+        // `grow` publishes the new blocks only after this
+        const block_id_t first = offset / this->block_sz;
+        const u64 end = std::min<u64>(
+            this->map_sz / this->block_sz,
+            round_up(offset + len, this->block_sz) / this->block_sz);
+        if (end > first) {
+            this->advise_range(first, end - first, options.hint);
+        }
+    }
+    if (options.lock_memory && mlock(start, len) != 0) {
+        std::cerr << "failed to lock the device in memory: " << strerror(errno)
+                  << std::endl;
+    }
+}
+
+namespace {
+
+// parse the online NUMA nodes, e.g., "0-1,4", nothing if unknown
+auto online_numa_nodes() -> std::vector<int> {
+    std::vector<int> nodes;
+    std::ifstream file("/sys/devices/system/node/online");
+    std::string range;
+    while (std::getline(file, range, ',')) {
+        auto dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos
+                           ? first
+                           : std::stoi(range.substr(dash + 1));
+            for (int node = first; node <= last; node++) {
+                nodes.push_back(node);
+            }
+        } catch (const std::exception &) {
+            return {};
+        }
     }
+    return nodes;
+}
+
+} // namespace
+
+auto BlockManager::place_memory(u64 offset, u64 len) -> void {
+    const auto &options = this->map_opts;
+    u8 *start = this->block_data + offset;
+    if (options.numa != NumaPolicy::Default) {
+        auto nodes = online_numa_nodes();
+        const usize bits = sizeof(unsigned long) * 8;
+        const int max_node =
+            nodes.empty() ? 0 : *std::max_element(nodes.begin(), nodes.end());
+        std::vector<unsigned long> mask(max_node / bits + 1, 0);
+        for (auto node : nodes) {
+            mask[node / bits] |= 1UL << (node % bits);
+        }
+
+        long ret = 0;
+        if (options.numa == NumaPolicy::Interleave) {
+            ret = syscall(SYS_mbind, start, len, MPOL_INTERLEAVE,
+                          mask.data(), mask.size() * bits + 1, 0);
+        } else {
+            ret = syscall(SYS_mbind, start, len, MPOL_LOCAL, nullptr, 0, 0);
+        }
+        if (ret != 0) {
+            std::cerr << "failed to set the NUMA policy: " << strerror(errno)
+                      << std::endl;
+        }
+    }
+
+    const usize thread_cnt = options.prefault_threads;
+    if (thread_cnt == 0) {
+        return;
+    }
+    // writing a byte per page allocates it, reading would map the zero page
+    const u64 page_sz =
+        this->hugetlb_mapped ? KHugePageSize : sysconf(_SC_PAGESIZE);
+    const u64 page_cnt = len / page_sz;
+    const u64 slice = (page_cnt + thread_cnt - 1) / thread_cnt;
+    std::vector<std::thread> threads;
+    for (usize t = 0; t < thread_cnt && t * slice < page_cnt; t++) {
+        threads.emplace_back([start, t, slice, page_cnt, page_sz] {
+            const u64 end = std::min(page_cnt, (t + 1) * slice);
+            volatile u8 *data = start;
+            for (u64 page = t * slice; page < end; page++) {
+                data[page * page_sz] = 0;
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+auto BlockManager::open_device_file(const std::string &file, usize &block_cnt,
+                                    usize block_size, int extra_flags) -> int {
+    int fd = open(file.c_str(), O_RDWR | O_CREAT | extra_flags,
+                  S_IRUSR | S_IWUSR);
+    CHFS_ASSERT(fd != -1, "Failed to open the block manager file");
 
-    this->block_data = static_cast<u8 *>(mmap(nullptr, this->total_storage_sz(),
-                                              PROT_READ | PROT_WRITE,
-                                              MAP_SHARED, this->fd, 0));
-    CHFS_ASSERT(this->block_data != MAP_FAILED, "Failed to mmap the data");
+    std::string file_name = file;
+    auto file_sz = get_file_sz(file_name);
+    if (file_sz == 0) {
+        initialize_file(fd, static_cast<u64>(block_cnt) * block_size);
+    } else {
+        // the device may have grown since it was created
+        block_cnt = file_sz / block_size;
+    }
+    return fd;
 }
 
 auto BlockManager::write_block(block_id_t block_id,
@@ -80,7 +300,12 @@ auto BlockManager::write_block(block_id_t block_id,
     // TODO: Implement this function.
     // UNIMPLEMENTED();
     u8 *target = block_id * block_sz + block_data;
-    memcpy(target, data, block_sz);
+    {
+        auto guard = this->lock_blocks(block_id, 1, true);
+        memcpy(target, data, block_sz);
+    }
+    this->mark_dirty(block_id, 1);
+    this->record_access(block_id, 1, true);
     return KNullOk;
 }
 
@@ -90,8 +315,14 @@ auto BlockManager::write_partial_block(block_id_t block_id, const u8 *data,
 
     // TODO: Implement this function.
     // UNIMPLEMENTED();
+    CHFS_ASSERT(offset + len <= block_sz, "partial write exceeds the block");
     u8 *target = block_id * block_sz + block_data + offset;
-    memcpy(target, data, block_sz - offset);
+    {
+        auto guard = this->lock_blocks(block_id, 1, true);
+        memcpy(target, data, len);
+    }
+    this->mark_dirty(block_id, 1);
+    this->record_access(block_id, 1, true);
     return KNullOk;
 }
 
@@ -100,7 +331,11 @@ auto BlockManager::read_block(block_id_t block_id, u8 *data) -> ChfsNullResult {
     // TODO: Implement this function.
     // UNIMPLEMENTED();
     u8 *from = block_id * this->block_sz + this->block_data;
-    memcpy(data, from, this->block_sz);
+    {
+        auto guard = this->lock_blocks(block_id, 1, false);
+        memcpy(data, from, this->block_sz);
+    }
+    this->record_access(block_id, 1, false);
     return KNullOk;
 }
 
@@ -108,39 +343,813 @@ auto BlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
 
     // TODO: Implement this function.
     // UNIMPLEMENTED();
+    this->record_access(block_id, 1, true);
+    if (this->discard_enabled) {
+        return this->discard_blocks({block_id});
+    }
     u8 *target = block_id * this->block_sz + this->block_data;
-    memset(target, 0, this->block_sz * sizeof(u8));
+    {
+        auto guard = this->lock_blocks(block_id, 1, true);
+        memset(target, 0, this->block_sz * sizeof(u8));
+    }
+    this->mark_dirty(block_id, 1);
+    return KNullOk;
+}
+
+auto BlockManager::grow(usize new_block_cnt) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->grow_mtx);
+    if (new_block_cnt < this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    if (this->fd < 0 && this->block_data == nullptr) {
+        std::cerr << "grow: the device owns no storage" << std::endl;
+        return ChfsNullResult(ErrorType::INVALID);
+    }
+    if (new_block_cnt == this->block_cnt) {
+        return KNullOk;
+    }
+
+    const u64 new_sz = static_cast<u64>(new_block_cnt) * this->block_sz;
+    const u64 new_map_sz =
+        this->hugetlb_mapped ? round_up(new_sz, KHugePageSize) : new_sz;
+    if (this->block_data != nullptr && new_map_sz > this->reserve_sz) {
+        std::cerr << "grow: the device can only grow to "
+                  << this->reserve_sz / this->block_sz
+                  << " blocks without moving" << std::endl;
+        return ChfsNullResult(ErrorType::INVALID);
+    }
+    if (this->fd >= 0 && ftruncate(this->fd, new_sz) != 0) {
+        std::cerr << "grow: failed to extend the file: " << strerror(errno)
+                  << std::endl;
+        return ChfsNullResult(ErrorType::INVALID);
+    }
+
+    if (this->block_data != nullptr && new_map_sz > this->map_sz) {
+        // map the new pages over the reservation after the mapped ones, so
+        // the pointers into the mapping stay valid
+        const u64 page_sz =
+            this->hugetlb_mapped ? KHugePageSize : sysconf(_SC_PAGESIZE);
+        const u64 mapped = round_up(this->map_sz, page_sz);
+        const u64 end = round_up(new_map_sz, page_sz);
+        if (end > mapped) {
+            int flags = this->fd >= 0 ? MAP_SHARED
+                                      : (MAP_PRIVATE | MAP_ANONYMOUS);
+            if (this->hugetlb_mapped) {
+                flags |= MAP_HUGETLB;
+            }
+            if (this->map_opts.populate) {
+                flags |= MAP_POPULATE;
+            }
+            void *addr = mmap(this->block_data + mapped, end - mapped,
+                              PROT_READ | PROT_WRITE, flags | MAP_FIXED,
+                              this->fd, this->fd >= 0 ? mapped : 0);
+            if (addr == MAP_FAILED) {
+                std::cerr << "grow: failed to map the new blocks: "
+                          << strerror(errno) << std::endl;
+                return ChfsNullResult(ErrorType::INVALID);
+            }
+            this->map_sz = new_map_sz;
+            this->prepare_mapping(mapped, end - mapped);
+        }
+        this->map_sz = new_map_sz;
+    }
+    // last, so a block is never accessed before it is mapped
+    this->block_cnt = new_block_cnt;
+    return KNullOk;
+}
+
+auto BlockManager::discard_blocks(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+    std::vector<block_id_t> sorted(block_ids);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (!sorted.empty() && sorted.back() >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    for (const auto &run : contiguous_runs(sorted)) {
+        auto res = this->discard_range(run.start, run.len);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto BlockManager::discard_range(block_id_t start,
+                                 usize cnt) -> ChfsNullResult {
+    {
+        auto guard = this->lock_blocks(start, cnt, true);
+        auto res = this->discard_in_place(start, cnt);
+        if (res.is_err()) {
+            return ChfsNullResult(res.unwrap_error());
+        }
+        if (res.unwrap()) {
+            return KNullOk;
+        }
+    }
+
+    // nothing to release in place, write the zeros through write_block, which
+    // takes the block locks itself and so must run with the guard dropped
+    std::vector<u8> zeros(this->block_sz, 0);
+    for (usize i = 0; i < cnt; i++) {
+        auto res = this->write_block(start + i, zeros.data());
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto BlockManager::discard_in_place(block_id_t start,
+                                    usize cnt) -> ChfsResult<bool> {
+    const u64 offset = start * this->block_sz;
+    const u64 len = static_cast<u64>(cnt) * this->block_sz;
+
+    if (this->fd >= 0) {
+        // the page cache and the mapping of the range are dropped as well
+        if (fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, len) == 0) {
+            this->mark_dirty(start, cnt);
+            return ChfsResult<bool>(true);
+        }
+        if (errno != EOPNOTSUPP) {
+            std::cerr << "failed to punch a hole at " << offset << ": "
+                      << strerror(errno) << std::endl;
+            return ChfsResult<bool>(ErrorType::INVALID);
+        }
+        // the file system cannot punch holes, write zeros instead
+    } else if (this->block_data != nullptr) {
+        // give the whole pages back, they are zero-filled on the next touch
+        const u64 page_sz = sysconf(_SC_PAGESIZE);
+        const u64 begin = (offset + page_sz - 1) / page_sz * page_sz;
+        const u64 end = (offset + len) / page_sz * page_sz;
+        if (begin < end && madvise(this->block_data + begin, end - begin,
+                                   MADV_DONTNEED) == 0) {
+            memset(this->block_data + offset, 0, begin - offset);
+            memset(this->block_data + end, 0, offset + len - end);
+            return ChfsResult<bool>(true);
+        }
+    }
+
+    if (this->block_data != nullptr) {
+        memset(this->block_data + offset, 0, len);
+        this->mark_dirty(start, cnt);
+        return ChfsResult<bool>(true);
+    }
+    return ChfsResult<bool>(false);
+}
+
+auto BlockManager::contiguous_runs(const std::vector<block_id_t> &block_ids)
+    -> std::vector<BlockRun> {
+    std::vector<BlockRun> runs;
+    for (usize i = 0; i < block_ids.size(); i++) {
+        if (!runs.empty() &&
+            runs.back().start + runs.back().len == block_ids[i]) {
+            runs.back().len += 1;
+        } else {
+            runs.push_back(BlockRun{i, block_ids[i], 1});
+        }
+    }
+    return runs;
+}
+
+auto BlockManager::read_blocks(const std::vector<block_id_t> &block_ids,
+                               u8 *buffer) -> ChfsNullResult {
+    if (this->block_data == nullptr) {
+        // no backing memory to copy from, fall back to the per-block path
+        for (usize i = 0; i < block_ids.size(); i++) {
+            auto res = this->read_block(
+                block_ids[i], buffer + static_cast<u64>(i) * this->block_sz);
+            if (res.is_err()) {
+                return res;
+            }
+        }
+        return KNullOk;
+    }
+
+    for (const auto &run : contiguous_runs(block_ids)) {
+        if (run.start + run.len > this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        auto guard = this->lock_blocks(run.start, run.len, false);
+        memcpy(buffer + static_cast<u64>(run.idx) * this->block_sz,
+               this->block_data + run.start * this->block_sz,
+               static_cast<u64>(run.len) * this->block_sz);
+        this->record_access(run.start, run.len, false);
+    }
+    return KNullOk;
+}
+
+auto BlockManager::write_blocks(const std::vector<block_id_t> &block_ids,
+                                const u8 *buffer) -> ChfsNullResult {
+    if (this->block_data == nullptr) {
+        for (usize i = 0; i < block_ids.size(); i++) {
+            auto res = this->write_block(
+                block_ids[i], buffer + static_cast<u64>(i) * this->block_sz);
+            if (res.is_err()) {
+                return res;
+            }
+        }
+        return KNullOk;
+    }
+
+    for (const auto &run : contiguous_runs(block_ids)) {
+        if (run.start + run.len > this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        {
+            auto guard = this->lock_blocks(run.start, run.len, true);
+            memcpy(this->block_data + run.start * this->block_sz,
+                   buffer + static_cast<u64>(run.idx) * this->block_sz,
+                   static_cast<u64>(run.len) * this->block_sz);
+        }
+        this->mark_dirty(run.start, run.len);
+        this->record_access(run.start, run.len, true);
+    }
     return KNullOk;
 }
 
+auto BlockManager::get_io_pool() -> ThreadPool & {
+    std::lock_guard<std::mutex> lock(this->io_pool_mtx);
+    if (this->io_pool == nullptr) {
+        this->io_pool = std::make_unique<ThreadPool>(this->io_worker_cnt);
+    }
+    return *this->io_pool;
+}
+
+auto BlockManager::read_block_async(block_id_t block_id, u8 *data)
+    -> std::future<ChfsNullResult> {
+    auto promise = std::make_shared<std::promise<ChfsNullResult>>();
+    auto future = promise->get_future();
+    this->read_block_async(block_id, data, [promise](ChfsNullResult res) {
+        promise->set_value(res);
+    });
+    return future;
+}
+
+auto BlockManager::write_block_async(block_id_t block_id, const u8 *data)
+    -> std::future<ChfsNullResult> {
+    auto promise = std::make_shared<std::promise<ChfsNullResult>>();
+    auto future = promise->get_future();
+    this->write_block_async(block_id, data, [promise](ChfsNullResult res) {
+        promise->set_value(res);
+    });
+    return future;
+}
+
+auto BlockManager::read_block_async(
+    block_id_t block_id, u8 *data,
+    std::function<void(ChfsNullResult)> callback) -> void {
+    this->get_io_pool().submit([this, block_id, data, callback] {
+        callback(this->read_block(block_id, data));
+    });
+}
+
+auto BlockManager::write_block_async(
+    block_id_t block_id, const u8 *data,
+    std::function<void(ChfsNullResult)> callback) -> void {
+    this->get_io_pool().submit([this, block_id, data, callback] {
+        callback(this->write_block(block_id, data));
+    });
+}
+
+auto BlockManager::wait_async() -> void {
+    std::unique_lock<std::mutex> lock(this->io_pool_mtx);
+    if (this->io_pool != nullptr) {
+        auto &pool = *this->io_pool;
+        lock.unlock();
+        pool.wait_idle();
+    }
+}
+
+auto BlockManager::insert_dirty(block_id_t start, block_id_t end) -> void {
+    auto it = this->dirty_ranges.upper_bound(start);
+    if (it != this->dirty_ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second >= start) {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            this->dirty_ranges.erase(prev);
+        }
+    }
+    while (it != this->dirty_ranges.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = this->dirty_ranges.erase(it);
+    }
+    this->dirty_ranges[start] = end;
+}
+
+auto BlockManager::take_dirty(block_id_t start, block_id_t end)
+    -> std::vector<std::pair<block_id_t, block_id_t>> {
+    std::vector<std::pair<block_id_t, block_id_t>> ranges;
+    auto it = this->dirty_ranges.upper_bound(start);
+    if (it != this->dirty_ranges.begin() && std::prev(it)->second > start) {
+        it = std::prev(it);
+    }
+    while (it != this->dirty_ranges.end() && it->first < end) {
+        auto range = *it;
+        it = this->dirty_ranges.erase(it);
+        // keep the parts outside [start, end) tracked
+        if (range.first < start) {
+            this->dirty_ranges[range.first] = start;
+        }
+        if (range.second > end) {
+            this->dirty_ranges[end] = range.second;
+        }
+        ranges.emplace_back(std::max(range.first, start),
+                            std::min(range.second, end));
+    }
+    return ranges;
+}
+
+auto BlockManager::mark_dirty(block_id_t start, usize cnt) -> void {
+    if (this->fd < 0 || cnt == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(this->sync_mtx);
+    this->insert_dirty(start, start + cnt);
+}
+
+auto BlockManager::advise(block_id_t start, usize cnt,
+                          AccessHint hint) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    return this->advise_range(start, cnt, hint);
+}
+
+auto BlockManager::advise_range(block_id_t start, usize cnt,
+                                AccessHint hint) -> ChfsNullResult {
+    if (cnt == 0) {
+        return KNullOk;
+    }
+
+    const u64 offset = start * this->block_sz;
+    const u64 len = static_cast<u64>(cnt) * this->block_sz;
+    if (this->block_data != nullptr) {
+        int advice = MADV_NORMAL;
+        switch (hint) {
+        case AccessHint::Sequential:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case AccessHint::Random:
+            advice = MADV_RANDOM;
+            break;
+        case AccessHint::WillNeed:
+            advice = MADV_WILLNEED;
+            break;
+        default:
+            break;
+        }
+        // madvise needs a page-aligned address
+        const u64 page_sz = sysconf(_SC_PAGESIZE);
+        const u64 begin = offset / page_sz * page_sz;
+        if (madvise(this->block_data + begin, offset + len - begin, advice) !=
+            0) {
+            std::cerr << "madvise failed: " << strerror(errno) << std::endl;
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+    } else if (this->fd >= 0) {
+        int advice = POSIX_FADV_NORMAL;
+        switch (hint) {
+        case AccessHint::Sequential:
+            advice = POSIX_FADV_SEQUENTIAL;
+            break;
+        case AccessHint::Random:
+            advice = POSIX_FADV_RANDOM;
+            break;
+        case AccessHint::WillNeed:
+            advice = POSIX_FADV_WILLNEED;
+            break;
+        default:
+            break;
+        }
+        auto ret = posix_fadvise(this->fd, offset, len, advice);
+        if (ret != 0) {
+            std::cerr << "posix_fadvise failed: " << strerror(ret)
+                      << std::endl;
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+    }
+    return KNullOk;
+}
+
+auto BlockManager::prefetch(const std::vector<block_id_t> &block_ids)
+    -> ChfsNullResult {
+    auto sorted = block_ids;
+    std::sort(sorted.begin(), sorted.end());
+    for (const auto &run : contiguous_runs(sorted)) {
+        auto res = this->advise(run.start, run.len, AccessHint::WillNeed);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto BlockManager::dirty_block_cnt() -> usize {
+    std::lock_guard<std::mutex> lock(this->sync_mtx);
+    usize cnt = 0;
+    for (const auto &range : this->dirty_ranges) {
+        cnt += range.second - range.first;
+    }
+    return cnt;
+}
+
+auto BlockManager::persist(
+    const std::vector<std::pair<block_id_t, block_id_t>> &ranges)
+    -> ChfsNullResult {
+    if (ranges.empty() || this->fd < 0) {
+        return KNullOk;
+    }
+
+    if (this->block_data == nullptr) {
+        // the writes went through the file, flush them all at once
+        if (fdatasync(this->fd) != 0) {
+            std::cerr << "fdatasync failed: " << strerror(errno) << std::endl;
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+        return KNullOk;
+    }
+
+    // msync needs a page-aligned address, so widen the ranges to pages and
+    // merge the ones falling into the same page
+    const u64 page_sz = sysconf(_SC_PAGESIZE);
+    std::vector<std::pair<u64, u64>> spans;
+    for (const auto &range : ranges) {
+        u64 begin = range.first * this->block_sz / page_sz * page_sz;
+        u64 end = range.second * this->block_sz;
+        if (!spans.empty() && begin <= spans.back().second) {
+            spans.back().second = std::max(spans.back().second, end);
+        } else {
+            spans.emplace_back(begin, end);
+        }
+    }
+    for (const auto &span : spans) {
+        if (msync(this->block_data + span.first, span.second - span.first,
+                  MS_SYNC) != 0) {
+            std::cerr << "msync failed at " << span.first << ": "
+                      << strerror(errno) << std::endl;
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+    }
+    return KNullOk;
+}
+
+auto BlockManager::sync() -> ChfsNullResult {
+    std::unique_lock<std::mutex> lock(this->sync_mtx);
+    if (this->sync_next == nullptr) {
+        this->sync_next = std::make_shared<SyncGeneration>();
+    }
+    // only the result of the flush covering our writes counts, not that of
+    // a later one
+    const auto generation = this->sync_next;
+    while (!generation->done && this->syncing) {
+        this->sync_cv.wait(lock);
+    }
+    if (generation->done) {
+        // a leader has flushed our writes
+        if (generation->failed) {
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+        return KNullOk;
+    }
+
+    // become the leader, and serve all the requests of the generation, whose
+    // writes have completed before the dirty ranges are taken
+    this->syncing = true;
+    this->sync_next = nullptr;
+    auto ranges = this->take_dirty(0, this->block_cnt);
+    lock.unlock();
+
+    auto res = this->persist(ranges);
+
+    lock.lock();
+    if (res.is_err()) {
+        for (const auto &range : ranges) {
+            this->insert_dirty(range.first, range.second);
+        }
+    }
+    this->syncing = false;
+    generation->done = true;
+    generation->failed = res.is_err();
+    lock.unlock();
+    this->sync_cv.notify_all();
+    return res;
+}
+
+auto BlockManager::sync_range(block_id_t start, usize cnt) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    // wait for the running flush, whose ranges are no longer tracked
+    std::unique_lock<std::mutex> lock(this->sync_mtx);
+    this->sync_cv.wait(lock, [this] { return !this->syncing; });
+    this->syncing = true;
+    auto ranges = this->take_dirty(start, start + cnt);
+    lock.unlock();
+
+    auto res = this->persist(ranges);
+
+    lock.lock();
+    if (res.is_err()) {
+        for (const auto &range : ranges) {
+            this->insert_dirty(range.first, range.second);
+        }
+    }
+    this->syncing = false;
+    lock.unlock();
+    this->sync_cv.notify_all();
+    return res;
+}
+
+namespace {
+
+/**
+ * A pin over a private copy of the block, used by the managers that have no
+ * backing memory to hand out.
+ */
+class BouncePin : public BlockPin {
+    BlockManager *bm;
+    std::vector<u8> buffer;
+
+  public:
+    BouncePin(BlockManager *bm, block_id_t block_id, std::vector<u8> buffer)
+        : BlockPin(block_id, nullptr), bm(bm), buffer(std::move(buffer)) {
+        this->data = this->buffer.data();
+    }
+
+    ~BouncePin() override {
+        if (this->dirty &&
+            this->bm->write_block(this->block_id, this->data).is_err()) {
+            std::cerr << "failed to write back pinned block " << this->block_id
+                      << std::endl;
+        }
+    }
+};
+
+} // namespace
+
+/**
+ * A pin of the memory backing a block. The block is marked dirty again upon
+ * release if it is written, since a sync may have run since the pinning.
+ */
+class BlockManager::MappedPin : public BlockPin {
+    BlockManager *bm;
+
+  public:
+    MappedPin(BlockManager *bm, block_id_t block_id, u8 *data)
+        : BlockPin(block_id, data), bm(bm) {}
+
+    ~MappedPin() override {
+        if (this->dirty) {
+            this->bm->mark_dirty(this->block_id, 1);
+        }
+    }
+};
+
+auto BlockManager::pin_block(block_id_t block_id, bool writable)
+    -> ChfsResult<std::shared_ptr<BlockPin>> {
+    if (block_id >= this->block_cnt) {
+        return ChfsResult<std::shared_ptr<BlockPin>>(ErrorType::INVALID_ARG);
+    }
+
+    if (this->block_data != nullptr) {
+        // pin the backing memory directly. The block is marked dirty now for
+        // the writes through raw pointers, and again upon release.
+        if (writable) {
+            this->mark_dirty(block_id, 1);
+        }
+        this->record_access(block_id, 1, writable);
+        auto pin = std::shared_ptr<BlockPin>(new MappedPin(
+            this, block_id, this->block_data + block_id * this->block_sz));
+        return ChfsResult<std::shared_ptr<BlockPin>>(pin);
+    }
+
+    std::vector<u8> buffer(this->block_sz);
+    auto res = this->read_block(block_id, buffer.data());
+    if (res.is_err()) {
+        return ChfsResult<std::shared_ptr<BlockPin>>(res.unwrap_error());
+    }
+    auto pin = std::shared_ptr<BlockPin>(
+        new BouncePin(this, block_id, std::move(buffer)));
+    return ChfsResult<std::shared_ptr<BlockPin>>(pin);
+}
+
+auto BlockManager::read_guard(block_id_t block_id)
+    -> ChfsResult<BlockReadGuard> {
+    auto res = this->pin_block(block_id, false);
+    if (res.is_err()) {
+        return ChfsResult<BlockReadGuard>(res.unwrap_error());
+    }
+    return ChfsResult<BlockReadGuard>(
+        BlockReadGuard(res.unwrap(), this->block_sz));
+}
+
+auto BlockManager::write_guard(block_id_t block_id)
+    -> ChfsResult<BlockWriteGuard> {
+    auto res = this->pin_block(block_id, true);
+    if (res.is_err()) {
+        return ChfsResult<BlockWriteGuard>(res.unwrap_error());
+    }
+    return ChfsResult<BlockWriteGuard>(
+        BlockWriteGuard(res.unwrap(), this->block_sz));
+}
+
+namespace {
+
+// visit the stripes [first, first + cnt) modulo n in ascending order
+template <typename F>
+auto for_each_stripe(usize first, usize cnt, usize n, F f) -> void {
+    if (first + cnt > n) {
+        for (usize i = 0; i < first + cnt - n; i++) {
+            f(i);
+        }
+        cnt = n - first;
+    }
+    for (usize i = first; i < first + cnt; i++) {
+        f(i);
+    }
+}
+
+} // namespace
+
+BlockLocks::Guard::Guard(BlockLocks *locks, block_id_t start, usize cnt,
+                         bool exclusive)
+    : locks(locks), first(0), cnt(0), exclusive(exclusive) {
+    if (locks == nullptr) {
+        return;
+    }
+    this->cnt = std::min(cnt, locks->stripe_cnt);
+    if (this->cnt < locks->stripe_cnt) {
+        this->first = start % locks->stripe_cnt;
+    }
+    for_each_stripe(this->first, this->cnt, locks->stripe_cnt, [&](usize i) {
+        if (exclusive) {
+            locks->stripes[i].mtx.lock();
+        } else {
+            locks->stripes[i].mtx.lock_shared();
+        }
+    });
+}
+
+BlockLocks::Guard::Guard(BlockLocks *locks,
+                         const std::vector<block_id_t> &block_ids,
+                         bool exclusive)
+    : locks(locks), first(0), cnt(0), exclusive(exclusive) {
+    if (locks == nullptr) {
+        return;
+    }
+    for (auto id : block_ids) {
+        this->picked.push_back(id % locks->stripe_cnt);
+    }
+    std::sort(this->picked.begin(), this->picked.end());
+    this->picked.erase(std::unique(this->picked.begin(), this->picked.end()),
+                       this->picked.end());
+    for (auto i : this->picked) {
+        if (exclusive) {
+            locks->stripes[i].mtx.lock();
+        } else {
+            locks->stripes[i].mtx.lock_shared();
+        }
+    }
+}
+
+BlockLocks::Guard::~Guard() {
+    if (this->locks == nullptr) {
+        return;
+    }
+    for (auto i : this->picked) {
+        if (this->exclusive) {
+            this->locks->stripes[i].mtx.unlock();
+        } else {
+            this->locks->stripes[i].mtx.unlock_shared();
+        }
+    }
+    for_each_stripe(this->first, this->cnt, this->locks->stripe_cnt,
+                    [&](usize i) {
+                        if (this->exclusive) {
+                            this->locks->stripes[i].mtx.unlock();
+                        } else {
+                            this->locks->stripes[i].mtx.unlock_shared();
+                        }
+                    });
+}
+
+AccessCounters::AccessCounters(usize block_cnt, u32 sample_rate)
+    : block_cnt(block_cnt), sample_rate(std::max<u32>(sample_rate, 1)),
+      reads(new std::atomic<u64>[block_cnt]),
+      writes(new std::atomic<u64>[block_cnt]) {
+    for (usize i = 0; i < block_cnt; i++) {
+        this->reads[i].store(0, std::memory_order_relaxed);
+        this->writes[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+auto AccessCounters::record(block_id_t start, usize cnt,
+                            bool is_write) -> void {
+    if (this->sample_rate > 1) {
+        thread_local u32 tick = 0;
+        if (++tick % this->sample_rate != 0) {
+            return;
+        }
+    }
+    auto &counters = is_write ? this->writes : this->reads;
+    const block_id_t end =
+        std::min<block_id_t>(start + cnt, this->block_cnt);
+    for (block_id_t i = start; i < end; i++) {
+        counters[i].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+auto AccessCounters::snapshot() const -> std::vector<BlockAccessCount> {
+    std::vector<BlockAccessCount> res(this->block_cnt);
+    for (usize i = 0; i < this->block_cnt; i++) {
+        res[i].reads =
+            this->reads[i].load(std::memory_order_relaxed) * this->sample_rate;
+        res[i].writes =
+            this->writes[i].load(std::memory_order_relaxed) * this->sample_rate;
+    }
+    return res;
+}
+
+auto BlockManager::enable_access_stats(u32 sample_rate) -> void {
+    this->access_counters =
+        std::make_unique<AccessCounters>(this->block_cnt, sample_rate);
+}
+
+auto BlockManager::access_stats() const -> std::vector<BlockAccessCount> {
+    if (this->access_counters == nullptr) {
+        return {};
+    }
+    return this->access_counters->snapshot();
+}
+
 BlockManager::~BlockManager() {
+    // drain the pending asynchronous I/Os before releasing the storage
+    this->io_pool.reset();
+    if (this->block_data != nullptr) {
+        munmap(this->block_data, this->reserve_sz);
+    }
     if (!this->in_memory) {
-        munmap(this->block_data, this->total_storage_sz());
         close(this->fd);
-    } else {
-        delete[] this->block_data;
     }
 }
 
 // BlockIterator
 auto BlockIterator::create(BlockManager *bm, block_id_t start_block_id,
-                           block_id_t end_block_id)
+                           block_id_t end_block_id,
+                           const BlockIteratorOptions &opts)
     -> ChfsResult<BlockIterator> {
+    if (opts.stride == 0 || start_block_id > end_block_id ||
+        end_block_id > bm->total_blocks()) {
+        return ChfsResult<BlockIterator>(ErrorType::INVALID_ARG);
+    }
+
     BlockIterator iter;
     iter.bm = bm;
-    iter.cur_block_off = 0;
     iter.start_block_id = start_block_id;
     iter.end_block_id = end_block_id;
+    iter.opts = opts;
+    iter.block_num =
+        (end_block_id - start_block_id + opts.stride - 1) / opts.stride;
 
-    std::vector<u8> buffer(bm->block_sz);
+    if (iter.has_next()) {
+        auto res = iter.pin_cur_block();
+        if (res.is_err()) {
+            return ChfsResult<BlockIterator>(res.unwrap_error());
+        }
+    }
+    return ChfsResult<BlockIterator>(std::move(iter));
+}
 
-    auto res = bm->read_block(
-        iter.cur_block_off / bm->block_sz + start_block_id, buffer.data());
-    if (res.is_ok()) {
-        iter.buffer = std::move(buffer);
-        return ChfsResult<BlockIterator>(iter);
+// pin the current block, prefetching the next blocks of the walk once less
+// than half of the prefetched ones are left
+auto BlockIterator::pin_cur_block() -> ChfsNullResult {
+    const u64 pos = this->cur_block_off / bm->block_size();
+    const usize batch = this->opts.prefetch;
+    if (batch > 0 && this->prefetched < pos + 1 + batch / 2) {
+        const u64 first = std::max(this->prefetched, pos + 1);
+        const u64 last = std::min(this->block_num, pos + 1 + batch);
+        std::vector<block_id_t> block_ids;
+        for (auto i = first; i < last; i++) {
+            block_ids.push_back(this->block_at(i));
+        }
+        this->prefetched = std::max(this->prefetched, last);
+        // prefetching is a hint, a failure only costs the readahead
+        if (!block_ids.empty()) {
+            bm->prefetch(block_ids);
+        }
+    }
+
+    auto res = bm->pin_block(this->block_at(pos), this->opts.writable);
+    if (res.is_err()) {
+        return ChfsNullResult(res.unwrap_error());
     }
-    return ChfsResult<BlockIterator>(res.unwrap_error());
+    this->pin = res.unwrap();
+    return KNullOk;
 }
 
 // assumption: a previous call of has_next() returns true
@@ -151,16 +1160,16 @@ auto BlockIterator::next(usize offset) -> ChfsNullResult {
     auto new_block_id = this->cur_block_off / bm->block_size();
     // move forward
     if (new_block_id != prev_block_id) {
-        if (this->start_block_id + new_block_id > this->end_block_id) {
+        // release the previous block first, which applies its modification
+        this->pin.reset();
+        if (new_block_id > this->block_num) {
             return ChfsNullResult(ErrorType::DONE);
         }
-
-        // else: we need to refresh the buffer
-        auto res = bm->read_block(this->start_block_id + new_block_id,
-                                  this->buffer.data());
-        if (res.is_err()) {
-            return ChfsNullResult(res.unwrap_error());
+        if (new_block_id == this->block_num) {
+            // just passed the last block
+            return KNullOk;
         }
+        return this->pin_cur_block();
     }
     return KNullOk;
 }
@@ -0,0 +1,36 @@
+#include <algorithm>
+
+#include "block/readahead.h"
+
+namespace chfs {
+
+auto ReadaheadWindow::on_read(u64 start, u64 end,
+                              u64 limit) -> std::pair<u64, u64> {
+    if (start != this->next) {
+        // a random read, start over from it
+        this->next = end;
+        this->prefetched = end;
+        this->window = 0;
+        return {end, end};
+    }
+
+    this->next = end;
+    this->prefetched = std::max(this->prefetched, end);
+    if (this->window != 0 && this->prefetched - end >= this->window / 2) {
+        // still far enough ahead of the reads
+        return {end, end};
+    }
+
+    this->window = this->window == 0
+                       ? this->initial
+                       : std::min<usize>(this->window * 2, this->max);
+    const u64 target = std::min<u64>(limit, end + this->window);
+    if (target <= this->prefetched) {
+        return {end, end};
+    }
+    const std::pair<u64, u64> range = {this->prefetched, target};
+    this->prefetched = target;
+    return range;
+}
+
+} // namespace chfs
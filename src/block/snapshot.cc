@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstring>
+
+#include "block/snapshot.h"
+
+namespace chfs {
+
+SnapshotBlockManager::SnapshotBlockManager(std::shared_ptr<BlockManager> inner,
+                                           usize block_cnt)
+    : BlockManager(block_cnt == 0 ? inner->total_blocks() -
+                                        inner->total_blocks() / 4
+                                  : block_cnt,
+                   inner->block_size(), nullptr),
+      inner(std::move(inner)) {
+    CHFS_VERIFY(this->block_cnt < this->inner->total_blocks(),
+                "No room is left for the copies of the snapshots");
+
+    this->copied_epochs.resize(this->block_cnt, 0);
+    // hand out the low blocks of the copy area first
+    for (usize i = this->inner->total_blocks(); i > this->block_cnt; i--) {
+        this->free_copies.push_back(i - 1);
+    }
+    this->copy_buf.resize(this->block_sz);
+}
+
+auto SnapshotBlockManager::snapshot()
+    -> ChfsResult<std::shared_ptr<BlockSnapshot>> {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->epoch += 1;
+    this->snapshots.emplace(this->epoch, Snapshot{});
+    return ChfsResult<std::shared_ptr<BlockSnapshot>>(
+        std::make_shared<BlockSnapshot>(this->shared_from_this(),
+                                        this->epoch));
+}
+
+auto SnapshotBlockManager::write_block(block_id_t block_id,
+                                       const u8 *data) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->copy_before_write(block_id, 1);
+    if (res.is_err()) {
+        return res;
+    }
+    this->record_access(block_id, 1, true);
+    return this->inner->write_block(block_id, data);
+}
+
+auto SnapshotBlockManager::write_partial_block(block_id_t block_id,
+                                               const u8 *data, usize offset,
+                                               usize len) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->copy_before_write(block_id, 1);
+    if (res.is_err()) {
+        return res;
+    }
+    this->record_access(block_id, 1, true);
+    return this->inner->write_partial_block(block_id, data, offset, len);
+}
+
+auto SnapshotBlockManager::read_block(block_id_t block_id,
+                                      u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    // the logical blocks never move, so the reads need no lock
+    this->record_access(block_id, 1, false);
+    return this->inner->read_block(block_id, data);
+}
+
+auto SnapshotBlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto res = this->copy_before_write(block_id, 1);
+    if (res.is_err()) {
+        return res;
+    }
+    this->record_access(block_id, 1, true);
+    return this->inner->zero_block(block_id);
+}
+
+auto SnapshotBlockManager::discard_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (const auto &block_id : block_ids) {
+        auto res = this->copy_before_write(block_id, 1);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return this->inner->discard_blocks(block_ids);
+}
+
+auto SnapshotBlockManager::read_blocks(const std::vector<block_id_t> &block_ids,
+                                       u8 *buffer) -> ChfsNullResult {
+    for (const auto &block_id : block_ids) {
+        if (block_id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+    }
+    this->record_access(block_ids, false);
+    return this->inner->read_blocks(block_ids, buffer);
+}
+
+auto SnapshotBlockManager::write_blocks(
+    const std::vector<block_id_t> &block_ids,
+    const u8 *buffer) -> ChfsNullResult {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (const auto &run : contiguous_runs(block_ids)) {
+        auto res = this->copy_before_write(run.start, run.len);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    this->record_access(block_ids, true);
+    return this->inner->write_blocks(block_ids, buffer);
+}
+
+auto SnapshotBlockManager::snapshot_cnt() -> usize {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->snapshots.size();
+}
+
+auto SnapshotBlockManager::copies_used() -> usize {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->copy_refs.size();
+}
+
+auto SnapshotBlockManager::latest_valid_epoch() const -> u64 {
+    for (auto it = this->snapshots.rbegin(); it != this->snapshots.rend();
+         ++it) {
+        if (it->second.valid) {
+            return it->first;
+        }
+    }
+    return 0;
+}
+
+auto SnapshotBlockManager::copy_before_write(block_id_t start,
+                                             usize cnt) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    const u64 latest = this->latest_valid_epoch();
+    for (block_id_t block_id = start; block_id < start + cnt; block_id++) {
+        // every snapshot taken since the last copy still sees the old content
+        const u64 copied = this->copied_epochs[block_id];
+        if (latest <= copied) {
+            continue;
+        }
+        this->copied_epochs[block_id] = latest;
+
+        auto first = this->snapshots.upper_bound(copied);
+        if (this->free_copies.empty()) {
+            // keep the writes going at the cost of the snapshots
+            for (auto it = first; it != this->snapshots.end(); ++it) {
+                if (it->second.valid) {
+                    std::cerr << "snapshot " << it->first
+                              << " is invalidated: no room for the copies"
+                              << std::endl;
+                    this->release_copies(it->second);
+                    it->second.valid = false;
+                }
+            }
+            continue;
+        }
+
+        auto copy = this->free_copies.back();
+        auto res = this->inner->read_block(block_id, this->copy_buf.data());
+        if (res.is_ok()) {
+            res = this->inner->write_block(copy, this->copy_buf.data());
+        }
+        if (res.is_err()) {
+            this->copied_epochs[block_id] = copied;
+            return res;
+        }
+        this->free_copies.pop_back();
+
+        u32 refs = 0;
+        for (auto it = first; it != this->snapshots.end(); ++it) {
+            if (it->second.valid) {
+                it->second.copies[block_id] = copy;
+                refs += 1;
+            }
+        }
+        this->copy_refs[copy] = refs;
+    }
+    return KNullOk;
+}
+
+auto SnapshotBlockManager::release_copies(Snapshot &snapshot) -> void {
+    for (const auto &[block_id, copy] : snapshot.copies) {
+        auto it = this->copy_refs.find(copy);
+        CHFS_ASSERT(it != this->copy_refs.end(), "copy is not referenced");
+        if (--it->second == 0) {
+            this->copy_refs.erase(it);
+            this->free_copies.push_back(copy);
+        }
+    }
+    snapshot.copies.clear();
+}
+
+auto SnapshotBlockManager::read_snapshot(u64 snapshot_epoch,
+                                         block_id_t block_id,
+                                         u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    // hold the lock, so the block is not overwritten before it is copied
+    std::lock_guard<std::mutex> lock(this->mtx);
+    const auto &snapshot = this->snapshots.at(snapshot_epoch);
+    if (!snapshot.valid) {
+        return ChfsNullResult(ErrorType::INVALID);
+    }
+    auto it = snapshot.copies.find(block_id);
+    return this->inner->read_block(
+        it == snapshot.copies.end() ? block_id : it->second, data);
+}
+
+auto SnapshotBlockManager::release_snapshot(u64 snapshot_epoch) -> void {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto it = this->snapshots.find(snapshot_epoch);
+    if (it == this->snapshots.end()) {
+        return;
+    }
+    this->release_copies(it->second);
+    this->snapshots.erase(it);
+}
+
+BlockSnapshot::BlockSnapshot(std::shared_ptr<SnapshotBlockManager> origin,
+                             u64 snapshot_epoch)
+    : BlockManager(origin->total_blocks(), origin->block_size(), nullptr),
+      origin(std::move(origin)), snapshot_epoch(snapshot_epoch) {}
+
+BlockSnapshot::~BlockSnapshot() {
+    this->origin->release_snapshot(this->snapshot_epoch);
+}
+
+} // namespace chfs
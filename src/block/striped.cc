@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <numeric>
+
+#include "block/striped.h"
+
+namespace chfs {
+
+namespace {
+
+auto striped_block_cnt(
+    const std::vector<std::shared_ptr<BlockManager>> &members,
+    usize stripe_unit) -> usize {
+    CHFS_VERIFY(!members.empty(), "A striped device needs members");
+    CHFS_VERIFY(stripe_unit > 0, "The stripe unit should be positive");
+    usize min_blocks = members.front()->total_blocks();
+    for (const auto &member : members) {
+        CHFS_VERIFY(member->block_size() == members.front()->block_size(),
+                    "The members should share the block size");
+        min_blocks = std::min(min_blocks, member->total_blocks());
+    }
+    return min_blocks / stripe_unit * stripe_unit * members.size();
+}
+
+/**
+ * A pin of a block on a member, so the guards see the id on the striped
+ * device while the member's pin does the release work.
+ */
+class MemberPin : public BlockPin {
+    std::shared_ptr<BlockPin> inner;
+
+  public:
+    MemberPin(block_id_t block_id, std::shared_ptr<BlockPin> inner)
+        : BlockPin(block_id, inner->data), inner(std::move(inner)) {}
+
+    ~MemberPin() override {
+        this->inner->dirty = this->inner->dirty || this->dirty;
+    }
+};
+
+} // namespace
+
+StripedBlockManager::StripedBlockManager(
+    std::vector<std::shared_ptr<BlockManager>> members, usize stripe_unit)
+    : BlockManager(striped_block_cnt(members, stripe_unit),
+                   members.front()->block_size(), nullptr),
+      members(std::move(members)), stripe_unit(stripe_unit) {
+    CHFS_VERIFY(this->block_cnt > 0, "The members are smaller than a stripe");
+    // one worker per member, the caller serves one of them itself
+    this->io_worker_cnt =
+        std::max<usize>(this->io_worker_cnt, this->members.size());
+}
+
+auto StripedBlockManager::create(const std::vector<std::string> &files,
+                                 usize block_cnt, usize stripe_unit)
+    -> std::shared_ptr<StripedBlockManager> {
+    CHFS_VERIFY(!files.empty(), "A striped device needs members");
+    const usize units = (block_cnt + stripe_unit - 1) / stripe_unit;
+    const usize member_blocks =
+        (units + files.size() - 1) / files.size() * stripe_unit;
+
+    std::vector<std::shared_ptr<BlockManager>> members;
+    for (const auto &file : files) {
+        members.push_back(std::make_shared<BlockManager>(file, member_blocks));
+    }
+    return std::make_shared<StripedBlockManager>(std::move(members),
+                                                 stripe_unit);
+}
+
+auto StripedBlockManager::write_block(block_id_t block_id,
+                                      const u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto loc = this->locate(block_id);
+    this->record_access(block_id, 1, true);
+    return this->members[loc.member]->write_block(loc.block_id, data);
+}
+
+auto StripedBlockManager::write_partial_block(block_id_t block_id,
+                                              const u8 *data, usize offset,
+                                              usize len) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto loc = this->locate(block_id);
+    this->record_access(block_id, 1, true);
+    return this->members[loc.member]->write_partial_block(loc.block_id, data,
+                                                          offset, len);
+}
+
+auto StripedBlockManager::read_block(block_id_t block_id,
+                                     u8 *data) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto loc = this->locate(block_id);
+    this->record_access(block_id, 1, false);
+    return this->members[loc.member]->read_block(loc.block_id, data);
+}
+
+auto StripedBlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
+    if (block_id >= this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto loc = this->locate(block_id);
+    this->record_access(block_id, 1, true);
+    if (this->discard_enabled) {
+        return this->members[loc.member]->discard_blocks({loc.block_id});
+    }
+    return this->members[loc.member]->zero_block(loc.block_id);
+}
+
+auto StripedBlockManager::read_blocks(const std::vector<block_id_t> &block_ids,
+                                      u8 *buffer) -> ChfsNullResult {
+    this->record_access(block_ids, false);
+    return this->dispatch(block_ids, buffer, false);
+}
+
+auto StripedBlockManager::write_blocks(
+    const std::vector<block_id_t> &block_ids,
+    const u8 *buffer) -> ChfsNullResult {
+    this->record_access(block_ids, true);
+    return this->dispatch(block_ids, const_cast<u8 *>(buffer), true);
+}
+
+auto StripedBlockManager::dispatch(const std::vector<block_id_t> &block_ids,
+                                   u8 *buffer,
+                                   bool is_write) -> ChfsNullResult {
+    // split the batch into per-member segments, each contiguous both in the
+    // buffer and on the member
+    std::vector<std::vector<BlockRun>> segments(this->members.size());
+    for (usize i = 0; i < block_ids.size(); i++) {
+        if (block_ids[i] >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        auto loc = this->locate(block_ids[i]);
+        auto &segs = segments[loc.member];
+        if (!segs.empty() && segs.back().idx + segs.back().len == i &&
+            segs.back().start + segs.back().len == loc.block_id) {
+            segs.back().len += 1;
+        } else {
+            segs.push_back(BlockRun{i, loc.block_id, 1});
+        }
+    }
+
+    auto serve = [this, &segments, buffer, is_write](usize m) {
+        for (const auto &seg : segments[m]) {
+            std::vector<block_id_t> member_ids(seg.len);
+            std::iota(member_ids.begin(), member_ids.end(), seg.start);
+            auto data = buffer + static_cast<u64>(seg.idx) * this->block_sz;
+            auto res = is_write
+                           ? this->members[m]->write_blocks(member_ids, data)
+                           : this->members[m]->read_blocks(member_ids, data);
+            if (res.is_err()) {
+                return res;
+            }
+        }
+        return KNullOk;
+    };
+
+    std::vector<usize> busy;
+    for (usize m = 0; m < this->members.size(); m++) {
+        if (!segments[m].empty()) {
+            busy.push_back(m);
+        }
+    }
+    if (busy.size() <= 1) {
+        return busy.empty() ? KNullOk : serve(busy.front());
+    }
+
+    // hand the other members to the workers and serve the first one here
+    std::vector<std::future<ChfsNullResult>> futures;
+    auto &pool = this->get_io_pool();
+    for (usize i = 1; i < busy.size(); i++) {
+        auto promise = std::make_shared<std::promise<ChfsNullResult>>();
+        futures.push_back(promise->get_future());
+        pool.submit([promise, serve, m = busy[i]] {
+            promise->set_value(serve(m));
+        });
+    }
+    auto res = serve(busy.front());
+    for (auto &future : futures) {
+        auto member_res = future.get();
+        if (res.is_ok() && member_res.is_err()) {
+            res = member_res;
+        }
+    }
+    return res;
+}
+
+auto StripedBlockManager::discard_blocks(
+    const std::vector<block_id_t> &block_ids) -> ChfsNullResult {
+    std::vector<std::vector<block_id_t>> member_ids(this->members.size());
+    for (auto id : block_ids) {
+        if (id >= this->block_cnt) {
+            return ChfsNullResult(ErrorType::INVALID_ARG);
+        }
+        auto loc = this->locate(id);
+        member_ids[loc.member].push_back(loc.block_id);
+    }
+    for (usize m = 0; m < this->members.size(); m++) {
+        if (member_ids[m].empty()) {
+            continue;
+        }
+        auto res = this->members[m]->discard_blocks(member_ids[m]);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto StripedBlockManager::pin_block(block_id_t block_id, bool writable)
+    -> ChfsResult<std::shared_ptr<BlockPin>> {
+    if (block_id >= this->block_cnt) {
+        return ChfsResult<std::shared_ptr<BlockPin>>(ErrorType::INVALID_ARG);
+    }
+    auto loc = this->locate(block_id);
+    this->record_access(block_id, 1, writable);
+    auto res = this->members[loc.member]->pin_block(loc.block_id, writable);
+    if (res.is_err()) {
+        return res;
+    }
+    auto pin =
+        std::shared_ptr<BlockPin>(new MemberPin(block_id, res.unwrap()));
+    return ChfsResult<std::shared_ptr<BlockPin>>(pin);
+}
+
+auto StripedBlockManager::grow(usize new_block_cnt) -> ChfsNullResult {
+    if (new_block_cnt < this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    const usize units = (new_block_cnt + this->stripe_unit - 1) /
+                        this->stripe_unit;
+    const usize member_blocks =
+        (units + this->members.size() - 1) / this->members.size() *
+        this->stripe_unit;
+    for (const auto &member : this->members) {
+        if (member->total_blocks() >= member_blocks) {
+            continue;
+        }
+        auto res = member->grow(member_blocks);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    this->block_cnt = striped_block_cnt(this->members, this->stripe_unit);
+    return KNullOk;
+}
+
+auto StripedBlockManager::sync() -> ChfsNullResult {
+    for (const auto &member : this->members) {
+        auto res = member->sync();
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto StripedBlockManager::for_member_ranges(
+    block_id_t start, usize cnt,
+    const std::function<ChfsNullResult(BlockManager &, block_id_t, usize)>
+        &op) -> ChfsNullResult {
+    if (start + cnt > this->block_cnt) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    if (cnt == 0) {
+        return KNullOk;
+    }
+
+    // the blocks of a member between its first and last piece in the range
+    // are contiguous on the member, so one range per member covers them
+    const auto n = this->members.size();
+    std::vector<block_id_t> first(n, 0);
+    std::vector<block_id_t> last(n, 0);
+    std::vector<bool> touched(n, false);
+    const block_id_t end = start + cnt;
+    auto visit = [&](block_id_t unit) {
+        const block_id_t begin = std::max(start, unit * this->stripe_unit);
+        const block_id_t piece_end =
+            std::min(end, (unit + 1) * this->stripe_unit);
+        auto loc = this->locate(begin);
+        if (!touched[loc.member]) {
+            touched[loc.member] = true;
+            first[loc.member] = loc.block_id;
+        }
+        last[loc.member] = loc.block_id + (piece_end - begin) - 1;
+    };
+    // only the first and the last piece of each member matter
+    const block_id_t first_unit = start / this->stripe_unit;
+    const block_id_t last_unit = (end - 1) / this->stripe_unit;
+    for (block_id_t unit = first_unit; unit <= last_unit; unit++) {
+        if (unit == first_unit + n && last_unit >= first_unit + 2 * n) {
+            unit = last_unit - n + 1;
+        }
+        visit(unit);
+    }
+    for (usize m = 0; m < n; m++) {
+        if (!touched[m]) {
+            continue;
+        }
+        auto res = op(*this->members[m], first[m], last[m] - first[m] + 1);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
+auto StripedBlockManager::sync_range(block_id_t start,
+                                     usize cnt) -> ChfsNullResult {
+    return this->for_member_ranges(
+        start, cnt, [](BlockManager &member, block_id_t begin, usize len) {
+            return member.sync_range(begin, len);
+        });
+}
+
+auto StripedBlockManager::advise(block_id_t start, usize cnt,
+                                 AccessHint hint) -> ChfsNullResult {
+    return this->for_member_ranges(
+        start, cnt,
+        [hint](BlockManager &member, block_id_t begin, usize len) {
+            return member.advise(begin, len, hint);
+        });
+}
+
+} // namespace chfs
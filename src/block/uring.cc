@@ -0,0 +1,423 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+#include "block/uring.h"
+
+namespace chfs {
+
+namespace {
+
+auto io_uring_setup(u32 entries, io_uring_params *params) -> int {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+auto io_uring_enter(int ring_fd, u32 to_submit, u32 min_complete, u32 flags)
+    -> int {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+// the maximum number of blocks transferred by a single request
+const usize KMaxBlocksPerRequest = 256;
+
+// how many times an io_uring_enter failing temporarily is retried, backing
+// off by the poll interval more each time
+const u32 KUringEnterRetries = 8;
+const auto KUringPollInterval = std::chrono::microseconds(100);
+// how long the requests in flight are waited for once io_uring_enter fails
+const auto KUringDrainTimeout = std::chrono::seconds(10);
+
+template <typename T> auto ring_ptr(void *ring, u32 off) -> T * {
+    return reinterpret_cast<T *>(static_cast<u8 *>(ring) + off);
+}
+
+} // namespace
+
+IoUringBlockManager::IoUringBlockManager(const std::string &file,
+                                         usize block_cnt, u32 queue_depth)
+    : BlockManager(block_cnt, KDefaultBlockSize, nullptr),
+      queue_depth(queue_depth), ring_fd(-1) {
+    CHFS_VERIFY(queue_depth > 0, "The queue depth should be positive");
+    this->file_name_ = file;
+    this->fd = open_device_file(file, block_cnt, this->block_sz);
+    this->block_cnt = block_cnt;
+    this->zero_buffer.resize(this->block_sz, 0);
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    this->ring_fd = io_uring_setup(queue_depth, &params);
+    CHFS_VERIFY(this->ring_fd >= 0, "Failed to set up the io_uring");
+    // the kernel may round the depth up
+    this->queue_depth = params.sq_entries;
+
+    this->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(u32);
+    this->cq_ring_sz =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        this->sq_ring_sz = std::max(this->sq_ring_sz, this->cq_ring_sz);
+        this->cq_ring_sz = this->sq_ring_sz;
+    }
+
+    this->sq_ring = mmap(nullptr, this->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                         IORING_OFF_SQ_RING);
+    CHFS_VERIFY(this->sq_ring != MAP_FAILED, "Failed to mmap the sq ring");
+    if (single_mmap) {
+        this->cq_ring = this->sq_ring;
+    } else {
+        this->cq_ring = mmap(nullptr, this->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                             IORING_OFF_CQ_RING);
+        CHFS_VERIFY(this->cq_ring != MAP_FAILED, "Failed to mmap the cq ring");
+    }
+
+    this->sqes_sz = params.sq_entries * sizeof(io_uring_sqe);
+    this->sqes = static_cast<io_uring_sqe *>(
+        mmap(nullptr, this->sqes_sz, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES));
+    CHFS_VERIFY(this->sqes != MAP_FAILED, "Failed to mmap the sqes");
+
+    this->sq_head = ring_ptr<u32>(this->sq_ring, params.sq_off.head);
+    this->sq_tail = ring_ptr<u32>(this->sq_ring, params.sq_off.tail);
+    this->sq_mask = ring_ptr<u32>(this->sq_ring, params.sq_off.ring_mask);
+    this->sq_array = ring_ptr<u32>(this->sq_ring, params.sq_off.array);
+    this->cq_head = ring_ptr<u32>(this->cq_ring, params.cq_off.head);
+    this->cq_tail = ring_ptr<u32>(this->cq_ring, params.cq_off.tail);
+    this->cq_mask = ring_ptr<u32>(this->cq_ring, params.cq_off.ring_mask);
+    this->cqes = ring_ptr<io_uring_cqe>(this->cq_ring, params.cq_off.cqes);
+
+    // no more requests than the submission entries are in flight, so the
+    // completion queue, twice as deep, never overflows
+    this->slots.resize(this->queue_depth);
+    for (u32 i = this->queue_depth; i > 0; i--) {
+        this->free_slots.push_back(i - 1);
+    }
+}
+
+IoUringBlockManager::~IoUringBlockManager() {
+    this->wait_async();
+    munmap(this->sqes, this->sqes_sz);
+    if (this->cq_ring != this->sq_ring) {
+        munmap(this->cq_ring, this->cq_ring_sz);
+    }
+    munmap(this->sq_ring, this->sq_ring_sz);
+    close(this->ring_fd);
+    close(this->fd);
+}
+
+auto IoUringBlockManager::is_supported() -> bool {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    auto fd = io_uring_setup(1, &params);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+auto IoUringBlockManager::write_block(block_id_t block_id,
+                                      const u8 *data) -> ChfsNullResult {
+    if (!this->check_range(block_id)) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, true);
+    auto res = this->submit_and_wait({UringRequest{
+        IORING_OP_WRITE, block_id * this->block_sz, const_cast<u8 *>(data),
+        static_cast<u32>(this->block_sz)}});
+    if (res.is_ok()) {
+        this->mark_dirty(block_id, 1);
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto IoUringBlockManager::write_partial_block(block_id_t block_id,
+                                              const u8 *data, usize offset,
+                                              usize len) -> ChfsNullResult {
+    if (!this->check_range(block_id) || offset + len > this->block_sz) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, true);
+    auto res = this->submit_and_wait(
+        {UringRequest{IORING_OP_WRITE, block_id * this->block_sz + offset,
+                      const_cast<u8 *>(data), static_cast<u32>(len)}});
+    if (res.is_ok()) {
+        this->mark_dirty(block_id, 1);
+        this->record_access(block_id, 1, true);
+    }
+    return res;
+}
+
+auto IoUringBlockManager::read_block(block_id_t block_id,
+                                     u8 *data) -> ChfsNullResult {
+    if (!this->check_range(block_id)) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    auto guard = this->lock_blocks(block_id, 1, false);
+    auto res = this->submit_and_wait(
+        {UringRequest{IORING_OP_READ, block_id * this->block_sz, data,
+                      static_cast<u32>(this->block_sz)}});
+    if (res.is_ok()) {
+        this->record_access(block_id, 1, false);
+    }
+    return res;
+}
+
+auto IoUringBlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
+    if (this->discard_enabled) {
+        this->record_access(block_id, 1, true);
+        return this->discard_blocks({block_id});
+    }
+    return this->write_block(block_id, this->zero_buffer.data());
+}
+
+auto IoUringBlockManager::read_blocks(const std::vector<block_id_t> &block_ids,
+                                      u8 *buffer) -> ChfsNullResult {
+    auto requests = this->runs_to_requests(block_ids, buffer, IORING_OP_READ);
+    if (requests.is_err()) {
+        return ChfsNullResult(requests.unwrap_error());
+    }
+    // the whole batch is in flight at once, so all of it stays locked
+    auto guard = this->lock_blocks(block_ids, false);
+    auto res = this->submit_and_wait(requests.unwrap());
+    if (res.is_ok()) {
+        this->record_access(block_ids, false);
+    }
+    return res;
+}
+
+auto IoUringBlockManager::write_blocks(
+    const std::vector<block_id_t> &block_ids,
+    const u8 *buffer) -> ChfsNullResult {
+    auto requests = this->runs_to_requests(
+        block_ids, const_cast<u8 *>(buffer), IORING_OP_WRITE);
+    if (requests.is_err()) {
+        return ChfsNullResult(requests.unwrap_error());
+    }
+    auto guard = this->lock_blocks(block_ids, true);
+    auto res = this->submit_and_wait(requests.unwrap());
+    if (res.is_ok()) {
+        for (const auto &run : contiguous_runs(block_ids)) {
+            this->mark_dirty(run.start, run.len);
+            this->record_access(run.start, run.len, true);
+        }
+    }
+    return res;
+}
+
+auto IoUringBlockManager::runs_to_requests(
+    const std::vector<block_id_t> &block_ids, u8 *buffer,
+    u8 opcode) -> ChfsResult<std::vector<UringRequest>> {
+    std::vector<UringRequest> requests;
+    for (const auto &run : contiguous_runs(block_ids)) {
+        if (run.start + run.len > this->block_cnt) {
+            return ChfsResult<std::vector<UringRequest>>(
+                ErrorType::INVALID_ARG);
+        }
+        // split long runs, so a huge transfer still spreads over the queue
+        for (usize off = 0; off < run.len; off += KMaxBlocksPerRequest) {
+            auto len = std::min(run.len - off, KMaxBlocksPerRequest);
+            requests.push_back(UringRequest{
+                opcode, (run.start + off) * this->block_sz,
+                buffer + static_cast<u64>(run.idx + off) * this->block_sz,
+                static_cast<u32>(len * this->block_sz)});
+        }
+    }
+    return ChfsResult<std::vector<UringRequest>>(requests);
+}
+
+auto IoUringBlockManager::submit_and_wait(std::vector<UringRequest> requests)
+    -> ChfsNullResult {
+    UringBatch batch;
+    batch.requests = std::move(requests);
+
+    std::unique_lock<std::mutex> lock(this->ring_mtx);
+    while (true) {
+        if (this->broken) {
+            // the requests left, if any, were orphaned in the ring
+            return ChfsNullResult(ErrorType::INVALID);
+        }
+        const usize in_use = this->slots.size() - this->free_slots.size();
+        if (this->polling && in_use == 0) {
+            this->polling = false;
+        }
+        if (!batch.failed && !this->polling) {
+            this->submit_batch(batch);
+        }
+        if ((batch.failed || batch.next == batch.requests.size()) &&
+            batch.inflight == 0) {
+            break;
+        }
+
+        if (batch.retries > 0 && batch.inflight == 0) {
+            // short of resources, back off before submitting again
+            lock.unlock();
+            std::this_thread::sleep_for(KUringPollInterval * batch.retries);
+            lock.lock();
+            continue;
+        }
+        if (this->reaping) {
+            // another call waits on the ring and hands our completions out
+            this->ring_cv.wait(lock);
+            continue;
+        }
+        if (this->slots.size() == this->free_slots.size()) {
+            continue;
+        }
+
+        // wait for completions on behalf of all the calls
+        this->reaping = true;
+        const bool poll = this->polling;
+        lock.unlock();
+        int err = 0;
+        if (poll) {
+            std::this_thread::sleep_for(KUringPollInterval);
+        } else if (io_uring_enter(this->ring_fd, 0, 1,
+                                  IORING_ENTER_GETEVENTS) < 0) {
+            err = errno;
+            if (err == EAGAIN || err == EBUSY) {
+                std::this_thread::sleep_for(KUringPollInterval);
+            }
+        }
+        lock.lock();
+        this->reaping = false;
+
+        if (err != 0 && err != EINTR && err != EAGAIN && err != EBUSY) {
+            std::cerr << "io_uring_enter failed: " << strerror(err)
+                      << std::endl;
+            batch.failed = true;
+            if (!this->polling) {
+                this->polling = true;
+                this->drain_deadline =
+                    std::chrono::steady_clock::now() + KUringDrainTimeout;
+            }
+        }
+        this->reap_completions();
+        const usize left = this->slots.size() - this->free_slots.size();
+        if (this->polling && left > 0 &&
+            std::chrono::steady_clock::now() > this->drain_deadline) {
+            // the requests left may still use the buffers of their calls,
+            // so the ring cannot be used anymore
+            std::cerr << "io_uring: " << left << " requests never completed"
+                      << std::endl;
+            this->broken = true;
+            for (auto &slot : this->slots) {
+                slot.batch = nullptr;
+            }
+        }
+        this->ring_cv.notify_all();
+    }
+
+    if (batch.failed) {
+        return ChfsNullResult(ErrorType::INVALID);
+    }
+    return KNullOk;
+}
+
+auto IoUringBlockManager::submit_batch(UringBatch &batch) -> void {
+    std::vector<u32> taken;
+    u32 tail = *this->sq_tail;
+    while (batch.next + taken.size() < batch.requests.size() &&
+           !this->free_slots.empty()) {
+        const usize req_idx = batch.next + taken.size();
+        const auto &req = batch.requests[req_idx];
+        const u32 slot = this->free_slots.back();
+        this->free_slots.pop_back();
+        this->slots[slot] = UringSlot{&batch, req_idx};
+        taken.push_back(slot);
+
+        auto idx = tail & *this->sq_mask;
+        auto sqe = &this->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = req.opcode;
+        sqe->fd = this->fd;
+        sqe->off = req.offset;
+        sqe->addr = reinterpret_cast<u64>(req.buf);
+        sqe->len = req.len;
+        sqe->user_data = slot;
+        this->sq_array[idx] = idx;
+        tail += 1;
+    }
+    if (taken.empty()) {
+        return;
+    }
+
+    __atomic_store_n(this->sq_tail, tail, __ATOMIC_RELEASE);
+    const u32 queued = taken.size();
+    auto ret = io_uring_enter(this->ring_fd, queued, 0, 0);
+    const int err = ret < 0 ? errno : 0;
+
+    // only the requests taken by the kernel stay in the ring, so no request
+    // outlives its call
+    const u32 submitted = ret < 0 ? 0 : static_cast<u32>(ret);
+    if (submitted < queued) {
+        __atomic_store_n(this->sq_tail,
+                         __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+        for (u32 i = queued; i > submitted; i--) {
+            this->free_slots.push_back(taken[i - 1]);
+        }
+    }
+    if (submitted > 0) {
+        if (batch.inflight == 0) {
+            this->inflight_calls += 1;
+            this->peak_inflight_calls =
+                std::max(this->peak_inflight_calls, this->inflight_calls);
+        }
+        batch.next += submitted;
+        batch.inflight += submitted;
+        batch.retries = 0;
+    } else if ((ret >= 0 || err == EINTR || err == EAGAIN || err == EBUSY) &&
+               batch.retries < KUringEnterRetries) {
+        // short of resources or completion slots, which the reaping may free
+        batch.retries += 1;
+    } else {
+        std::cerr << "io_uring_enter failed: "
+                  << strerror(ret < 0 ? err : EAGAIN) << std::endl;
+        batch.failed = true;
+    }
+}
+
+auto IoUringBlockManager::reap_completions() -> void {
+    u32 head = *this->cq_head;
+    const u32 tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        auto cqe = &this->cqes[head & *this->cq_mask];
+        const auto slot = static_cast<u32>(cqe->user_data);
+        const auto res = cqe->res;
+        head += 1;
+        this->free_slots.push_back(slot);
+        auto *batch = this->slots[slot].batch;
+        if (batch == nullptr) {
+            // orphaned once the ring broke
+            continue;
+        }
+
+        batch->inflight -= 1;
+        if (batch->inflight == 0) {
+            this->inflight_calls -= 1;
+        }
+        auto req = batch->requests[this->slots[slot].req_idx];
+        if (res < 0 || (res == 0 && req.len > 0)) {
+            std::cerr << "io_uring request failed: "
+                      << strerror(res < 0 ? -res : EIO) << std::endl;
+            batch->failed = true;
+        } else if (static_cast<u32>(res) < req.len) {
+            // a short transfer, resubmit the rest
+            req.offset += res;
+            req.buf += res;
+            req.len -= res;
+            batch->requests.push_back(req);
+        }
+    }
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+}
+
+} // namespace chfs
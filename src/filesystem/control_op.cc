@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "filesystem/operations.h"
 #include "metadata/superblock.h"
 
@@ -10,7 +12,9 @@ FileOperation::FileOperation(std::shared_ptr<BlockManager> bm,
       block_allocator_(std::shared_ptr<BlockAllocator>(
           new BlockAllocator(bm, inode_manager_->get_reserved_blocks()))) {
   // now initialize the superblock
-  SuperBlock(bm, inode_manager_->get_max_inode_supported()).flush(0).unwrap();
+  auto superblock = SuperBlock(bm, inode_manager_->get_max_inode_supported());
+  superblock.set_nbitmap_blocks(block_allocator_->total_bitmap_block());
+  superblock.flush(0).unwrap();
 }
 
 auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
@@ -31,11 +35,18 @@ auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
   }
 
   auto reserved_block_num = inode_manager_res.unwrap().get_reserved_blocks();
+  // 3. create the block allocator, whose bitmap may have been extended
+  auto nbitmap_blocks = superblock_res.unwrap()->get_nbitmap_blocks();
+  auto allocator =
+      nbitmap_blocks == 0
+          ? std::shared_ptr<BlockAllocator>(
+                new BlockAllocator(bm, reserved_block_num, false))
+          : BlockAllocator::create_from_existing(bm, reserved_block_num,
+                                                 nbitmap_blocks);
   return ChfsResult<std::shared_ptr<FileOperation>>(
       std::shared_ptr<FileOperation>(new FileOperation(
           bm, InodeManager::to_shared_ptr(inode_manager_res.unwrap()),
-          std::shared_ptr<BlockAllocator>(
-              new BlockAllocator(bm, reserved_block_num, false)))));
+          allocator)));
 }
 
 auto FileOperation::get_free_inode_num() const -> ChfsResult<u64> {
@@ -46,6 +57,97 @@ auto FileOperation::get_free_blocks_num() const -> ChfsResult<u64> {
   return ChfsResult<u64>(block_allocator_->free_block_cnt());
 }
 
+auto FileOperation::sync() -> ChfsNullResult {
+  return block_manager_->sync();
+}
+
+auto FileOperation::grow(u64 new_block_cnt) -> ChfsNullResult {
+  auto res = block_manager_->grow(new_block_cnt);
+  if (res.is_err()) {
+    return res;
+  }
+  res = block_allocator_->grow(block_manager_->total_blocks());
+  if (res.is_err()) {
+    return res;
+  }
+
+  auto superblock_res = SuperBlock::create_from_existing(block_manager_, 0);
+  if (superblock_res.is_err()) {
+    return ChfsNullResult(superblock_res.unwrap_error());
+  }
+  auto superblock = superblock_res.unwrap();
+  superblock->set_nblocks(block_manager_->total_blocks());
+  if (superblock->get_nbitmap_blocks() == 0) {
+    // an image created before growth was supported
+    superblock->set_nbitmap_blocks(block_allocator_->base_bitmap_block());
+  }
+  return superblock->flush(0);
+}
+
+auto FileOperation::access_heatmap() const -> std::vector<BlockRegionStats> {
+  auto counts = block_manager_->access_stats();
+  if (counts.empty()) {
+    return {};
+  }
+
+  const block_id_t table_start = 1;
+  const block_id_t inode_bitmap_start =
+      table_start + inode_manager_->n_table_blocks;
+  const block_id_t block_bitmap_start = inode_manager_->get_reserved_blocks();
+  const block_id_t data_start =
+      block_bitmap_start + block_allocator_->base_bitmap_block();
+  std::vector<BlockRegionStats> regions = {
+      {"superblock", 0, table_start, 0, 0},
+      {"inode table", table_start, inode_bitmap_start, 0, 0},
+      {"inode bitmap", inode_bitmap_start, block_bitmap_start, 0, 0},
+      {"block bitmap", block_bitmap_start, data_start, 0, 0},
+      {"data", data_start, counts.size(), 0, 0},
+  };
+  for (auto &region : regions) {
+    for (auto i = region.start; i < region.end; i++) {
+      region.reads += counts[i].reads;
+      region.writes += counts[i].writes;
+    }
+  }
+  return regions;
+}
+
+auto FileOperation::dump_access_heatmap(std::ostream &os, usize top) const
+    -> void {
+  auto regions = access_heatmap();
+  if (regions.empty()) {
+    os << "access counting is disabled" << std::endl;
+    return;
+  }
+  for (const auto &region : regions) {
+    os << region.name << " [" << region.start << ", " << region.end
+       << "): " << region.reads << " reads, " << region.writes << " writes"
+       << std::endl;
+  }
+
+  auto counts = block_manager_->access_stats();
+  std::vector<block_id_t> ids;
+  for (block_id_t i = 0; i < counts.size(); i++) {
+    if (counts[i].reads + counts[i].writes > 0) {
+      ids.push_back(i);
+    }
+  }
+  top = std::min<usize>(top, ids.size());
+  std::partial_sort(ids.begin(), ids.begin() + top, ids.end(),
+                    [&counts](block_id_t a, block_id_t b) {
+                      return counts[a].reads + counts[a].writes >
+                             counts[b].reads + counts[b].writes;
+                    });
+  for (usize i = 0; i < top; i++) {
+    auto id = ids[i];
+    auto region = std::find_if(
+        regions.begin(), regions.end(),
+        [id](const BlockRegionStats &r) { return id < r.end; });
+    os << "block " << id << " (" << region->name << "): " << counts[id].reads
+       << " reads, " << counts[id].writes << " writes" << std::endl;
+  }
+}
+
 auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
   auto error_code = ErrorType::DONE;
   const auto block_size = this->block_manager_->block_size();
@@ -71,10 +173,11 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
 
   if (inode_p->blocks[inode_p->get_direct_block_num()] != KInvalidBlockID) {
     // we still need to release the indirect block
-    std::vector<u8> indirect_block;
-    auto read_res = this->block_manager_->read_block(
-        inode_p->blocks[inode_p->get_direct_block_num()],
-        indirect_block.data());
+    const auto indirect_block_id =
+        inode_p->blocks[inode_p->get_direct_block_num()];
+    std::vector<u8> indirect_block(block_size);
+    auto read_res = this->block_manager_->read_block(indirect_block_id,
+                                                     indirect_block.data());
     if (read_res.is_err()) {
       error_code = read_res.unwrap_error();
       goto err_ret;
@@ -89,6 +192,7 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
         free_set.push_back(block_p[i]);
       }
     }
+    free_set.push_back(indirect_block_id);
   }
 
   // First we free the inode
@@ -101,9 +205,9 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
     free_set.push_back(inode_res.unwrap());
   }
 
-  // now free the blocks
-  for (auto bid : free_set) {
-    auto res = this->block_allocator_->deallocate(bid);
+  // now free the blocks, in one go so each bitmap block is written once
+  {
+    auto res = this->block_allocator_->deallocate(free_set);
     if (res.is_err()) {
       return res;
     }
@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cstring>
 #include <ctime>
 #include <iostream>
 #include <ostream>
+#include <unordered_set>
 #include <vector>
 
 #include "common/config.h"
@@ -113,45 +115,64 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
 
     if (new_block_num > inlined_blocks_num ||
         old_block_num > inlined_blocks_num) {
-        auto indirect_block_id =
-            inode_p->get_or_insert_indirect_block(block_allocator_);
-        if (indirect_block_id.is_err()) {
-            error_code = indirect_block_id.unwrap_error();
-            goto err_ret;
-        }
         indirect_block.resize(block_size);
-        block_manager_->read_block(indirect_block_id.unwrap(),
-                                   indirect_block.data());
+        if (old_block_num > inlined_blocks_num) {
+            // a new indirect block is allocated after the data blocks
+            block_manager_->read_block(inode_p->get_indirect_block_id(),
+                                       indirect_block.data());
+        }
     }
 
     if (new_block_num > old_block_num) {
         // If we need to allocate more blocks.
-        for (usize idx = old_block_num; idx < new_block_num; ++idx) {
-
-            // TODO: Implement the case of allocating more blocks.
-            // 1. Allocate a block.
-            // 2. Fill the allocated block id to the inode.
-            //    You should pay attention to the case of indirect block.
-            //    You may use function `get_or_insert_indirect_block`
-            //    in the case of indirect block.
-            // UNIMPLEMENTED();
-            // ATTENTION assume there is only one level of indirect block
-            auto res = block_allocator_->allocate();
+        // ATTENTION assume there is only one level of indirect block
+        auto block_at = [&](usize idx) -> block_id_t {
+            if (inode_p->is_direct_block(idx)) {
+                return inode_p->get_block_direct(idx);
+            }
+            return reinterpret_cast<block_id_t *>(
+                indirect_block.data())[idx - inlined_blocks_num];
+        };
+
+        // allocate contiguous extents, going on after the last block of the
+        // file if possible, so the file is laid out sequentially
+        block_id_t goal =
+            old_block_num > 0 ? block_at(old_block_num - 1) + 1 : 0;
+        usize idx = old_block_num;
+        while (idx < new_block_num) {
+            auto res = block_allocator_->allocate_extent(
+                1, new_block_num - idx, goal);
             if (res.is_err()) {
                 error_code = res.unwrap_error();
                 goto err_ret;
             }
-            block_id_t alloc_bid = res.unwrap();
-            std::cout << "alloc id: " << alloc_bid << std::endl;
-            if (inode_p->is_direct_block(idx)) {
-                inode_p->set_block_direct(idx, alloc_bid);
-            } else {
+            auto [start, len] = res.unwrap();
+            std::cout << "alloc extent: " << start << " +" << len
+                      << std::endl;
+            for (block_id_t alloc_bid = start; alloc_bid < start + len;
+                 ++alloc_bid, ++idx) {
+                if (inode_p->is_direct_block(idx)) {
+                    inode_p->set_block_direct(idx, alloc_bid);
+                } else {
+
+                    CHFS_ASSERT(idx >= inlined_blocks_num, "Invalid index");
+                    // ATTENTION: indirect block is not inode
+                    memcpy(indirect_block.data() +
+                               (idx - inlined_blocks_num) * sizeof(block_id_t),
+                           &alloc_bid, sizeof(block_id_t));
+                }
+            }
+            goal = start + len;
+        }
 
-                CHFS_ASSERT(idx >= inlined_blocks_num, "Invalid index");
-                // ATTENTION: indirect block is not inode
-                memcpy(indirect_block.data() +
-                           (idx - inlined_blocks_num) * sizeof(block_id_t),
-                       &alloc_bid, sizeof(block_id_t));
+        if (new_block_num > inlined_blocks_num) {
+            // allocated after the data blocks, so it does not split the
+            // extent following the file
+            auto indirect_block_id =
+                inode_p->get_or_insert_indirect_block(block_allocator_);
+            if (indirect_block_id.is_err()) {
+                error_code = indirect_block_id.unwrap_error();
+                goto err_ret;
             }
         }
 
@@ -214,21 +235,17 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
     inode_p->inner_attr.mtime = time(0);
 
     {
-        auto block_idx = 0;
-        u64 write_sz = 0;
-
-        while (write_sz < content.size()) {
-            auto sz = (content.size() > write_sz + block_size)
-                          ? block_size
-                          : (content.size() - write_sz);
-            std::vector<u8> buffer(block_size);
-            memcpy(buffer.data(), content.data() + write_sz, sz);
+        // collect the blocks to write, so the full blocks are written in one
+        // batch and only the tail block needs a padded copy
+        std::vector<block_id_t> block_ids;
+        block_ids.reserve(new_block_num);
+        for (usize block_idx = 0; block_idx < new_block_num; ++block_idx) {
             block_id_t cur_block_id = 0;
             if (inode_p->is_direct_block(block_idx)) {
 
                 // TODO: Implement getting block id of current direct block.
                 // UNIMPLEMENTED();
-                CHFS_ASSERT(block_idx < inlined_blocks_num && block_idx >= 0,
+                CHFS_ASSERT(block_idx < inlined_blocks_num,
                             "Invalid index in write_file");
                 cur_block_id = inode_p->get_block_direct(block_idx);
             } else {
@@ -242,18 +259,66 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
                 cur_block_id = (reinterpret_cast<block_id_t *>(
                     indirect_block.data()))[block_idx - inlined_blocks_num];
             }
+            block_ids.push_back(cur_block_id);
+        }
 
+        if (this->dedup_ != nullptr) {
+            std::vector<u8> buffer(block_size);
+            for (usize block_idx = 0; block_idx < block_ids.size();
+                 ++block_idx) {
+                const u64 write_sz = static_cast<u64>(block_idx) * block_size;
+                const u64 len =
+                    std::min<u64>(block_size, content.size() - write_sz);
+                memcpy(buffer.data(), content.data() + write_sz, len);
+                memset(buffer.data() + len, 0, block_size - len);
+
+                auto dedup_res =
+                    this->dedup_write_block(block_ids[block_idx], buffer.data());
+                if (dedup_res.is_err()) {
+                    error_code = dedup_res.unwrap_error();
+                    goto err_ret;
+                }
+                const auto bid = dedup_res.unwrap();
+                if (bid == block_ids[block_idx]) {
+                    continue;
+                }
+                if (inode_p->is_direct_block(block_idx)) {
+                    inode_p->set_block_direct(block_idx, bid);
+                } else {
+                    reinterpret_cast<block_id_t *>(
+                        indirect_block.data())[block_idx - inlined_blocks_num] =
+                        bid;
+                }
+            }
+        } else {
             // TODO: Write to current block.
             // UNIMPLEMENTED();
+            const auto full_block_num = content.size() / block_size;
+            std::vector<block_id_t> tail_id;
+            if (full_block_num < block_ids.size()) {
+                tail_id.push_back(block_ids.back());
+                block_ids.pop_back();
+            }
+
             auto write_res =
-                block_manager_->write_block(cur_block_id, buffer.data());
+                block_manager_->write_blocks(block_ids, content.data());
             if (write_res.is_err()) {
                 error_code = write_res.unwrap_error();
                 goto err_ret;
             }
 
-            write_sz += sz;
-            block_idx += 1;
+            if (!tail_id.empty()) {
+                const u64 write_sz = full_block_num * block_size;
+                std::vector<u8> buffer(block_size);
+                memcpy(buffer.data(), content.data() + write_sz,
+                       content.size() - write_sz);
+                write_res =
+                    block_manager_->write_block(tail_id[0], buffer.data());
+                if (write_res.is_err()) {
+                    error_code = write_res.unwrap_error();
+                    goto err_ret;
+                }
+            }
         }
     }
 
@@ -288,6 +353,119 @@ err_ret:
     return ChfsNullResult(error_code);
 }
 
+auto FileOperation::dedup_write_block(block_id_t block_id, const u8 *data)
+    -> ChfsResult<block_id_t> {
+    const auto block_size = this->block_manager_->block_size();
+    const auto fingerprint = DedupIndex::fingerprint(data, block_size);
+
+    auto hit = this->dedup_->lookup(fingerprint);
+    if (hit && hit.value() == block_id) {
+        // the block already holds the content
+        return ChfsResult<block_id_t>(block_id);
+    }
+    if (hit) {
+        // the fingerprints may collide, so compare the contents
+        std::vector<u8> buffer(block_size);
+        auto read_res =
+            this->block_manager_->read_block(hit.value(), buffer.data());
+        if (read_res.is_ok() &&
+            memcmp(buffer.data(), data, block_size) == 0) {
+            this->dedup_->add_ref(hit.value());
+            auto res = this->block_allocator_->deallocate(block_id);
+            if (res.is_err()) {
+                // the block keeps its content, so drop the new reference
+                this->dedup_->release(hit.value());
+                return ChfsResult<block_id_t>(res.unwrap_error());
+            }
+            return ChfsResult<block_id_t>(hit.value());
+        }
+    }
+
+    // no identical block, copy the block first if it is shared
+    block_id_t target = block_id;
+    if (this->dedup_->ref_count(block_id) > 1) {
+        auto alloc_res = this->block_allocator_->allocate();
+        if (alloc_res.is_err()) {
+            return alloc_res;
+        }
+        target = alloc_res.unwrap();
+    } else {
+        this->dedup_->forget(block_id);
+    }
+
+    auto res = this->block_manager_->write_block(target, data);
+    if (res.is_err()) {
+        if (target != block_id) {
+            this->block_allocator_->deallocate(target);
+        }
+        return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+    if (target != block_id) {
+        // drop the reference of this file to the shared block
+        res = this->block_allocator_->deallocate(block_id);
+        if (res.is_err()) {
+            return ChfsResult<block_id_t>(res.unwrap_error());
+        }
+    }
+    this->dedup_->insert(fingerprint, target);
+    return ChfsResult<block_id_t>(target);
+}
+
+auto FileOperation::enable_dedup(usize max_entries) -> ChfsNullResult {
+    auto dedup = std::make_shared<DedupIndex>(max_entries);
+    const auto block_size = this->block_manager_->block_size();
+
+    // count the references to each data block, as the blocks may have been
+    // shared before the filesystem is remounted
+    std::vector<u8> inode(block_size);
+    std::vector<u8> indirect_block(block_size);
+    std::unordered_set<block_id_t> referenced;
+    auto inode_p = reinterpret_cast<Inode *>(inode.data());
+    for (inode_id_t id = 1; id <= inode_manager_->get_max_inode_supported();
+         ++id) {
+        auto bid_res = this->inode_manager_->get(id);
+        if (bid_res.is_err()) {
+            return ChfsNullResult(bid_res.unwrap_error());
+        }
+        if (bid_res.unwrap() == KInvalidBlockID) {
+            continue;
+        }
+        auto inode_res = this->inode_manager_->read_inode(id, inode);
+        if (inode_res.is_err()) {
+            return ChfsNullResult(inode_res.unwrap_error());
+        }
+
+        const auto block_num =
+            calculate_block_sz(inode_p->get_size(), block_size);
+        const auto inlined_blocks_num = inode_p->get_direct_block_num();
+        if (block_num > inlined_blocks_num) {
+            auto read_res = this->block_manager_->read_block(
+                inode_p->get_indirect_block_id(), indirect_block.data());
+            if (read_res.is_err()) {
+                return read_res;
+            }
+        }
+        for (usize idx = 0; idx < block_num; ++idx) {
+            const auto bid =
+                inode_p->is_direct_block(idx)
+                    ? inode_p->get_block_direct(idx)
+                    : reinterpret_cast<block_id_t *>(
+                          indirect_block.data())[idx - inlined_blocks_num];
+            if (bid == KInvalidBlockID) {
+                continue;
+            }
+            // the first reference is implied by the allocation
+            if (!referenced.insert(bid).second) {
+                dedup->add_ref(bid);
+            }
+        }
+    }
+
+    this->dedup_ = dedup;
+    this->block_allocator_->set_dedup(dedup);
+    return KNullOk;
+}
+
 // {Your code here}
 auto FileOperation::read_file(inode_id_t id) -> ChfsResult<std::vector<u8>> {
     auto error_code = ErrorType::DONE;
@@ -334,39 +512,40 @@ auto FileOperation::read_file(inode_id_t id) -> ChfsResult<std::vector<u8>> {
     // ATTENTION: need reserve little more space(1 block size upperbound)
     content.resize(((file_sz + block_size - 1) / block_size) * block_size);
     // Now read the file
-    while (read_sz < file_sz) {
-        auto sz = ((inode_p->get_size() - read_sz) > block_size)
-                      ? block_size
-                      : (inode_p->get_size() - read_sz);
-        std::vector<u8> buffer(block_size);
-        block_id_t cur_block_id = 0;
-        // Get current block id.
-        if (inode_p->is_direct_block(read_sz / block_size)) {
-            // TODO: Implement the case of direct block.
-            // UNIMPLEMENTED();
-            cur_block_id = inode_p->get_block_direct(read_sz / block_size);
+    {
+        std::vector<block_id_t> block_ids;
+        block_ids.reserve(content.size() / block_size);
+        for (u64 block_idx = 0; read_sz < file_sz;
+             ++block_idx, read_sz += block_size) {
+            block_id_t cur_block_id = 0;
+            // Get current block id.
+            if (inode_p->is_direct_block(block_idx)) {
+                // TODO: Implement the case of direct block.
+                // UNIMPLEMENTED();
+                cur_block_id = inode_p->get_block_direct(block_idx);
 
-        } else {
-            // TODO: Implement the case of indirect block.
-            // UNIMPLEMENTED();
-            CHFS_ASSERT(indirect_block.size() == block_size,
-                        "indirect block should not be empty");
-            CHFS_ASSERT(read_sz / block_size - inline_blocks_num >= 0,
-                        "invalid index");
-            memcpy(&cur_block_id,
-                   indirect_block.data() +
-                       (read_sz / block_size - inline_blocks_num) *
-                           sizeof(block_id_t),
-                   sizeof(block_id_t));
-            CHFS_ASSERT(cur_block_id != 0, "cur_block_id should not be 0");
-
-            // std::cout << cur_block_id << std::endl;
+            } else {
+                // TODO: Implement the case of indirect block.
+                // UNIMPLEMENTED();
+                CHFS_ASSERT(indirect_block.size() == block_size,
+                            "indirect block should not be empty");
+                CHFS_ASSERT(block_idx >= inline_blocks_num, "invalid index");
+                memcpy(&cur_block_id,
+                       indirect_block.data() +
+                           (block_idx - inline_blocks_num) * sizeof(block_id_t),
+                       sizeof(block_id_t));
+                CHFS_ASSERT(cur_block_id != 0, "cur_block_id should not be 0");
+            }
+            block_ids.push_back(cur_block_id);
         }
 
         // TODO: Read from current block and store to `content`.
-        block_manager_->read_block(cur_block_id, content.data() + read_sz);
         // UNIMPLEMENTED();
-        read_sz += sz;
+        auto res = block_manager_->read_blocks(block_ids, content.data());
+        if (res.is_err()) {
+            error_code = res.unwrap_error();
+            goto err_ret;
+        }
     }
     content.resize(file_sz);
 
@@ -378,14 +557,58 @@ err_ret:
 
 auto FileOperation::read_file_w_off(inode_id_t id, u64 sz,
                                     u64 offset) -> ChfsResult<std::vector<u8>> {
-    auto res = read_file(id);
+    const auto block_size = this->block_manager_->block_size();
+
+    auto blocks_res = this->get_file_blocks(id);
+    if (blocks_res.is_err()) {
+        return ChfsResult<std::vector<u8>>(blocks_res.unwrap_error());
+    }
+    auto [file_sz, block_ids] = blocks_res.unwrap();
+    if (offset >= file_sz || sz == 0) {
+        return ChfsResult<std::vector<u8>>(std::vector<u8>());
+    }
+    sz = std::min(sz, file_sz - offset);
+
+    // only read the blocks covering the range
+    const u64 first = offset / block_size;
+    const u64 last = (offset + sz + block_size - 1) / block_size;
+    this->readahead(id, block_ids, first, last);
+
+    std::vector<block_id_t> range(block_ids.begin() + first,
+                                  block_ids.begin() + last);
+    std::vector<u8> content((last - first) * block_size);
+    auto res = this->block_manager_->read_blocks(range, content.data());
     if (res.is_err()) {
-        return res;
+        return ChfsResult<std::vector<u8>>(res.unwrap_error());
     }
 
-    auto content = res.unwrap();
+    const u64 begin = offset - first * block_size;
     return ChfsResult<std::vector<u8>>(std::vector<u8>(
-        content.begin() + offset, content.begin() + offset + sz));
+        content.begin() + begin, content.begin() + begin + sz));
+}
+
+auto FileOperation::readahead(inode_id_t id,
+                              const std::vector<block_id_t> &block_ids,
+                              u64 first, u64 last) -> void {
+    if (!this->readahead_enabled_) {
+        return;
+    }
+
+    auto it = this->readahead_.find(id);
+    if (it == this->readahead_.end()) {
+        if (this->readahead_.size() >= KReadaheadStreams) {
+            // forget an arbitrary stream, it only loses its window
+            this->readahead_.erase(this->readahead_.begin());
+        }
+        it = this->readahead_.emplace(id, ReadaheadWindow()).first;
+    }
+
+    auto [start, end] = it->second.on_read(first, last, block_ids.size());
+    if (start < end) {
+        // prefetching is a hint, a failure only costs the readahead
+        this->block_manager_->prefetch(std::vector<block_id_t>(
+            block_ids.begin() + start, block_ids.begin() + end));
+    }
 }
 
 auto FileOperation::resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr> {
@@ -415,4 +638,61 @@ auto FileOperation::resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr> {
     return ChfsResult<FileAttr>(attr);
 }
 
+auto FileOperation::get_file_blocks(inode_id_t id)
+    -> ChfsResult<std::pair<u64, std::vector<block_id_t>>> {
+    using Res = ChfsResult<std::pair<u64, std::vector<block_id_t>>>;
+    const auto block_size = this->block_manager_->block_size();
+
+    std::vector<u8> inode(block_size);
+    auto inode_p = reinterpret_cast<Inode *>(inode.data());
+    auto inode_res = this->inode_manager_->read_inode(id, inode);
+    if (inode_res.is_err()) {
+        return Res(inode_res.unwrap_error());
+    }
+
+    const u64 file_sz = inode_p->get_size();
+    if (file_sz > inode_p->max_file_sz_supported()) {
+        return Res(ErrorType::OUT_OF_RESOURCE);
+    }
+    const u64 block_num = (file_sz + block_size - 1) / block_size;
+    const u64 inline_blocks_num = inode_p->get_direct_block_num();
+    std::vector<block_id_t> block_ids;
+    block_ids.reserve(block_num);
+    for (u64 i = 0; i < block_num && i < inline_blocks_num; ++i) {
+        block_ids.push_back(inode_p->get_block_direct(i));
+    }
+    if (block_num > inline_blocks_num) {
+        std::vector<u8> indirect_block(block_size);
+        auto res = this->block_manager_->read_block(
+            inode_p->get_indirect_block_id(), indirect_block.data());
+        if (res.is_err()) {
+            return Res(res.unwrap_error());
+        }
+        auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+        for (u64 i = inline_blocks_num; i < block_num; ++i) {
+            block_ids.push_back(indirect_p[i - inline_blocks_num]);
+        }
+    }
+    return Res(std::make_pair(file_sz, std::move(block_ids)));
+}
+
+auto FileOperation::advise(inode_id_t id, AccessHint hint) -> ChfsNullResult {
+    auto blocks_res = this->get_file_blocks(id);
+    if (blocks_res.is_err()) {
+        return ChfsNullResult(blocks_res.unwrap_error());
+    }
+    auto block_ids = blocks_res.unwrap().second;
+
+    // the hints apply to physical ranges, so merge the blocks regardless of
+    // their order in the file
+    std::sort(block_ids.begin(), block_ids.end());
+    for (const auto &run : BlockManager::contiguous_runs(block_ids)) {
+        auto res = this->block_manager_->advise(run.start, run.len, hint);
+        if (res.is_err()) {
+            return res;
+        }
+    }
+    return KNullOk;
+}
+
 } // namespace chfs
@@ -11,8 +11,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
 
+#include "block/dedup.h"
 #include "block/manager.h"
 
 namespace chfs {
@@ -20,10 +27,41 @@ namespace chfs {
 class SuperBlock;
 class InodeManager;
 
+/**
+ * The policy used by the block allocator to choose a free block
+ */
+enum class AllocPolicy : u8 {
+  // the lowest free block
+  FirstFit = 0,
+  // the first free block after the last allocated one, wrapping around
+  NextFit = 1,
+  // the first block of the smallest free run in the fullest bitmap block,
+  // keeping the large free runs for the large files
+  BestFit = 2,
+};
+
 /**
  * BlockManager implements a block allocator to manage blocks of the manager
  * It internally uses bitmap for the management.
- * Note that the block allocator is **not** thread-safe.
+ * Note that the block allocator is **not** thread-safe unless
+ * `set_thread_safe` is called.
+ *
+ * The bitmap is mirrored in memory along with the number of free bits of
+ * each bitmap block, so the allocation skips the full bitmap blocks without
+ * reading them and the free blocks are counted at once. Every change to the
+ * mirror is written through to the block manager, so the bitmap on it is
+ * always up to date. The allocator must thus be the only one writing the
+ * bitmap while it is alive.
+ *
+ * Like the block groups of ext4, each bitmap block and the blocks it tracks
+ * form an allocation group, with its own lock and free count. When
+ * thread-safe, a thread allocates from the group of its CPU first, and from
+ * the next groups with free blocks once that one runs dry, so the threads
+ * mostly take different locks and write different bitmap blocks. The
+ * operations over several groups, e.g., the batch `allocate`, take their
+ * locks in ascending order. `grow` may run concurrently with them: it
+ * excludes them with a resize lock they share, and holds every group lock
+ * while it extends the mirror and the groups.
  *
  * # Example
  *
@@ -33,18 +71,61 @@ class BlockAllocator {
   friend class SuperBlock;
   friend class nodeManager;
 
+  // the bytes of a bitmap block an update changed, to undo it
+  struct BitmapUndo {
+    usize bitmap_idx;
+    usize first_byte;
+    std::vector<u8> old_bytes;
+    // the number of bits changed
+    usize cnt;
+  };
+
+  struct alignas(64) AllocGroup {
+    std::mutex mtx;
+    // the number of free bits of the bitmap block
+    std::atomic<usize> free_cnt{0};
+    // where the next-fit search in the group starts, in bits
+    usize rotor = 0;
+  };
+
 public:
   std::shared_ptr<BlockManager> bm;
 
 protected:
   // The bitmap block is stored at [bitmap_block_id, bitmap_block_id +
-  // bitmap_block_cnt - 1]
+  // base_bitmap_block_cnt - 1]. The bitmap blocks added by `grow` are stored
+  // at the first block they track, see `bitmap_block_location`.
   block_id_t bitmap_block_id;
   block_id_t bitmap_block_cnt;
+  block_id_t base_bitmap_block_cnt;
 
   // number of bits needed in the last bitmap block
   usize last_block_num;
 
+  // whether the freed blocks are discarded on the block manager
+  bool discard_on_free = false;
+
+  // the reference counts of the shared blocks, null unless deduplicating
+  std::shared_ptr<DedupIndex> dedup;
+
+  // the bitmap blocks back to back, the i-th one at [i * block_size,
+  // (i + 1) * block_size)
+  std::vector<u8> bitmap_mirror;
+  // the allocation group of each bitmap block, and their total free count
+  std::vector<std::unique_ptr<AllocGroup>> groups;
+  std::atomic<usize> total_free{0};
+
+  AllocPolicy policy = AllocPolicy::NextFit;
+  // where the next-fit search starts, i.e., after the last allocated block
+  block_id_t rotor = 0;
+
+  // whether the groups are locked, and the lock of the dedup index
+  bool thread_safe = false;
+  std::mutex dedup_mtx;
+  // shared by the operations, exclusive while `grow` resizes the mirror and
+  // the groups
+  std::shared_mutex resize_mtx;
+
 public:
   /**
    * Creates a new block allocator with a block manager.
@@ -68,10 +149,69 @@ public:
   BlockAllocator(std::shared_ptr<BlockManager> bm, usize bitmap_block_id,
                  bool will_initialize = true);
 
+  /**
+   * Creates a block allocator over an initialized bitmap, which may have been
+   * extended by `grow`.
+   *
+   * @param bm the block manager
+   * @param bitmap_block_id the block id of the bitmap
+   * @param base_bitmap_block_cnt the number of the contiguous bitmap blocks,
+   * i.e., those created with the allocator
+   */
+  static auto create_from_existing(std::shared_ptr<BlockManager> bm,
+                                   usize bitmap_block_id,
+                                   usize base_bitmap_block_cnt)
+      -> std::shared_ptr<BlockAllocator>;
+
   auto total_bitmap_block() -> usize { return this->bitmap_block_cnt; }
 
   /**
-   * Count the number of free blocks.
+   * Get the number of the contiguous bitmap blocks
+   */
+  auto base_bitmap_block() const -> usize {
+    return this->base_bitmap_block_cnt;
+  }
+
+  /**
+   * Set whether a deallocated block is discarded on the block manager,
+   * so its storage is released, e.g., from a sparse image file.
+   */
+  auto set_discard_on_free(bool enabled) -> void {
+    this->discard_on_free = enabled;
+  }
+
+  /**
+   * Make `deallocate` respect the reference counts of a dedup index:
+   * a shared block is only freed once its last reference is dropped.
+   */
+  auto set_dedup(std::shared_ptr<DedupIndex> index) -> void {
+    this->dedup = std::move(index);
+  }
+
+  /**
+   * Make the allocator thread-safe or not, see the allocation groups above.
+   * It must not be called while the allocator is in use.
+   */
+  auto set_thread_safe(bool enabled) -> void { this->thread_safe = enabled; }
+
+  auto is_thread_safe() const -> bool { return this->thread_safe; }
+
+  /**
+   * Set the policy to choose the allocated blocks, next-fit by default.
+   * When thread-safe, `allocate` searches the groups by the CPU instead, and
+   * the policy only decides where the search in a group starts: after the
+   * last block allocated from it for next-fit, and at its beginning
+   * otherwise.
+   */
+  auto set_policy(AllocPolicy new_policy) -> void {
+    this->policy = new_policy;
+  }
+
+  auto get_policy() const -> AllocPolicy { return this->policy; }
+
+  /**
+   * Count the number of free blocks, which is kept up to date so it does not
+   * touch the bitmap.
    *
    * @return the number of free blocks
    */
@@ -86,14 +226,204 @@ public:
    */
   auto allocate() -> ChfsResult<block_id_t>;
 
+  /**
+   * Allocate a number of blocks at once, with one write per bitmap block
+   * changed. The free blocks are taken in order from the rotor for next-fit
+   * and from the beginning otherwise, so they may not be contiguous, see
+   * `allocate_extent`.
+   *
+   * @param cnt the number of blocks to allocate
+   *
+   * @return the block ids of the allocated blocks in ascending order.
+   *         OUT_OF_RESOURCE if there are not enough free blocks, in which
+   *         case nothing is allocated.
+   */
+  auto allocate(usize cnt) -> ChfsResult<std::vector<block_id_t>>;
+
+  /**
+   * Allocate a run of contiguous blocks, as long as possible up to
+   * `max_len`.
+   *
+   * The search starts at `goal`, e.g., the block after the last one of a
+   * file, and goes on to the end of the bitmap, then wraps around. It stops
+   * at the first run of `max_len` blocks, or at the longest run of at least
+   * `min_len` blocks once it has gone through a bitmap block past the start.
+   *
+   * When thread-safe, the search goes group by group instead, from the group
+   * of the goal, or from the group of the CPU without one, and locks one
+   * group at a time. As in ext4, the run then ends at the group boundary.
+   *
+   * @param min_len the least number of blocks to allocate
+   * @param max_len the most number of blocks to allocate
+   * @param goal where to start the search, KInvalidBlockID (0) to start where
+   * `allocate` would, i.e., at the rotor for next-fit and at the beginning
+   * otherwise
+   *
+   * @return the first block id and the number of the allocated blocks.
+   *         INVALID_ARG if the lengths are invalid.
+   *         OUT_OF_RESOURCE if there is no run of `min_len` free blocks.
+   */
+  auto allocate_extent(usize min_len, usize max_len, block_id_t goal = 0)
+      -> ChfsResult<std::pair<block_id_t, usize>>;
+
   /**
    * Deallocate a block.
+   * If the block is shared through the dedup index, only one of its
+   * references is dropped.
    * @param block_id the block id to be deallocated.
    *
    * @return INVALID_ARG if the block id is freed.
    *         other error code if there is other error.
    */
   auto deallocate(block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Deallocate a number of blocks at once, with one write per bitmap block
+   * changed, e.g., the blocks of a removed file.
+   * The dedup index is respected as in `deallocate`, so a shared block may
+   * appear several times, but at most once per reference.
+   * @param block_ids the block ids to be deallocated, in any order
+   *
+   * @return INVALID_ARG if any of the blocks cannot be deallocated, in which
+   *         case nothing is deallocated.
+   *         other error code if there is other error.
+   */
+  auto deallocate(const std::vector<block_id_t> &block_ids) -> ChfsNullResult;
+
+  /**
+   * Extend the bitmap to track the blocks of a grown block manager.
+   * The new blocks are free, except that each new bitmap block occupies the
+   * first block it tracks.
+   *
+   * @param new_block_cnt the number of blocks to track, at most the number of
+   * blocks of the block manager
+   *
+   * @return INVALID_ARG if the bitmap would shrink or exceed the manager.
+   */
+  auto grow(usize new_block_cnt) -> ChfsNullResult;
+
+private:
+  /**
+   * Get the block storing the i-th bitmap block
+   */
+  auto bitmap_block_location(usize i) const -> block_id_t;
+
+  /**
+   * Get the number of blocks tracked by the i-th bitmap block
+   */
+  auto tracked_bits(usize i) const -> usize;
+
+  /**
+   * Get the number of blocks tracked by the bitmap
+   */
+  auto tracked_blocks() const -> usize;
+
+  /**
+   * Find the first free block of the i-th bitmap block at or after its bit
+   * `from`
+   */
+  auto find_free_in(usize i, usize from) -> std::optional<block_id_t>;
+
+  /**
+   * Choose a free block with the policy, std::nullopt if there is none
+   */
+  auto first_fit() -> std::optional<block_id_t>;
+  auto next_fit() -> std::optional<block_id_t>;
+  auto best_fit() -> std::optional<block_id_t>;
+
+  /**
+   * Create a group with nothing free for each bitmap block
+   */
+  auto reset_groups() -> void;
+
+  /**
+   * Lock the groups [first, last] in ascending order, if thread-safe
+   */
+  auto lock_groups(usize first, usize last)
+      -> std::vector<std::unique_lock<std::mutex>>;
+
+  /**
+   * Keep the mirror and the groups from being resized, if thread-safe
+   */
+  auto lock_resize() -> std::shared_lock<std::shared_mutex> {
+    return this->thread_safe
+               ? std::shared_lock<std::shared_mutex>(this->resize_mtx)
+               : std::shared_lock<std::shared_mutex>();
+  }
+
+  /**
+   * Lock all the groups, if thread-safe
+   */
+  auto lock_all_groups() -> std::vector<std::unique_lock<std::mutex>> {
+    return this->lock_groups(0, this->bitmap_block_cnt - 1);
+  }
+
+  /**
+   * Get the group the calling thread allocates from first, by its CPU
+   */
+  auto home_group() const -> usize;
+
+  /**
+   * Allocate a block from the group of the calling thread, or from the next
+   * groups if it is full
+   */
+  auto allocate_in_groups() -> ChfsResult<block_id_t>;
+
+  /**
+   * Find the longest free run of at most `max_len` blocks that starts in
+   * [from, to) and ends by `end`, stopping at the first of `max_len` blocks
+   * @return the first block and the length of the run, 0 long if none
+   */
+  auto longest_free_run(usize from, usize to, usize end, usize max_len)
+      -> std::pair<usize, usize>;
+
+  /**
+   * `allocate_extent` for a thread-safe allocator: the run is taken from a
+   * single group, locked alone
+   */
+  auto allocate_extent_in_groups(usize min_len, usize max_len,
+                                 block_id_t goal)
+      -> ChfsResult<std::pair<block_id_t, usize>>;
+
+  /**
+   * Read the bitmap blocks into the mirror and count their free bits
+   */
+  auto load_bitmap() -> ChfsNullResult;
+
+  /**
+   * Set or clear the bit of a block in the mirror, and write the byte holding
+   * it through to the block manager. The mirror is left as is on failure.
+   */
+  auto update_bit(block_id_t block_id, bool used) -> ChfsNullResult;
+
+  /**
+   * Check whether a block can be deallocated, i.e., it is an allocated block
+   * other than those storing the bitmap
+   */
+  auto check_deallocate(block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Set or clear the bits of the sorted blocks, which must all be the
+   * opposite, writing the changed bytes of each bitmap block through at
+   * once. If a bitmap block fails to write, the ones already written are
+   * rolled back, so nothing is changed.
+   */
+  auto update_blocks(const std::vector<block_id_t> &block_ids, bool used)
+      -> ChfsNullResult;
+
+  /**
+   * Set or clear the bits of blocks [start, start + len), which must all be
+   * the opposite, writing the changed bytes of each bitmap block through at
+   * once. If a bitmap block fails to write, the ones already written are
+   * rolled back, so nothing is changed.
+   */
+  auto update_range(block_id_t start, usize len, bool used) -> ChfsNullResult;
+
+  /**
+   * Undo the updates of `used` bits, the last one first, in the mirror, the
+   * free counts and, as far as it can be written, the bitmap
+   */
+  auto roll_back(const std::vector<BitmapUndo> &undo, bool used) -> void;
 };
 
 } // namespace chfs
\ No newline at end of file
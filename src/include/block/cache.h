@@ -0,0 +1,205 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// cache.h
+//
+// Identification: src/include/block/cache.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * The replacement policy used by the block cache
+ */
+enum class CachePolicy {
+  LRU = 0,
+  Clock = 1,
+};
+
+/**
+ * CachedBlockManager is a write-back block cache layered over another block
+ * manager. Since it is also a block manager, it can be passed wherever a
+ * `std::shared_ptr<BlockManager>` is expected.
+ *
+ * Modified blocks are only written to the underlying manager when they are
+ * evicted or when `flush()` is called.
+ * The cache operations are serialized by a single lock, so the cache can
+ * serve the asynchronous I/O workers.
+ *
+ * # Example
+ *
+ * ```
+ * auto bm = std::make_shared<BlockManager>("chfs.db");
+ * auto cached = std::make_shared<CachedBlockManager>(bm, 1024);
+ * auto fs = FileOperation(cached, 4096);
+ * ...
+ * cached->flush();
+ * ```
+ */
+class CachedBlockManager : public BlockManager {
+  friend class FramePin;
+
+  struct Frame {
+    block_id_t block_id;
+    bool valid;
+    bool dirty;
+    // the number of alive pins, a pinned frame is never evicted
+    usize pins;
+    // the reference bit of the CLOCK policy
+    bool referenced;
+    // the position in the LRU list, only meaningful for the LRU policy
+    std::list<usize>::iterator lru_pos;
+  };
+
+  std::shared_ptr<BlockManager> inner;
+  usize capacity;
+  CachePolicy policy;
+
+  // the data of frame i is stored at [i * block_sz, (i + 1) * block_sz)
+  std::vector<u8> frame_data;
+  std::vector<Frame> frames;
+  std::vector<usize> free_frames;
+  std::unordered_map<block_id_t, usize> table;
+
+  // the most recently used frame is at the front
+  std::list<usize> lru;
+  usize clock_hand;
+
+  u64 hits;
+  u64 misses;
+
+  mutable std::mutex mtx;
+
+public:
+  /**
+   * Creates a new cache over a block manager.
+   *
+   * @param inner the block manager to cache
+   * @param capacity the maximum number of blocks kept in the cache
+   * @param policy the replacement policy
+   */
+  CachedBlockManager(std::shared_ptr<BlockManager> inner, usize capacity,
+                     CachePolicy policy = CachePolicy::LRU);
+
+  /**
+   * The dirty blocks are flushed upon destruction.
+   */
+  ~CachedBlockManager() override;
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  /**
+   * With discarding enabled (see `set_discard`), the block is discarded
+   * through `discard_blocks` instead of zeroed in its frame.
+   */
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  /**
+   * Pin the frame caching the block, so the guards view the cached data in
+   * place. The frame is marked dirty when a dirty pin is released.
+   */
+  auto pin_block(block_id_t block_id, bool writable)
+      -> ChfsResult<std::shared_ptr<BlockPin>> override;
+
+  /**
+   * Write all the dirty blocks back to the underlying block manager.
+   * The blocks stay in the cache.
+   */
+  auto flush() -> ChfsNullResult;
+
+  /**
+   * The cached copies of the blocks are dropped without being written back,
+   * then the blocks are discarded on the underlying block manager under
+   * the same lock, so no read in between loads their old content back.
+   */
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  /**
+   * Grow the underlying block manager, the cached blocks stay valid
+   */
+  auto grow(usize new_block_cnt) -> ChfsNullResult override;
+
+  /**
+   * Flush the dirty blocks and then sync the underlying block manager.
+   */
+  auto sync() -> ChfsNullResult override;
+
+  auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult override;
+
+  /**
+   * The hints are about the underlying device, so they are forwarded.
+   */
+  auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult override {
+    return inner->advise(start, cnt, hint);
+  }
+
+  /**
+   * Load the blocks missing from the cache on the I/O workers. At most half
+   * of the frames are filled, so a prefetch does not evict its own blocks.
+   * A prefetched block counts as a miss, and its later reads as hits.
+   */
+  auto prefetch(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  /**
+   * Get the underlying block manager
+   */
+  auto get_inner() const -> std::shared_ptr<BlockManager> { return inner; }
+
+  /**
+   * Statistics of the cache, which the I/O workers may update concurrently
+   */
+  auto hit_count() const -> u64;
+  auto miss_count() const -> u64;
+  auto cached_blocks() const -> usize;
+  auto dirty_blocks() const -> usize;
+
+private:
+  auto frame_ptr(usize frame) -> u8 * {
+    return frame_data.data() + static_cast<u64>(frame) * block_sz;
+  }
+
+  /**
+   * Find the frame caching the block. On a miss, a frame is allocated and
+   * the block is read from the underlying manager if `load` is set.
+   */
+  auto get_frame(block_id_t block_id, bool load) -> ChfsResult<usize>;
+
+  /**
+   * Choose a victim frame by the policy and write it back if it is dirty.
+   */
+  auto evict() -> ChfsResult<usize>;
+
+  /**
+   * Write back and invalidate an unpinned frame so it can be reused.
+   */
+  auto reclaim(usize frame) -> ChfsResult<usize>;
+
+  auto touch(usize frame) -> void;
+
+  auto write_back(usize frame) -> ChfsNullResult;
+};
+
+} // namespace chfs
@@ -0,0 +1,190 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// checksum.h
+//
+// Identification: src/include/block/checksum.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * Compute the CRC32C (Castagnoli) of a buffer.
+ * The SSE4.2 crc32 instruction is used if the CPU supports it, and buffers
+ * of at least 256 bytes are folded with the AVX-512 carry-less
+ * multiplication if that is supported as well, which is about twice as fast.
+ *
+ * @param data the buffer
+ * @param len the length of the buffer
+ * @param crc the checksum of the preceding data, to checksum a buffer in
+ * pieces
+ */
+auto crc32c(const u8 *data, usize len, u32 crc = 0) -> u32;
+
+/**
+ * The table-driven version of `crc32c`, used when there is no hardware
+ * support.
+ */
+auto crc32c_software(const u8 *data, usize len, u32 crc = 0) -> u32;
+
+/**
+ * ChecksumBlockManager is a block manager layered over another one that
+ * keeps a CRC32C checksum per block. The checksum is updated on each write
+ * and verified on each read, and a mismatch fails the read with
+ * `ErrorType::Corrupted`.
+ *
+ * The checksums are stored in a side table at the tail of the underlying
+ * device, so the manager exposes fewer blocks than the device has. The table
+ * is mirrored in memory, and each update is written through to the device,
+ * so a read does no table I/O: it only checksums the block and compares the
+ * result with the mirror.
+ * A zero entry means the checksum is unknown (e.g., the block has never been
+ * written through this layer), and such blocks are not verified.
+ *
+ * A block and its checksum are not updated atomically: the block is written
+ * first, then its table entry. A crash between the two leaves the new data
+ * with the old entry (or the reverse, if the device persisted the table
+ * block first), so the block fails its reads with `ErrorType::Corrupted`
+ * after the restart until it is written again.
+ *
+ * It is made thread-safe with `set_thread_safe`, along with the manager under
+ * it. A block is then locked across its data write and the update of its
+ * checksum, or across its read and verification, and the table is written
+ * back under a lock of its own, so it never goes back to older entries.
+ *
+ * # Example
+ *
+ * ```
+ * auto bm = std::make_shared<BlockManager>("chfs.db");
+ * auto checked = std::make_shared<ChecksumBlockManager>(bm);
+ * auto fs = FileOperation(checked, 4096);
+ * ```
+ */
+class ChecksumBlockManager : public BlockManager {
+  std::shared_ptr<BlockManager> inner;
+  // the number of blocks holding the checksum table
+  usize table_blocks;
+  // the in-memory mirror of the checksum table
+  std::vector<u32> sums;
+  // the checksum entry of a zeroed block
+  u32 zero_sum;
+  // the lock of the mirror entries and their write-back, if thread-safe
+  std::mutex table_mtx;
+
+public:
+  /**
+   * Creates a checksumming manager over a block manager.
+   * The checksum table is loaded from the underlying device.
+   *
+   * @param inner the block manager to store the blocks and the checksums
+   */
+  explicit ChecksumBlockManager(std::shared_ptr<BlockManager> inner);
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  /**
+   * The block is read back to recompute its checksum.
+   */
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  /**
+   * The blocks are read in a single batch and then verified together.
+   */
+  auto read_blocks(const std::vector<block_id_t> &block_ids, u8 *buffer)
+      -> ChfsNullResult override;
+
+  /**
+   * The checksum entries of the batch are written back per table block.
+   */
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override;
+
+  /**
+   * The discarded blocks read as zeros, so their checksums are updated
+   * accordingly.
+   */
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  /**
+   * Grow the underlying block manager and move the checksum table to its
+   * new tail. The blocks that held the old table have unknown checksums.
+   */
+  auto grow(usize new_block_cnt) -> ChfsNullResult override;
+
+  auto sync() -> ChfsNullResult override { return inner->sync(); }
+
+  auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult override;
+
+  auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult override {
+    return inner->advise(start, cnt, hint);
+  }
+
+  /**
+   * Get the underlying block manager
+   */
+  auto get_inner() const -> std::shared_ptr<BlockManager> { return inner; }
+
+  /**
+   * Get the number of blocks of the underlying device used by the table
+   */
+  auto get_table_blocks() const -> usize { return table_blocks; }
+
+private:
+  /**
+   * The entry of a checksum. Zero is reserved for the unknown checksum.
+   */
+  static auto to_entry(u32 crc) -> u32 { return crc == 0 ? ~0u : crc; }
+
+  auto entries_per_block() const -> usize { return block_sz / sizeof(u32); }
+
+  /**
+   * Lock the checksum table if the manager is thread-safe
+   */
+  auto lock_table() -> std::unique_lock<std::mutex> {
+    return is_thread_safe() ? std::unique_lock<std::mutex>(table_mtx)
+                            : std::unique_lock<std::mutex>();
+  }
+
+  /**
+   * Read a block from the device and verify it, with the block locked
+   */
+  auto load_block(block_id_t block_id, u8 *block_data) -> ChfsNullResult;
+
+  /**
+   * Compare a block with its recorded checksum
+   */
+  auto verify(block_id_t block_id, const u8 *block_data) const -> bool;
+
+  /**
+   * Write the entries [start, end) of the mirror to the table on the device
+   */
+  auto store_entries(block_id_t start, block_id_t end) -> ChfsNullResult;
+
+  /**
+   * Write the table blocks holding the entries of the blocks, each once
+   */
+  auto store_table_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult;
+};
+
+} // namespace chfs
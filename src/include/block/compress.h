@@ -0,0 +1,221 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// compress.h
+//
+// Identification: src/include/block/compress.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * Compress a buffer with a byte-oriented LZ77 codec in the spirit of LZ4:
+ * a sequence is a token, its literals and a 2-byte back reference.
+ * The input is skipped over faster as the matches keep failing, so the
+ * incompressible data costs little CPU before the compressor gives up.
+ *
+ * @param src the buffer to compress
+ * @param len the length of the buffer
+ * @param dst the buffer to store the result
+ * @param cap the capacity of `dst`
+ * @return the compressed length, or 0 if it does not fit in `cap` bytes
+ */
+auto lz_compress(const u8 *src, usize len, u8 *dst, usize cap) -> usize;
+
+/**
+ * Decompress the output of `lz_compress`.
+ * The input is fully bounds-checked, so a corrupted one fails with
+ * `ErrorType::Corrupted` instead of overrunning the buffers.
+ *
+ * @param src the compressed buffer
+ * @param len the length of the compressed buffer
+ * @param dst the buffer to store the result
+ * @param cap the capacity of `dst`
+ * @return the decompressed length
+ */
+auto lz_decompress(const u8 *src, usize len, u8 *dst, usize cap)
+    -> ChfsResult<usize>;
+
+/**
+ * Where a logical block is stored on the underlying device.
+ * A physical block is split into `KCompressSlots` slots, and a compressed
+ * block takes the contiguous slots [slot, slot + slot_cnt) of a physical
+ * block. A block that does not compress takes a whole physical block.
+ */
+struct CompressedExtent {
+  u32 physical;
+  u8 slot;
+  // 0 if the block is not stored and reads as zeros
+  u8 slot_cnt;
+  // the compressed length, unused if the block is stored raw
+  u16 len;
+} __attribute__((packed));
+
+const usize KCompressSlots = 8;
+
+/**
+ * CompressedBlockManager is a block manager layered over another one that
+ * compresses each block with `lz_compress` and packs the compressed blocks
+ * into the physical blocks of the underlying device, so a logical block
+ * costs a fraction of a physical one when its data compresses well.
+ *
+ * A block is stored raw, bypassing the decompression on reads, if it does
+ * not fit in `KCompressSlots - 1` slots. Zeroed blocks take no space.
+ *
+ * The remap table from the logical blocks to their extents sits at the tail
+ * of the underlying device, followed by a header recording the number of
+ * logical blocks. The table is mirrored in memory, and each update is
+ * written through to the device after the data, so a block is either at its
+ * old or its new place. It cannot grow.
+ *
+ * # Example
+ *
+ * ```
+ * auto bm = std::make_shared<BlockManager>("chfs.db");
+ * // expose twice as many blocks as the device has, betting on a 2x ratio
+ * auto compressed = std::make_shared<CompressedBlockManager>(
+ *     bm, bm->total_blocks() * 2);
+ * auto fs = FileOperation(compressed, 4096);
+ * ```
+ */
+class CompressedBlockManager : public BlockManager {
+  std::shared_ptr<BlockManager> inner;
+  // the number of physical blocks available to the data
+  usize data_blocks;
+  // the number of blocks holding the remap table
+  usize table_blocks;
+  usize slot_sz;
+
+  // the in-memory mirror of the remap table
+  std::vector<CompressedExtent> extents;
+  // the used slots of each physical data block, one bit per slot
+  std::vector<u8> slot_masks;
+  // where the next extent is searched from
+  block_id_t rotor = 0;
+
+  // buffers of the block being (de)compressed, guarded by `mtx`
+  std::vector<u8> physical_buf;
+  std::vector<u8> compress_buf;
+  std::mutex mtx;
+
+public:
+  /**
+   * Creates a compressing manager over a block manager.
+   * A device formatted by a previous manager keeps its number of logical
+   * blocks, otherwise the header and an empty table are written to it.
+   *
+   * @param inner the block manager to store the blocks and the table
+   * @param block_cnt the number of logical blocks of a new device, by
+   * default as many as it has physical blocks for the data
+   */
+  explicit CompressedBlockManager(std::shared_ptr<BlockManager> inner,
+                                  usize block_cnt = 0);
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  /**
+   * The block is decompressed, patched and compressed again.
+   */
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  /**
+   * The block is unmapped, which releases its slots. A physical block left
+   * without any used slot is discarded if discarding is enabled.
+   */
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  /**
+   * Same as `zero_block` on each block. The physical blocks left without
+   * any used slot are discarded on the underlying device.
+   */
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  auto sync() -> ChfsNullResult override { return inner->sync(); }
+
+  /**
+   * The blocks are scattered over the device, so the whole device is synced.
+   */
+  auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult override;
+
+  /**
+   * The logical blocks are not laid out contiguously, so hints are ignored.
+   */
+  auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult override {
+    return KNullOk;
+  }
+
+  /**
+   * Get the underlying block manager
+   */
+  auto get_inner() const -> std::shared_ptr<BlockManager> { return inner; }
+
+  /**
+   * Get the number of physical blocks holding at least one logical block
+   */
+  auto physical_blocks_used() -> usize;
+
+  /**
+   * Get the extent of a logical block
+   */
+  auto get_extent(block_id_t block_id) -> CompressedExtent;
+
+private:
+  auto is_raw(const CompressedExtent &extent) const -> bool {
+    return extent.slot_cnt == KCompressSlots;
+  }
+
+  /**
+   * Decompress a block. The caller must hold `mtx`.
+   */
+  auto load(block_id_t block_id, u8 *block_data) -> ChfsNullResult;
+
+  /**
+   * Compress a block to a new extent and remap the block to it, releasing
+   * the old one. The caller must hold `mtx`.
+   */
+  auto store(block_id_t block_id, const u8 *block_data) -> ChfsNullResult;
+
+  /**
+   * Unmap the blocks and release their slots, discarding the physical blocks
+   * left without any used slot if `discard` is set. The caller must hold
+   * `mtx`.
+   */
+  auto unmap(const std::vector<block_id_t> &block_ids, bool discard)
+      -> ChfsNullResult;
+
+  /**
+   * Find `slot_cnt` free contiguous slots in a physical block and take them
+   */
+  auto allocate(usize slot_cnt) -> ChfsResult<CompressedExtent>;
+
+  /**
+   * Give the slots of an extent back
+   * @return whether its physical block is left without any used slot
+   */
+  auto release(const CompressedExtent &extent) -> bool;
+
+  /**
+   * Write the entries [start, end) of the mirror to the table on the device
+   */
+  auto store_entries(block_id_t start, block_id_t end) -> ChfsNullResult;
+};
+
+} // namespace chfs
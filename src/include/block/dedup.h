@@ -0,0 +1,102 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// dedup.h
+//
+// Identification: src/include/block/dedup.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <list>
+#include <optional>
+#include <unordered_map>
+
+#include "common/config.h"
+
+namespace chfs {
+
+const usize KDefaultDedupEntries = 4096;
+
+/**
+ * DedupIndex tracks the content of the data blocks so that the blocks with
+ * the same content can be shared.
+ *
+ * It has two parts:
+ * - a fingerprint index from the content hash to a block holding it. It
+ *   lives in memory only and is bounded: the least recently used entries are
+ *   evicted, which only loses the chance to share their blocks.
+ * - the reference counts of the shared blocks, which the block allocator
+ *   consults before freeing a block. They are never evicted.
+ *
+ * Note that it is **not** thread-safe.
+ */
+class DedupIndex {
+  usize capacity;
+  // (fingerprint, block id) in LRU order, the most recent at the front
+  std::list<std::pair<u64, block_id_t>> lru;
+  std::unordered_map<u64, std::list<std::pair<u64, block_id_t>>::iterator>
+      by_fingerprint;
+  std::unordered_map<block_id_t, u64> by_block;
+  // the references beyond the first one of each shared block
+  std::unordered_map<block_id_t, u32> extra_refs;
+
+public:
+  /**
+   * @param capacity the maximum number of fingerprints kept
+   */
+  explicit DedupIndex(usize capacity = KDefaultDedupEntries);
+
+  /**
+   * Hash the content of a block. Equal fingerprints do not guarantee equal
+   * contents, so the blocks must still be compared before being shared.
+   */
+  static auto fingerprint(const u8 *data, usize len) -> u64;
+
+  /**
+   * Find a block with the given fingerprint
+   */
+  auto lookup(u64 fingerprint) -> std::optional<block_id_t>;
+
+  /**
+   * Record that a block holds the content of the fingerprint.
+   * It replaces any previous entry of the fingerprint or the block.
+   */
+  auto insert(u64 fingerprint, block_id_t block_id) -> void;
+
+  /**
+   * Drop the entry of a block, e.g., because its content changes
+   */
+  auto forget(block_id_t block_id) -> void;
+
+  /**
+   * Add a reference to a block
+   */
+  auto add_ref(block_id_t block_id) -> void;
+
+  /**
+   * Drop a reference to a block
+   * @return whether the block is still referenced, i.e., must not be freed
+   */
+  auto release(block_id_t block_id) -> bool;
+
+  /**
+   * Get the number of references to an allocated block
+   */
+  auto ref_count(block_id_t block_id) const -> u32;
+
+  /**
+   * Get the number of fingerprints kept
+   */
+  auto size() const -> usize { return lru.size(); }
+
+  /**
+   * Get the number of blocks referenced more than once
+   */
+  auto shared_block_cnt() const -> usize { return extra_refs.size(); }
+};
+
+} // namespace chfs
@@ -0,0 +1,182 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// direct.h
+//
+// Identification: src/include/block/direct.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * A pool of block-sized buffers aligned for O_DIRECT I/O.
+ * Buffers beyond the capacity are allocated on demand and freed on release.
+ */
+class AlignedBufferPool {
+  usize buffer_sz;
+  usize alignment;
+  usize capacity;
+  std::vector<u8 *> free_buffers;
+  mutable std::mutex mtx;
+
+public:
+  /**
+   * @param buffer_sz the size of each buffer
+   * @param alignment the alignment of each buffer
+   * @param capacity the maximum number of buffers kept in the pool
+   */
+  AlignedBufferPool(usize buffer_sz, usize alignment, usize capacity);
+
+  ~AlignedBufferPool();
+
+  DISALLOW_COPY_AND_MOVE(AlignedBufferPool);
+
+  /**
+   * Get a buffer from the pool
+   */
+  auto acquire() -> u8 *;
+
+  /**
+   * Return a buffer acquired from the pool
+   */
+  auto release(u8 *buffer) -> void;
+
+  auto is_aligned(const u8 *ptr) const -> bool {
+    return reinterpret_cast<uintptr_t>(ptr) % alignment == 0;
+  }
+
+  auto free_cnt() const -> usize {
+    std::lock_guard<std::mutex> lock(mtx);
+    return free_buffers.size();
+  }
+};
+
+// the blocks a DirectBlockManager holds read ahead at once, room for the
+// window being read and the next one
+const usize KMaxPrefetchedBlocks = 2 * KReadaheadMaxBlocks;
+
+/**
+ * DirectBlockManager implements a file-backed block device that bypasses the
+ * page cache. The file is opened with O_DIRECT and accessed with positional
+ * I/O (pread/pwrite), so the device costs no memory beyond the buffer pool
+ * and the caching is left to the layers above, e.g., `CachedBlockManager`.
+ *
+ * Caller buffers that are suitably aligned are used for I/O directly, others
+ * are bounced through the aligned buffer pool.
+ *
+ * As posix_fadvise(2) has no page cache to fill, `prefetch` reads the blocks
+ * ahead itself, on the I/O workers and into buffers of the pool. The next
+ * read of such a block is served from its buffer, unless the block is
+ * written or discarded in between.
+ *
+ * Note that the backing file system must support O_DIRECT (tmpfs, for
+ * example, does not).
+ */
+class DirectBlockManager : public BlockManager {
+  AlignedBufferPool pool;
+  u8 *zero_buffer;
+
+  // a block read ahead, whose buffer is null while the read is in flight;
+  // the ticket tells a read from a later claim of the same block
+  struct Prefetched {
+    u8 *buffer = nullptr;
+    u64 ticket = 0;
+  };
+  std::unordered_map<block_id_t, Prefetched> prefetched;
+  std::mutex prefetch_mtx;
+  u64 prefetch_ticket = 0;
+
+public:
+  /**
+   * Creates a new block manager that writes to a file with direct I/O.
+   *
+   * @param file the file name of the file to write to
+   * @param block_cnt the number of expected blocks in the device. If the
+   * device's blocks are more or less than it, the manager should adjust the
+   * actual block cnt.
+   * @param pool_sz the number of aligned buffers kept in the pool
+   */
+  DirectBlockManager(const std::string &file, usize block_cnt,
+                     usize pool_sz = 16);
+
+  ~DirectBlockManager() override;
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  /**
+   * Each run of contiguous blocks is a single pread when the buffer is
+   * aligned.
+   */
+  auto read_blocks(const std::vector<block_id_t> &block_ids, u8 *buffer)
+      -> ChfsNullResult override;
+
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override;
+
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  /**
+   * Read the blocks ahead on the I/O workers, at most
+   * `KMaxPrefetchedBlocks` at once. The blocks already read ahead are
+   * skipped.
+   */
+  auto prefetch(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  auto get_pool() -> AlignedBufferPool & { return pool; }
+
+  /**
+   * Get the number of blocks read ahead, or being read, and not consumed
+   */
+  auto prefetched_cnt() -> usize {
+    std::lock_guard<std::mutex> lock(prefetch_mtx);
+    return prefetched.size();
+  }
+
+private:
+  auto pread_full(u8 *buffer, u64 len, u64 offset) -> ChfsNullResult;
+  auto pwrite_full(const u8 *buffer, u64 len, u64 offset) -> ChfsNullResult;
+
+  /**
+   * Read blocks [start, start + cnt) claimed by `prefetch` with `ticket`
+   * into buffers of the pool
+   */
+  auto read_ahead(block_id_t start, usize cnt, u64 ticket) -> void;
+
+  /**
+   * Copy the blocks of [start, start + cnt) that are read ahead to `data`,
+   * consuming them
+   *
+   * @return which blocks are copied, empty if none is
+   */
+  auto take_prefetched(block_id_t start, usize cnt,
+                       u8 *data) -> std::vector<bool>;
+
+  /**
+   * Drop the blocks of [start, start + cnt) read ahead, as they are written
+   */
+  auto drop_prefetched(block_id_t start, usize cnt) -> void;
+};
+
+} // namespace chfs
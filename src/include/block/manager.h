@@ -11,32 +11,249 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <vector>
 
+#include "block/readahead.h"
 #include "common/config.h"
 #include "common/macros.h"
 #include "common/result.h"
+#include "common/thread_pool.h"
 
 namespace chfs {
 // TODO
 
 class BlockIterator;
+class BlockReadGuard;
+class BlockWriteGuard;
+
+/**
+ * A run of physically contiguous blocks in a batch of block ids:
+ * block_ids[idx, idx + len) == [start, start + len)
+ */
+struct BlockRun {
+  usize idx;
+  block_id_t start;
+  usize len;
+};
+
+/**
+ * Access patterns a block manager can be told about, mapped to madvise(2)
+ * on memory-mapped devices and posix_fadvise(2) on file-backed ones.
+ */
+enum class AccessHint : u8 {
+  Normal = 0,
+  Sequential = 1,
+  Random = 2,
+  WillNeed = 3,
+};
+
+/**
+ * Where the pages of an in-memory device are placed on a NUMA machine
+ */
+enum class NumaPolicy : u8 {
+  // the default policy of the process, usually the node of the first touch
+  Default = 0,
+  // spread the pages round-robin over all the nodes (MPOL_INTERLEAVE)
+  Interleave = 1,
+  // place each page on the node of the thread faulting it (MPOL_LOCAL)
+  Local = 2,
+};
+
+/**
+ * Construction options of the memory-backed devices.
+ * Features the system cannot provide are reported and skipped.
+ */
+struct BlockManagerOptions {
+  // prefault the whole device upon creation (MAP_POPULATE)
+  bool populate = false;
+  // back the device with transparent huge pages (MADV_HUGEPAGE)
+  bool huge_pages = false;
+  // back the in-memory device with reserved huge pages (MAP_HUGETLB),
+  // falling back to transparent huge pages if none is available
+  bool hugetlb = false;
+  // lock the device in memory (mlock)
+  bool lock_memory = false;
+  // the initial access hint of the whole device
+  AccessHint hint = AccessHint::Normal;
+  // zero blocks by discarding them, see `BlockManager::discard_blocks`
+  bool discard = false;
+  // guard the block operations with locks, see `BlockManager::set_thread_safe`
+  bool thread_safe = false;
+  // the NUMA placement of the in-memory device, applied with mbind(2)
+  NumaPolicy numa = NumaPolicy::Default;
+  // fault the in-memory device in with this many threads upon creation,
+  // each touching a slice of it; 0 to fault it in lazily. It replaces
+  // `populate` for the in-memory device.
+  usize prefault_threads = 0;
+  // the number of blocks the device may grow to, whose address space is
+  // reserved upon creation so that `grow` never moves the mapping; 0 for
+  // `KDefaultMapGrowth` times the initial size
+  usize max_blocks = 0;
+};
+
+/**
+ * A block pinned in memory by a block manager.
+ * The data stays addressable until the pin is destroyed, upon which the
+ * manager is told whether the block has been modified.
+ *
+ * Managers that need to do something upon release (e.g., write back a bounce
+ * buffer or unpin a cache frame) derive from it.
+ */
+class BlockPin {
+public:
+  block_id_t block_id;
+  u8 *data;
+  bool dirty;
+
+  BlockPin(block_id_t block_id, u8 *data)
+      : block_id(block_id), data(data), dirty(false) {}
+
+  virtual ~BlockPin() = default;
+};
+
+/**
+ * The number of reads and writes of a block
+ */
+struct BlockAccessCount {
+  u64 reads = 0;
+  u64 writes = 0;
+};
+
+/**
+ * Per-block access counters, updated with relaxed atomics so that they can
+ * be bumped from concurrent I/O paths.
+ *
+ * With a sample rate of n, each thread counts one in n of its accesses, and
+ * the counts are scaled back by n in the snapshot.
+ */
+class AccessCounters {
+  usize block_cnt;
+  u32 sample_rate;
+  std::unique_ptr<std::atomic<u64>[]> reads;
+  std::unique_ptr<std::atomic<u64>[]> writes;
+
+public:
+  AccessCounters(usize block_cnt, u32 sample_rate);
+
+  /**
+   * Count an access of blocks [start, start + cnt).
+   * The blocks beyond the counted ones are ignored.
+   */
+  auto record(block_id_t start, usize cnt, bool is_write) -> void;
+
+  auto snapshot() const -> std::vector<BlockAccessCount>;
+};
+
+/**
+ * Striped reader-writer locks over the blocks of a device.
+ * Block i is guarded by stripe i % stripe_cnt, and each stripe sits on its
+ * own cache line, so the accesses to different blocks rarely contend.
+ */
+class BlockLocks {
+  struct alignas(64) Stripe {
+    std::shared_mutex mtx;
+  };
+
+  std::unique_ptr<Stripe[]> stripes;
+  usize stripe_cnt;
+
+public:
+  explicit BlockLocks(usize stripe_cnt = KBlockLockStripes)
+      : stripes(new Stripe[stripe_cnt]), stripe_cnt(stripe_cnt) {}
+
+  /**
+   * The locks of blocks [start, start + cnt), released upon destruction.
+   * The stripes are taken in ascending order, so two guards never deadlock.
+   * A guard over no locks is a no-op.
+   */
+  class Guard {
+    BlockLocks *locks;
+    // the stripes [first, first + cnt) modulo the stripe count
+    usize first;
+    usize cnt;
+    bool exclusive;
+    // the stripes of a batch in ascending order, empty for a range
+    std::vector<usize> picked;
+
+  public:
+    Guard(BlockLocks *locks, block_id_t start, usize cnt, bool exclusive);
+
+    /**
+     * The locks of a batch of blocks in any order
+     */
+    Guard(BlockLocks *locks, const std::vector<block_id_t> &block_ids,
+          bool exclusive);
+
+    ~Guard();
+
+    Guard(const Guard &) = delete;
+    auto operator=(const Guard &) -> Guard & = delete;
+  };
+};
 
 /**
  * BlockManager implements a block device to read/write block devices
- * Note that the block manager is **not** thread-safe.
+ * Note that the block manager is **not** thread-safe unless it is made so
+ * with `set_thread_safe`.
  */
 class BlockManager {
   friend class BlockIterator;
+  class MappedPin;
 
 protected:
-  const usize block_sz = 4096;
+  const usize block_sz = KDefaultBlockSize;
 
   std::string file_name_;
   int fd;
   u8 *block_data;
-  usize block_cnt;
+  // published by `grow` once the new blocks are mapped
+  std::atomic<usize> block_cnt;
   bool in_memory; // whether we use in-memory to emulate the block manager
+  u64 map_sz = 0; // the length of the mapping at `block_data`
+  // the address space reserved at `block_data` to grow into, at least
+  // `map_sz`
+  u64 reserve_sz = 0;
+  bool hugetlb_mapped = false; // whether the mapping uses MAP_HUGETLB
+  // the options of the mapping, applied to its grown parts as well
+  BlockManagerOptions map_opts;
+  // serializes `grow`, which owns `map_sz`
+  std::mutex grow_mtx;
+
+  // the workers serving the asynchronous APIs, created upon the first use
+  std::unique_ptr<ThreadPool> io_pool;
+  std::mutex io_pool_mtx;
+  usize io_worker_cnt = KDefaultIoWorkers;
+
+  // whether `zero_block` discards the block instead of writing zeros
+  bool discard_enabled = false;
+
+  // the dirty block ranges [start, end) not yet synced, keyed by start
+  std::map<block_id_t, block_id_t> dirty_ranges;
+  std::mutex sync_mtx;
+  std::condition_variable sync_cv;
+  bool syncing = false;
+  // a flush of the group commit and its result, shared by the sync requests
+  // it serves
+  struct SyncGeneration {
+    bool done = false;
+    bool failed = false;
+  };
+  // the generation the sync requests join until a leader starts flushing it
+  std::shared_ptr<SyncGeneration> sync_next;
+
+  // the per-block access counters, null unless enabled
+  std::unique_ptr<AccessCounters> access_counters;
+
+  // the block locks, null unless thread-safe
+  std::unique_ptr<BlockLocks> block_locks;
 
 public:
   /**
@@ -54,6 +271,12 @@ public:
    */
   BlockManager(const std::string &file, usize block_cnt);
 
+  /**
+   * Same as above, with options on how the file is mapped.
+   */
+  BlockManager(const std::string &file, usize block_cnt,
+               const BlockManagerOptions &options);
+
   /**
    * Creates a memory-backed block manager that writes to a memory block device.
    * Note that this is commonly used for testing.
@@ -64,6 +287,12 @@ public:
    */
   BlockManager(usize block_count, usize block_size);
 
+  /**
+   * Same as above, with options on how the memory is mapped.
+   */
+  BlockManager(usize block_count, usize block_size,
+               const BlockManagerOptions &options);
+
   virtual ~BlockManager();
 
   /**
@@ -91,10 +320,230 @@ public:
 
   /**
    * Clear the content of a block
+   * The block is discarded instead if discarding is enabled.
    * @param block_id id of the block
    */
   virtual auto zero_block(block_id_t block_id) -> ChfsNullResult;
 
+  /**
+   * Release the storage of the blocks, which read as zeros afterwards.
+   * The ids are merged into contiguous runs, and each run punches a hole in
+   * the backing file (fallocate(2) with FALLOC_FL_PUNCH_HOLE) or, for the
+   * in-memory device, gives its pages back (madvise(2) with MADV_DONTNEED).
+   * Devices that support neither write zeros instead.
+   *
+   * @param block_ids ids of the blocks, in any order
+   */
+  virtual auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult;
+
+  /**
+   * Grow the device to `new_block_cnt` blocks, which read as zeros.
+   * The backing file is extended and the new blocks are mapped into the
+   * address space reserved after the mapping (see
+   * `BlockManagerOptions::max_blocks`), so the mapping never moves and the
+   * pinned blocks and the pointer from `unsafe_get_block_ptr` stay valid.
+   * The block operations may run concurrently with it: the new blocks are
+   * only accessible once they are mapped. Concurrent calls are serialized.
+   *
+   * @param new_block_cnt the new number of blocks, no less than the current
+   * @return INVALID if the device cannot grow, e.g., past its reservation
+   */
+  virtual auto grow(usize new_block_cnt) -> ChfsNullResult;
+
+  /**
+   * Start counting the reads and writes of each block, resetting the counts.
+   * The pins count as one access when they are taken, and zeroing a block
+   * counts as a write. Only the accesses through this manager are counted,
+   * not those it issues to the managers below it.
+   *
+   * It must not run concurrently with block operations. The blocks added by
+   * a later `grow` are counted once the counting is restarted.
+   *
+   * @param sample_rate each thread counts one in `sample_rate` accesses,
+   * which trades accuracy for less contention on the hot blocks
+   */
+  auto enable_access_stats(u32 sample_rate = 1) -> void;
+
+  auto disable_access_stats() -> void { access_counters.reset(); }
+
+  /**
+   * Get the access counts of each block, empty if counting is disabled
+   */
+  auto access_stats() const -> std::vector<BlockAccessCount>;
+
+  /**
+   * Set whether `zero_block` discards the block instead of writing zeros
+   */
+  auto set_discard(bool enabled) -> void { discard_enabled = enabled; }
+
+  auto is_discard_enabled() const -> bool { return discard_enabled; }
+
+  /**
+   * Set whether the block operations of the device are thread-safe.
+   *
+   * The reads, writes, zeroing and discarding of the device, the direct and
+   * io_uring ones included, take striped block locks, shared for reading
+   * and exclusive for writing. A block
+   * operation, including `write_partial_block` and each contiguous run of
+   * the batch operations, is then atomic to the others.
+   * The pins are not locked. A layered manager is not made thread-safe by
+   * the device under it: it must be made so itself where it supports it
+   * (see ChecksumBlockManager). It must not be called concurrently with
+   * block operations.
+   */
+  auto set_thread_safe(bool enabled) -> void {
+    block_locks.reset(enabled ? new BlockLocks() : nullptr);
+  }
+
+  auto is_thread_safe() const -> bool { return block_locks != nullptr; }
+
+  /**
+   * Read a batch of blocks into a contiguous buffer, where the i-th block is
+   * stored at `buffer + i * block_size()`.
+   * Physically contiguous block ids are merged into a single copy.
+   *
+   * @param block_ids ids of the blocks
+   * @param buffer the buffer to store the result, at least
+   * `block_ids.size() * block_size()` bytes
+   */
+  virtual auto read_blocks(const std::vector<block_id_t> &block_ids,
+                           u8 *buffer) -> ChfsNullResult;
+
+  /**
+   * Write a batch of blocks from a contiguous buffer, where the i-th block is
+   * stored at `buffer + i * block_size()`.
+   * Physically contiguous block ids are merged into a single copy.
+   *
+   * @param block_ids ids of the blocks
+   * @param buffer the raw block data
+   */
+  virtual auto write_blocks(const std::vector<block_id_t> &block_ids,
+                            const u8 *buffer) -> ChfsNullResult;
+
+  /**
+   * Asynchronously read a block on the I/O workers.
+   * The buffer must stay alive until the returned future is ready.
+   *
+   * Note that the block operations of the manager run concurrently on the
+   * workers, and the accesses to the same block are not ordered. All the
+   * asynchronous I/Os must complete before the manager is destroyed.
+   *
+   * @param block_id id of the block
+   * @param block_data raw block data buffer to store the result
+   */
+  auto read_block_async(block_id_t block_id, u8 *block_data)
+      -> std::future<ChfsNullResult>;
+
+  /**
+   * Asynchronously write a block on the I/O workers.
+   * The buffer must stay alive until the returned future is ready.
+   */
+  auto write_block_async(block_id_t block_id, const u8 *block_data)
+      -> std::future<ChfsNullResult>;
+
+  /**
+   * Callback versions of the above APIs.
+   * The callback is invoked on an I/O worker with the result.
+   */
+  auto read_block_async(block_id_t block_id, u8 *block_data,
+                        std::function<void(ChfsNullResult)> callback) -> void;
+
+  auto write_block_async(block_id_t block_id, const u8 *block_data,
+                         std::function<void(ChfsNullResult)> callback)
+      -> void;
+
+  /**
+   * Set the number of I/O workers.
+   * It only takes effect before the first asynchronous I/O.
+   */
+  auto set_io_workers(usize worker_cnt) -> void { io_worker_cnt = worker_cnt; }
+
+  /**
+   * Wait for all the issued asynchronous I/Os to complete
+   */
+  auto wait_async() -> void;
+
+  /**
+   * Make all the completed writes durable on the backing device.
+   * Only the blocks written since the last sync are flushed, e.g., with
+   * `msync` on the page-aligned dirty ranges for a memory-mapped device.
+   *
+   * Concurrent calls are coalesced into a group commit: one caller flushes
+   * the dirty ranges on behalf of all the callers queued behind it.
+   * It is a no-op for an in-memory device.
+   */
+  virtual auto sync() -> ChfsNullResult;
+
+  /**
+   * Make the completed writes to blocks [start, start + cnt) durable.
+   * It does not join the group commit.
+   *
+   * @param start id of the first block
+   * @param cnt the number of blocks
+   */
+  virtual auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult;
+
+  /**
+   * Tell the device how blocks [start, start + cnt) are going to be
+   * accessed. Hints are best-effort: devices that cannot use them ignore
+   * them.
+   *
+   * @param start id of the first block
+   * @param cnt the number of blocks
+   * @param hint the expected access pattern
+   */
+  virtual auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult;
+
+  /**
+   * Start bringing blocks into memory ahead of their reads, without waiting
+   * for them. By default, it advises each contiguous run of the blocks with
+   * `AccessHint::WillNeed`.
+   *
+   * @param block_ids ids of the blocks, in any order
+   */
+  virtual auto prefetch(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult;
+
+  /**
+   * Get the number of blocks written since the last sync
+   */
+  auto dirty_block_cnt() -> usize;
+
+  /**
+   * Split a batch of block ids into runs of physically contiguous blocks.
+   */
+  static auto contiguous_runs(const std::vector<block_id_t> &block_ids)
+      -> std::vector<BlockRun>;
+
+  /**
+   * Pin a block in memory and return a pointer to its data.
+   * For a memory-mapped or in-memory device, the pointer refers to the
+   * backing memory directly. Managers without backing memory fall back to a
+   * bounce buffer, which is written back on release if it is dirty.
+   *
+   * Prefer `read_guard` and `write_guard` over calling it directly.
+   *
+   * @param block_id id of the block
+   * @param writable whether the caller may modify the block
+   */
+  virtual auto pin_block(block_id_t block_id, bool writable)
+      -> ChfsResult<std::shared_ptr<BlockPin>>;
+
+  /**
+   * Get a read-only view of a block without copying it.
+   * @param block_id id of the block
+   */
+  auto read_guard(block_id_t block_id) -> ChfsResult<BlockReadGuard>;
+
+  /**
+   * Get a writable view of a block without copying it.
+   * The modification is applied in place.
+   * @param block_id id of the block
+   */
+  auto write_guard(block_id_t block_id) -> ChfsResult<BlockWriteGuard>;
+
   auto total_storage_sz() const -> usize {
     return this->block_cnt * this->block_sz;
   }
@@ -111,23 +560,275 @@ public:
 
   /**
    * Get the block data pointer of the manager
+   *
+   * Note that managers layered over other devices (e.g., the cache) own no
+   * storage, so this returns nullptr for them.
    */
   auto unsafe_get_block_ptr() const -> u8 * { return this->block_data; }
+
+protected:
+  /**
+   * Open (and create if necessary) the file backing a block device.
+   * An empty file is extended to hold `block_cnt` blocks, otherwise
+   * `block_cnt` is adjusted to the size of the file.
+   *
+   * @param file the file name of the device
+   * @param block_cnt the expected number of blocks, updated to the actual one
+   * @param block_size the size of each block
+   * @param extra_flags extra flags passed to open(2), e.g., O_DIRECT
+   * @return the opened file descriptor
+   */
+  static auto open_device_file(const std::string &file, usize &block_cnt,
+                               usize block_size, int extra_flags = 0) -> int;
+
+  /**
+   * Creates a block manager that owns no storage.
+   * It is used by the managers layered over other block managers,
+   * which must override all the block operations.
+   *
+   * @param block_count the number of blocks exposed by the manager
+   * @param block_size the size of each block
+   */
+  BlockManager(usize block_count, usize block_size, std::nullptr_t);
+
+  /**
+   * Get the I/O workers, creating them if necessary
+   */
+  auto get_io_pool() -> ThreadPool &;
+
+  /**
+   * Count an access of blocks [start, start + cnt) if counting is enabled
+   */
+  auto record_access(block_id_t start, usize cnt, bool is_write) -> void {
+    if (access_counters != nullptr) {
+      access_counters->record(start, cnt, is_write);
+    }
+  }
+
+  /**
+   * Count an access of each block in a batch if counting is enabled
+   */
+  auto record_access(const std::vector<block_id_t> &block_ids, bool is_write)
+      -> void {
+    if (access_counters != nullptr) {
+      for (auto id : block_ids) {
+        access_counters->record(id, 1, is_write);
+      }
+    }
+  }
+
+  /**
+   * Lock blocks [start, start + cnt) if the device is thread-safe
+   */
+  auto lock_blocks(block_id_t start, usize cnt, bool exclusive)
+      -> BlockLocks::Guard {
+    return BlockLocks::Guard(block_locks.get(), start, cnt, exclusive);
+  }
+
+  /**
+   * Lock a batch of blocks if the device is thread-safe
+   */
+  auto lock_blocks(const std::vector<block_id_t> &block_ids, bool exclusive)
+      -> BlockLocks::Guard {
+    return BlockLocks::Guard(block_locks.get(), block_ids, exclusive);
+  }
+
+  /**
+   * Record that blocks [start, start + cnt) are written, so the next sync
+   * flushes them. Nothing is tracked for devices without a backing file.
+   */
+  auto mark_dirty(block_id_t start, usize cnt) -> void;
+
+  /**
+   * Flush the given dirty ranges to the backing file.
+   * The memory-mapped device issues an `msync` per page-aligned range, other
+   * file-backed devices an `fdatasync`.
+   *
+   * @param ranges the sorted and disjoint ranges [start, end) to flush
+   */
+  virtual auto persist(
+      const std::vector<std::pair<block_id_t, block_id_t>> &ranges)
+      -> ChfsNullResult;
+
+private:
+  /**
+   * Discard blocks [start, start + cnt)
+   */
+  auto discard_range(block_id_t start, usize cnt) -> ChfsNullResult;
+
+  /**
+   * Release blocks [start, start + cnt) without going through write_block,
+   * the caller holds their block locks
+   *
+   * @return whether the range was zeroed, false if the device can only be
+   *         zeroed by writing to it
+   */
+  auto discard_in_place(block_id_t start, usize cnt) -> ChfsResult<bool>;
+
+  /**
+   * Map `map_sz` bytes for the device, from the file if `fd` is valid,
+   * and apply the options to the mapping.
+   */
+  auto map_storage(const BlockManagerOptions &options) -> void;
+
+  /**
+   * Apply the options of the mapping to its bytes [offset, offset + len)
+   */
+  auto prepare_mapping(u64 offset, u64 len) -> void;
+
+  /**
+   * Advise blocks [start, start + cnt) without checking them against the
+   * device size, e.g., while they are being mapped
+   */
+  auto advise_range(block_id_t start, usize cnt,
+                    AccessHint hint) -> ChfsNullResult;
+
+  /**
+   * Apply the NUMA policy to the bytes [offset, offset + len) of the
+   * in-memory mapping and fault them in with the requested threads.
+   */
+  auto place_memory(u64 offset, u64 len) -> void;
+
+  /**
+   * Remove the dirty ranges within [start, end) from the tracked ones.
+   * The caller must hold `sync_mtx`.
+   */
+  auto take_dirty(block_id_t start, block_id_t end)
+      -> std::vector<std::pair<block_id_t, block_id_t>>;
+
+  /**
+   * Insert [start, end) into the tracked ranges, merging the overlapping
+   * and adjacent ones. The caller must hold `sync_mtx`.
+   */
+  auto insert_dirty(block_id_t start, block_id_t end) -> void;
+};
+
+/**
+ * A RAII read-only view of a pinned block.
+ * The block is unpinned when the last copy of the guard is destroyed,
+ * so the guard must not outlive its block manager.
+ *
+ * # Example
+ *
+ * ```
+ * auto guard = bm->read_guard(table_block_id).unwrap();
+ * auto bid = guard.as<block_id_t>(table_offset);
+ * ```
+ */
+class BlockReadGuard {
+protected:
+  std::shared_ptr<BlockPin> pin;
+  usize block_sz;
+
+public:
+  BlockReadGuard(std::shared_ptr<BlockPin> pin, usize block_sz)
+      : pin(std::move(pin)), block_sz(block_sz) {}
+
+  auto block_id() const -> block_id_t { return pin->block_id; }
+
+  auto size() const -> usize { return block_sz; }
+
+  auto data() const -> const u8 * { return pin->data; }
+
+  /**
+   * View the block as an array of T and get its idx-th element.
+   * The element must lie in the block.
+   */
+  template <typename T> auto as(usize idx = 0) const -> const T & {
+    CHFS_VERIFY((static_cast<u64>(idx) + 1) * sizeof(T) <= block_sz,
+                "block view out of range");
+    return reinterpret_cast<const T *>(pin->data)[idx];
+  }
+};
+
+/**
+ * A RAII writable view of a pinned block.
+ * Any mutable access marks the block dirty.
+ */
+class BlockWriteGuard : public BlockReadGuard {
+public:
+  BlockWriteGuard(std::shared_ptr<BlockPin> pin, usize block_sz)
+      : BlockReadGuard(std::move(pin), block_sz) {}
+
+  auto mark_dirty() -> void { pin->dirty = true; }
+
+  auto mut_data() -> u8 * {
+    this->mark_dirty();
+    return pin->data;
+  }
+
+  /**
+   * Mutable version of `as`
+   */
+  template <typename T> auto as_mut(usize idx = 0) -> T & {
+    CHFS_VERIFY((static_cast<u64>(idx) + 1) * sizeof(T) <= block_sz,
+                "block view out of range");
+    this->mark_dirty();
+    return reinterpret_cast<T *>(pin->data)[idx];
+  }
+};
+
+/**
+ * How a BlockIterator walks its range of blocks
+ */
+struct BlockIteratorOptions {
+  // visit every `stride`-th block of the range
+  usize stride = 1;
+  // walk from the last visited block of the range down to the first
+  bool reverse = false;
+  // the number of blocks prefetched ahead of the walk, 0 to disable it;
+  // only worth it for long walks known to visit the whole range
+  usize prefetch = 0;
+  // whether the blocks are pinned for writing
+  bool writable = true;
 };
 
 /**
  * A class to simplify iterating blocks in the block manager.
  *
+ * The iterator pins the current block and views it in place, so no block is
+ * copied unless the manager has no memory to hand out (see `pin_block`).
+ * If `prefetch` is set, the blocks after the current one in the walk are
+ * prefetched in batches.
+ *
  * Note that we don't provide a conventional iterator interface, because
  * each block read/write may return error due to failed reading/writing blocks.
+ *
+ * # Example
+ *
+ * ```
+ * auto opts = BlockIteratorOptions{};
+ * opts.writable = false;
+ * auto iter = BlockIterator::create(bm, start, end, opts).unwrap();
+ * for (; iter.has_next(); iter.next_block().unwrap()) {
+ *   count += Bitmap(iter.data(), iter.block_size()).count_zeros();
+ * }
+ * ```
  */
 class BlockIterator {
   BlockManager *bm;
-  u64 cur_block_off;
   block_id_t start_block_id;
   block_id_t end_block_id;
+  BlockIteratorOptions opts;
+  // the number of blocks visited by the walk
+  u64 block_num = 0;
+  // the byte offset in the walk, i.e., the position in the walk times the
+  // block size plus the offset in the current block
+  u64 cur_block_off = 0;
+  // the end of the prefetched positions of the walk
+  u64 prefetched = 0;
+
+  std::shared_ptr<BlockPin> pin;
+
+  /**
+   * Get the id of the block at a position of the walk
+   */
+  auto block_at(u64 pos) const -> block_id_t {
+    auto idx = opts.reverse ? block_num - 1 - pos : pos;
+    return start_block_id + idx * opts.stride;
+  }
 
-  std::vector<u8> buffer;
+  auto pin_cur_block() -> ChfsNullResult;
 
 public:
   /**
@@ -138,7 +839,17 @@ public:
    * @param end_block_id the end block id of the iterator
    */
   static auto create(BlockManager *bm, block_id_t start_block_id,
-                     block_id_t end_block_id) -> ChfsResult<BlockIterator>;
+                     block_id_t end_block_id) -> ChfsResult<BlockIterator> {
+    return create(bm, start_block_id, end_block_id, BlockIteratorOptions{});
+  }
+
+  /**
+   * Same as above, walking the range as told by the options.
+   */
+  static auto create(BlockManager *bm, block_id_t start_block_id,
+                     block_id_t end_block_id,
+                     const BlockIteratorOptions &opts)
+      -> ChfsResult<BlockIterator>;
 
   /**
    * Iterate to the cur_block_off to an offset
@@ -153,26 +864,64 @@ public:
    */
   auto next(usize offset) -> ChfsNullResult;
 
+  /**
+   * Move to the start of the next block of the walk
+   */
+  auto next_block() -> ChfsNullResult {
+    return next(bm->block_sz - cur_block_off % bm->block_sz);
+  }
+
+  /**
+   * Move to the next 64-bit word, which may be in the next block
+   */
+  auto next_word() -> ChfsNullResult { return next(sizeof(u64)); }
+
   auto has_next() -> bool {
-    return this->cur_block_off <
-           (this->end_block_id - this->start_block_id) * bm->block_sz;
+    return this->cur_block_off < this->block_num * bm->block_sz;
+  }
+
+  /**
+   * Get the id of the current block
+   */
+  auto cur_block_id() const -> block_id_t {
+    return block_at(cur_block_off / bm->block_sz);
   }
 
+  auto block_size() const -> usize { return bm->block_sz; }
+
   /**
+   * View the current block in place
+   */
+  auto data() const -> u8 * { return pin->data; }
+
+  /**
+   * Get a writable view of the current block, which marks it dirty.
+   * The iterator must be created writable.
+   */
+  auto mut_data() -> u8 * {
+    CHFS_VERIFY(opts.writable, "the iterator is read-only");
+    pin->dirty = true;
+    return pin->data;
+  }
+
+  /**
+   * Write back the modification to the current block.
+   *
    *  Assumption: a prior call of has_next() must return true
    */
   auto flush_cur_block() -> ChfsNullResult {
-    auto target_block_id =
-        this->start_block_id + this->cur_block_off / bm->block_sz;
-    return this->bm->write_block(target_block_id, this->buffer.data());
+    this->mut_data();
+    // releasing the pin applies the modification
+    this->pin.reset();
+    return this->pin_cur_block();
   }
 
   auto get_cur_byte() const -> u8 {
-    return this->buffer[this->cur_block_off % bm->block_sz];
+    return this->pin->data[this->cur_block_off % bm->block_sz];
   }
 
   template <typename T> auto unsafe_get_value_ptr() -> T * {
-    return reinterpret_cast<T *>(this->buffer.data() +
+    return reinterpret_cast<T *>(this->pin->data +
                                  this->cur_block_off % bm->block_sz);
   }
 };
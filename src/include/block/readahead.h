@@ -0,0 +1,61 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// readahead.h
+//
+// Identification: src/include/block/readahead.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <utility>
+
+#include "common/config.h"
+
+namespace chfs {
+
+const usize KReadaheadInitialBlocks = 4;
+const usize KReadaheadMaxBlocks = 64;
+// the number of streams tracked by a filesystem
+const usize KReadaheadStreams = 64;
+
+/**
+ * The readahead state of a stream of reads over a range of blocks, e.g., the
+ * blocks of a file.
+ *
+ * A read starting where the previous one ended is sequential. The first
+ * sequential read opens a window of `initial` blocks past it, and the window
+ * doubles up to `max` blocks each time the reads catch up with half of it.
+ * Any other read is random, which closes the window.
+ */
+class ReadaheadWindow {
+  usize initial;
+  usize max;
+  // where the next sequential read starts
+  u64 next = 0;
+  // the end of the prefetched blocks
+  u64 prefetched = 0;
+  // 0 if the stream is not sequential
+  usize window = 0;
+
+public:
+  explicit ReadaheadWindow(usize initial = KReadaheadInitialBlocks,
+                           usize max = KReadaheadMaxBlocks)
+      : initial(initial), max(std::max(initial, max)) {}
+
+  /**
+   * Account a read of blocks [start, end) of the stream.
+   *
+   * @param limit the number of blocks of the stream
+   * @return the blocks [first, second) to prefetch, empty if none
+   */
+  auto on_read(u64 start, u64 end, u64 limit) -> std::pair<u64, u64>;
+
+  auto window_size() const -> usize { return window; }
+};
+
+} // namespace chfs
@@ -0,0 +1,259 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// snapshot.h
+//
+// Identification: src/include/block/snapshot.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+class BlockSnapshot;
+
+/**
+ * SnapshotBlockManager is a block manager layered over another one that
+ * takes point-in-time snapshots of it while the writes go on.
+ *
+ * The logical blocks stay at their place on the underlying device, and the
+ * blocks after them form a copy area. Taking a snapshot only starts a new
+ * epoch, which is O(1). The first write to a block after a snapshot copies
+ * its old content to the copy area and records the copy in the remap table
+ * of every snapshot still seeing the old content, so a copy may be shared by
+ * several snapshots. A snapshot reads its copies through its remap table and
+ * the other blocks from their place.
+ *
+ * A snapshot is read through its own `BlockSnapshot`, and it is dropped with
+ * its copies once the last reference to that manager is gone. If the copy
+ * area runs out, the snapshots needing a new copy are invalidated rather
+ * than failing the write, and their reads fail with `ErrorType::INVALID`.
+ *
+ * The snapshots live in memory, so they do not survive a restart, while
+ * the logical blocks do.
+ *
+ * # Example
+ *
+ * ```
+ * auto origin = std::make_shared<SnapshotBlockManager>(bm);
+ * auto fs = FileOperation(origin, 4096);
+ * // ...
+ * auto snapshot = origin->snapshot().unwrap();
+ * auto image = FileOperation::create_from_raw(snapshot).unwrap();
+ * ```
+ */
+class SnapshotBlockManager
+    : public BlockManager,
+      public std::enable_shared_from_this<SnapshotBlockManager> {
+  friend class BlockSnapshot;
+
+  struct Snapshot {
+    // the copies of the blocks written since the snapshot
+    std::unordered_map<block_id_t, block_id_t> copies;
+    bool valid = true;
+  };
+
+  std::shared_ptr<BlockManager> inner;
+  // the epoch of the latest snapshot, 0 before any
+  u64 epoch = 0;
+  // the live snapshots by their epochs
+  std::map<u64, Snapshot> snapshots;
+  // the epoch at which each block was last copied
+  std::vector<u64> copied_epochs;
+
+  // the free blocks of the copy area, and the number of snapshots sharing
+  // each used one
+  std::vector<block_id_t> free_copies;
+  std::unordered_map<block_id_t, u32> copy_refs;
+
+  // the old content of the block being copied, guarded by `mtx`
+  std::vector<u8> copy_buf;
+  std::mutex mtx;
+
+public:
+  /**
+   * Creates a snapshotting manager over a block manager.
+   *
+   * @param inner the block manager to store the blocks and their copies
+   * @param block_cnt the number of logical blocks, by default three quarters
+   * of the underlying ones, leaving the rest as the copy area
+   */
+  explicit SnapshotBlockManager(std::shared_ptr<BlockManager> inner,
+                                usize block_cnt = 0);
+
+  /**
+   * Take a snapshot of the current content of the blocks.
+   *
+   * @return a read-only block manager viewing the snapshot
+   */
+  auto snapshot() -> ChfsResult<std::shared_ptr<BlockSnapshot>>;
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  /**
+   * The blocks are copied if necessary, then discarded on the underlying
+   * block manager.
+   */
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  auto read_blocks(const std::vector<block_id_t> &block_ids, u8 *buffer)
+      -> ChfsNullResult override;
+
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override;
+
+  auto sync() -> ChfsNullResult override { return inner->sync(); }
+
+  /**
+   * The logical blocks are at their place, so the range is forwarded.
+   */
+  auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult override {
+    return inner->sync_range(start, cnt);
+  }
+
+  auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult override {
+    return inner->advise(start, cnt, hint);
+  }
+
+  auto prefetch(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override {
+    return inner->prefetch(block_ids);
+  }
+
+  /**
+   * Get the underlying block manager
+   */
+  auto get_inner() const -> std::shared_ptr<BlockManager> { return inner; }
+
+  /**
+   * Get the number of live snapshots, including the invalidated ones
+   */
+  auto snapshot_cnt() -> usize;
+
+  /**
+   * Get the number of used blocks of the copy area
+   */
+  auto copies_used() -> usize;
+
+private:
+  /**
+   * Copy the old content of blocks [start, start + cnt) for the snapshots
+   * that still see it. The caller must hold `mtx`.
+   */
+  auto copy_before_write(block_id_t start, usize cnt) -> ChfsNullResult;
+
+  /**
+   * Release the copies of a snapshot. The caller must hold `mtx`.
+   */
+  auto release_copies(Snapshot &snapshot) -> void;
+
+  /**
+   * Get the epoch of the latest valid snapshot, 0 if none.
+   * The caller must hold `mtx`.
+   */
+  auto latest_valid_epoch() const -> u64;
+
+  /**
+   * Read a block as a snapshot sees it
+   */
+  auto read_snapshot(u64 snapshot_epoch, block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult;
+
+  /**
+   * Drop a snapshot along with its copies
+   */
+  auto release_snapshot(u64 snapshot_epoch) -> void;
+};
+
+/**
+ * A read-only view of a snapshot, see `SnapshotBlockManager`.
+ * The writes fail with `ErrorType::INVALID`.
+ */
+class BlockSnapshot : public BlockManager {
+  std::shared_ptr<SnapshotBlockManager> origin;
+  u64 snapshot_epoch;
+
+public:
+  BlockSnapshot(std::shared_ptr<SnapshotBlockManager> origin,
+                u64 snapshot_epoch);
+
+  /**
+   * The snapshot is dropped upon destruction.
+   */
+  ~BlockSnapshot() override;
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override {
+    return origin->read_snapshot(snapshot_epoch, block_id, block_data);
+  }
+
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+
+  /**
+   * Nothing is written through a snapshot
+   */
+  auto sync() -> ChfsNullResult override { return KNullOk; }
+
+  auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult override {
+    return KNullOk;
+  }
+
+  /**
+   * The copies are scattered over the copy area, so hints are ignored.
+   */
+  auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult override {
+    return KNullOk;
+  }
+
+  /**
+   * Get the epoch of the snapshot, increasing with the snapshots
+   */
+  auto get_epoch() const -> u64 { return snapshot_epoch; }
+};
+
+} // namespace chfs
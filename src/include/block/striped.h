@@ -0,0 +1,154 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// striped.h
+//
+// Identification: src/include/block/striped.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * The location of a block on the members of a striped device
+ */
+struct StripeLocation {
+  usize member;
+  block_id_t block_id;
+};
+
+/**
+ * StripedBlockManager spreads the blocks over several member block managers
+ * (RAID-0). Every `stripe_unit` consecutive blocks form a stripe unit, and
+ * the units are placed on the members round-robin:
+ *
+ * ```
+ * member:   0        1        2        0
+ * blocks:   [0, u)   [u, 2u)  [2u, 3u) [3u, 4u) ...
+ * ```
+ *
+ * The vectored APIs split a batch by member and serve the members in
+ * parallel on the I/O workers, so large sequential I/O reaches all the
+ * members at once.
+ *
+ * # Example
+ *
+ * ```
+ * auto bm = StripedBlockManager::create({"a.db", "b.db"}, 8192, 16);
+ * auto fs = FileOperation(bm, 4096);
+ * ```
+ */
+class StripedBlockManager : public BlockManager {
+  std::vector<std::shared_ptr<BlockManager>> members;
+  // the number of blocks per stripe unit
+  usize stripe_unit;
+
+public:
+  /**
+   * Creates a striped device over the members.
+   * The members must share the block size. Each member contributes the same
+   * number of whole stripe units, limited by the smallest member.
+   *
+   * @param members the block managers to stripe over
+   * @param stripe_unit the number of consecutive blocks on a member
+   */
+  StripedBlockManager(std::vector<std::shared_ptr<BlockManager>> members,
+                      usize stripe_unit);
+
+  /**
+   * Creates a striped device over memory-mapped files.
+   *
+   * @param files the backing files, one per member
+   * @param block_cnt the expected number of blocks of the whole device
+   * @param stripe_unit the number of consecutive blocks on a member
+   */
+  static auto create(const std::vector<std::string> &files, usize block_cnt,
+                     usize stripe_unit) -> std::shared_ptr<StripedBlockManager>;
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  auto read_blocks(const std::vector<block_id_t> &block_ids, u8 *buffer)
+      -> ChfsNullResult override;
+
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override;
+
+  /**
+   * The blocks are discarded on their members
+   */
+  auto discard_blocks(const std::vector<block_id_t> &block_ids)
+      -> ChfsNullResult override;
+
+  /**
+   * Pin the block on its member
+   */
+  auto pin_block(block_id_t block_id, bool writable)
+      -> ChfsResult<std::shared_ptr<BlockPin>> override;
+
+  /**
+   * Grow every member by the same number of stripe units.
+   * The existing blocks keep their locations.
+   */
+  auto grow(usize new_block_cnt) -> ChfsNullResult override;
+
+  auto sync() -> ChfsNullResult override;
+
+  auto sync_range(block_id_t start, usize cnt) -> ChfsNullResult override;
+
+  auto advise(block_id_t start, usize cnt, AccessHint hint)
+      -> ChfsNullResult override;
+
+  /**
+   * Map a block of the striped device to its member
+   */
+  auto locate(block_id_t block_id) const -> StripeLocation {
+    const auto unit = block_id / stripe_unit;
+    return StripeLocation{
+        static_cast<usize>(unit % members.size()),
+        unit / members.size() * stripe_unit + block_id % stripe_unit};
+  }
+
+  auto get_members() const
+      -> const std::vector<std::shared_ptr<BlockManager>> & {
+    return members;
+  }
+
+  auto get_stripe_unit() const -> usize { return stripe_unit; }
+
+private:
+  /**
+   * Run a batch of block I/O split by member, the members in parallel
+   */
+  auto dispatch(const std::vector<block_id_t> &block_ids, u8 *buffer,
+                bool is_write) -> ChfsNullResult;
+
+  /**
+   * Apply `op` to the range of each member covering blocks
+   * [start, start + cnt) of the striped device
+   */
+  auto for_member_ranges(
+      block_id_t start, usize cnt,
+      const std::function<ChfsNullResult(BlockManager &, block_id_t, usize)>
+          &op) -> ChfsNullResult;
+};
+
+} // namespace chfs
@@ -0,0 +1,190 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// uring.h
+//
+// Identification: src/include/block/uring.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <chrono>
+#include <linux/io_uring.h>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+/**
+ * A single I/O submitted to the ring.
+ * `len` bytes are transferred between `buf` and the device at `offset`.
+ */
+struct UringRequest {
+  u8 opcode;
+  u64 offset;
+  u8 *buf;
+  u32 len;
+};
+
+/**
+ * IoUringBlockManager implements a file-backed block device with io_uring.
+ * Unlike the mmap-based device, each block operation is an explicit I/O
+ * submitted to the kernel, and the vectored APIs keep up to `queue_depth`
+ * I/Os in flight.
+ *
+ * The ring is set up with raw syscalls, so no liburing is needed.
+ * The ring is shared by the concurrent calls: a lock is only held to fill
+ * the submission queue and to reap the completions, so the requests of
+ * several calls are in flight at once. Each request is tagged with a slot
+ * naming its call, and one waiting call at a time waits on the ring and
+ * hands the completions out to their calls. A call returns only once the
+ * kernel is done with all its requests, even on failure.
+ *
+ * The file is not opened with O_DIRECT, so the default `prefetch` with
+ * posix_fadvise(2) has the kernel read the blocks into the page cache
+ * asynchronously, where the next reads find them.
+ */
+class IoUringBlockManager : public BlockManager {
+  u32 queue_depth;
+  int ring_fd;
+
+  // the submission queue
+  void *sq_ring;
+  usize sq_ring_sz;
+  u32 *sq_head;
+  u32 *sq_tail;
+  u32 *sq_mask;
+  u32 *sq_array;
+  io_uring_sqe *sqes;
+  usize sqes_sz;
+
+  // the completion queue, which may share the mapping with the submission one
+  void *cq_ring;
+  usize cq_ring_sz;
+  u32 *cq_head;
+  u32 *cq_tail;
+  u32 *cq_mask;
+  io_uring_cqe *cqes;
+
+  std::vector<u8> zero_buffer;
+
+  /**
+   * The completion record of a `submit_and_wait` call, updated by whichever
+   * call reaps its completions
+   */
+  struct UringBatch {
+    std::vector<UringRequest> requests;
+    // the next request to submit
+    usize next = 0;
+    // the number of its requests in the kernel
+    u32 inflight = 0;
+    bool failed = false;
+    // the retries of the current submission
+    u32 retries = 0;
+  };
+
+  // the owner of a request in flight, indexed by the user_data of its SQE
+  struct UringSlot {
+    UringBatch *batch;
+    usize req_idx;
+  };
+
+  std::mutex ring_mtx;
+  std::condition_variable ring_cv;
+  std::vector<UringSlot> slots;
+  std::vector<u32> free_slots;
+  // whether a call is waiting on the ring for completions, without the lock
+  bool reaping = false;
+  // set once io_uring_enter cannot wait anymore, so the completions are
+  // polled until the deadline and no request is submitted
+  bool polling = false;
+  std::chrono::steady_clock::time_point drain_deadline;
+  // set if some requests never completed, so they may still be in the ring
+  // and the ring fails every request
+  bool broken = false;
+  // the calls with requests in the kernel, and the most of them at once
+  usize inflight_calls = 0;
+  usize peak_inflight_calls = 0;
+
+public:
+  /**
+   * Creates a new block manager backed by a file with io_uring.
+   *
+   * @param file the file name of the file to write to
+   * @param block_cnt the number of expected blocks in the device. If the
+   * device's blocks are more or less than it, the manager should adjust the
+   * actual block cnt.
+   * @param queue_depth the number of entries of the submission queue
+   */
+  IoUringBlockManager(const std::string &file, usize block_cnt,
+                      u32 queue_depth = 64);
+
+  ~IoUringBlockManager() override;
+
+  /**
+   * Whether the running kernel allows setting up an io_uring
+   */
+  static auto is_supported() -> bool;
+
+  auto write_block(block_id_t block_id, const u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override;
+
+  auto read_block(block_id_t block_id, u8 *block_data)
+      -> ChfsNullResult override;
+
+  auto zero_block(block_id_t block_id) -> ChfsNullResult override;
+
+  /**
+   * Each run of contiguous blocks becomes a single I/O, and all the runs are
+   * submitted in batches of up to `queue_depth`.
+   */
+  auto read_blocks(const std::vector<block_id_t> &block_ids, u8 *buffer)
+      -> ChfsNullResult override;
+
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override;
+
+  auto get_queue_depth() const -> u32 { return queue_depth; }
+
+  /**
+   * Get the most calls that have had requests in the kernel at once
+   */
+  auto get_peak_inflight_calls() -> usize {
+    std::lock_guard<std::mutex> lock(ring_mtx);
+    return peak_inflight_calls;
+  }
+
+  /**
+   * Submit the requests and wait for all of them to complete.
+   * Short transfers are resubmitted for the remaining bytes.
+   */
+  auto submit_and_wait(std::vector<UringRequest> requests) -> ChfsNullResult;
+
+private:
+  auto check_range(block_id_t block_id) const -> bool {
+    return block_id < this->block_cnt;
+  }
+
+  auto runs_to_requests(const std::vector<block_id_t> &block_ids, u8 *buffer,
+                        u8 opcode) -> ChfsResult<std::vector<UringRequest>>;
+
+  /**
+   * Submit as many requests of the call as there are free slots, with the
+   * ring locked
+   */
+  auto submit_batch(UringBatch &batch) -> void;
+
+  /**
+   * Hand the completions in the ring out to their calls, with the ring
+   * locked
+   */
+  auto reap_completions() -> void;
+};
+
+} // namespace chfs
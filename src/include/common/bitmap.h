@@ -11,6 +11,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <optional>
 #include <string.h>
 
@@ -76,11 +77,16 @@ public:
    * @return the number of ones in the bitmap
    */
   auto count_ones() -> usize {
+    // count a word at a time, then the bytes left
     usize num_ones = 0;
-    for (usize i = 0; i < payload * KBitsPerByte; ++i) {
-      if (this->check(i)) {
-        ++num_ones;
-      }
+    usize i = 0;
+    for (; i + KBytesPerWord <= payload; i += KBytesPerWord) {
+      u64 word;
+      memcpy(&word, data + i, KBytesPerWord);
+      num_ones += __builtin_popcountll(word);
+    }
+    for (; i < payload; ++i) {
+      num_ones += __builtin_popcount(data[i]);
     }
     return num_ones;
   }
@@ -101,13 +107,21 @@ public:
    * @param upbound the upper bound of the count
    */
   auto count_zeros_to_bound(usize upbound) -> usize {
-    usize num_zeros = 0;
-    for (usize i = 0; i < upbound; ++i) {
-      if (!this->check(i)) {
-        ++num_zeros;
+    // count the ones a word at a time, then the bits left
+    const usize bits_per_word = KBytesPerWord * KBitsPerByte;
+    usize num_ones = 0;
+    usize i = 0;
+    for (; i + bits_per_word <= upbound; i += bits_per_word) {
+      u64 word;
+      memcpy(&word, data + i / KBitsPerByte, KBytesPerWord);
+      num_ones += __builtin_popcountll(word);
+    }
+    for (; i < upbound; ++i) {
+      if (this->check(i)) {
+        ++num_ones;
       }
     }
-    return num_zeros;
+    return upbound - num_ones;
   }
 
   /**
@@ -135,17 +149,14 @@ public:
     for (usize i = 0; i < num_words; ++i) {
       if (words[i] !=
           ~u64(0)) { // if word is not all ones, at least one bit is free
-        for (size_t j = 0; j < KBitsPerByte * KBytesPerWord; ++j) {
-          size_t bit_index = i * KBytesPerWord * KBitsPerByte + j;
-          if (!this->check(bit_index)) {
-            return bit_index;
-          }
-        }
+        // the bits of a (little-endian) word follow those of its bytes
+        return i * KBytesPerWord * KBitsPerByte +
+               __builtin_ctzll(~words[i]);
       }
     }
 
     // Check remaining bits
-    size_t num_remaining_bits = bits % (KBytesPerWord * KBitsPerByte);
+    size_t num_remaining_bits = refined_bits % (KBytesPerWord * KBitsPerByte);
     for (size_t i = 0; i < num_remaining_bits; ++i) {
       auto bit_index = i + num_words * KBytesPerWord * KBitsPerByte;
       if (!this->check(bit_index)) {
@@ -155,6 +166,60 @@ public:
 
     return std::nullopt; // No free bit found
   }
+
+  /**
+   * Find the first free bit at or after an index
+   * @param from the index to start the search from
+   * @param bits the upper bound of the search (in bits!)
+   *
+   * @return the index of the free bit, or std::nullopt if no free bit is
+   * found
+   */
+  auto find_next_free(usize from, usize bits) -> std::optional<usize> {
+    const auto bound = std::min(this->payload * KBitsPerByte, bits);
+    const auto index = find_next(from, bound, false);
+    return index < bound ? std::optional<usize>(index) : std::nullopt;
+  }
+
+  /**
+   * Find the first set bit at or after an index
+   * @param from the index to start the search from
+   * @param bits the upper bound of the search (in bits!)
+   *
+   * @return the index of the set bit, or std::nullopt if no set bit is found
+   */
+  auto find_next_used(usize from, usize bits) -> std::optional<usize> {
+    const auto bound = std::min(this->payload * KBitsPerByte, bits);
+    const auto index = find_next(from, bound, true);
+    return index < bound ? std::optional<usize>(index) : std::nullopt;
+  }
+
+private:
+  /**
+   * Find the first bit equal to `set` at or after an index, the bound of
+   * the search if none
+   */
+  auto find_next(usize from, usize bound, bool set) -> usize {
+    const usize bits_per_word = KBytesPerWord * KBitsPerByte;
+    for (usize base = from - from % bits_per_word; base < bound;
+         base += bits_per_word) {
+      // the last word may be partial
+      u64 word = 0;
+      memcpy(&word, data + base / KBitsPerByte,
+             std::min(KBytesPerWord, payload - base / KBitsPerByte));
+      if (!set) {
+        word = ~word;
+      }
+      if (base < from) {
+        word &= ~u64(0) << (from - base);
+      }
+      if (word != 0) {
+        // the bits of a (little-endian) word follow those of its bytes
+        return std::min(bound, base + __builtin_ctzll(word));
+      }
+    }
+    return bound;
+  }
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -6,6 +6,7 @@ namespace chfs {
 
 using u8 = uint8_t;
 using i8 = int8_t;
+using u16 = uint16_t;
 using i32 = int32_t;
 using u32 = uint32_t;
 using u64 = uint64_t;
@@ -16,5 +17,9 @@ using block_id_t = u64; // page id type
 using inode_id_t = u64;
 
 const usize KDefaultBlockCnt = 4096; // use a default 8MB file size
+const usize KDefaultBlockSize = 4096;
+const usize KDefaultIoWorkers = 4; // workers serving the asynchronous I/O
+const usize KBlockLockStripes = 64; // lock stripes of a thread-safe device
+const u64 KDefaultMapGrowth = 16; // times its size a device may grow into
 
 } // namespace chfs
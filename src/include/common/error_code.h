@@ -22,6 +22,9 @@ enum class ErrorType {
   AlreadyExist = 5,
 
   NotEmpty = 6,
+
+  /** The data fails the integrity check */
+  Corrupted = 7,
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,113 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// thread_pool.h
+//
+// Identification: src/include/common/thread_pool.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "./config.h"
+#include "./macros.h"
+
+namespace chfs {
+
+/**
+ * A fixed-size pool of worker threads executing tasks in FIFO order.
+ * The pending tasks are drained before the pool is destroyed.
+ */
+class ThreadPool {
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mtx;
+  std::condition_variable task_cv;
+  std::condition_variable idle_cv;
+  usize running;
+  bool stopped;
+
+public:
+  /**
+   * @param worker_cnt the number of worker threads
+   */
+  explicit ThreadPool(usize worker_cnt) : running(0), stopped(false) {
+    CHFS_VERIFY(worker_cnt > 0, "The pool needs at least one worker");
+    workers.reserve(worker_cnt);
+    for (usize i = 0; i < worker_cnt; ++i) {
+      workers.emplace_back([this] { this->work(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopped = true;
+    }
+    task_cv.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  DISALLOW_COPY_AND_MOVE(ThreadPool);
+
+  /**
+   * Queue a task to run on a worker
+   */
+  auto submit(std::function<void()> task) -> void {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      tasks.push(std::move(task));
+    }
+    task_cv.notify_one();
+  }
+
+  /**
+   * Block until all the submitted tasks have finished
+   */
+  auto wait_idle() -> void {
+    std::unique_lock<std::mutex> lock(mtx);
+    idle_cv.wait(lock, [this] { return tasks.empty() && running == 0; });
+  }
+
+  auto size() const -> usize { return workers.size(); }
+
+private:
+  auto work() -> void {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        task_cv.wait(lock, [this] { return stopped || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop();
+        running += 1;
+      }
+
+      task();
+
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        running -= 1;
+        if (tasks.empty() && running == 0) {
+          idle_cv.notify_all();
+        }
+      }
+    }
+  }
+};
+
+} // namespace chfs
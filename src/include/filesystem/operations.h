@@ -12,10 +12,25 @@
 #pragma once
 
 #include "metadata/manager.h"
+#include <ostream>
+#include <string>
 #include <sys/stat.h>
+#include <unordered_map>
 
 namespace chfs {
 
+/**
+ * The accesses of a region of the filesystem layout, e.g., the inode table
+ */
+struct BlockRegionStats {
+  std::string name;
+  // the blocks [start, end) of the region
+  block_id_t start;
+  block_id_t end;
+  u64 reads;
+  u64 writes;
+};
+
 /**
  * Implement the basic inode filesystem
  */
@@ -26,6 +41,11 @@ protected:
   [[maybe_unused]] std::shared_ptr<BlockManager> block_manager_;
   [[maybe_unused]] std::shared_ptr<InodeManager> inode_manager_;
   [[maybe_unused]] std::shared_ptr<BlockAllocator> block_allocator_;
+  // the content index of the data blocks, null unless deduplicating
+  std::shared_ptr<DedupIndex> dedup_;
+  // the readahead state of the files being read, at most KReadaheadStreams
+  std::unordered_map<inode_id_t, ReadaheadWindow> readahead_;
+  bool readahead_enabled_ = true;
 
 public:
   /**
@@ -92,6 +112,22 @@ public:
    */
   auto write_file(inode_id_t, const std::vector<u8> &content) -> ChfsNullResult;
 
+  /**
+   * Share the data blocks with the same content between files from now on.
+   * `write_file` hashes each data block it writes and points the inode to an
+   * identical block if the index knows one; a shared block is copied before
+   * it is modified, and it is freed with its last reference.
+   *
+   * The reference counts are rebuilt from the inodes, so it must be enabled
+   * again on a filesystem written with it before any file is changed.
+   *
+   * @param max_entries the number of fingerprints kept in memory
+   */
+  auto enable_dedup(usize max_entries = KDefaultDedupEntries)
+      -> ChfsNullResult;
+
+  auto get_dedup() const -> std::shared_ptr<DedupIndex> { return dedup_; }
+
   /**
    * Write the content to the blocks pointed by the inode
    * If the inode's block is insufficient, we will dynamically allocate more
@@ -114,8 +150,12 @@ public:
   /**
    * Read the content to the blocks pointed by the inode
    *
+   * Only the blocks covering [offset, offset + sz) are read. When the reads
+   * of a file are sequential, the blocks after them are prefetched with a
+   * growing window, see `ReadaheadWindow`.
+   *
    * # Note
-   * We assume that the offset + size <= file size
+   * The content is cut at the end of the file
    */
   auto read_file_w_off(inode_id_t id, u64 sz, u64 offset)
       -> ChfsResult<std::vector<u8>>;
@@ -135,6 +175,23 @@ public:
    */
   auto get_free_blocks_num() const -> ChfsResult<u64>;
 
+  /**
+   * Make all the completed updates of the filesystem durable.
+   * Data and metadata share the block device, so both are flushed.
+   */
+  auto sync() -> ChfsNullResult;
+
+  /**
+   * Grow the filesystem online to `new_block_cnt` blocks.
+   * The block manager grows first, then the block bitmap is extended over
+   * the new blocks and the superblock records the new size.
+   *
+   * The block I/O and the allocation may run concurrently with it when the
+   * block manager and the allocator are thread-safe, as the new blocks are
+   * only handed out once both have grown; another `grow` may not.
+   */
+  auto grow(u64 new_block_cnt) -> ChfsNullResult;
+
   /**
    * Lookup the directory
    */
@@ -176,6 +233,39 @@ public:
    */
   auto resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr>;
 
+  /**
+   * Tell the block device how the blocks of a file are going to be
+   * accessed, e.g., `AccessHint::Sequential` before streaming it.
+   *
+   * @param id the id of the inode
+   * @param hint the expected access pattern
+   */
+  auto advise(inode_id_t id, AccessHint hint) -> ChfsNullResult;
+
+  /**
+   * Turn the readahead of `read_file_w_off` on or off. It is on by default.
+   */
+  auto set_readahead(bool enabled) -> void {
+    readahead_enabled_ = enabled;
+    readahead_.clear();
+  }
+
+  /**
+   * Sum up the block access counts per region of the layout: the superblock,
+   * the inode table, the inode bitmap, the block bitmap and the data blocks.
+   * The bitmap blocks added by `grow` are counted as data blocks.
+   *
+   * The counting must be enabled on the block manager with
+   * `BlockManager::enable_access_stats`, otherwise it returns nothing.
+   */
+  auto access_heatmap() const -> std::vector<BlockRegionStats>;
+
+  /**
+   * Print the per-region access counts, followed by the `top` most accessed
+   * blocks labelled with their regions.
+   */
+  auto dump_access_heatmap(std::ostream &os, usize top = 10) const -> void;
+
   /**
    * Remove the file named @name from directory @parent.
    * Free the file's blocks.
@@ -190,6 +280,31 @@ private:
                 std::shared_ptr<InodeManager> im,
                 std::shared_ptr<BlockAllocator> ba)
       : block_manager_(bm), inode_manager_(im), block_allocator_(ba) {}
+
+  /**
+   * Write a data block through the dedup index.
+   *
+   * @param block_id the block currently holding the data
+   * @param data the new content of the block
+   * @return the block holding the content afterwards, which the inode must
+   * point to: an identical shared block, a copy if `block_id` is shared, or
+   * `block_id` itself
+   */
+  auto dedup_write_block(block_id_t block_id, const u8 *data)
+      -> ChfsResult<block_id_t>;
+
+  /**
+   * Get the size of a file and the ids of its data blocks in file order
+   */
+  auto get_file_blocks(inode_id_t id)
+      -> ChfsResult<std::pair<u64, std::vector<block_id_t>>>;
+
+  /**
+   * Account a read of the file blocks [first, last) and prefetch the blocks
+   * after them if the reads are sequential.
+   */
+  auto readahead(inode_id_t id, const std::vector<block_id_t> &block_ids,
+                 u64 first, u64 last) -> void;
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -135,6 +135,16 @@ private:
    */
   auto read_inode(inode_id_t id, std::vector<u8> &buffer)
       -> ChfsResult<block_id_t>;
+
+  /**
+   * Pin the block of the inode to read it in place
+   */
+  auto pin_inode(inode_id_t id) -> ChfsResult<BlockReadGuard>;
+
+  /**
+   * Get the block ID of an allocated inode, checking the ID on the way
+   */
+  auto get_inode_block(inode_id_t id) -> ChfsResult<block_id_t>;
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -28,6 +28,9 @@ typedef struct SuperBlockInternal {
   u64 ninodes;
   // The current filesystem size.
   u64 file_system_size;
+  // The number of the contiguous block bitmap blocks, i.e., those before the
+  // filesystem grows. Zero on images created before growth was supported.
+  u64 nbitmap_blocks;
 } SuperblockInternal;
 
 /**
@@ -78,6 +81,13 @@ public:
   u32 get_block_size() const { return inner.block_size; }
   u64 get_nblocks() const { return inner.nblocks; }
   u64 get_ninodes() const { return inner.ninodes; }
+  u64 get_nbitmap_blocks() const { return inner.nbitmap_blocks; }
+
+  /**
+   * Setters, the changes are persisted by `flush`
+   */
+  void set_nblocks(u64 nblocks) { inner.nblocks = nblocks; }
+  void set_nbitmap_blocks(u64 n) { inner.nbitmap_blocks = n; }
 
 private:
   explicit SuperBlock(std::shared_ptr<BlockManager> bm) : bm(bm) {}
@@ -71,8 +71,12 @@ auto InodeManager::create_from_block_manager(std::shared_ptr<BlockManager> bm,
 // { Your code here }
 auto InodeManager::allocate_inode(InodeType type,
                                   block_id_t bid) -> ChfsResult<inode_id_t> {
-    auto iter_res = BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
-                                          1 + n_table_blocks + n_bitmap_blocks);
+    // scan the bitmap read-only, so only the updated block gets dirty
+    auto opts = BlockIteratorOptions{};
+    opts.writable = false;
+    auto iter_res =
+        BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
+                              1 + n_table_blocks + n_bitmap_blocks, opts);
     if (iter_res.is_err()) {
         return ChfsResult<inode_id_t>(iter_res.unwrap_error());
     }
@@ -81,20 +85,20 @@ auto InodeManager::allocate_inode(InodeType type,
 
     // Find an available inode ID.
     for (auto iter = iter_res.unwrap(); iter.has_next();
-         iter.next(bm->block_size()).unwrap(), count++) {
-        auto data = iter.unsafe_get_value_ptr<u8>();
-        auto bitmap = Bitmap(data, bm->block_size());
-        auto free_idx = bitmap.find_first_free();
+         iter.next_block().unwrap(), count++) {
+        auto free_idx =
+            Bitmap(iter.data(), bm->block_size()).find_first_free();
 
         if (free_idx) {
             // If there is an available inode ID.
 
             // Setup the bitmap.
-            bitmap.set(free_idx.value());
-            auto res = iter.flush_cur_block();
-            if (res.is_err()) {
-                return ChfsResult<inode_id_t>(res.unwrap_error());
+            auto guard_res = bm->write_guard(iter.cur_block_id());
+            if (guard_res.is_err()) {
+                return ChfsResult<inode_id_t>(guard_res.unwrap_error());
             }
+            auto guard = guard_res.unwrap();
+            Bitmap(guard.mut_data(), bm->block_size()).set(free_idx.value());
 
             // TODO:
             // 1. Initialize the inode with the given type.
@@ -129,20 +133,18 @@ auto InodeManager::set_table(inode_id_t idx, block_id_t bid) -> ChfsNullResult {
     const auto inode_per_block = bm->block_size() / sizeof(block_id_t);
     const auto table_block_id = idx / inode_per_block + 1; // 1: super block
     const auto table_offset = idx % inode_per_block;
-    std::vector<u8> buffer(bm->block_size());
-    bm->read_block(table_block_id, buffer.data());
-    // update buffer
-    memcpy(buffer.data() + table_offset * sizeof(block_id_t), &bid,
-           sizeof(block_id_t));
-    // write back
-    bm->write_block(table_block_id, buffer.data());
+    // update the entry in place
+    auto guard_res = bm->write_guard(table_block_id);
+    if (guard_res.is_err()) {
+        return ChfsNullResult(guard_res.unwrap_error());
+    }
+    auto guard = guard_res.unwrap();
+    guard.as_mut<block_id_t>(table_offset) = bid;
     return KNullOk;
 }
 
 // { Your code here }
 auto InodeManager::get(inode_id_t id) -> ChfsResult<block_id_t> {
-    block_id_t res_block_id = 0;
-
     // TODO: Implement this function.
     // Get the block id of inode whose id is `id`
     // from the inode table. You may have to use
@@ -153,16 +155,22 @@ auto InodeManager::get(inode_id_t id) -> ChfsResult<block_id_t> {
     const auto table_block_id =
         LOGIC_2_RAW(id) / inode_per_block + 1; // 1: super block
     const auto table_offset = LOGIC_2_RAW(id) % inode_per_block;
-    std::vector<u8> buffer(bm->block_size());
-    bm->read_block(table_block_id, buffer.data());
-    memcpy(&res_block_id, buffer.data() + table_offset * sizeof(block_id_t),
-           sizeof(block_id_t));
-    return ChfsResult<block_id_t>(res_block_id);
+    auto guard_res = bm->read_guard(table_block_id);
+    if (guard_res.is_err()) {
+        return ChfsResult<block_id_t>(guard_res.unwrap_error());
+    }
+    auto guard = guard_res.unwrap();
+    return ChfsResult<block_id_t>(guard.as<block_id_t>(table_offset));
 }
 
 auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
-    auto iter_res = BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
-                                          1 + n_table_blocks + n_bitmap_blocks);
+    // the count visits every bitmap block, so read them ahead
+    auto opts = BlockIteratorOptions{};
+    opts.writable = false;
+    opts.prefetch = KReadaheadMaxBlocks;
+    auto iter_res =
+        BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
+                              1 + n_table_blocks + n_bitmap_blocks, opts);
 
     if (iter_res.is_err()) {
         return ChfsResult<u64>(iter_res.unwrap_error());
@@ -170,12 +178,9 @@ auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
 
     u64 count = 0;
     for (auto iter = iter_res.unwrap(); iter.has_next();) {
-        auto data = iter.unsafe_get_value_ptr<u8>();
-        auto bitmap = Bitmap(data, bm->block_size());
-
-        count += bitmap.count_zeros();
+        count += Bitmap(iter.data(), bm->block_size()).count_zeros();
 
-        auto iter_res = iter.next(bm->block_size());
+        auto iter_res = iter.next_block();
         if (iter_res.is_err()) {
             return ChfsResult<u64>(iter_res.unwrap_error());
         }
@@ -184,40 +189,44 @@ auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
 }
 
 auto InodeManager::get_attr(inode_id_t id) -> ChfsResult<FileAttr> {
-    std::vector<u8> buffer(bm->block_size());
-    auto res = this->read_inode(id, buffer);
+    auto res = this->pin_inode(id);
     if (res.is_err()) {
         return ChfsResult<FileAttr>(res.unwrap_error());
     }
-    Inode *inode_p = reinterpret_cast<Inode *>(buffer.data());
-    return ChfsResult<FileAttr>(inode_p->inner_attr);
+    auto guard = res.unwrap();
+    return ChfsResult<FileAttr>(FileAttr(guard.as<Inode>().inner_attr));
 }
 
 auto InodeManager::get_type(inode_id_t id) -> ChfsResult<InodeType> {
-    std::vector<u8> buffer(bm->block_size());
-    auto res = this->read_inode(id, buffer);
+    auto res = this->pin_inode(id);
     if (res.is_err()) {
         return ChfsResult<InodeType>(res.unwrap_error());
     }
-    Inode *inode_p = reinterpret_cast<Inode *>(buffer.data());
-    return ChfsResult<InodeType>(inode_p->type);
+    auto guard = res.unwrap();
+    return ChfsResult<InodeType>(InodeType(guard.as<Inode>().type));
 }
 
 auto InodeManager::get_type_attr(inode_id_t id)
     -> ChfsResult<std::pair<InodeType, FileAttr>> {
-    std::vector<u8> buffer(bm->block_size());
-    auto res = this->read_inode(id, buffer);
+    auto res = this->pin_inode(id);
     if (res.is_err()) {
         return ChfsResult<std::pair<InodeType, FileAttr>>(res.unwrap_error());
     }
-    Inode *inode_p = reinterpret_cast<Inode *>(buffer.data());
+    auto guard = res.unwrap();
+    const auto &inode = guard.as<Inode>();
     return ChfsResult<std::pair<InodeType, FileAttr>>(
-        std::make_pair(inode_p->type, inode_p->inner_attr));
+        std::make_pair(InodeType(inode.type), FileAttr(inode.inner_attr)));
 }
 
-// Note: the buffer must be as large as block size
-auto InodeManager::read_inode(inode_id_t id, std::vector<u8> &buffer)
-    -> ChfsResult<block_id_t> {
+auto InodeManager::pin_inode(inode_id_t id) -> ChfsResult<BlockReadGuard> {
+    auto block_id = this->get_inode_block(id);
+    if (block_id.is_err()) {
+        return ChfsResult<BlockReadGuard>(block_id.unwrap_error());
+    }
+    return bm->read_guard(block_id.unwrap());
+}
+
+auto InodeManager::get_inode_block(inode_id_t id) -> ChfsResult<block_id_t> {
     if (id >= max_inode_supported - 1) {
         std::cerr << "invalid id: exceed maxium inode id supported, id: " << id
                   << std::endl;
@@ -234,12 +243,22 @@ auto InodeManager::read_inode(inode_id_t id, std::vector<u8> &buffer)
                   << std::endl;
         return ChfsResult<block_id_t>(ErrorType::INVALID_ARG);
     }
+    return block_id;
+}
+
+// Note: the buffer must be as large as block size
+auto InodeManager::read_inode(inode_id_t id, std::vector<u8> &buffer)
+    -> ChfsResult<block_id_t> {
+    auto block_id = this->get_inode_block(id);
+    if (block_id.is_err()) {
+        return block_id;
+    }
 
     auto res = bm->read_block(block_id.unwrap(), buffer.data());
     if (res.is_err()) {
         return ChfsResult<block_id_t>(res.unwrap_error());
     }
-    return ChfsResult<block_id_t>(block_id.unwrap());
+    return block_id;
 }
 
 // {Your code}
@@ -259,26 +278,23 @@ auto InodeManager::free_inode(inode_id_t id) -> ChfsNullResult {
     // 2. Clear the inode bitmap.
     // UNIMPLEMENTED();
     const auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
-    auto inode_per_block = bm->block_size() / sizeof(block_id_t);
-    const auto table_block_id =
-        LOGIC_2_RAW(id) / inode_per_block + 1; // 1: super block
-    const auto table_offset = LOGIC_2_RAW(id) % inode_per_block;
-    std::vector<u8> buffer(bm->block_size());
-    bm->read_block(table_block_id, buffer.data());
-
-    const block_id_t bid = KInvalidBlockID;
-    memcpy(buffer.data() + table_offset * sizeof(block_id_t), &bid,
-           sizeof(block_id_t));
-    bm->write_block(table_block_id, buffer.data());
-    // clear the bitmap
+    auto clear_res = this->set_table(LOGIC_2_RAW(id), KInvalidBlockID);
+    if (clear_res.is_err()) {
+        return clear_res;
+    }
+
+    // clear the bitmap in place
     auto inode_bitmap_block_id =
         1 + n_table_blocks + LOGIC_2_RAW(id) / inode_bits_per_block;
     auto inode_bitmap_block_off = LOGIC_2_RAW(id) % inode_bits_per_block;
 
-    bm->read_block(inode_bitmap_block_id, buffer.data());
-    auto bitmap = Bitmap(buffer.data(), bm->block_size());
-    bitmap.set(inode_bitmap_block_off);
-    bm->write_block(inode_bitmap_block_id, buffer.data());
+    auto guard_res = bm->write_guard(inode_bitmap_block_id);
+    if (guard_res.is_err()) {
+        return ChfsNullResult(guard_res.unwrap_error());
+    }
+    auto guard = guard_res.unwrap();
+    auto bitmap = Bitmap(guard.mut_data(), bm->block_size());
+    bitmap.clear(inode_bitmap_block_off);
     return KNullOk;
 }
 
@@ -8,6 +8,7 @@ SuperBlock::SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes) : bm(bm) {
   this->inner.block_size = bm->block_size();
   this->inner.nblocks = bm->total_blocks();
   this->inner.ninodes = ninodes;
+  this->inner.nbitmap_blocks = 0;
 
   CHFS_VERIFY(this->inner.block_size >= sizeof(SuperBlockInternal),
               "Block size too small");
@@ -1,5 +1,9 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
 #include <random>
+#include <thread>
 #include <unordered_set>
 
 #include "block/allocator.h"
@@ -62,6 +66,164 @@ TEST(BlockAllocatorTest, StressTest1) {
             << std::endl;
 }
 
+// Compare the allocation latency of the policies on a 90% full device, where
+// each allocation follows the deallocation of a random block.
+TEST(BlockAllocatorTest, PolicyLatency) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 1024;
+  const usize rounds = 100000;
+
+  const std::pair<AllocPolicy, const char *> policies[] = {
+      {AllocPolicy::FirstFit, "first-fit"},
+      {AllocPolicy::NextFit, "next-fit"},
+      {AllocPolicy::BestFit, "best-fit"},
+  };
+  for (auto [policy, name] : policies) {
+    auto bm =
+        std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+    auto allocator = BlockAllocator(bm);
+
+    // fill the device, then free a random tenth of it
+    std::vector<block_id_t> active;
+    while (allocator.free_block_cnt() > 0) {
+      active.push_back(allocator.allocate().unwrap());
+    }
+    std::mt19937 gen(0xdeadbeaf);
+    std::shuffle(active.begin(), active.end(), gen);
+    for (usize i = 0; i < block_cnt / 10; i++) {
+      ASSERT_TRUE(allocator.deallocate(active.back()).is_ok());
+      active.pop_back();
+    }
+
+    allocator.set_policy(policy);
+    std::chrono::nanoseconds total(0);
+    for (usize i = 0; i < rounds; i++) {
+      const usize victim = gen() % active.size();
+      ASSERT_TRUE(allocator.deallocate(active[victim]).is_ok());
+
+      auto start = std::chrono::steady_clock::now();
+      auto res = allocator.allocate();
+      total += std::chrono::steady_clock::now() - start;
+      ASSERT_TRUE(res.is_ok());
+      active[victim] = res.unwrap();
+    }
+    std::cout << name << ": " << total.count() / rounds << " ns per allocation"
+              << std::endl;
+  }
+}
+
+// Each thread allocates and frees blocks through a thread-safe allocator, so
+// the throughput should scale with the threads as they use different groups.
+TEST(BlockAllocatorTest, GroupScaling) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 1024;
+  const usize ops_per_thread = 200000;
+  const usize live_per_thread = 1024;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BlockAllocator(bm);
+  allocator.set_thread_safe(true);
+  const auto free_cnt = allocator.free_block_cnt();
+
+  double base_rate = 0;
+  const usize max_threads =
+      std::max<usize>(1, std::min(16u, std::thread::hardware_concurrency()));
+  for (usize thread_cnt = 1; thread_cnt <= max_threads; thread_cnt *= 2) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (usize t = 0; t < thread_cnt; t++) {
+      threads.emplace_back([&] {
+        // keep a window of live blocks, freeing the oldest one
+        std::vector<block_id_t> live(live_per_thread);
+        for (auto &id : live) {
+          id = allocator.allocate().unwrap();
+        }
+        for (usize i = 0; i < ops_per_thread; i++) {
+          auto &id = live[i % live_per_thread];
+          allocator.deallocate(id).unwrap();
+          id = allocator.allocate().unwrap();
+        }
+        allocator.deallocate(live).unwrap();
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    ASSERT_EQ(allocator.free_block_cnt(), free_cnt);
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double rate = thread_cnt * ops_per_thread / elapsed.count();
+    if (thread_cnt == 1) {
+      base_rate = rate;
+    }
+    std::cout << thread_cnt << " threads: " << rate / 1e6 << " Mops/s, "
+              << rate / base_rate << "x" << std::endl;
+  }
+}
+
+// The same through allocate_extent, as the file writes allocate, so the
+// extents should scale as well when the threads keep to their own groups.
+TEST(BlockAllocatorTest, ExtentScaling) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 1024 * 1024;
+  const usize ops_per_thread = 50000;
+  const usize live_per_thread = 64;
+  const usize max_len = 16;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BlockAllocator(bm);
+  allocator.set_thread_safe(true);
+  const auto free_cnt = allocator.free_block_cnt();
+
+  double base_rate = 0;
+  const usize max_threads =
+      std::max<usize>(1, std::min(16u, std::thread::hardware_concurrency()));
+  for (usize thread_cnt = 1; thread_cnt <= max_threads; thread_cnt *= 2) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (usize t = 0; t < thread_cnt; t++) {
+      threads.emplace_back([&] {
+        // keep a window of live extents, freeing the oldest one
+        std::vector<std::vector<block_id_t>> live(live_per_thread);
+        auto take = [&](std::vector<block_id_t> &ids) {
+          auto [first, len] = allocator.allocate_extent(1, max_len).unwrap();
+          ids.resize(len);
+          std::iota(ids.begin(), ids.end(), first);
+        };
+        for (auto &ids : live) {
+          take(ids);
+        }
+        for (usize i = 0; i < ops_per_thread; i++) {
+          auto &ids = live[i % live_per_thread];
+          allocator.deallocate(ids).unwrap();
+          take(ids);
+        }
+        for (auto &ids : live) {
+          allocator.deallocate(ids).unwrap();
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    ASSERT_EQ(allocator.free_block_cnt(), free_cnt);
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double rate = thread_cnt * ops_per_thread / elapsed.count();
+    if (thread_cnt == 1) {
+      base_rate = rate;
+    }
+    std::cout << thread_cnt << " threads: " << rate / 1e6
+              << " M extents/s, " << rate / base_rate << "x" << std::endl;
+  }
+}
+
 } // namespace chfs
 
 int main(int argc, char **argv) {
@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+#include "block/manager.h"
+
+namespace chfs {
+
+// Each thread reads and writes its own disjoint range of blocks, so the
+// throughput of a thread-safe device should scale with the threads.
+TEST(BlockManagerTest, DisjointScaling) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 64 * 1024;
+  const usize ops_per_thread = 200000;
+
+  auto opts = BlockManagerOptions{};
+  opts.thread_safe = true;
+  auto bm = BlockManager(block_cnt, block_sz, opts);
+
+  double base_rate = 0;
+  const usize max_threads =
+      std::max<usize>(1, std::min(16u, std::thread::hardware_concurrency()));
+  for (usize thread_cnt = 1; thread_cnt <= max_threads; thread_cnt *= 2) {
+    const usize range = block_cnt / thread_cnt;
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (usize t = 0; t < thread_cnt; t++) {
+      threads.emplace_back([&, t] {
+        std::vector<u8> buf(block_sz, static_cast<u8>(t));
+        for (usize i = 0; i < ops_per_thread; i++) {
+          const block_id_t id = t * range + (i * 7919) % range;
+          if (i % 4 == 0) {
+            bm.write_block(id, buf.data()).unwrap();
+          } else if (i % 4 == 1) {
+            bm.write_partial_block(id, buf.data(), 128, 512).unwrap();
+          } else {
+            bm.read_block(id, buf.data()).unwrap();
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double rate = thread_cnt * ops_per_thread / elapsed.count();
+    if (thread_cnt == 1) {
+      base_rate = rate;
+    }
+    std::cout << thread_cnt << " threads: " << rate / 1e6 << " Mops/s, "
+              << rate / base_rate << "x" << std::endl;
+  }
+}
+
+} // namespace chfs
+
+int main(int argc, char **argv) {
+  // Initialize Google Test
+  ::testing::InitGoogleTest(&argc, argv);
+
+  // Run the tests
+  return RUN_ALL_TESTS();
+}
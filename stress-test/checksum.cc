@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <numeric>
+
+#include "block/checksum.h"
+
+namespace chfs {
+
+// Compares the read throughput of a plain device with the same device behind
+// a ChecksumBlockManager, which verifies a CRC32C on every block it reads.
+TEST(ChecksumTest, ReadThroughput) {
+  const usize block_sz = 4096;
+  const usize block_cnt = 16 * 1024;
+  const usize batch = 64;
+  const usize rounds = 8;
+
+  auto bm = std::make_shared<BlockManager>(block_cnt, block_sz);
+  auto checked = ChecksumBlockManager(bm);
+  const usize data_cnt = checked.total_blocks();
+
+  std::vector<u8> buf(batch * block_sz);
+  for (usize i = 0; i < buf.size(); i++) {
+    buf[i] = static_cast<u8>(i * 131);
+  }
+  for (block_id_t id = 0; id < data_cnt; id++) {
+    checked.write_block(id, buf.data()).unwrap();
+  }
+
+  auto measure = [&](auto &&op) {
+    auto start = std::chrono::steady_clock::now();
+    for (usize r = 0; r < rounds; r++) {
+      for (block_id_t id = 0; id + batch <= data_cnt; id += batch) {
+        op(id);
+      }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double bytes = rounds * (data_cnt / batch) * batch * block_sz;
+    return bytes / elapsed.count() / (1 << 20);
+  };
+
+  const double raw_block = measure([&](block_id_t id) {
+    for (usize i = 0; i < batch; i++) {
+      bm->read_block(id + i, buf.data() + i * block_sz).unwrap();
+    }
+  });
+  const double checked_block = measure([&](block_id_t id) {
+    for (usize i = 0; i < batch; i++) {
+      checked.read_block(id + i, buf.data() + i * block_sz).unwrap();
+    }
+  });
+
+  std::vector<block_id_t> ids(batch);
+  const double raw_blocks = measure([&](block_id_t id) {
+    std::iota(ids.begin(), ids.end(), id);
+    bm->read_blocks(ids, buf.data()).unwrap();
+  });
+  const double checked_blocks = measure([&](block_id_t id) {
+    std::iota(ids.begin(), ids.end(), id);
+    checked.read_blocks(ids, buf.data()).unwrap();
+  });
+
+  std::cout << "read_block: " << raw_block << " MiB/s raw, " << checked_block
+            << " MiB/s checked, "
+            << (raw_block / checked_block - 1) * 100 << "% slower"
+            << std::endl;
+  std::cout << "read_blocks: " << raw_blocks << " MiB/s raw, "
+            << checked_blocks << " MiB/s checked, "
+            << (raw_blocks / checked_blocks - 1) * 100 << "% slower"
+            << std::endl;
+
+  // and the raw checksum rate over single blocks, for reference
+  auto start = std::chrono::steady_clock::now();
+  u32 crc = 0;
+  for (usize r = 0; r < rounds * 64; r++) {
+    for (usize i = 0; i < batch; i++) {
+      crc += crc32c(buf.data() + i * block_sz, block_sz);
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "crc32c: " << rounds * 64 * buf.size() / elapsed.count() /
+                                 (1 << 20)
+            << " MiB/s (" << crc << ")" << std::endl;
+}
+
+} // namespace chfs
+
+int main(int argc, char **argv) {
+  // Initialize Google Test
+  ::testing::InitGoogleTest(&argc, argv);
+
+  // Run the tests
+  return RUN_ALL_TESTS();
+}
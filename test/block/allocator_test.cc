@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <limits>
+#include <thread>
+
 #include "block/allocator.h"
 #include "common/macros.h"
 #include "gtest/gtest.h"
@@ -66,4 +70,456 @@ TEST_F(BlockAllocatorTest, Allocation) {
   }
 }
 
-} // namespace chfs
\ No newline at end of file
+TEST_F(BlockAllocatorTest, DiscardOnFree) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(1024, 4096));
+  auto allocator = BlockAllocator(bm);
+  allocator.set_discard_on_free(true);
+
+  auto block_id = allocator.allocate().unwrap();
+  std::vector<u8> data(bm->block_size(), 0xcc);
+  bm->write_block(block_id, data.data());
+
+  ASSERT_TRUE(allocator.deallocate(block_id).is_ok());
+  std::vector<u8> buf(bm->block_size());
+  bm->read_block(block_id, buf.data());
+  ASSERT_EQ(buf, std::vector<u8>(bm->block_size(), 0));
+  ASSERT_TRUE(allocator.deallocate(block_id).is_err());
+}
+
+TEST_F(BlockAllocatorTest, Grow) {
+  // 4096 blocks per bitmap block
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(4096, 512));
+  auto allocator = BlockAllocator(bm);
+  auto free_cnt = allocator.free_block_cnt();
+  ASSERT_EQ(free_cnt, 4095);
+
+  ASSERT_TRUE(allocator.grow(8192).is_err());
+  bm->grow(4096 * 3 + 100).unwrap();
+  ASSERT_TRUE(allocator.grow(4096 * 3 + 100).is_ok());
+  ASSERT_EQ(allocator.total_bitmap_block(), 4);
+  // three new bitmap blocks, each at the first block it tracks
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt + 4096 * 2 + 100 - 3);
+  ASSERT_TRUE(allocator.deallocate(8192).is_err());
+
+  auto reopened = BlockAllocator::create_from_existing(bm, 0, 1);
+  ASSERT_EQ(reopened->free_block_cnt(), allocator.free_block_cnt());
+
+  std::vector<bool> seen(bm->total_blocks(), false);
+  while (true) {
+    auto res = allocator.allocate();
+    if (res.is_err()) {
+      break;
+    }
+    auto id = res.unwrap();
+    ASSERT_FALSE(seen[id]);
+    seen[id] = true;
+  }
+  ASSERT_FALSE(seen[4096]);
+  ASSERT_FALSE(seen[8192]);
+  ASSERT_FALSE(seen[12288]);
+  ASSERT_TRUE(seen[12387]);
+  ASSERT_EQ(allocator.free_block_cnt(), 0);
+}
+
+TEST_F(BlockAllocatorTest, WriteThrough) {
+  // 4096 blocks per bitmap block
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(4096 * 3, 512));
+  auto allocator = BlockAllocator(bm, 1);
+  ASSERT_EQ(allocator.free_block_cnt(), 4096 * 3 - 4);
+
+  // fill the first bitmap block, so the next allocation skips it
+  std::vector<block_id_t> ids;
+  for (usize i = 0; i < 4096 - 4; i++) {
+    ids.push_back(allocator.allocate().unwrap());
+  }
+  ASSERT_EQ(allocator.allocate().unwrap(), 4096);
+  ASSERT_TRUE(allocator.deallocate(ids[10]).is_ok());
+  ASSERT_TRUE(allocator.deallocate(ids[10]).is_err());
+  ASSERT_EQ(allocator.free_block_cnt(), 4096 * 2);
+
+  // the bitmap on the block manager is up to date
+  auto reopened = BlockAllocator::create_from_existing(bm, 1, 3);
+  ASSERT_EQ(reopened->free_block_cnt(), allocator.free_block_cnt());
+  ASSERT_EQ(reopened->allocate().unwrap(), ids[10]);
+  ASSERT_EQ(reopened->allocate().unwrap(), 4097);
+}
+
+TEST_F(BlockAllocatorTest, Policies) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(4096 * 2, 512));
+  auto allocator = BlockAllocator(bm);
+  ASSERT_EQ(allocator.get_policy(), AllocPolicy::NextFit);
+
+  // [2, 200) used, then free 10, [20, 23) and [40, 50)
+  for (usize i = 0; i < 198; i++) {
+    ASSERT_EQ(allocator.allocate().unwrap(), i + 2);
+  }
+  ASSERT_TRUE(allocator.deallocate(10).is_ok());
+  for (block_id_t id = 20; id < 23; id++) {
+    ASSERT_TRUE(allocator.deallocate(id).is_ok());
+  }
+  for (block_id_t id = 40; id < 50; id++) {
+    ASSERT_TRUE(allocator.deallocate(id).is_ok());
+  }
+
+  // the rotor goes on after the last allocated block
+  ASSERT_EQ(allocator.allocate().unwrap(), 200);
+  ASSERT_TRUE(allocator.deallocate(200).is_ok());
+  ASSERT_EQ(allocator.allocate().unwrap(), 201);
+
+  allocator.set_policy(AllocPolicy::FirstFit);
+  ASSERT_EQ(allocator.allocate().unwrap(), 10);
+  ASSERT_EQ(allocator.allocate().unwrap(), 20);
+
+  // the smallest runs left in the first bitmap block are 200 and [21, 23)
+  allocator.set_policy(AllocPolicy::BestFit);
+  ASSERT_EQ(allocator.allocate().unwrap(), 200);
+  ASSERT_EQ(allocator.allocate().unwrap(), 21);
+  ASSERT_EQ(allocator.allocate().unwrap(), 22);
+  ASSERT_EQ(allocator.allocate().unwrap(), 40);
+
+  allocator.set_policy(AllocPolicy::NextFit);
+  ASSERT_EQ(allocator.allocate().unwrap(), 41);
+  for (usize i = 0; i < 8; i++) {
+    ASSERT_EQ(allocator.allocate().unwrap(), 42 + i);
+  }
+  ASSERT_EQ(allocator.allocate().unwrap(), 202);
+
+  // the rotor wraps around when the tail is full
+  while (allocator.free_block_cnt() > 0) {
+    allocator.allocate().unwrap();
+  }
+  ASSERT_TRUE(allocator.deallocate(5000).is_ok());
+  ASSERT_TRUE(allocator.deallocate(30).is_ok());
+  ASSERT_EQ(allocator.allocate().unwrap(), 30);
+  ASSERT_EQ(allocator.allocate().unwrap(), 5000);
+  ASSERT_TRUE(allocator.allocate().is_err());
+}
+
+TEST_F(BlockAllocatorTest, Extent) {
+  // 4096 blocks per bitmap block
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(4096 * 3, 512));
+  auto allocator = BlockAllocator(bm);
+  ASSERT_TRUE(allocator.allocate_extent(0, 4).is_err());
+  ASSERT_TRUE(allocator.allocate_extent(4, 2).is_err());
+
+  // across the bitmap blocks
+  auto extent = allocator.allocate_extent(1, 5000).unwrap();
+  ASSERT_EQ(extent, std::make_pair(block_id_t(3), usize(5000)));
+  auto free_cnt = allocator.free_block_cnt();
+  ASSERT_EQ(free_cnt, 4096 * 3 - 3 - 5000);
+
+  // free [100, 110) and [200, 300)
+  for (block_id_t id = 100; id < 110; id++) {
+    ASSERT_TRUE(allocator.deallocate(id).is_ok());
+  }
+  for (block_id_t id = 200; id < 300; id++) {
+    ASSERT_TRUE(allocator.deallocate(id).is_ok());
+  }
+
+  // from the goal, taking what is left of its run
+  ASSERT_EQ(allocator.allocate_extent(1, 3, 105).unwrap(),
+            std::make_pair(block_id_t(105), usize(3)));
+  // a full run is preferred over a shorter one at the goal
+  ASSERT_EQ(allocator.allocate_extent(1, 50, 100).unwrap(),
+            std::make_pair(block_id_t(200), usize(50)));
+  // skipping the runs too short
+  ASSERT_EQ(allocator.allocate_extent(10, 20, 100).unwrap(),
+            std::make_pair(block_id_t(250), usize(20)));
+  // the longest run when none is long enough
+  ASSERT_EQ(allocator.allocate_extent(1, 8000, 100).unwrap(),
+            std::make_pair(block_id_t(5003), usize(4096 * 3 - 5003)));
+  ASSERT_TRUE(allocator.allocate_extent(31, 100, 100).is_err());
+  ASSERT_EQ(allocator.allocate_extent(30, 100, 100).unwrap(),
+            std::make_pair(block_id_t(270), usize(30)));
+
+  // the bitmap on the block manager is up to date
+  auto reopened = BlockAllocator::create_from_existing(bm, 0, 3);
+  ASSERT_EQ(reopened->free_block_cnt(), 7);
+  ASSERT_EQ(reopened->free_block_cnt(), allocator.free_block_cnt());
+  ASSERT_EQ(reopened->allocate_extent(1, 8).unwrap(),
+            std::make_pair(block_id_t(100), usize(5)));
+  ASSERT_EQ(reopened->allocate_extent(1, 8).unwrap(),
+            std::make_pair(block_id_t(108), usize(2)));
+  ASSERT_TRUE(reopened->allocate_extent(1, 8).is_err());
+}
+
+// Counts the writes to the bitmap blocks
+class CountingBlockManager : public BlockManager {
+public:
+  using BlockManager::BlockManager;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override {
+    if (this->partial_writes == this->fail_at) {
+      this->fail_at = std::numeric_limits<usize>::max();
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+    this->partial_writes++;
+    return BlockManager::write_partial_block(block_id, block_data, offset,
+                                             len);
+  }
+
+  usize partial_writes = 0;
+  // the partial write that fails once, counted like `partial_writes`
+  usize fail_at = std::numeric_limits<usize>::max();
+};
+
+TEST_F(BlockAllocatorTest, Batch) {
+  // 4096 blocks per bitmap block
+  auto bm = std::make_shared<CountingBlockManager>(4096 * 3, 512);
+  auto allocator = BlockAllocator(bm);
+  ASSERT_TRUE(allocator.allocate(4096 * 3).is_err());
+
+  // in ascending order, after the rotor, then wrapping around
+  ASSERT_EQ(allocator.allocate().unwrap(), 3);
+  ASSERT_TRUE(allocator.deallocate(3).is_ok());
+  bm->partial_writes = 0;
+  auto ids = allocator.allocate(4096 * 3 - 3).unwrap();
+  ASSERT_EQ(bm->partial_writes, 3);
+  ASSERT_EQ(ids.size(), 4096 * 3 - 3);
+  for (usize i = 0; i < ids.size(); i++) {
+    ASSERT_EQ(ids[i], i + 3);
+  }
+  ASSERT_EQ(allocator.free_block_cnt(), 0);
+
+  // nothing is freed if any block cannot be
+  ASSERT_TRUE(allocator.deallocate(std::vector<block_id_t>{10, 20, 10})
+                  .is_err());
+  ASSERT_TRUE(allocator.deallocate(10).is_ok());
+  ASSERT_TRUE(allocator.deallocate(std::vector<block_id_t>{20, 10}).is_err());
+  ASSERT_EQ(allocator.free_block_cnt(), 1);
+
+  // one write per bitmap block
+  std::vector<block_id_t> to_free;
+  for (block_id_t id = 5000; id > 100; id -= 3) {
+    to_free.push_back(id);
+  }
+  bm->partial_writes = 0;
+  ASSERT_TRUE(allocator.deallocate(to_free).is_ok());
+  ASSERT_EQ(bm->partial_writes, 2);
+  ASSERT_EQ(allocator.free_block_cnt(), 1 + to_free.size());
+
+  auto reopened = BlockAllocator::create_from_existing(bm, 0, 3);
+  ASSERT_EQ(reopened->free_block_cnt(), allocator.free_block_cnt());
+  ids = reopened->allocate(3).unwrap();
+  ASSERT_EQ(ids, std::vector<block_id_t>({10, 101, 104}));
+  ASSERT_TRUE(allocator.allocate(0).unwrap().empty());
+}
+
+TEST_F(BlockAllocatorTest, BatchDedup) {
+  auto bm = std::make_shared<BlockManager>(4096, 512);
+  auto allocator = BlockAllocator(bm);
+  auto dedup = std::make_shared<DedupIndex>(16);
+  allocator.set_dedup(dedup);
+
+  // block a has three references, block b one
+  auto a = allocator.allocate().unwrap();
+  auto b = allocator.allocate().unwrap();
+  dedup->add_ref(a);
+  dedup->add_ref(a);
+  const auto free_cnt = allocator.free_block_cnt();
+
+  // more frees than references: nothing is released
+  ASSERT_TRUE(allocator.deallocate(std::vector<block_id_t>{a, b, b})
+                  .is_err());
+  ASSERT_TRUE(allocator.deallocate(std::vector<block_id_t>{a, a, a, a})
+                  .is_err());
+  ASSERT_EQ(dedup->ref_count(a), 3);
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt);
+
+  // dropping some references keeps the block
+  ASSERT_TRUE(allocator.deallocate(std::vector<block_id_t>{a, a}).is_ok());
+  ASSERT_EQ(dedup->ref_count(a), 1);
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt);
+
+  ASSERT_TRUE(allocator.deallocate(std::vector<block_id_t>{b, a}).is_ok());
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt + 2);
+}
+
+TEST_F(BlockAllocatorTest, BatchFailure) {
+  // 4096 blocks per bitmap block
+  auto bm = std::make_shared<CountingBlockManager>(4096 * 3, 512);
+  auto allocator = BlockAllocator(bm);
+  auto dedup = std::make_shared<DedupIndex>(16);
+  allocator.set_dedup(dedup);
+  const auto free_cnt = allocator.free_block_cnt();
+
+  // the second bitmap block fails, so the first one is rolled back
+  bm->fail_at = bm->partial_writes + 1;
+  ASSERT_TRUE(allocator.allocate(5000).is_err());
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt);
+  auto reopened = BlockAllocator::create_from_existing(bm, 0, 3);
+  ASSERT_EQ(reopened->free_block_cnt(), free_cnt);
+
+  auto ids = allocator.allocate(5000).unwrap();
+  dedup->add_ref(ids[0]);
+  const std::vector<block_id_t> to_free = {ids[0], ids[0], ids[1],
+                                           ids[4999]};
+  bm->fail_at = bm->partial_writes + 1;
+  ASSERT_TRUE(allocator.deallocate(to_free).is_err());
+  // neither the bits nor the references have changed
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt - 5000);
+  ASSERT_EQ(dedup->ref_count(ids[0]), 2);
+  reopened = BlockAllocator::create_from_existing(bm, 0, 3);
+  ASSERT_EQ(reopened->free_block_cnt(), free_cnt - 5000);
+
+  // and the same batch can be freed again
+  ASSERT_TRUE(allocator.deallocate(to_free).is_ok());
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt - 4997);
+  ASSERT_EQ(dedup->ref_count(ids[0]), 1);
+
+  // a failing single free keeps the reference of the block as well
+  dedup->add_ref(ids[2]);
+  ASSERT_TRUE(allocator.deallocate(ids[2]).is_ok());
+  bm->fail_at = bm->partial_writes;
+  ASSERT_TRUE(allocator.deallocate(ids[2]).is_err());
+  ASSERT_EQ(dedup->ref_count(ids[2]), 1);
+  ASSERT_TRUE(allocator.deallocate(ids[2]).is_ok());
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt - 4996);
+}
+
+TEST_F(BlockAllocatorTest, ThreadSafe) {
+  // 8 groups of 4096 blocks
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(4096 * 8, 512));
+  auto allocator = BlockAllocator(bm);
+  allocator.set_thread_safe(true);
+  const usize free_cnt = allocator.free_block_cnt();
+
+  // more than a group each, so the threads steal from the others
+  const usize thread_cnt = 4;
+  const usize per_thread = 6000;
+  std::vector<std::vector<block_id_t>> allocated(thread_cnt);
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < thread_cnt; t++) {
+    threads.emplace_back([&, t] {
+      for (usize i = 0; i < per_thread; i++) {
+        auto id = allocator.allocate().unwrap();
+        allocated[t].push_back(id);
+        if (i % 3 == 0) {
+          allocator.deallocate(allocated[t].front()).unwrap();
+          allocated[t].erase(allocated[t].begin());
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::vector<block_id_t> all;
+  for (auto &ids : allocated) {
+    all.insert(all.end(), ids.begin(), ids.end());
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(std::adjacent_find(all.begin(), all.end()), all.end());
+  ASSERT_EQ(allocator.free_block_cnt() + all.size(), free_cnt);
+
+  auto reopened = BlockAllocator::create_from_existing(bm, 0, 8);
+  ASSERT_EQ(reopened->free_block_cnt(), allocator.free_block_cnt());
+  ASSERT_TRUE(allocator.deallocate(all).is_ok());
+  ASSERT_EQ(allocator.free_block_cnt(), free_cnt);
+
+  // the extents are taken within a group each, and never overlap
+  std::vector<std::vector<std::pair<block_id_t, usize>>> extents(thread_cnt);
+  threads.clear();
+  for (usize t = 0; t < thread_cnt; t++) {
+    threads.emplace_back([&, t] {
+      for (usize i = 0; i < 200; i++) {
+        auto res = allocator.allocate_extent(1, 64);
+        if (res.is_err()) {
+          break;
+        }
+        extents[t].push_back(res.unwrap());
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  all.clear();
+  for (auto &runs : extents) {
+    for (auto [start, len] : runs) {
+      ASSERT_EQ(start / 4096, (start + len - 1) / 4096);
+      for (usize i = 0; i < len; i++) {
+        all.push_back(start + i);
+      }
+    }
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(std::adjacent_find(all.begin(), all.end()), all.end());
+  ASSERT_EQ(allocator.free_block_cnt() + all.size(), free_cnt);
+
+  // a goal keeps the search in its group
+  ASSERT_TRUE(allocator.deallocate(all).is_ok());
+  auto [start, len] = allocator.allocate_extent(1, 16, 4096 * 5 + 10).unwrap();
+  ASSERT_EQ(start, 4096 * 5 + 10);
+  ASSERT_EQ(len, 16);
+  // and the run ends at the group boundary
+  std::tie(start, len) = allocator.allocate_extent(1, 8192, 4096 * 6).unwrap();
+  ASSERT_EQ(start, 4096 * 6);
+  ASSERT_EQ(len, 4096);
+}
+
+TEST_F(BlockAllocatorTest, GrowConcurrently) {
+  BlockManagerOptions opts;
+  opts.thread_safe = true;
+  opts.max_blocks = 4096 * 8;
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(4096, 512, opts));
+  auto allocator = BlockAllocator(bm);
+  allocator.set_thread_safe(true);
+
+  // the threads keep allocating, writing and freeing blocks while the
+  // device and the bitmap grow under them
+  std::atomic<bool> done{false};
+  std::atomic<usize> max_id{0};
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      std::vector<u8> data(bm->block_size(), static_cast<u8>(t + 1));
+      std::vector<u8> buf(bm->block_size());
+      std::vector<block_id_t> held;
+      while (!done) {
+        auto res = allocator.allocate();
+        if (res.is_ok()) {
+          auto id = res.unwrap();
+          bm->write_block(id, data.data()).unwrap();
+          bm->read_block(id, buf.data()).unwrap();
+          ASSERT_EQ(buf, data);
+          held.push_back(id);
+          if (id > max_id) {
+            max_id = id;
+          }
+        }
+        if (res.is_err()) {
+          // out of blocks until the next grow
+          ASSERT_TRUE(allocator.deallocate(held).is_ok());
+          held.clear();
+        }
+      }
+      ASSERT_TRUE(allocator.deallocate(held).is_ok());
+    });
+  }
+  for (usize groups = 2; groups <= 8; groups++) {
+    // grow once the threads are about to run out
+    while (allocator.free_block_cnt() > 512) {
+      std::this_thread::yield();
+    }
+    bm->grow(4096 * groups).unwrap();
+    allocator.grow(4096 * groups).unwrap();
+  }
+  while (max_id < 4096 * 7) {
+    std::this_thread::yield();
+  }
+  done = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(allocator.total_bitmap_block(), 8);
+  ASSERT_EQ(allocator.free_block_cnt(), 4096 * 8 - 8);
+  auto reopened = BlockAllocator::create_from_existing(bm, 0, 1);
+  ASSERT_EQ(reopened->free_block_cnt(), allocator.free_block_cnt());
+}
+
+} // namespace chfs
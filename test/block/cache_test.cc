@@ -0,0 +1,262 @@
+#include "block/cache.h"
+#include "common/macros.h"
+#include "gtest/gtest.h"
+#include <cstring>
+
+namespace chfs {
+
+class CachedBlockManagerTest : public ::testing::Test {
+protected:
+  // This function is called before every test.
+  void SetUp() override {}
+
+  // This function is called after every test.
+  void TearDown() override{};
+};
+
+TEST_F(CachedBlockManagerTest, ReadWriteBack) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 4);
+
+  std::vector<u8> data(cached.block_size());
+  std::vector<u8> buf(cached.block_size());
+  std::strncpy((char *)data.data(), "A test string.", cached.block_size());
+
+  cached.write_block(3, data.data()).unwrap();
+  cached.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data(), data.data(), cached.block_size()), 0);
+
+  // the write is not visible to the underlying manager before the flush
+  bm->read_block(3, buf.data()).unwrap();
+  EXPECT_NE(std::memcmp(buf.data(), data.data(), cached.block_size()), 0);
+  EXPECT_EQ(cached.dirty_blocks(), 1);
+
+  cached.flush().unwrap();
+  EXPECT_EQ(cached.dirty_blocks(), 0);
+  bm->read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data(), data.data(), cached.block_size()), 0);
+}
+
+TEST_F(CachedBlockManagerTest, PartialWriteAndZero) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 4);
+
+  std::vector<u8> data(cached.block_size(), 0xab);
+  std::vector<u8> buf(cached.block_size());
+  bm->write_block(5, data.data()).unwrap();
+
+  const char *msg = "hello";
+  cached.write_partial_block(5, (const u8 *)msg, 100, 5).unwrap();
+  cached.read_block(5, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data() + 100, msg, 5), 0);
+  EXPECT_EQ(buf[99], 0xab);
+  EXPECT_EQ(buf[105], 0xab);
+
+  cached.zero_block(5).unwrap();
+  cached.flush().unwrap();
+  bm->read_block(5, buf.data()).unwrap();
+  for (usize i = 0; i < cached.block_size(); i++) {
+    ASSERT_EQ(buf[i], 0);
+  }
+}
+
+TEST_F(CachedBlockManagerTest, Eviction) {
+  for (auto policy : {CachePolicy::LRU, CachePolicy::Clock}) {
+    auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+    auto cached = CachedBlockManager(bm, 8, policy);
+
+    std::vector<u8> buf(cached.block_size());
+    for (block_id_t i = 0; i < 64; ++i) {
+      std::vector<u8> data(cached.block_size(), static_cast<u8>(i + 1));
+      cached.write_block(i, data.data()).unwrap();
+    }
+    ASSERT_EQ(cached.cached_blocks(), 8);
+
+    // the evicted blocks must have been written back
+    for (block_id_t i = 0; i < 64; ++i) {
+      cached.read_block(i, buf.data()).unwrap();
+      ASSERT_EQ(buf[0], static_cast<u8>(i + 1));
+      ASSERT_EQ(buf[cached.block_size() - 1], static_cast<u8>(i + 1));
+    }
+  }
+}
+
+TEST_F(CachedBlockManagerTest, LRUKeepsHotBlocks) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 4, CachePolicy::LRU);
+
+  std::vector<u8> buf(cached.block_size());
+  for (block_id_t i = 0; i < 32; ++i) {
+    // block 0 is touched between every other access
+    cached.read_block(0, buf.data()).unwrap();
+    cached.read_block(i + 1, buf.data()).unwrap();
+  }
+  auto misses = cached.miss_count();
+  cached.read_block(0, buf.data()).unwrap();
+  EXPECT_EQ(cached.miss_count(), misses);
+}
+
+TEST_F(CachedBlockManagerTest, PinnedFramesStay) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 2);
+
+  std::vector<u8> buf(cached.block_size());
+  {
+    auto guard = cached.write_guard(7).unwrap();
+    guard.as_mut<u64>(1) = 42;
+
+    // the pinned frame is never chosen as the victim
+    for (block_id_t i = 10; i < 20; ++i) {
+      cached.read_block(i, buf.data()).unwrap();
+    }
+    ASSERT_EQ(guard.as<u64>(1), 42);
+
+    // a second pin leaves no frame for eviction
+    auto another = cached.read_guard(8).unwrap();
+    ASSERT_TRUE(cached.read_block(9, buf.data()).is_err());
+  }
+
+  ASSERT_EQ(cached.dirty_blocks(), 1);
+  cached.flush().unwrap();
+  bm->read_block(7, buf.data()).unwrap();
+  ASSERT_EQ(reinterpret_cast<u64 *>(buf.data())[1], 42);
+}
+
+TEST_F(CachedBlockManagerTest, AsyncThroughCache) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 8);
+
+  // more blocks than frames, so the workers race on eviction
+  std::vector<u8> data(128 * 4096);
+  std::vector<std::future<ChfsNullResult>> futures;
+  for (usize i = 0; i < 128; ++i) {
+    memset(data.data() + i * 4096, static_cast<int>(i), 4096);
+    futures.push_back(cached.write_block_async(i, data.data() + i * 4096));
+  }
+  for (auto &future : futures) {
+    ASSERT_TRUE(future.get().is_ok());
+  }
+
+  cached.flush().unwrap();
+  std::vector<u8> result(128 * 4096);
+  bm->read_blocks(std::vector<block_id_t>([] {
+                    std::vector<block_id_t> ids;
+                    for (block_id_t i = 0; i < 128; ++i) {
+                      ids.push_back(i);
+                    }
+                    return ids;
+                  }()),
+                  result.data())
+      .unwrap();
+  ASSERT_EQ(result, data);
+}
+
+TEST_F(CachedBlockManagerTest, SyncFlushesFirst) {
+  std::string file("cache_sync_test.db");
+  remove(file.c_str());
+  auto bm = std::make_shared<BlockManager>(file, KDefaultBlockCnt);
+  auto cached = CachedBlockManager(bm, 8);
+  std::vector<u8> data(bm->block_size(), 0x5a);
+
+  cached.write_block(1, data.data()).unwrap();
+  cached.write_block(9, data.data()).unwrap();
+  ASSERT_EQ(bm->dirty_block_cnt(), 0);
+
+  ASSERT_TRUE(cached.sync_range(0, 4).is_ok());
+  ASSERT_EQ(cached.dirty_blocks(), 1);
+  ASSERT_EQ(bm->dirty_block_cnt(), 0);
+
+  ASSERT_TRUE(cached.sync().is_ok());
+  ASSERT_EQ(cached.dirty_blocks(), 0);
+  ASSERT_EQ(bm->dirty_block_cnt(), 0);
+
+  std::vector<u8> buf(bm->block_size());
+  bm->read_block(9, buf.data()).unwrap();
+  ASSERT_EQ(buf, data);
+  remove(file.c_str());
+}
+
+TEST_F(CachedBlockManagerTest, Discard) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 8);
+  std::vector<u8> data(cached.block_size(), 0x11);
+  std::vector<u8> buf(cached.block_size());
+
+  cached.write_block(1, data.data()).unwrap();
+  cached.write_block(2, data.data()).unwrap();
+  ASSERT_EQ(cached.dirty_blocks(), 2);
+
+  // the dirty copy of block 1 is dropped rather than written back
+  cached.discard_blocks({1}).unwrap();
+  ASSERT_EQ(cached.dirty_blocks(), 1);
+  ASSERT_EQ(cached.cached_blocks(), 1);
+  cached.read_block(1, buf.data()).unwrap();
+  ASSERT_EQ(buf, std::vector<u8>(cached.block_size(), 0));
+}
+
+TEST_F(CachedBlockManagerTest, ZeroDiscards) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 8);
+  cached.set_discard(true);
+  std::vector<u8> data(cached.block_size(), 0x33);
+  std::vector<u8> buf(cached.block_size());
+  const std::vector<u8> zeros(cached.block_size(), 0);
+
+  bm->write_block(4, data.data()).unwrap();
+  cached.write_block(3, data.data()).unwrap();
+  cached.read_block(4, buf.data()).unwrap();
+  ASSERT_EQ(cached.cached_blocks(), 2);
+
+  // the cached copies are dropped, and the device is zeroed at once
+  // rather than upon the next flush
+  cached.zero_block(3).unwrap();
+  cached.zero_block(4).unwrap();
+  ASSERT_EQ(cached.dirty_blocks(), 0);
+  ASSERT_EQ(cached.cached_blocks(), 0);
+  bm->read_block(4, buf.data()).unwrap();
+  ASSERT_EQ(buf, zeros);
+  cached.read_block(3, buf.data()).unwrap();
+  ASSERT_EQ(buf, zeros);
+}
+
+TEST_F(CachedBlockManagerTest, Prefetch) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(128, 4096));
+  auto cached = CachedBlockManager(bm, 8);
+  std::vector<u8> data(cached.block_size(), 0x22);
+  std::vector<u8> buf(cached.block_size());
+  bm->write_block(10, data.data()).unwrap();
+
+  // at most half of the frames are filled
+  cached.prefetch({10, 11, 12, 13, 14, 15}).unwrap();
+  cached.wait_async();
+  ASSERT_EQ(cached.cached_blocks(), 4);
+  ASSERT_EQ(cached.miss_count(), 4);
+
+  cached.read_block(10, buf.data()).unwrap();
+  ASSERT_EQ(buf, data);
+  ASSERT_EQ(cached.hit_count(), 1);
+  ASSERT_EQ(cached.miss_count(), 4);
+
+  ASSERT_TRUE(cached.prefetch({128}).is_err());
+}
+
+TEST_F(CachedBlockManagerTest, Iterator) {
+  auto bm = std::make_shared<BlockManager>(256, 4096);
+  auto cached = CachedBlockManager(bm, 16);
+
+  // the modifications go through the cache frames
+  auto opts = BlockIteratorOptions{};
+  opts.prefetch = 4;
+  auto iter = BlockIterator::create(&cached, 10, 20, opts).unwrap();
+  for (; iter.has_next(); iter.next_block().unwrap()) {
+    iter.mut_data()[0] = static_cast<u8>(iter.cur_block_id());
+  }
+  cached.wait_async();
+  ASSERT_EQ(cached.dirty_blocks(), 10);
+  cached.flush().unwrap();
+  for (block_id_t i = 10; i < 20; ++i) {
+    ASSERT_EQ(bm->unsafe_get_block_ptr()[i * 4096], i);
+  }
+}
+
+} // namespace chfs
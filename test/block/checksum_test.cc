@@ -0,0 +1,179 @@
+#include "block/checksum.h"
+#include "common/macros.h"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <random>
+#include <thread>
+
+namespace chfs {
+
+class ChecksumBlockManagerTest : public ::testing::Test {
+protected:
+  // This function is called before every test.
+  void SetUp() override {}
+
+  // This function is called after every test.
+  void TearDown() override{};
+};
+
+TEST_F(ChecksumBlockManagerTest, Crc32c) {
+  const char *check = "123456789";
+  auto data = reinterpret_cast<const u8 *>(check);
+  EXPECT_EQ(crc32c(data, 9), 0xE3069283);
+  EXPECT_EQ(crc32c_software(data, 9), 0xE3069283);
+  // checksum in pieces
+  EXPECT_EQ(crc32c(data + 4, 5, crc32c(data, 4)), 0xE3069283);
+
+  std::mt19937 rng(42);
+  std::vector<u8> buf(3 * 8192 + 4099);
+  for (auto &b : buf) {
+    b = rng() & 0xff;
+  }
+  for (usize len = 0; len < buf.size(); len += 37) {
+    ASSERT_EQ(crc32c(buf.data(), len), crc32c_software(buf.data(), len));
+  }
+  // unaligned, and resumed across the interleaved chunks
+  auto crc = crc32c(buf.data() + 3, 3 * 256 + 5);
+  crc = crc32c(buf.data() + 3 * 256 + 8, buf.size() - 3 * 256 - 8, crc);
+  EXPECT_EQ(crc, crc32c_software(buf.data() + 3, buf.size() - 3));
+}
+
+TEST_F(ChecksumBlockManagerTest, ReadWriteVerify) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(1025, 4096));
+  auto checked = ChecksumBlockManager(bm);
+  // 1024 entries per table block
+  EXPECT_EQ(checked.get_table_blocks(), 1);
+  EXPECT_EQ(checked.total_blocks(), 1024);
+
+  std::vector<u8> data(checked.block_size());
+  std::vector<u8> buf(checked.block_size());
+  std::strncpy((char *)data.data(), "A test string.", checked.block_size());
+
+  checked.write_block(3, data.data()).unwrap();
+  checked.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+
+  checked.write_partial_block(3, data.data(), 100, 14).unwrap();
+  checked.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data() + 100, data.data(), 14), 0);
+
+  checked.zero_block(4).unwrap();
+  checked.read_block(4, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(checked.block_size(), 0));
+
+  // a block never written through the layer is not verified
+  checked.read_block(5, buf.data()).unwrap();
+  EXPECT_TRUE(checked.write_block(1024, data.data()).is_err());
+
+  // corrupt a block behind the layer
+  bm->write_partial_block(3, data.data(), 2000, 1).unwrap();
+  auto res = checked.read_block(3, buf.data());
+  ASSERT_TRUE(res.is_err());
+  EXPECT_EQ(res.unwrap_error(), ErrorType::Corrupted);
+
+  // the table survives a reload
+  auto reloaded = ChecksumBlockManager(bm);
+  EXPECT_TRUE(reloaded.read_block(3, buf.data()).is_err());
+  EXPECT_TRUE(reloaded.read_block(4, buf.data()).is_ok());
+}
+
+TEST_F(ChecksumBlockManagerTest, Vectored) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(4096, 4096));
+  auto checked = ChecksumBlockManager(bm);
+  const auto block_sz = checked.block_size();
+
+  // across table blocks, in random order
+  std::vector<block_id_t> ids = {2000, 7, 8, 9, 1023, 1024, 3000};
+  std::vector<u8> data(ids.size() * block_sz);
+  for (usize i = 0; i < data.size(); i++) {
+    data[i] = static_cast<u8>(i * 7 + i / block_sz);
+  }
+  checked.write_blocks(ids, data.data()).unwrap();
+
+  std::vector<u8> buf(data.size());
+  checked.read_blocks(ids, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+  for (usize i = 0; i < ids.size(); i++) {
+    checked.read_block(ids[i], buf.data()).unwrap();
+    EXPECT_EQ(std::memcmp(buf.data(), data.data() + i * block_sz, block_sz), 0);
+  }
+
+  bm->zero_block(1024).unwrap();
+  auto res = checked.read_blocks(ids, buf.data());
+  ASSERT_TRUE(res.is_err());
+  EXPECT_EQ(res.unwrap_error(), ErrorType::Corrupted);
+
+  auto reloaded = ChecksumBlockManager(bm);
+  EXPECT_TRUE(reloaded.read_blocks({7, 8, 9, 3000}, buf.data()).is_ok());
+}
+
+TEST_F(ChecksumBlockManagerTest, Grow) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(1025, 4096));
+  auto checked = ChecksumBlockManager(bm);
+  std::vector<u8> data(checked.block_size(), 0x3c);
+  std::vector<u8> buf(checked.block_size());
+  checked.write_block(1023, data.data()).unwrap();
+
+  ASSERT_TRUE(checked.grow(2000).is_ok());
+  EXPECT_EQ(checked.total_blocks(), 2000);
+  EXPECT_EQ(checked.get_table_blocks(), 2);
+  EXPECT_EQ(bm->total_blocks(), 2002);
+  checked.read_block(1023, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+  checked.write_block(1999, data.data()).unwrap();
+
+  // the moved table is found again on reload
+  auto reloaded = ChecksumBlockManager(bm);
+  EXPECT_EQ(reloaded.total_blocks(), 2000);
+  EXPECT_TRUE(reloaded.read_block(1999, buf.data()).is_ok());
+  bm->zero_block(1999).unwrap();
+  EXPECT_TRUE(reloaded.read_block(1999, buf.data()).is_err());
+}
+
+TEST_F(ChecksumBlockManagerTest, ThreadSafe) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(1025, 4096));
+  bm->set_thread_safe(true);
+  auto checked = ChecksumBlockManager(bm);
+  checked.set_thread_safe(true);
+
+  // the threads overwrite the same blocks, whose readers must never see a
+  // block that does not match its checksum
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      std::vector<u8> data(2 * 4096, static_cast<u8>(t + 1));
+      std::vector<u8> buf(2 * 4096);
+      for (int i = 0; i < 2000; i++) {
+        const block_id_t id = (i * 7) % 16;
+        switch (i % 4) {
+        case 0:
+          checked.write_block(id, data.data()).unwrap();
+          break;
+        case 1:
+          checked.write_partial_block(id, data.data(), 100, 200).unwrap();
+          break;
+        case 2:
+          checked.write_blocks({id, id + 16}, data.data()).unwrap();
+          break;
+        default:
+          ASSERT_TRUE(checked.read_blocks({id, id + 16}, buf.data()).is_ok());
+        }
+        ASSERT_TRUE(checked.read_block(id, buf.data()).is_ok());
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // and the table on the device ends up with the latest checksums
+  auto reloaded = ChecksumBlockManager(bm);
+  std::vector<u8> buf(32 * 4096);
+  std::vector<block_id_t> ids;
+  for (block_id_t id = 0; id < 32; id++) {
+    ids.push_back(id);
+  }
+  EXPECT_TRUE(reloaded.read_blocks(ids, buf.data()).is_ok());
+}
+
+} // namespace chfs
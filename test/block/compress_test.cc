@@ -0,0 +1,163 @@
+#include "block/compress.h"
+#include "common/macros.h"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace chfs {
+
+class CompressedBlockManagerTest : public ::testing::Test {
+protected:
+  // This function is called before every test.
+  void SetUp() override {}
+
+  // This function is called after every test.
+  void TearDown() override{};
+
+  // a block of log lines, which compresses well
+  static auto log_block(usize block_sz, usize seed) -> std::vector<u8> {
+    std::string text;
+    for (usize i = 0; text.size() < block_sz; i++) {
+      text += "[2024-01-01 00:00:" + std::to_string(seed + i) +
+              "] INFO request served in 3ms\n";
+    }
+    return std::vector<u8>(text.begin(), text.begin() + block_sz);
+  }
+
+  static auto random_block(usize block_sz, usize seed) -> std::vector<u8> {
+    std::mt19937 rng(seed);
+    std::vector<u8> data(block_sz);
+    for (auto &b : data) {
+      b = rng() & 0xff;
+    }
+    return data;
+  }
+};
+
+TEST_F(CompressedBlockManagerTest, Codec) {
+  auto text = log_block(4096, 0);
+  std::vector<u8> packed(4096);
+  std::vector<u8> unpacked(4096);
+  auto len = lz_compress(text.data(), text.size(), packed.data(), 4096);
+  ASSERT_GT(len, 0);
+  EXPECT_LT(len, 1024);
+  ASSERT_EQ(lz_decompress(packed.data(), len, unpacked.data(), 4096).unwrap(),
+            4096);
+  EXPECT_EQ(unpacked, text);
+
+  // long runs and short inputs
+  std::vector<u8> run(4096, 'a');
+  len = lz_compress(run.data(), run.size(), packed.data(), 4096);
+  ASSERT_GT(len, 0);
+  ASSERT_EQ(lz_decompress(packed.data(), len, unpacked.data(), 4096).unwrap(),
+            4096);
+  EXPECT_EQ(unpacked, run);
+  for (usize n = 0; n < 8; n++) {
+    len = lz_compress(text.data(), n, packed.data(), 4096);
+    ASSERT_EQ(lz_decompress(packed.data(), len, unpacked.data(), 4096).unwrap(),
+              n);
+    EXPECT_EQ(std::memcmp(unpacked.data(), text.data(), n), 0);
+  }
+
+  // random data does not fit in less than its size
+  auto noise = random_block(4096, 1);
+  EXPECT_EQ(lz_compress(noise.data(), noise.size(), packed.data(), 3584), 0);
+
+  // a truncated input comes out short, an overflowing one is rejected
+  len = lz_compress(text.data(), text.size(), packed.data(), 4096);
+  auto res = lz_decompress(packed.data(), len / 2, unpacked.data(), 4096);
+  EXPECT_TRUE(res.is_err() || res.unwrap() < 4096);
+  EXPECT_TRUE(
+      lz_decompress(packed.data(), len, unpacked.data(), 2048).is_err());
+}
+
+TEST_F(CompressedBlockManagerTest, ReadWrite) {
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(1024, 4096));
+  auto compressed = CompressedBlockManager(bm);
+  // 512 entries per table block, and the header
+  EXPECT_EQ(compressed.total_blocks(), 1021);
+
+  std::vector<u8> buf(compressed.block_size());
+  for (usize i = 0; i < 64; i++) {
+    compressed.write_block(i, log_block(compressed.block_size(), i).data())
+        .unwrap();
+  }
+  for (usize i = 0; i < 64; i++) {
+    compressed.read_block(i, buf.data()).unwrap();
+    ASSERT_EQ(buf, log_block(compressed.block_size(), i));
+  }
+  // several blocks share a physical block
+  EXPECT_LE(compressed.physical_blocks_used(), 16);
+
+  // an incompressible block is stored raw
+  auto noise = random_block(compressed.block_size(), 7);
+  compressed.write_block(100, noise.data()).unwrap();
+  EXPECT_EQ(compressed.get_extent(100).slot_cnt, KCompressSlots);
+  compressed.read_block(100, buf.data()).unwrap();
+  EXPECT_EQ(buf, noise);
+
+  // overwrite in place, partially and with zeros
+  compressed.write_block(3, noise.data()).unwrap();
+  compressed.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(buf, noise);
+  compressed.write_partial_block(4, noise.data(), 100, 14).unwrap();
+  compressed.read_block(4, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data() + 100, noise.data(), 14), 0);
+  EXPECT_EQ(std::memcmp(buf.data(),
+                        log_block(compressed.block_size(), 4).data(), 100),
+            0);
+  compressed.zero_block(5).unwrap();
+  EXPECT_EQ(compressed.get_extent(5).slot_cnt, 0);
+  compressed.read_block(5, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(compressed.block_size(), 0));
+  EXPECT_TRUE(compressed.write_block(1021, noise.data()).is_err());
+
+  // the table survives a reload
+  auto reloaded = CompressedBlockManager(bm, 10);
+  EXPECT_EQ(reloaded.total_blocks(), 1021);
+  reloaded.read_block(3, buf.data()).unwrap();
+  EXPECT_EQ(buf, noise);
+  reloaded.read_block(63, buf.data()).unwrap();
+  EXPECT_EQ(buf, log_block(compressed.block_size(), 63));
+  EXPECT_EQ(reloaded.physical_blocks_used(),
+            compressed.physical_blocks_used());
+}
+
+TEST_F(CompressedBlockManagerTest, Capacity) {
+  // more logical blocks than physical ones
+  auto bm = std::shared_ptr<BlockManager>(new BlockManager(64, 4096));
+  auto compressed = CompressedBlockManager(bm, 256);
+  EXPECT_EQ(compressed.total_blocks(), 256);
+
+  std::vector<u8> buf(compressed.block_size());
+  for (usize i = 0; i < 256; i++) {
+    compressed.write_block(i, log_block(compressed.block_size(), i).data())
+        .unwrap();
+  }
+  for (usize i = 0; i < 256; i += 17) {
+    compressed.read_block(i, buf.data()).unwrap();
+    ASSERT_EQ(buf, log_block(compressed.block_size(), i));
+  }
+
+  // the raw blocks run out of space
+  ChfsNullResult res = KNullOk;
+  for (usize i = 0; i < 256 && res.is_ok(); i++) {
+    res = compressed.write_block(
+        i, random_block(compressed.block_size(), i).data());
+  }
+  ASSERT_TRUE(res.is_err());
+  EXPECT_EQ(res.unwrap_error(), ErrorType::OUT_OF_RESOURCE);
+
+  // discarding gives the space back
+  std::vector<block_id_t> ids;
+  for (usize i = 0; i < 256; i++) {
+    ids.push_back(i);
+  }
+  compressed.discard_blocks(ids).unwrap();
+  EXPECT_EQ(compressed.physical_blocks_used(), 0);
+  compressed.write_block(0, random_block(compressed.block_size(), 0).data())
+      .unwrap();
+}
+
+} // namespace chfs
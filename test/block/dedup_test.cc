@@ -0,0 +1,55 @@
+#include "block/dedup.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace chfs {
+
+TEST(DedupIndexTest, Fingerprint) {
+  std::vector<u8> a(4096, 'a');
+  auto b = a;
+  EXPECT_EQ(DedupIndex::fingerprint(a.data(), a.size()),
+            DedupIndex::fingerprint(b.data(), b.size()));
+  b[4095] = 'b';
+  EXPECT_NE(DedupIndex::fingerprint(a.data(), a.size()),
+            DedupIndex::fingerprint(b.data(), b.size()));
+  EXPECT_NE(DedupIndex::fingerprint(a.data(), 4095),
+            DedupIndex::fingerprint(a.data(), 4094));
+}
+
+TEST(DedupIndexTest, BoundedLru) {
+  auto index = DedupIndex(2);
+  index.insert(1, 10);
+  index.insert(2, 20);
+  // refresh 1, so 2 is evicted
+  EXPECT_EQ(index.lookup(1).value(), 10);
+  index.insert(3, 30);
+  EXPECT_EQ(index.size(), 2);
+  EXPECT_FALSE(index.lookup(2).has_value());
+  EXPECT_EQ(index.lookup(3).value(), 30);
+
+  // a block holds a single fingerprint
+  index.insert(4, 10);
+  EXPECT_FALSE(index.lookup(1).has_value());
+  EXPECT_EQ(index.lookup(4).value(), 10);
+  index.forget(10);
+  EXPECT_FALSE(index.lookup(4).has_value());
+  EXPECT_EQ(index.size(), 1);
+}
+
+TEST(DedupIndexTest, References) {
+  auto index = DedupIndex();
+  EXPECT_EQ(index.ref_count(7), 1);
+  EXPECT_FALSE(index.release(7));
+
+  index.add_ref(7);
+  index.add_ref(7);
+  EXPECT_EQ(index.ref_count(7), 3);
+  EXPECT_EQ(index.shared_block_cnt(), 1);
+  EXPECT_TRUE(index.release(7));
+  EXPECT_TRUE(index.release(7));
+  EXPECT_EQ(index.shared_block_cnt(), 0);
+  // the last reference is left to the allocator
+  EXPECT_FALSE(index.release(7));
+}
+
+} // namespace chfs
@@ -0,0 +1,151 @@
+#include "block/direct.h"
+#include "common/macros.h"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <thread>
+
+namespace chfs {
+
+class DirectBlockManagerTest : public ::testing::Test {
+protected:
+  // This function is called before every test.
+  void SetUp() override { remove("direct_test.db"); }
+
+  // This function is called after every test.
+  void TearDown() override { remove("direct_test.db"); };
+};
+
+TEST_F(DirectBlockManagerTest, ReadWriteZero) {
+  auto bm = DirectBlockManager("direct_test.db", KDefaultBlockCnt, 2);
+
+  // std::vector gives no alignment guarantee, so the pool is exercised
+  std::vector<u8> data(bm.block_size() + 1);
+  std::vector<u8> buf(bm.block_size() + 1);
+  u8 *unaligned_data = data.data() + 1;
+  u8 *unaligned_buf = buf.data() + 1;
+  std::strncpy((char *)unaligned_data, "A test string.", bm.block_size());
+
+  bm.write_block(2, unaligned_data).unwrap();
+  bm.read_block(2, unaligned_buf).unwrap();
+  EXPECT_EQ(std::memcmp(unaligned_buf, unaligned_data, bm.block_size()), 0);
+
+  const char *msg = "hello";
+  bm.write_partial_block(2, (const u8 *)msg, 2, 5).unwrap();
+  bm.read_block(2, unaligned_buf).unwrap();
+  EXPECT_EQ(std::memcmp(unaligned_buf, "A hellostring.", 14), 0);
+
+  bm.zero_block(2).unwrap();
+  bm.read_block(2, unaligned_buf).unwrap();
+  for (usize i = 0; i < bm.block_size(); i++) {
+    ASSERT_EQ(unaligned_buf[i], 0);
+  }
+
+  // the buffers are returned to the pool
+  ASSERT_EQ(bm.get_pool().free_cnt(), 1);
+}
+
+TEST_F(DirectBlockManagerTest, Vectored) {
+  auto bm = DirectBlockManager("direct_test.db", KDefaultBlockCnt);
+  auto &pool = bm.get_pool();
+
+  std::vector<block_id_t> ids = {8, 9, 10, 11, 100, 3};
+  // a run of aligned buffers from the pool is not contiguous, so use a
+  // single big aligned allocation instead
+  void *raw = nullptr;
+  ASSERT_EQ(posix_memalign(&raw, 4096, ids.size() * bm.block_size()), 0);
+  auto data = static_cast<u8 *>(raw);
+  ASSERT_TRUE(pool.is_aligned(data));
+  for (usize i = 0; i < ids.size(); ++i) {
+    memset(data + i * bm.block_size(), static_cast<int>(i + 1),
+           bm.block_size());
+  }
+  bm.write_blocks(ids, data).unwrap();
+
+  // read back through the unaligned path
+  std::vector<u8> result(ids.size() * bm.block_size() + 1);
+  bm.read_blocks(ids, result.data() + 1).unwrap();
+  ASSERT_EQ(std::memcmp(result.data() + 1, data, ids.size() * bm.block_size()),
+            0);
+  free(raw);
+}
+
+TEST_F(DirectBlockManagerTest, ThreadSafePartialWrites) {
+  auto bm = DirectBlockManager("direct_test.db", KDefaultBlockCnt);
+  bm.set_thread_safe(true);
+  const usize thread_cnt = 4;
+  const usize slice = 16;
+  const usize rounds = 200;
+
+  // each thread owns a slice of the same block, so an unlocked
+  // read-modify-write would overwrite the slices of the others
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < thread_cnt; t++) {
+    threads.emplace_back([&, t] {
+      std::vector<u8> data(slice);
+      for (usize r = 1; r <= rounds; r++) {
+        memset(data.data(), static_cast<int>(r), slice);
+        bm.write_partial_block(5, data.data(), t * slice, slice).unwrap();
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::vector<u8> buf(bm.block_size());
+  bm.read_block(5, buf.data()).unwrap();
+  for (usize i = 0; i < thread_cnt * slice; i++) {
+    ASSERT_EQ(buf[i], static_cast<u8>(rounds)) << "byte " << i;
+  }
+}
+
+TEST_F(DirectBlockManagerTest, Prefetch) {
+  auto bm = DirectBlockManager("direct_test.db", KDefaultBlockCnt);
+  std::vector<u8> data(bm.block_size());
+  for (block_id_t i = 10; i < 20; i++) {
+    memset(data.data(), static_cast<int>(i), bm.block_size());
+    bm.write_block(i, data.data()).unwrap();
+  }
+
+  bm.prefetch({10, 11, 12, 13, 14, 15, 16, 17, 18, 19}).unwrap();
+  bm.wait_async();
+  ASSERT_EQ(bm.prefetched_cnt(), 10);
+  // the blocks read ahead already are not read again
+  bm.prefetch({10, 11}).unwrap();
+  bm.wait_async();
+  ASSERT_EQ(bm.prefetched_cnt(), 10);
+
+  // a read consumes its block
+  std::vector<u8> buf(bm.block_size());
+  bm.read_block(10, buf.data()).unwrap();
+  ASSERT_EQ(buf[0], 10);
+  ASSERT_EQ(bm.prefetched_cnt(), 9);
+
+  // a write drops it, so the next read sees the new data
+  memset(data.data(), 0xff, bm.block_size());
+  bm.write_block(11, data.data()).unwrap();
+  const char *msg = "hello";
+  bm.write_partial_block(12, (const u8 *)msg, 0, 5).unwrap();
+  bm.zero_block(13).unwrap();
+  ASSERT_EQ(bm.prefetched_cnt(), 6);
+  bm.read_block(11, buf.data()).unwrap();
+  ASSERT_EQ(buf[0], 0xff);
+  bm.read_block(12, buf.data()).unwrap();
+  ASSERT_EQ(std::memcmp(buf.data(), "hello", 5), 0);
+  ASSERT_EQ(buf[5], 12);
+
+  // a batch read mixes the blocks read ahead with the others
+  void *raw = nullptr;
+  ASSERT_EQ(posix_memalign(&raw, 4096, 8 * bm.block_size()), 0);
+  auto batch = static_cast<u8 *>(raw);
+  bm.read_blocks({13, 14, 15, 16, 17, 18, 19, 20}, batch).unwrap();
+  ASSERT_EQ(batch[0], 0);
+  for (usize i = 1; i < 7; i++) {
+    ASSERT_EQ(batch[i * bm.block_size()], 13 + i);
+  }
+  ASSERT_EQ(batch[7 * bm.block_size()], 0);
+  ASSERT_EQ(bm.prefetched_cnt(), 0);
+  free(raw);
+}
+
+} // namespace chfs
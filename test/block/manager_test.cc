@@ -1,7 +1,11 @@
 #include "block/manager.h"
 #include "common/macros.h"
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <sys/stat.h>
+#include <thread>
 
 namespace chfs {
 
@@ -109,4 +113,497 @@ TEST_F(BlockManagerTest, Iterator) {
   }
 }
 
+TEST_F(BlockManagerTest, IteratorWalks) {
+  auto bm = BlockManager(1024, 4096);
+  for (block_id_t i = 0; i < 32; ++i) {
+    std::vector<u8> buffer(4096, static_cast<u8>(i));
+    bm.write_block(i, buffer.data()).unwrap();
+  }
+
+  // the blocks are viewed in place
+  auto opts = BlockIteratorOptions{};
+  opts.writable = false;
+  auto iter = BlockIterator::create(&bm, 3, 5, opts).unwrap();
+  ASSERT_EQ(iter.data(), bm.unsafe_get_block_ptr() + 3 * 4096);
+
+  // strided and reversed: 30, 26, ..., 2
+  opts.stride = 4;
+  opts.reverse = true;
+  iter = BlockIterator::create(&bm, 2, 32, opts).unwrap();
+  std::vector<block_id_t> visited;
+  for (; iter.has_next(); iter.next_block().unwrap()) {
+    ASSERT_EQ(iter.get_cur_byte(), iter.cur_block_id());
+    visited.push_back(iter.cur_block_id());
+  }
+  ASSERT_EQ(visited,
+            std::vector<block_id_t>({30, 26, 22, 18, 14, 10, 6, 2}));
+
+  // word by word across a block boundary
+  iter = BlockIterator::create(&bm, 7, 9).unwrap();
+  usize words = 0;
+  for (; iter.has_next(); iter.next_word().unwrap(), words++) {
+    if (iter.cur_block_id() == 8) {
+      break;
+    }
+    *iter.unsafe_get_value_ptr<u64>() += 1;
+  }
+  ASSERT_EQ(words, 4096 / sizeof(u64));
+  ASSERT_EQ(bm.unsafe_get_block_ptr()[7 * 4096 + 4088], 8);
+
+  ASSERT_TRUE(BlockIterator::create(&bm, 0, 1025).is_err());
+  opts.stride = 0;
+  ASSERT_TRUE(BlockIterator::create(&bm, 0, 8, opts).is_err());
+}
+
+TEST_F(BlockManagerTest, ThreadSafe) {
+  auto opts = BlockManagerOptions{};
+  opts.thread_safe = true;
+  auto bm = BlockManager(64, 4096, opts);
+  ASSERT_TRUE(bm.is_thread_safe());
+
+  // each write fills a block with a single value, so a reader sees either
+  // one of the writes entirely or a torn block
+  std::atomic<bool> stop(false);
+  std::atomic<usize> torn(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      std::vector<u8> data(4096, static_cast<u8>(t + 1));
+      for (int i = 0; i < 2000; i++) {
+        bm.write_partial_block(5, data.data(), 0, 4096).unwrap();
+        bm.write_blocks({4, 5, 6}, std::vector<u8>(3 * 4096, t + 1).data())
+            .unwrap();
+      }
+    });
+  }
+  threads.emplace_back([&] {
+    std::vector<u8> buf(3 * 4096);
+    while (!stop.load()) {
+      bm.read_blocks({4, 5, 6}, buf.data()).unwrap();
+      for (int i = 0; i < 3; i++) {
+        auto block = buf.begin() + i * 4096;
+        if (std::count(block, block + 4096, *block) != 4096) {
+          torn += 1;
+        }
+      }
+    }
+  });
+  for (int t = 0; t < 4; t++) {
+    threads[t].join();
+  }
+  stop = true;
+  threads.back().join();
+  ASSERT_EQ(torn.load(), 0);
+}
+
+TEST_F(BlockManagerTest, PlacedInMemory) {
+  // the policies fall back gracefully on a single node
+  for (auto numa : {NumaPolicy::Default, NumaPolicy::Interleave,
+                    NumaPolicy::Local}) {
+    auto opts = BlockManagerOptions{};
+    opts.numa = numa;
+    opts.prefault_threads = 3;
+    auto bm = BlockManager(1000, 4096, opts);
+
+    std::vector<u8> zeros(4096, 0);
+    std::vector<u8> buf(4096, 1);
+    for (block_id_t i = 0; i < 1000; i += 111) {
+      bm.read_block(i, buf.data()).unwrap();
+      ASSERT_EQ(buf, zeros);
+    }
+    std::vector<u8> data(4096, 0x3c);
+    bm.write_block(999, data.data()).unwrap();
+    bm.read_block(999, buf.data()).unwrap();
+    ASSERT_EQ(buf, data);
+  }
+}
+
+TEST_F(BlockManagerTest, Guard) {
+  auto bm = BlockManager(128, 4096);
+
+  {
+    auto guard = bm.write_guard(3).unwrap();
+    guard.as_mut<u64>(0) = 42;
+    guard.as_mut<u64>(511) = 73;
+  }
+
+  // the guard views the backing memory directly
+  std::vector<u8> buffer(4096);
+  bm.read_block(3, buffer.data());
+  ASSERT_EQ(reinterpret_cast<u64 *>(buffer.data())[0], 42);
+  ASSERT_EQ(reinterpret_cast<u64 *>(buffer.data())[511], 73);
+
+  auto guard = bm.read_guard(3).unwrap();
+  ASSERT_EQ(guard.data(), bm.unsafe_get_block_ptr() + 3 * 4096);
+  ASSERT_EQ(guard.as<u64>(511), 73);
+  ASSERT_DEATH(guard.as<u64>(512), "");
+
+  ASSERT_TRUE(bm.read_guard(128).is_err());
+}
+
+TEST_F(BlockManagerTest, Vectored) {
+  auto bm = BlockManager(128, 4096);
+
+  // two contiguous runs and a single block
+  std::vector<block_id_t> ids = {10, 11, 12, 40, 41, 7};
+  auto runs = BlockManager::contiguous_runs(ids);
+  ASSERT_EQ(runs.size(), 3);
+  ASSERT_EQ(runs[0].len, 3);
+  ASSERT_EQ(runs[1].idx, 3);
+  ASSERT_EQ(runs[1].start, 40);
+  ASSERT_EQ(runs[2].len, 1);
+
+  std::vector<u8> data(ids.size() * 4096);
+  for (usize i = 0; i < ids.size(); ++i) {
+    memset(data.data() + i * 4096, static_cast<int>(i + 1), 4096);
+  }
+  bm.write_blocks(ids, data.data()).unwrap();
+
+  std::vector<u8> buffer(4096);
+  for (usize i = 0; i < ids.size(); ++i) {
+    bm.read_block(ids[i], buffer.data()).unwrap();
+    ASSERT_EQ(buffer[0], i + 1);
+    ASSERT_EQ(buffer[4095], i + 1);
+  }
+
+  std::vector<u8> result(ids.size() * 4096);
+  bm.read_blocks(ids, result.data()).unwrap();
+  ASSERT_EQ(result, data);
+
+  ASSERT_TRUE(bm.read_blocks({127, 128}, result.data()).is_err());
+}
+
+TEST_F(BlockManagerTest, Async) {
+  auto bm = BlockManager(128, 4096);
+  bm.set_io_workers(4);
+
+  std::vector<u8> data(64 * 4096);
+  std::vector<std::future<ChfsNullResult>> futures;
+  for (usize i = 0; i < 64; ++i) {
+    memset(data.data() + i * 4096, static_cast<int>(i + 1), 4096);
+    futures.push_back(bm.write_block_async(i, data.data() + i * 4096));
+  }
+  for (auto &future : futures) {
+    ASSERT_TRUE(future.get().is_ok());
+  }
+
+  std::vector<u8> result(64 * 4096);
+  std::atomic<usize> done(0);
+  for (usize i = 0; i < 64; ++i) {
+    bm.read_block_async(i, result.data() + i * 4096,
+                        [&done](ChfsNullResult res) {
+                          if (res.is_ok()) {
+                            done.fetch_add(1);
+                          }
+                        });
+  }
+  bm.wait_async();
+  ASSERT_EQ(done.load(), 64);
+  ASSERT_EQ(result, data);
+}
+
+TEST_F(BlockManagerTest, Sync) {
+  std::string file("sync_test.db");
+  remove(file.c_str());
+  auto bm = BlockManager(file, KDefaultBlockCnt);
+  std::vector<u8> data(bm.block_size(), 0xab);
+
+  ASSERT_EQ(bm.dirty_block_cnt(), 0);
+  bm.write_block(3, data.data());
+  bm.write_block(4, data.data());
+  bm.write_partial_block(10, data.data(), 0, 16);
+  bm.zero_block(5);
+  // [3, 6) and [10, 11)
+  ASSERT_EQ(bm.dirty_block_cnt(), 4);
+
+  ASSERT_TRUE(bm.sync_range(4, 2).is_ok());
+  ASSERT_EQ(bm.dirty_block_cnt(), 2);
+  ASSERT_TRUE(bm.sync_range(0, bm.total_blocks() + 1).is_err());
+
+  // concurrent syncs are served by group commits
+  std::vector<std::thread> threads;
+  for (usize i = 0; i < 8; ++i) {
+    threads.emplace_back([&bm, &data, i] {
+      bm.write_block(100 + i, data.data());
+      ASSERT_TRUE(bm.sync().is_ok());
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(bm.dirty_block_cnt(), 0);
+
+  std::vector<u8> buf(bm.block_size());
+  bm.read_block(107, buf.data());
+  ASSERT_EQ(buf, data);
+
+  // a write through a guard is tracked even if a sync runs before it
+  {
+    auto guard = bm.write_guard(20).unwrap();
+    ASSERT_TRUE(bm.sync().is_ok());
+    ASSERT_EQ(bm.dirty_block_cnt(), 0);
+    guard.mut_data()[0] = 0xcd;
+  }
+  ASSERT_EQ(bm.dirty_block_cnt(), 1);
+  ASSERT_TRUE(bm.sync().is_ok());
+  ASSERT_EQ(bm.dirty_block_cnt(), 0);
+  remove(file.c_str());
+}
+
+class FlakyBlockManager : public BlockManager {
+public:
+  using BlockManager::BlockManager;
+
+  // the number of flushes to fail before they succeed again, decided as
+  // each flush starts
+  std::atomic<usize> failures{0};
+  // the flushes wait until it is open
+  std::atomic<bool> open{true};
+  std::atomic<usize> flushes{0};
+
+protected:
+  auto persist(const std::vector<std::pair<block_id_t, block_id_t>> &ranges)
+      -> ChfsNullResult override {
+    const bool fail = this->failures > 0;
+    if (fail) {
+      this->failures--;
+    }
+    this->flushes++;
+    while (!this->open) {
+      std::this_thread::yield();
+    }
+    if (fail) {
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+    return BlockManager::persist(ranges);
+  }
+};
+
+TEST_F(BlockManagerTest, SyncGenerations) {
+  std::string file("sync_gen_test.db");
+  remove(file.c_str());
+  auto bm = FlakyBlockManager(file, KDefaultBlockCnt);
+  std::vector<u8> data(bm.block_size(), 0xab);
+
+  // a flush is running while two requests queue behind it
+  bm.write_block(1, data.data());
+  bm.open = false;
+  std::thread leader([&bm] { ASSERT_TRUE(bm.sync().is_ok()); });
+  while (bm.flushes == 0) {
+    std::this_thread::yield();
+  }
+  bm.failures = 1;
+  std::atomic<usize> failed{0};
+  std::vector<std::thread> threads;
+  for (usize i = 0; i < 2; ++i) {
+    threads.emplace_back([&bm, &data, &failed, i] {
+      bm.write_block(10 + i, data.data());
+      if (bm.sync().is_err()) {
+        failed++;
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  bm.open = true;
+  leader.join();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  // both are served by the same failed flush, and only by it
+  ASSERT_EQ(bm.flushes, 2);
+  ASSERT_EQ(failed, 2);
+  ASSERT_EQ(bm.dirty_block_cnt(), 2);
+  ASSERT_TRUE(bm.sync().is_ok());
+  ASSERT_EQ(bm.dirty_block_cnt(), 0);
+  remove(file.c_str());
+}
+
+TEST_F(BlockManagerTest, Options) {
+  BlockManagerOptions options;
+  options.populate = true;
+  options.hugetlb = true;
+  options.lock_memory = true;
+  options.hint = AccessHint::Random;
+  auto bm = BlockManager(1024, 4096, options);
+
+  // the anonymous mapping starts zeroed
+  std::vector<u8> buf(bm.block_size(), 0xff);
+  bm.read_block(1023, buf.data());
+  ASSERT_EQ(buf, std::vector<u8>(bm.block_size(), 0));
+
+  std::vector<u8> data(bm.block_size(), 0x42);
+  bm.write_block(7, data.data());
+  bm.read_block(7, buf.data());
+  ASSERT_EQ(buf, data);
+
+  ASSERT_TRUE(bm.advise(0, 1024, AccessHint::Sequential).is_ok());
+  ASSERT_TRUE(bm.advise(3, 5, AccessHint::WillNeed).is_ok());
+  ASSERT_TRUE(bm.advise(1020, 5, AccessHint::Normal).is_err());
+
+  std::string file("options_test.db");
+  remove(file.c_str());
+  {
+    options.hugetlb = false;
+    options.huge_pages = true;
+    auto fbm = BlockManager(file, KDefaultBlockCnt, options);
+    fbm.write_block(3, data.data());
+    ASSERT_TRUE(fbm.advise(0, 8, AccessHint::WillNeed).is_ok());
+  }
+  auto fbm = BlockManager(file, KDefaultBlockCnt);
+  fbm.read_block(3, buf.data());
+  ASSERT_EQ(buf, data);
+  remove(file.c_str());
+}
+
+TEST_F(BlockManagerTest, Discard) {
+  std::string file("discard_test.db");
+  remove(file.c_str());
+  auto bm = BlockManager(file, KDefaultBlockCnt);
+  std::vector<u8> data(bm.block_size(), 0x77);
+  std::vector<u8> zeros(bm.block_size(), 0);
+  std::vector<u8> buf(bm.block_size());
+
+  std::vector<block_id_t> ids;
+  for (block_id_t i = 0; i < 256; i++) {
+    bm.write_block(i, data.data());
+    ids.push_back(255 - i);
+  }
+  bm.sync();
+  struct stat before;
+  stat(file.c_str(), &before);
+
+  // out of order, coalesced into a single run
+  ASSERT_TRUE(bm.discard_blocks(ids).is_ok());
+  bm.read_block(100, buf.data());
+  ASSERT_EQ(buf, zeros);
+  ASSERT_TRUE(bm.discard_blocks({KDefaultBlockCnt}).is_err());
+
+  struct stat after;
+  stat(file.c_str(), &after);
+  // the file stays the same size, but its storage is released on the file
+  // systems supporting holes
+  ASSERT_EQ(after.st_size, before.st_size);
+  ASSERT_LE(after.st_blocks, before.st_blocks);
+
+  bm.set_discard(true);
+  bm.write_block(300, data.data());
+  bm.zero_block(300);
+  bm.read_block(300, buf.data());
+  ASSERT_EQ(buf, zeros);
+  remove(file.c_str());
+
+  // the in-memory device gives the pages back
+  auto mem = BlockManager(64, 512);
+  for (block_id_t i = 0; i < 64; i++) {
+    mem.write_block(i, data.data());
+  }
+  mem.discard_blocks({3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 40});
+  for (block_id_t i = 0; i < 64; i++) {
+    mem.read_block(i, buf.data());
+    bool discarded = (i >= 3 && i <= 12) || i == 40;
+    ASSERT_EQ(memcmp(buf.data(), discarded ? zeros.data() : data.data(), 512),
+              0);
+  }
+}
+
+TEST_F(BlockManagerTest, Grow) {
+  std::string file("grow_test.db");
+  remove(file.c_str());
+  std::vector<u8> data(KDefaultBlockSize, 0x5a);
+  std::vector<u8> zeros(KDefaultBlockSize, 0);
+  std::vector<u8> buf(KDefaultBlockSize);
+  {
+    auto bm = BlockManager(file, 1024);
+    bm.write_block(1023, data.data());
+    ASSERT_TRUE(bm.grow(1000).is_err());
+    ASSERT_TRUE(bm.grow(3000).is_ok());
+    ASSERT_EQ(bm.total_blocks(), 3000);
+
+    bm.read_block(1023, buf.data());
+    ASSERT_EQ(buf, data);
+    bm.read_block(2999, buf.data());
+    ASSERT_EQ(buf, zeros);
+    bm.write_block(2999, data.data());
+  }
+  {
+    // the size is taken from the grown file
+    auto bm = BlockManager(file, 1024);
+    ASSERT_EQ(bm.total_blocks(), 3000);
+    bm.read_block(2999, buf.data());
+    ASSERT_EQ(buf, data);
+  }
+  remove(file.c_str());
+
+  // the mapping never moves, so the pins outlive the growth
+  auto opts = BlockManagerOptions{};
+  opts.max_blocks = 8192;
+  auto mem = BlockManager(16, 4096, opts);
+  mem.write_block(15, data.data());
+  const u8 *base = mem.unsafe_get_block_ptr();
+  {
+    auto guard = mem.write_guard(15).unwrap();
+    ASSERT_TRUE(mem.grow(4096).is_ok());
+    ASSERT_EQ(mem.unsafe_get_block_ptr(), base);
+    guard.as_mut<u8>(0) = 0x77;
+  }
+  mem.read_block(15, buf.data());
+  ASSERT_EQ(buf[0], 0x77);
+  ASSERT_EQ(buf[1], 0x5a);
+  mem.read_block(4095, buf.data());
+  ASSERT_EQ(buf, zeros);
+  mem.write_block(4095, data.data());
+
+  // but not past the reserved address space
+  ASSERT_TRUE(mem.grow(8192).is_ok());
+  ASSERT_TRUE(mem.grow(8193).is_err());
+  ASSERT_EQ(mem.total_blocks(), 8192);
+  ASSERT_EQ(mem.unsafe_get_block_ptr(), base);
+  mem.read_block(4095, buf.data());
+  ASSERT_EQ(buf, data);
+}
+
+TEST_F(BlockManagerTest, AccessStats) {
+  auto bm = BlockManager(64, 512);
+  std::vector<u8> data(bm.block_size() * 4, 0x11);
+  ASSERT_TRUE(bm.access_stats().empty());
+
+  bm.enable_access_stats();
+  bm.write_block(1, data.data());
+  bm.read_block(1, data.data());
+  bm.read_block(1, data.data());
+  bm.zero_block(2);
+  bm.read_blocks({3, 4, 5, 9}, data.data());
+  { auto guard = bm.write_guard(7).unwrap(); }
+
+  auto stats = bm.access_stats();
+  ASSERT_EQ(stats.size(), 64);
+  EXPECT_EQ(stats[1].reads, 2);
+  EXPECT_EQ(stats[1].writes, 1);
+  EXPECT_EQ(stats[2].writes, 1);
+  EXPECT_EQ(stats[4].reads, 1);
+  EXPECT_EQ(stats[9].reads, 1);
+  EXPECT_EQ(stats[7].writes, 1);
+  EXPECT_EQ(stats[0].reads + stats[0].writes, 0);
+
+  // one in four accesses is counted, and scaled back
+  bm.enable_access_stats(4);
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < 4; t++) {
+    threads.emplace_back([&bm] {
+      std::vector<u8> buf(bm.block_size());
+      for (usize i = 0; i < 1000; i++) {
+        bm.read_block(10, buf.data());
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(bm.access_stats()[10].reads, 4000);
+
+  bm.disable_access_stats();
+  ASSERT_TRUE(bm.access_stats().empty());
+}
+
 } // namespace chfs
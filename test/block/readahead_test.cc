@@ -0,0 +1,43 @@
+#include "block/readahead.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(ReadaheadWindowTest, SequentialGrows) {
+  auto window = ReadaheadWindow(4, 16);
+  using Range = std::pair<u64, u64>;
+
+  // the first read opens the window
+  EXPECT_EQ(window.on_read(0, 1, 100), Range(1, 5));
+  EXPECT_EQ(window.window_size(), 4);
+  // far enough ahead, nothing to prefetch
+  EXPECT_EQ(window.on_read(1, 2, 100), Range(2, 2));
+  EXPECT_EQ(window.on_read(2, 3, 100), Range(3, 3));
+  // less than half a window is left, so it doubles
+  EXPECT_EQ(window.on_read(3, 4, 100), Range(5, 12));
+  EXPECT_EQ(window.window_size(), 8);
+
+  // the window is capped
+  EXPECT_EQ(window.on_read(4, 10, 100), Range(12, 26));
+  EXPECT_EQ(window.window_size(), 16);
+  EXPECT_EQ(window.on_read(10, 20, 100), Range(26, 36));
+  EXPECT_EQ(window.window_size(), 16);
+
+  // nothing past the end
+  EXPECT_EQ(window.on_read(20, 95, 100), Range(95, 100));
+  EXPECT_EQ(window.on_read(95, 100, 100), Range(100, 100));
+}
+
+TEST(ReadaheadWindowTest, RandomResets) {
+  auto window = ReadaheadWindow(4, 16);
+  using Range = std::pair<u64, u64>;
+
+  EXPECT_EQ(window.on_read(0, 2, 100), Range(2, 6));
+  EXPECT_EQ(window.on_read(50, 51, 100), Range(51, 51));
+  EXPECT_EQ(window.window_size(), 0);
+
+  // a stream starting in the middle opens the window at its second read
+  EXPECT_EQ(window.on_read(51, 52, 100), Range(52, 56));
+}
+
+} // namespace chfs
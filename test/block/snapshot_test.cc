@@ -0,0 +1,78 @@
+#include "block/snapshot.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+namespace chfs {
+
+TEST(SnapshotBlockManagerTest, CopyOnWrite) {
+  auto bm = std::make_shared<BlockManager>(128, 4096);
+  auto origin = std::make_shared<SnapshotBlockManager>(bm);
+  ASSERT_EQ(origin->total_blocks(), 96);
+
+  std::vector<u8> a(4096, 'a'), b(4096, 'b'), c(4096, 'c');
+  std::vector<u8> buf(4096);
+  origin->write_block(1, a.data()).unwrap();
+  origin->write_block(2, a.data()).unwrap();
+
+  auto snap1 = origin->snapshot().unwrap();
+  origin->write_block(1, b.data()).unwrap();
+  // copied only upon the first write
+  origin->write_partial_block(1, c.data(), 0, 10).unwrap();
+  ASSERT_EQ(origin->copies_used(), 1);
+
+  auto snap2 = origin->snapshot().unwrap();
+  // the copy of block 2 is shared by both snapshots
+  origin->zero_block(2).unwrap();
+  ASSERT_EQ(origin->copies_used(), 2);
+
+  snap1->read_block(1, buf.data()).unwrap();
+  ASSERT_EQ(buf, a);
+  snap1->read_block(2, buf.data()).unwrap();
+  ASSERT_EQ(buf, a);
+  snap2->read_block(1, buf.data()).unwrap();
+  ASSERT_EQ(buf[0], 'c');
+  ASSERT_EQ(buf[10], 'b');
+  snap2->read_block(2, buf.data()).unwrap();
+  ASSERT_EQ(buf, a);
+  origin->read_block(2, buf.data()).unwrap();
+  ASSERT_EQ(buf, std::vector<u8>(4096, 0));
+
+  // snapshots are read-only
+  ASSERT_TRUE(snap1->write_block(3, a.data()).is_err());
+
+  // the copies are released with the snapshots
+  snap1.reset();
+  ASSERT_EQ(origin->snapshot_cnt(), 1);
+  ASSERT_EQ(origin->copies_used(), 1);
+  snap2.reset();
+  ASSERT_EQ(origin->copies_used(), 0);
+  origin->write_block(1, a.data()).unwrap();
+  ASSERT_EQ(origin->copies_used(), 0);
+}
+
+TEST(SnapshotBlockManagerTest, Invalidated) {
+  auto bm = std::make_shared<BlockManager>(16, 4096);
+  auto origin = std::make_shared<SnapshotBlockManager>(bm, 14);
+  std::vector<u8> data(4096, 'x');
+  std::vector<u8> buf(4096);
+
+  auto snap = origin->snapshot().unwrap();
+  origin->write_blocks({0, 1}, std::vector<u8>(2 * 4096, 'y').data())
+      .unwrap();
+  ASSERT_EQ(origin->copies_used(), 2);
+
+  // the writes go on once the copy area is full
+  origin->write_block(2, data.data()).unwrap();
+  ASSERT_EQ(origin->copies_used(), 0);
+  ASSERT_TRUE(snap->read_block(0, buf.data()).is_err());
+  origin->read_block(2, buf.data()).unwrap();
+  ASSERT_EQ(buf, data);
+
+  // a new snapshot is unaffected
+  auto snap1 = origin->snapshot().unwrap();
+  origin->write_block(0, data.data()).unwrap();
+  snap1->read_block(0, buf.data()).unwrap();
+  ASSERT_EQ(buf, std::vector<u8>(4096, 'y'));
+}
+
+} // namespace chfs
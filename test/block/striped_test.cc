@@ -0,0 +1,113 @@
+#include "block/striped.h"
+#include "common/macros.h"
+#include "filesystem/operations.h"
+#include "gtest/gtest.h"
+#include <cstring>
+
+namespace chfs {
+
+class StripedBlockManagerTest : public ::testing::Test {
+protected:
+  // This function is called before every test.
+  void SetUp() override {}
+
+  // This function is called after every test.
+  void TearDown() override{};
+
+  auto make_members(usize n, usize blocks)
+      -> std::vector<std::shared_ptr<BlockManager>> {
+    std::vector<std::shared_ptr<BlockManager>> members;
+    for (usize i = 0; i < n; i++) {
+      members.push_back(std::make_shared<BlockManager>(blocks, 512));
+    }
+    return members;
+  }
+};
+
+TEST_F(StripedBlockManagerTest, Layout) {
+  auto members = make_members(3, 130);
+  auto striped = StripedBlockManager(members, 4);
+  // 32 whole units per member
+  ASSERT_EQ(striped.total_blocks(), 3 * 128);
+
+  std::vector<u8> data(striped.block_size());
+  std::vector<u8> buf(striped.block_size());
+  for (block_id_t b = 0; b < striped.total_blocks(); b++) {
+    memset(data.data(), static_cast<int>(b), data.size());
+    striped.write_block(b, data.data()).unwrap();
+  }
+
+  // block 13 is in unit 3, i.e., the second unit on member 0
+  auto loc = striped.locate(13);
+  EXPECT_EQ(loc.member, 0);
+  EXPECT_EQ(loc.block_id, 5);
+  members[0]->read_block(5, buf.data()).unwrap();
+  EXPECT_EQ(buf[0], 13);
+
+  striped.write_partial_block(14, data.data(), 10, 4).unwrap();
+  striped.zero_block(15).unwrap();
+  members[0]->read_block(7, buf.data()).unwrap();
+  EXPECT_EQ(buf, std::vector<u8>(striped.block_size(), 0));
+  EXPECT_TRUE(striped.read_block(3 * 128, buf.data()).is_err());
+
+  {
+    auto guard = striped.write_guard(22).unwrap();
+    EXPECT_EQ(guard.block_id(), 22);
+    guard.mut_data()[0] = 0xee;
+  }
+  loc = striped.locate(22);
+  members[loc.member]->read_block(loc.block_id, buf.data()).unwrap();
+  EXPECT_EQ(buf[0], 0xee);
+}
+
+TEST_F(StripedBlockManagerTest, Vectored) {
+  auto members = make_members(4, 256);
+  auto striped = StripedBlockManager(members, 8);
+  const auto block_sz = striped.block_size();
+
+  std::vector<block_id_t> ids;
+  for (block_id_t b = 5; b < 300; b++) {
+    ids.push_back(b);
+  }
+  // and some scattered ones
+  ids.push_back(1000);
+  ids.push_back(2);
+  ids.push_back(1001);
+
+  std::vector<u8> data(ids.size() * block_sz);
+  for (usize i = 0; i < data.size(); i++) {
+    data[i] = static_cast<u8>(i / block_sz * 31 + i);
+  }
+  striped.write_blocks(ids, data.data()).unwrap();
+
+  std::vector<u8> buf(data.size());
+  striped.read_blocks(ids, buf.data()).unwrap();
+  EXPECT_EQ(buf, data);
+  for (usize i = 0; i < ids.size(); i++) {
+    striped.read_block(ids[i], buf.data()).unwrap();
+    ASSERT_EQ(std::memcmp(buf.data(), data.data() + i * block_sz, block_sz),
+              0);
+  }
+
+  EXPECT_TRUE(striped.read_blocks({1, 4096}, buf.data()).is_err());
+  EXPECT_TRUE(striped.advise(0, 1024, AccessHint::Sequential).is_ok());
+  EXPECT_TRUE(striped.sync_range(3, 500).is_ok());
+}
+
+TEST_F(StripedBlockManagerTest, FileSystem) {
+  auto bm = std::make_shared<StripedBlockManager>(make_members(4, 8192), 16);
+  auto fs = FileOperation(bm, 1024);
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(512 * 90);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = static_cast<u8>(i * 13);
+  }
+  fs.write_file(id, content).unwrap();
+  EXPECT_EQ(fs.read_file(id).unwrap(), content);
+
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  EXPECT_EQ(fs1->read_file(id).unwrap(), content);
+}
+
+} // namespace chfs
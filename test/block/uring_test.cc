@@ -0,0 +1,111 @@
+#include "block/uring.h"
+#include "common/macros.h"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <thread>
+
+namespace chfs {
+
+class IoUringBlockManagerTest : public ::testing::Test {
+protected:
+  // This function is called before every test.
+  void SetUp() override {
+    if (!IoUringBlockManager::is_supported()) {
+      GTEST_SKIP() << "io_uring is not available";
+    }
+    remove("uring_test.db");
+  }
+
+  // This function is called after every test.
+  void TearDown() override { remove("uring_test.db"); };
+};
+
+TEST_F(IoUringBlockManagerTest, ReadWriteZero) {
+  auto bm = IoUringBlockManager("uring_test.db", KDefaultBlockCnt, 8);
+  ASSERT_EQ(bm.total_blocks(), KDefaultBlockCnt);
+
+  std::vector<u8> data(bm.block_size());
+  std::vector<u8> buf(bm.block_size());
+  std::strncpy((char *)data.data(), "A test string.", bm.block_size());
+
+  bm.write_block(1, data.data()).unwrap();
+  bm.read_block(1, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data(), data.data(), bm.block_size()), 0);
+
+  const char *msg = "hello";
+  bm.write_partial_block(1, (const u8 *)msg, 2, 5).unwrap();
+  bm.read_block(1, buf.data()).unwrap();
+  EXPECT_EQ(std::memcmp(buf.data(), "A hellostring.", 14), 0);
+
+  bm.zero_block(1).unwrap();
+  bm.read_block(1, buf.data()).unwrap();
+  for (usize i = 0; i < bm.block_size(); i++) {
+    ASSERT_EQ(buf[i], 0);
+  }
+
+  ASSERT_TRUE(bm.read_block(KDefaultBlockCnt, buf.data()).is_err());
+}
+
+TEST_F(IoUringBlockManagerTest, Vectored) {
+  // a shallow queue, so the batch needs several rounds of submission
+  auto bm = IoUringBlockManager("uring_test.db", KDefaultBlockCnt, 4);
+
+  std::vector<block_id_t> ids;
+  for (block_id_t i = 0; i < 1024; ++i) {
+    ids.push_back(i);
+  }
+  for (block_id_t i = 0; i < 64; ++i) {
+    ids.push_back(2048 + i * 7);
+  }
+
+  std::vector<u8> data(ids.size() * bm.block_size());
+  for (usize i = 0; i < ids.size(); ++i) {
+    memset(data.data() + i * bm.block_size(), static_cast<int>(i * 13),
+           bm.block_size());
+  }
+  bm.write_blocks(ids, data.data()).unwrap();
+
+  std::vector<u8> result(data.size());
+  bm.read_blocks(ids, result.data()).unwrap();
+  ASSERT_EQ(result, data);
+
+  std::vector<u8> buf(bm.block_size());
+  bm.read_block(2048 + 7 * 5, buf.data()).unwrap();
+  ASSERT_EQ(buf[0], static_cast<u8>((1024 + 5) * 13));
+}
+
+TEST_F(IoUringBlockManagerTest, ConcurrentCalls) {
+  auto bm = IoUringBlockManager("uring_test.db", KDefaultBlockCnt, 16);
+  const usize thread_cnt = 4;
+  const usize per_thread = KDefaultBlockCnt / thread_cnt;
+
+  // each thread writes and reads back its own range, scattered over runs
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < thread_cnt; t++) {
+    threads.emplace_back([&, t] {
+      std::vector<block_id_t> ids;
+      for (block_id_t i = 0; i < per_thread; i += 2) {
+        ids.push_back(t * per_thread + i);
+      }
+      std::vector<u8> data(ids.size() * bm.block_size());
+      std::vector<u8> result(data.size());
+      for (usize round = 0; round < 20; round++) {
+        for (usize i = 0; i < ids.size(); i++) {
+          memset(data.data() + i * bm.block_size(),
+                 static_cast<int>(t * 31 + i + round), bm.block_size());
+        }
+        bm.write_blocks(ids, data.data()).unwrap();
+        bm.read_blocks(ids, result.data()).unwrap();
+        ASSERT_EQ(result, data);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // the calls do not wait for each other to finish before submitting
+  EXPECT_GT(bm.get_peak_inflight_calls(), 1);
+}
+
+} // namespace chfs
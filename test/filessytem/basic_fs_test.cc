@@ -1,6 +1,10 @@
 #include "./common.h"
+#include "block/cache.h"
+#include "block/snapshot.h"
 #include "filesystem/operations.h"
 #include "gtest/gtest.h"
+#include <cstring>
+#include <sstream>
 
 namespace chfs {
 
@@ -29,4 +33,268 @@ TEST(BasicFileSystemTest, Init) {
   std::cout << "Basic FS test done" << std::endl;
 }
 
-} // namespace chfs
\ No newline at end of file
+TEST(BasicFileSystemTest, Advise) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  // large enough to use the indirect block
+  std::vector<u8> content(kBlockSize * 100, 'a');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+
+  ASSERT_TRUE(fs.advise(id, AccessHint::Sequential).is_ok());
+  ASSERT_TRUE(fs.advise(id, AccessHint::WillNeed).is_ok());
+  ASSERT_EQ(fs.read_file(id).unwrap(), content);
+}
+
+TEST(BasicFileSystemTest, Grow) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(kBlockSize * 10, 'g');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  auto free_cnt = fs.get_free_blocks_num().unwrap();
+
+  // 4096 blocks per bitmap block, so three bitmap blocks are added
+  const u64 new_block_cnt = kBlockNum + 4096 * 2 + 10;
+  ASSERT_TRUE(fs.grow(new_block_cnt).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(),
+            free_cnt + new_block_cnt - kBlockNum - 3);
+
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs1->get_free_blocks_num().unwrap(),
+            fs.get_free_blocks_num().unwrap());
+  ASSERT_EQ(fs1->read_file(id).unwrap(), content);
+
+  // the new blocks are usable
+  std::vector<u8> large(kBlockSize * 120, 'h');
+  ASSERT_TRUE(fs1->write_file(id, large).is_ok());
+  ASSERT_EQ(fs1->read_file(id).unwrap(), large);
+}
+
+TEST(BasicFileSystemTest, AccessHeatmap) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  ASSERT_TRUE(fs.access_heatmap().empty());
+
+  bm->enable_access_stats();
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(kBlockSize * 4, 'x');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  ASSERT_EQ(fs.read_file(id).unwrap(), content);
+
+  auto regions = fs.access_heatmap();
+  ASSERT_EQ(regions.size(), 5);
+  EXPECT_EQ(regions[0].name, "superblock");
+  // superblock + inode table + inode bitmap + block bitmap
+  EXPECT_EQ(regions[1].start, 1);
+  EXPECT_EQ(regions[1].end, 1 + 128);
+  EXPECT_EQ(regions[2].end, 1 + 128 + 2);
+  EXPECT_EQ(regions[3].end, 1 + 128 + 2 + 8);
+  EXPECT_EQ(regions[4].end, kBlockNum);
+  // the inode table is read to locate the inode, the bitmaps are updated
+  // upon allocation and the file content is written then read back
+  EXPECT_GT(regions[1].reads, 0);
+  EXPECT_GT(regions[2].writes, 0);
+  EXPECT_GT(regions[3].writes, 0);
+  EXPECT_GE(regions[4].writes, 4);
+  EXPECT_GE(regions[4].reads, 4);
+
+  std::stringstream ss;
+  fs.dump_access_heatmap(ss, 3);
+  EXPECT_NE(ss.str().find("inode table ["), std::string::npos);
+  EXPECT_NE(ss.str().find("(data)"), std::string::npos);
+}
+
+TEST(BasicFileSystemTest, Dedup) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  ASSERT_TRUE(fs.enable_dedup().is_ok());
+
+  // 10 distinct blocks
+  std::vector<u8> content(kBlockSize * 10);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = static_cast<u8>(i / kBlockSize + 1);
+  }
+  auto a = fs.alloc_inode(InodeType::FILE).unwrap();
+  ASSERT_TRUE(fs.write_file(a, content).is_ok());
+
+  // an identical file takes no new data block
+  auto b = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto free_cnt = fs.get_free_blocks_num().unwrap();
+  ASSERT_TRUE(fs.write_file(b, content).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_cnt);
+  ASSERT_EQ(fs.read_file(b).unwrap(), content);
+  ASSERT_EQ(fs.get_dedup()->shared_block_cnt(), 10);
+
+  // modifying a shared block copies it
+  auto modified = content;
+  modified[3] = 0xff;
+  ASSERT_TRUE(fs.write_file(b, modified).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_cnt - 1);
+  ASSERT_EQ(fs.read_file(a).unwrap(), content);
+  ASSERT_EQ(fs.read_file(b).unwrap(), modified);
+
+  // the references are rebuilt upon remount, and the blocks are freed
+  // with their last reference
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_TRUE(fs1->enable_dedup().is_ok());
+  ASSERT_EQ(fs1->get_dedup()->shared_block_cnt(), 9);
+  ASSERT_TRUE(fs1->remove_file(a).is_ok());
+  ASSERT_EQ(fs1->get_free_blocks_num().unwrap(), free_cnt + 1);
+
+  // the freed blocks are reused without touching the shared ones
+  auto c = fs1->alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> other(kBlockSize * 10, 'c');
+  ASSERT_TRUE(fs1->write_file(c, other).is_ok());
+  ASSERT_EQ(fs1->read_file(b).unwrap(), modified);
+  ASSERT_EQ(fs1->read_file(c).unwrap(), other);
+}
+
+// Fails the partial writes, e.g., of the bitmap, once armed
+class FailingPartialBlockManager : public BlockManager {
+public:
+  using BlockManager::BlockManager;
+
+  auto write_partial_block(block_id_t block_id, const u8 *block_data,
+                           usize offset, usize len) -> ChfsNullResult override {
+    if (this->fail) {
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+    return BlockManager::write_partial_block(block_id, block_data, offset,
+                                             len);
+  }
+
+  bool fail = false;
+};
+
+TEST(BasicFileSystemTest, DedupFreeFailure) {
+  auto bm = std::make_shared<FailingPartialBlockManager>(kBlockNum, kBlockSize);
+  auto fs = FileOperation(bm, kTestInodeNum);
+  ASSERT_TRUE(fs.enable_dedup().is_ok());
+
+  auto a = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto b = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(kBlockSize, 'a');
+  ASSERT_TRUE(fs.write_file(a, content).is_ok());
+  ASSERT_TRUE(fs.write_file(b, std::vector<u8>(kBlockSize, 'b')).is_ok());
+
+  // b's old block cannot be freed, so it keeps it and a's block stays
+  // unshared
+  bm->fail = true;
+  ASSERT_TRUE(fs.write_file(b, content).is_err());
+  bm->fail = false;
+  ASSERT_EQ(fs.get_dedup()->shared_block_cnt(), 0);
+
+  ASSERT_TRUE(fs.write_file(b, content).is_ok());
+  ASSERT_EQ(fs.get_dedup()->shared_block_cnt(), 1);
+  ASSERT_TRUE(fs.remove_file(a).is_ok());
+  ASSERT_EQ(fs.read_file(b).unwrap(), content);
+}
+
+TEST(BasicFileSystemTest, Readahead) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(kBlockSize * 100);
+  for (usize i = 0; i < content.size(); i++) {
+    content[i] = static_cast<u8>(i % 251);
+  }
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+
+  // only the covered blocks are read, and the content ends with the file
+  auto slice = fs.read_file_w_off(id, 10, kBlockSize - 5).unwrap();
+  ASSERT_EQ(slice, std::vector<u8>(content.begin() + kBlockSize - 5,
+                                   content.begin() + kBlockSize + 5));
+  slice = fs.read_file_w_off(id, kBlockSize, content.size() - 3).unwrap();
+  ASSERT_EQ(slice, std::vector<u8>(content.end() - 3, content.end()));
+  ASSERT_TRUE(fs.read_file_w_off(id, 1, content.size()).unwrap().empty());
+
+  // stream the file block by block through a cache, with and without
+  // readahead
+  auto stream = [&](bool readahead) {
+    auto cached = std::make_shared<CachedBlockManager>(bm, 256);
+    auto fs1 = FileOperation::create_from_raw(cached).unwrap();
+    fs1->set_readahead(readahead);
+    for (u64 off = 0; off < content.size(); off += kBlockSize) {
+      auto res = fs1->read_file_w_off(id, kBlockSize, off).unwrap();
+      EXPECT_EQ(0, memcmp(res.data(), content.data() + off, kBlockSize));
+      cached->wait_async();
+    }
+    return std::make_pair(cached->hit_count(), cached->miss_count());
+  };
+  auto [hits_off, misses_off] = stream(false);
+  auto [hits_on, misses_on] = stream(true);
+  // nothing is prefetched past the end, and every block after the first is
+  // in the cache before it is read
+  ASSERT_EQ(misses_on, misses_off);
+  ASSERT_EQ(hits_on, hits_off + 99);
+}
+
+TEST(BasicFileSystemTest, Snapshot) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto origin = std::make_shared<SnapshotBlockManager>(bm);
+  auto fs = FileOperation(origin, kTestInodeNum);
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(kBlockSize * 20, 's');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+
+  auto snapshot = origin->snapshot().unwrap();
+  std::vector<u8> modified(kBlockSize * 30, 'm');
+  ASSERT_TRUE(fs.write_file(id, modified).is_ok());
+  ASSERT_TRUE(fs.alloc_inode(InodeType::FILE).is_ok());
+
+  // the snapshot is mounted as it was, and it is read-only
+  auto image = FileOperation::create_from_raw(snapshot).unwrap();
+  ASSERT_EQ(image->read_file(id).unwrap(), content);
+  ASSERT_EQ(image->get_free_inode_num().unwrap(),
+            fs.get_free_inode_num().unwrap() + 1);
+  ASSERT_TRUE(image->write_file(id, modified).is_err());
+
+  ASSERT_EQ(fs.read_file(id).unwrap(), modified);
+}
+
+// Records the blocks written in batches
+class RecordingBlockManager : public BlockManager {
+public:
+  using BlockManager::BlockManager;
+
+  auto write_blocks(const std::vector<block_id_t> &block_ids,
+                    const u8 *buffer) -> ChfsNullResult override {
+    this->written = block_ids;
+    return BlockManager::write_blocks(block_ids, buffer);
+  }
+
+  std::vector<block_id_t> written;
+};
+
+TEST(BasicFileSystemTest, Extents) {
+  auto bm = std::make_shared<RecordingBlockManager>(kBlockNum, kBlockSize);
+  auto fs = FileOperation(bm, kTestInodeNum);
+
+  auto a = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto b = fs.alloc_inode(InodeType::FILE).unwrap();
+  ASSERT_TRUE(fs.write_file(a, std::vector<u8>(kBlockSize * 4, 'a')).is_ok());
+  ASSERT_TRUE(fs.write_file(b, std::vector<u8>(kBlockSize, 'b')).is_ok());
+  ASSERT_TRUE(fs.write_file(b, {}).is_ok());
+
+  // the appended blocks follow the file, where the block of b was
+  std::vector<u8> content(kBlockSize * 100, 'a');
+  ASSERT_TRUE(fs.write_file(a, content).is_ok());
+  ASSERT_EQ(bm->written.size(), 100);
+  for (usize i = 1; i < bm->written.size(); i++) {
+    ASSERT_EQ(bm->written[i], bm->written[0] + i);
+  }
+  ASSERT_EQ(fs.read_file(a).unwrap(), content);
+}
+
+} // namespace chfs
@@ -60,4 +60,22 @@ TEST(FileSystemTest, Remove) {
   ASSERT_EQ(free_block_cnt_after_2, free_block_cnt);
 }
 
+TEST(FileSystemTest, RemoveLargeFile) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto free_block_cnt = fs.get_free_blocks_num().unwrap();
+
+  // large enough to use the indirect block
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  std::vector<u8> content(KLargeFileMax, 'r');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+
+  // the data blocks, the indirect block and the inode block are all freed
+  ASSERT_TRUE(fs.remove_file(id).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_cnt);
+  auto fs1 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs1->get_free_blocks_num().unwrap(), free_block_cnt);
+}
+
 } // namespace chfs
\ No newline at end of file